@@ -18,6 +18,8 @@
 #include <errno.h>
 #include <ctype.h>
 #include <stdarg.h>
+#include <stdint.h>
+#include <limits.h>
 
 #define die(fmt, args...) do { fprintf(stderr, "bencode: fatal error: " fmt, ## args); abort(); } while (0)
 #define warn(fmt, args...) do { fprintf(stderr, "bencode: warning: " fmt, ## args); } while (0)
@@ -33,6 +35,7 @@ struct ben_decode_ctx {
 	int level;
 	char c;
 	int line;
+	int view;
 	struct bencode_type **types;
 };
 
@@ -40,8 +43,21 @@ struct ben_encode_ctx {
 	char *data;
 	size_t size;
 	size_t pos;
+	int grow; /* data is malloc'd, and is realloc'd when it fills up */
+	/*
+	 * With a sink, data is a staging buffer that is flushed to it. Bytes
+	 * from 'staged' to 'pos' haven't been made into a chunk yet.
+	 */
+	const struct ben_sink *sink;
+	struct ben_chunk *chunks;
+	int chunks_n;
+	size_t staged;
+	size_t sunk; /* bytes in chunks so far */
 };
 
+/* Pieces at least this long are handed to a sink rather than copied */
+#define SINK_REF_MIN 512
+
 /*
  * Buffer size for fitting all unsigned long long and long long integers,
  * assuming it is at most 64 bits. If long long is larger than 64 bits,
@@ -49,6 +65,100 @@ struct ben_encode_ctx {
  */
 #define LONGLONGSIZE 21
 
+static void *default_malloc(void *opaque, size_t size)
+{
+	return malloc(size);
+}
+
+static void *default_realloc(void *opaque, void *ptr, size_t old_size, size_t new_size)
+{
+	return realloc(ptr, new_size);
+}
+
+static void default_free(void *opaque, void *ptr, size_t size)
+{
+	free(ptr);
+}
+
+static const struct ben_allocator default_allocator = {
+	.malloc_ = default_malloc,
+	.realloc_ = default_realloc,
+	.free_ = default_free,
+};
+
+/* Per thread, so that threads can each use their own arena */
+static __thread const struct ben_allocator *allocator = &default_allocator;
+
+void ben_set_allocator(const struct ben_allocator *a)
+{
+	allocator = a != NULL ? a : &default_allocator;
+}
+
+static void *ben_malloc(size_t size)
+{
+	return allocator->malloc_(allocator->opaque, size);
+}
+
+static void *ben_calloc(size_t size)
+{
+	void *ptr = ben_malloc(size);
+	if (ptr != NULL)
+		memset(ptr, 0, size);
+	return ptr;
+}
+
+static void *ben_realloc(void *ptr, size_t old_size, size_t new_size)
+{
+	if (ptr == NULL)
+		return ben_malloc(new_size);
+	return allocator->realloc_(allocator->opaque, ptr, old_size, new_size);
+}
+
+static void ben_dealloc(void *ptr, size_t size)
+{
+	if (ptr != NULL)
+		allocator->free_(allocator->opaque, ptr, size);
+}
+
+static __thread int max_depth = BEN_DEFAULT_MAX_DEPTH;
+
+void ben_set_max_depth(int depth)
+{
+	max_depth = depth > 0 ? depth : BEN_DEFAULT_MAX_DEPTH;
+}
+
+/*
+ * Decoding, encoding and freeing walk trees with an explicit stack instead
+ * of recursing. It starts out on the C stack with this many frames, which
+ * is plenty for torrents, and moves to the heap if it has to grow.
+ */
+#define STACK_INLINE_DEPTH 32
+
+/*
+ * Double a stack of 'frame_size' byte frames. The stack lives in
+ * 'inline_frames' until it first grows. Returns the new frames, or NULL
+ * if there is no memory, in which case the old ones are still valid.
+ */
+static void *grow_stack(void *frames, size_t *alloc, const void *inline_frames,
+			size_t frame_size)
+{
+	size_t newalloc = *alloc * 2;
+	void *newframes;
+
+	if (newalloc > ((size_t) -1) / frame_size)
+		return NULL;
+	if (frames == inline_frames) {
+		newframes = malloc(newalloc * frame_size);
+		if (newframes != NULL)
+			memcpy(newframes, frames, *alloc * frame_size);
+	} else {
+		newframes = realloc(frames, newalloc * frame_size);
+	}
+	if (newframes != NULL)
+		*alloc = newalloc;
+	return newframes;
+}
+
 static struct bencode *decode_printed(struct ben_decode_ctx *ctx);
 static void inplace_ben_str(struct bencode_str *b, const char *s, size_t len);
 static int resize_dict(struct bencode_dict *d, size_t newalloc);
@@ -77,7 +187,7 @@ static size_t type_size(int type)
 
 static void *alloc(int type)
 {
-	struct bencode *b = calloc(1, type_size(type));
+	struct bencode *b = ben_calloc(type_size(type));
 	if (b == NULL)
 		return NULL;
 	b->type = type;
@@ -86,7 +196,7 @@ static void *alloc(int type)
 
 void *ben_alloc_user(struct bencode_type *type)
 {
-	struct bencode_user *user = calloc(1, type->size);
+	struct bencode_user *user = ben_calloc(type->size);
 	if (user == NULL)
 		return NULL;
 	user->type = BENCODE_USER;
@@ -545,14 +655,39 @@ static int resize_dict(struct bencode_dict *d, size_t newalloc)
 	/* size must be a power of two */
 	assert((newalloc & (newalloc - 1)) == 0);
 
-	newbuckets = realloc(d->buckets, sizeof(newbuckets[0]) * newalloc);
-	newnodes = realloc(d->nodes, sizeof(newnodes[0]) * newalloc);
-	if (newnodes == NULL || newbuckets == NULL) {
-		free(newnodes);
-		free(newbuckets);
+	if (d->buckets == NULL && newalloc <= BEN_DICT_SMALL_MAX) {
+		newnodes = ben_realloc(d->nodes, sizeof(newnodes[0]) * d->alloc,
+				       sizeof(newnodes[0]) * newalloc);
+		if (newnodes == NULL)
+			return -1;
+		d->alloc = newalloc;
+		d->nodes = newnodes;
+		return 0;
+	}
+
+	newbuckets = ben_realloc(d->buckets,
+				 d->buckets == NULL ? 0 : sizeof(newbuckets[0]) * d->alloc,
+				 sizeof(newbuckets[0]) * newalloc);
+	if (newbuckets == NULL)
+		return -1;
+	newnodes = ben_realloc(d->nodes, sizeof(newnodes[0]) * d->alloc,
+			       sizeof(newnodes[0]) * newalloc);
+	if (newnodes == NULL) {
+		if (d->buckets == NULL) {
+			/* Stay small */
+			ben_dealloc(newbuckets, sizeof(newbuckets[0]) * newalloc);
+			return -1;
+		}
+		/* Bigger buckets are harmless if the nodes can't grow with them */
+		d->buckets = newbuckets;
 		return -1;
 	}
 
+	if (d->buckets == NULL) {
+		/* Too big to stay small, so the keys need their hashes */
+		for (pos = 0; pos < d->n; pos++)
+			newnodes[pos].hash = ben_hash(newnodes[pos].key);
+	}
 	d->alloc = newalloc;
 	d->buckets = newbuckets;
 	d->nodes = newnodes;
@@ -571,17 +706,114 @@ static int resize_dict(struct bencode_dict *d, size_t newalloc)
 	return 0;
 }
 
-/* The string/binary object hash is copied from Python */
+/*
+ * Binary search for 'key' in a small dict. Returns its position, or where
+ * it would be inserted if '*found' is set to 0.
+ */
+static size_t small_find(const struct bencode_dict *d, const struct bencode *key, int *found)
+{
+	size_t lo = 0;
+	size_t hi = d->n;
+	int cmp;
+
+	*found = 0;
+	/* Keys usually arrive in order, so check the end first */
+	if (d->n == 0)
+		return 0;
+	cmp = ben_cmp(d->nodes[d->n - 1].key, key);
+	if (cmp < 0)
+		return d->n;
+	if (cmp == 0) {
+		*found = 1;
+		return d->n - 1;
+	}
+	hi = d->n - 1;
+	while (lo < hi) {
+		size_t mid = lo + (hi - lo) / 2;
+		cmp = ben_cmp(d->nodes[mid].key, key);
+		if (cmp == 0) {
+			*found = 1;
+			return mid;
+		}
+		if (cmp < 0)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo;
+}
+
+static inline uint64_t hash_read64(const unsigned char *p)
+{
+	uint64_t v;
+	memcpy(&v, p, sizeof v);
+	return v;
+}
+
+static inline uint64_t hash_read32(const unsigned char *p)
+{
+	uint32_t v;
+	memcpy(&v, p, sizeof v);
+	return v;
+}
+
+/* Multiply, then fold the high half of the product into the low half */
+static inline uint64_t hash_mix(uint64_t a, uint64_t b)
+{
+#ifdef __SIZEOF_INT128__
+	__uint128_t r = (__uint128_t) a * b;
+	return (uint64_t) r ^ (uint64_t) (r >> 64);
+#else
+	uint64_t ha = a >> 32, la = (uint32_t) a;
+	uint64_t hb = b >> 32, lb = (uint32_t) b;
+	uint64_t hh = ha * hb, hl = ha * lb, lh = la * hb, ll = la * lb;
+	uint64_t t = ll + (hl << 32);
+	uint64_t lo = t + (lh << 32);
+	uint64_t hi = hh + (hl >> 32) + (lh >> 32) + (t < ll) + (lo < t);
+	return lo ^ hi;
+#endif
+}
+
+/*
+ * wyhash-style string hash. It reads 8 or 16 bytes per step instead of
+ * one, and keys up to 16 bytes, which are nearly all dict keys, take
+ * two multiplies. Hashes depend on the host's byte order, which is fine
+ * since they never leave memory.
+ */
 static long long str_hash(const unsigned char *s, size_t len)
 {
+	const uint64_t p0 = 0xa0761d6478bd642fULL;
+	const uint64_t p1 = 0xe7037ed1a0b428dbULL;
+	uint64_t seed = p0;
+	uint64_t a, b;
 	long long hash;
-	size_t i;
-	if (len == 0)
-		return 0;
-	hash = s[0] << 7;
-	for (i = 0; i < len; i++)
-		hash = (1000003 * hash) ^ s[i];
-	hash ^= len;
+
+	if (len <= 16) {
+		if (len >= 4) {
+			size_t mid = (len >> 3) << 2;
+			a = (hash_read32(s) << 32) | hash_read32(s + mid);
+			b = (hash_read32(s + len - 4) << 32) |
+			    hash_read32(s + len - 4 - mid);
+		} else if (len > 0) {
+			a = ((uint64_t) s[0] << 16) |
+			    ((uint64_t) s[len >> 1] << 8) | s[len - 1];
+			b = 0;
+		} else {
+			a = 0;
+			b = 0;
+		}
+	} else {
+		size_t i = len;
+		while (i > 16) {
+			seed = hash_mix(hash_read64(s) ^ p1,
+					hash_read64(s + 8) ^ seed);
+			s += 16;
+			i -= 16;
+		}
+		a = hash_read64(s + i - 16);
+		b = hash_read64(s + i - 8);
+	}
+	hash = (long long) hash_mix(p1 ^ len, hash_mix(a ^ p1, b ^ seed));
 	if (hash == -1)
 		hash = -2;
 	return hash;
@@ -612,118 +844,114 @@ long long ben_hash(const struct bencode *b)
 	}		
 }
 
-static struct bencode *decode_dict(struct ben_decode_ctx *ctx)
-{
-	struct bencode *key;
-	struct bencode *lastkey = NULL;
-	struct bencode *value;
-	struct bencode_dict *d;
-
-	d = alloc(BENCODE_DICT);
-	if (d == NULL) {
-		warn("Not enough memory for dict\n");
-		return ben_oom_ptr(ctx);
-	}
-
-	ctx->off++;
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__ && defined(__GNUC__)
+#define BEN_SWAR_DIGITS 1
 
-	while (ctx->off < ctx->len && ben_current_char(ctx) != 'e') {
-		key = ben_ctx_decode(ctx);
-		if (key == NULL)
-			goto error;
-		if (key->type != BENCODE_INT && key->type != BENCODE_STR) {
-			ben_free(key);
-			key = NULL;
-			ctx->error = BEN_INVALID;
-			warn("Invalid dict key type\n");
-			goto error;
-		}
+/*
+ * Number of ASCII digits at the start of the 8 bytes in 'chunk', which
+ * were loaded in little endian order.
+ */
+static inline int swar_digits_n(uint64_t chunk)
+{
+	uint64_t x = chunk ^ 0x3030303030303030ULL;
+	/*
+	 * Digit bytes are now 0-9. Anything else either has bits in the high
+	 * nibble or carries into bit 4 when 6 is added. A carry out of a
+	 * byte only affects bytes after the first non-digit, which don't
+	 * matter.
+	 */
+	uint64_t bad = (x & 0xf0f0f0f0f0f0f0f0ULL) |
+		       ((x + 0x0606060606060606ULL) & 0x1010101010101010ULL);
+	if (bad == 0)
+		return 8;
+	return __builtin_ctzll(bad) / 8;
+}
 
-		if (lastkey != NULL && ben_cmp(lastkey, key) >= 0) {
-			ben_free(key);
-			key = NULL;
-			ctx->error = BEN_INVALID;
-			goto error;
-		}
+/* Value of the first 'n' digits in 'chunk', 1 <= n <= 8 */
+static inline uint64_t swar_parse(uint64_t chunk, int n)
+{
+	/* Move the digits to the top so that the bytes below are zeros */
+	uint64_t x = (chunk ^ 0x3030303030303030ULL) << (8 * (8 - n));
+	x = (x * 10 + (x >> 8)) & 0x00ff00ff00ff00ffULL;
+	x = (x * 100 + (x >> 16)) & 0x0000ffff0000ffffULL;
+	x = (x * 10000 + (x >> 32)) & 0x00000000ffffffffULL;
+	return x;
+}
 
-		value = ben_ctx_decode(ctx);
-		if (value == NULL) {
-			ben_free(key);
-			key = NULL;
-			goto error;
-		}
+static const uint64_t powers_of_ten[] = {
+	1ULL, 10ULL, 100ULL, 1000ULL, 10000ULL, 100000ULL, 1000000ULL,
+	10000000ULL, 100000000ULL,
+};
+#endif
 
-		if (ben_dict_set((struct bencode *) d, key, value)) {
-			ben_free(key);
-			ben_free(value);
-			key = NULL;
-			value = NULL;
-			ctx->error = BEN_NO_MEMORY;
-			goto error;
+/*
+ * Read the digits from 'p' up to 'end' into '*value', eight at a time
+ * where possible. Returns a pointer to the first non-digit, or 'end'.
+ * Stops early once there are more digits than any 64 bit integer has, and
+ * '*value' is then meaningless.
+ */
+static const char *read_digits(const char *p, const char *end, uint64_t *value)
+{
+	const char *start = p;
+	uint64_t v = 0;
+
+#ifdef BEN_SWAR_DIGITS
+	while (end - p >= 8 && p - start <= 20) {
+		uint64_t chunk;
+		int n;
+		memcpy(&chunk, p, 8);
+		n = swar_digits_n(chunk);
+		if (n > 0)
+			v = v * powers_of_ten[n] + swar_parse(chunk, n);
+		p += n;
+		if (n < 8) {
+			*value = v;
+			return p;
 		}
-
-		lastkey = key;
 	}
-	if (ctx->off >= ctx->len) {
-		ctx->error = BEN_INSUFFICIENT;
-		goto error;
+#endif
+	while (p < end && *p >= '0' && *p <= '9' && p - start <= 20) {
+		v = v * 10 + (*p - '0');
+		p++;
 	}
-
-	ctx->off++;
-
-	return (struct bencode *) d;
-
-error:
-	ben_free((struct bencode *) d);
-	return NULL;
+	*value = v;
+	return p;
 }
 
-static size_t find(const struct ben_decode_ctx *ctx, char c)
-{
-	char *match = memchr(ctx->data + ctx->off, c, ctx->len - ctx->off);
-	if (match == NULL)
-		return -1;
-	return (size_t) (match - ctx->data);
-}
-
-/* off is the position of first number in */
+/*
+ * off is the position of first number in. The number must be followed by
+ * 'c'. Demands a unique encoding for all integers: zero may not begin with a
+ * (minus) sign, and non-zero integers may not have leading zeros.
+ */
 static int read_long_long(long long *ll, struct ben_decode_ctx *ctx, int c)
 {
-	char buf[LONGLONGSIZE]; /* fits all 64 bit integers */
-	char *endptr;
-	size_t slen;
-	size_t pos = find(ctx, c);
-
-	if (pos == -1)
-		return insufficient(ctx);
-
-	slen = pos - ctx->off;
-	if (slen == 0 || slen >= sizeof buf)
-		return invalid(ctx);
-
-	assert(slen < sizeof buf);
-	memcpy(buf, ctx->data + ctx->off, slen);
-	buf[slen] = 0;
+	const char *p = ctx->data + ctx->off;
+	const char *end = ctx->data + ctx->len;
+	const char *digits;
+	uint64_t v;
+	int neg = 0;
+	size_t n;
 
-	if (buf[0] != '-' && !isdigit(buf[0]))
-		return invalid(ctx);
+	if (p < end && *p == '-') {
+		neg = 1;
+		p++;
+	}
+	digits = p;
+	p = read_digits(p, end, &v);
+	n = p - digits;
 
-	errno = 0;
-	*ll = strtoll(buf, &endptr, 10);
-	if (errno == ERANGE || *endptr != 0)
+	if (p == end)
+		return insufficient(ctx);
+	if (*p != c || n == 0 || n > 19)
 		return invalid(ctx);
-
-	/*
-	 * Demand a unique encoding for all integers.
-	 * Zero may not begin with a (minus) sign.
-	 * Non-zero integers may not have leading zeros in the encoding.
-	 */
-	if (buf[0] == '-' && buf[1] == '0')
+	if (digits[0] == '0' && (n > 1 || neg))
 		return invalid(ctx);
-	if (buf[0] == '0' && pos != (ctx->off + 1))
+	if (v > (uint64_t) LLONG_MAX + neg)
 		return invalid(ctx);
 
-	ctx->off = pos + 1;
+	/* -v would overflow for LLONG_MIN */
+	*ll = neg ? -(long long) (v - 1) - 1 : (long long) v;
+	ctx->off = p + 1 - ctx->data;
 	return 0;
 }
 
@@ -759,7 +987,8 @@ static int resize_list(struct bencode_list *list, size_t newalloc)
 	}
 
 	newsize = sizeof(list->values[0]) * newalloc;
-	newvalues = realloc(list->values, newsize);
+	newvalues = ben_realloc(list->values,
+				sizeof(list->values[0]) * list->alloc, newsize);
 	if (newvalues == NULL)
 		return -1;
 	list->alloc = newalloc;
@@ -767,38 +996,6 @@ static int resize_list(struct bencode_list *list, size_t newalloc)
 	return 0;
 }
 
-static struct bencode *decode_list(struct ben_decode_ctx *ctx)
-{
-	struct bencode_list *l = alloc(BENCODE_LIST);
-	if (l == NULL)
-		return ben_oom_ptr(ctx);
-
-	ctx->off++;
-
-	while (ctx->off < ctx->len && ben_current_char(ctx) != 'e') {
-		struct bencode *b = ben_ctx_decode(ctx);
-		if (b == NULL)
-			goto error;
-		if (ben_list_append((struct bencode *) l, b)) {
-			ben_free(b);
-			ctx->error = BEN_NO_MEMORY;
-			goto error;
-		}
-	}
-
-	if (ctx->off >= ctx->len) {
-		ctx->error = BEN_INSUFFICIENT;
-		goto error;
-	}
-
-	ctx->off++;
-	return (struct bencode *) l;
-
-error:
-	ben_free((struct bencode *) l);
-	return NULL;
-}
-
 static size_t read_size_t(struct ben_decode_ctx *ctx, int c)
 {
 	long long ll;
@@ -827,26 +1024,29 @@ static struct bencode *decode_str(struct ben_decode_ctx *ctx)
 	if (ben_need_bytes(ctx, datalen))
 		return ben_insufficient_ptr(ctx);
 
+	if (ctx->view) {
+		/* Point into the caller's buffer instead of copying */
+		b = alloc(BENCODE_STR);
+		if (b == NULL)
+			return ben_oom_ptr(ctx);
+		ben_str_cast(b)->s = (char *) ctx->data + ctx->off;
+		ben_str_cast(b)->len = datalen;
+		ben_str_cast(b)->view = 1;
+		ctx->off += datalen;
+		return b;
+	}
+
 	/* Allocate string structure and copy data into it */
 	b = ben_blob(ctx->data + ctx->off, datalen);
 	ctx->off += datalen;
 	return b;
 }
 
-struct bencode *ben_ctx_decode(struct ben_decode_ctx *ctx)
+/* Decode a value that is not a dict or a list */
+static struct bencode *decode_scalar(struct ben_decode_ctx *ctx, char c)
 {
-	char c;
 	struct bencode_type *type;
-	struct bencode *b;
-	ctx->level++;
-	if (ctx->level > 256)
-		return ben_invalid_ptr(ctx);
-
-	if (ctx->off == ctx->len)
-		return ben_insufficient_ptr(ctx);
 
-	assert (ctx->off < ctx->len);
-	c = ben_current_char(ctx);
 	switch (c) {
 	case '0':
 	case '1':
@@ -858,33 +1058,154 @@ struct bencode *ben_ctx_decode(struct ben_decode_ctx *ctx)
 	case '7':
 	case '8':
 	case '9':
-		b = decode_str(ctx);
-		break;
+		return decode_str(ctx);
 	case 'b':
-		b = decode_bool(ctx);
-		break;
-	case 'd':
-		b = decode_dict(ctx);
-		break;
+		return decode_bool(ctx);
 	case 'i':
-		b = decode_int(ctx);
-		break;
-	case 'l':
-		b = decode_list(ctx);
-		break;
+		return decode_int(ctx);
 	default:
 		if (ctx->types && (unsigned char) c < 128) {
 			type = ctx->types[(unsigned char) c];
 			if (type) {
 				ctx->off++;
-				b = type->decode(ctx);
-			} else
-				return ben_invalid_ptr(ctx);
-		} else
-			return ben_invalid_ptr(ctx);
+				return type->decode(ctx);
+			}
+		}
+		return ben_invalid_ptr(ctx);
 	}
-	ctx->level--;
+}
+
+struct decode_frame {
+	struct bencode *b; /* the dict or list being filled */
+	struct bencode *key; /* dict key waiting for its value */
+	struct bencode *lastkey;
+	size_t start;
+};
+
+/* Add a complete value to the innermost dict or list. Frees it on error. */
+static int decode_attach(struct ben_decode_ctx *ctx, struct decode_frame *f,
+			 struct bencode *b)
+{
+	if (f->b->type == BENCODE_LIST) {
+		if (ben_list_append(f->b, b)) {
+			ben_free(b);
+			ctx->error = BEN_NO_MEMORY;
+			return -1;
+		}
+		return 0;
+	}
+
+	if (f->key == NULL) {
+		if (b->type != BENCODE_INT && b->type != BENCODE_STR) {
+			ben_free(b);
+			ctx->error = BEN_INVALID;
+			warn("Invalid dict key type\n");
+			return -1;
+		}
+		if (f->lastkey != NULL && ben_cmp(f->lastkey, b) >= 0) {
+			ben_free(b);
+			ctx->error = BEN_INVALID;
+			return -1;
+		}
+		f->key = b;
+		return 0;
+	}
+
+	if (ben_dict_set(f->b, f->key, b)) {
+		ben_free(b);
+		ctx->error = BEN_NO_MEMORY;
+		return -1;
+	}
+	f->lastkey = f->key;
+	f->key = NULL;
+	return 0;
+}
+
+struct bencode *ben_ctx_decode(struct ben_decode_ctx *ctx)
+{
+	struct decode_frame inline_frames[STACK_INLINE_DEPTH];
+	struct decode_frame *frames = inline_frames;
+	struct decode_frame *f;
+	struct decode_frame *newframes;
+	size_t frames_alloc = STACK_INLINE_DEPTH;
+	size_t depth = 0;
+	int level = ctx->level;
+	struct bencode *b;
+	char c;
+
+	for (;;) {
+		if (ctx->off >= ctx->len) {
+			ben_insufficient_ptr(ctx);
+			goto error;
+		}
+		c = ben_current_char(ctx);
+		f = depth > 0 ? &frames[depth - 1] : NULL;
+
+		if (f != NULL && f->key == NULL && c == 'e') {
+			/* The innermost dict or list is complete */
+			ctx->off++;
+			b = f->b;
+			if (ctx->view && b->type == BENCODE_DICT) {
+				ben_dict_cast(b)->span = ctx->data + f->start;
+				ben_dict_cast(b)->span_len = ctx->off - f->start;
+			} else if (ctx->view) {
+				ben_list_cast(b)->span = ctx->data + f->start;
+				ben_list_cast(b)->span_len = ctx->off - f->start;
+			}
+			depth--;
+			ctx->level--;
+		} else if (c == 'd' || c == 'l') {
+			if (ctx->level >= max_depth) {
+				ben_invalid_ptr(ctx);
+				goto error;
+			}
+			if (depth == frames_alloc) {
+				newframes = grow_stack(frames, &frames_alloc,
+						       inline_frames, sizeof(frames[0]));
+				if (newframes == NULL) {
+					ben_oom_ptr(ctx);
+					goto error;
+				}
+				frames = newframes;
+			}
+			b = alloc(c == 'd' ? BENCODE_DICT : BENCODE_LIST);
+			if (b == NULL) {
+				warn("Not enough memory for %s\n", c == 'd' ? "dict" : "list");
+				ben_oom_ptr(ctx);
+				goto error;
+			}
+			frames[depth++] = (struct decode_frame) {.b = b,
+								 .start = ctx->off};
+			ctx->level++;
+			ctx->off++;
+			continue;
+		} else {
+			b = decode_scalar(ctx, c);
+			if (b == NULL)
+				goto error;
+		}
+
+		if (depth == 0)
+			break;
+		if (decode_attach(ctx, &frames[depth - 1], b))
+			goto error;
+	}
+
+	if (frames != inline_frames)
+		free(frames);
 	return b;
+
+error:
+	/* Containers still open are not in their parents yet */
+	while (depth > 0) {
+		depth--;
+		ben_free(frames[depth].key);
+		ben_free(frames[depth].b);
+	}
+	ctx->level = level;
+	if (frames != inline_frames)
+		free(frames);
+	return NULL;
 }
 
 struct bencode *ben_decode(const void *data, size_t len)
@@ -910,10 +1231,10 @@ struct bencode *ben_decode2(const void *data, size_t len, size_t *off, int *erro
 	return b;
 }
 
-struct bencode *ben_decode3(const void *data, size_t len, size_t *off, int *error, struct bencode_type *types[128])
+struct bencode *ben_decode_view(const void *data, size_t len, size_t *off, int *error)
 {
 	struct ben_decode_ctx ctx = {.data = data, .len = len, .off = *off,
-				     .types = types};
+				     .view = 1};
 	struct bencode *b = ben_ctx_decode(&ctx);
 	*off = ctx.off;
 	if (error != NULL) {
@@ -923,10 +1244,282 @@ struct bencode *ben_decode3(const void *data, size_t len, size_t *off, int *erro
 	return b;
 }
 
-static struct bencode *decode_printed_bool(struct ben_decode_ctx *ctx)
+void ben_tokenizer_init(struct ben_tokenizer *t, const void *data, size_t len)
 {
-	struct bencode *b;
-	int bval = -1;
+	memset(t, 0, sizeof *t);
+	t->data = data;
+	t->len = len;
+}
+
+void ben_tokenizer_feed(struct ben_tokenizer *t, const void *data, size_t len)
+{
+	t->base += t->pos;
+	t->data = data;
+	t->len = len;
+	t->pos = 0;
+	if (t->error == BEN_INSUFFICIENT)
+		t->error = BEN_OK;
+}
+
+static int token_error(struct ben_tokenizer *t, int error)
+{
+	t->error = error;
+	return -1;
+}
+
+/*
+ * Stack entries: 'k' is a dict expecting a key or its end, 'v' is a dict
+ * expecting a value and 'l' is a list.
+ */
+static void token_value_done(struct ben_tokenizer *t)
+{
+	if (t->depth == 0)
+		t->done = 1;
+	else if (t->stack[t->depth - 1] == 'v')
+		t->stack[t->depth - 1] = 'k';
+}
+
+int ben_next_token(struct ben_tokenizer *t, struct ben_token *token)
+{
+	/* Reuse the decoder's number parsing on the current chunk */
+	struct ben_decode_ctx ctx = {.data = t->data, .len = t->len, .off = t->pos};
+	char top;
+	char c;
+	size_t datalen;
+
+	if (t->error)
+		return -1;
+	if (t->done)
+		return 0;
+	if (t->pos == t->len)
+		return token_error(t, BEN_INSUFFICIENT);
+
+	memset(token, 0, sizeof *token);
+	token->off = t->base + t->pos;
+	top = t->depth > 0 ? t->stack[t->depth - 1] : 0;
+	c = t->data[t->pos];
+
+	switch (c) {
+	case 'e':
+		if (top == 0 || top == 'v')
+			return token_error(t, BEN_INVALID);
+		token->type = BEN_TOKEN_END;
+		ctx.off++;
+		break;
+	case '0':
+	case '1':
+	case '2':
+	case '3':
+	case '4':
+	case '5':
+	case '6':
+	case '7':
+	case '8':
+	case '9':
+		token->type = top == 'k' ? BEN_TOKEN_KEY : BEN_TOKEN_STR;
+		datalen = read_size_t(&ctx, ':');
+		if (datalen == -1)
+			return token_error(t, ctx.error);
+		if (ben_need_bytes(&ctx, datalen))
+			return token_error(t, BEN_INSUFFICIENT);
+		token->s = ctx.data + ctx.off;
+		token->s_len = datalen;
+		ctx.off += datalen;
+		break;
+	default:
+		if (top == 'k')
+			return token_error(t, BEN_INVALID);
+		switch (c) {
+		case 'i':
+			token->type = BEN_TOKEN_INT;
+			ctx.off++;
+			if (read_long_long(&token->ll, &ctx, 'e'))
+				return token_error(t, ctx.error);
+			break;
+		case 'b':
+			token->type = BEN_TOKEN_BOOL;
+			if (ben_need_bytes(&ctx, 2))
+				return token_error(t, BEN_INSUFFICIENT);
+			if (ctx.data[ctx.off + 1] != '0' && ctx.data[ctx.off + 1] != '1')
+				return token_error(t, BEN_INVALID);
+			token->ll = ctx.data[ctx.off + 1] == '1';
+			ctx.off += 2;
+			break;
+		case 'd':
+		case 'l':
+			if (t->depth == BEN_TOKENIZER_MAX_DEPTH)
+				return token_error(t, BEN_INVALID);
+			token->type = c == 'd' ? BEN_TOKEN_DICT : BEN_TOKEN_LIST;
+			ctx.off++;
+			break;
+		default:
+			return token_error(t, BEN_INVALID);
+		}
+	}
+
+	/* Only now that the whole token is there, update the state */
+	token->len = ctx.off - t->pos;
+	t->pos = ctx.off;
+	switch (token->type) {
+	case BEN_TOKEN_KEY:
+		t->stack[t->depth - 1] = 'v';
+		break;
+	case BEN_TOKEN_DICT:
+		t->stack[t->depth++] = 'k';
+		break;
+	case BEN_TOKEN_LIST:
+		t->stack[t->depth++] = 'l';
+		break;
+	case BEN_TOKEN_END:
+		t->depth--;
+		token_value_done(t);
+		break;
+	default:
+		token_value_done(t);
+		break;
+	}
+	return 1;
+}
+
+static int tape_push(struct ben_tape *tape, const struct ben_token *token)
+{
+	struct ben_tape_entry *entries;
+	size_t alloc;
+
+	if (tape->n == tape->alloc) {
+		alloc = tape->alloc == 0 ? 64 : tape->alloc * 2;
+		if (alloc > MAX_ALLOC)
+			return -1;
+		entries = ben_realloc(tape->entries,
+				      sizeof(entries[0]) * tape->alloc,
+				      sizeof(entries[0]) * alloc);
+		if (entries == NULL)
+			return -1;
+		tape->entries = entries;
+		tape->alloc = alloc;
+	}
+	tape->entries[tape->n].token = *token;
+	tape->entries[tape->n].next = tape->n + 1;
+	tape->n++;
+	return 0;
+}
+
+int ben_tape_build(struct ben_tape *tape, const void *data, size_t len, size_t *off)
+{
+	struct ben_tokenizer t;
+	struct ben_token token;
+	/* tape index of each open dict and list */
+	size_t open[BEN_TOKENIZER_MAX_DEPTH];
+	int ret;
+
+	memset(tape, 0, sizeof *tape);
+	tape->data = data;
+	tape->len = len;
+	ben_tokenizer_init(&t, data, len);
+
+	while ((ret = ben_next_token(&t, &token)) > 0) {
+		switch (token.type) {
+		case BEN_TOKEN_DICT:
+		case BEN_TOKEN_LIST:
+			open[t.depth - 1] = tape->n;
+			break;
+		case BEN_TOKEN_END:
+			tape->entries[open[t.depth]].next = tape->n + 1;
+			break;
+		}
+		if (tape_push(tape, &token)) {
+			ben_tape_free(tape);
+			return BEN_NO_MEMORY;
+		}
+	}
+
+	if (ret < 0) {
+		ben_tape_free(tape);
+		return t.error;
+	}
+	if (off != NULL)
+		*off = t.pos;
+	return BEN_OK;
+}
+
+void ben_tape_free(struct ben_tape *tape)
+{
+	ben_dealloc(tape->entries, sizeof(tape->entries[0]) * tape->alloc);
+	tape->entries = NULL;
+	tape->n = 0;
+	tape->alloc = 0;
+}
+
+size_t ben_tape_dict_get_by_str(const struct ben_tape *tape, size_t dict, const char *key)
+{
+	size_t keylen = strlen(key);
+	const struct ben_token *k;
+	size_t i;
+
+	if (dict >= tape->n || tape->entries[dict].token.type != BEN_TOKEN_DICT)
+		return -1;
+
+	i = dict + 1;
+	while (tape->entries[i].token.type == BEN_TOKEN_KEY) {
+		k = &tape->entries[i].token;
+		if (k->s_len == keylen && memcmp(k->s, key, keylen) == 0)
+			return i + 1;
+		i = tape->entries[i + 1].next;
+	}
+	return -1;
+}
+
+size_t ben_tape_list_get(const struct ben_tape *tape, size_t list, size_t pos)
+{
+	size_t i;
+
+	if (list >= tape->n || tape->entries[list].token.type != BEN_TOKEN_LIST)
+		return -1;
+
+	i = list + 1;
+	while (tape->entries[i].token.type != BEN_TOKEN_END) {
+		if (pos-- == 0)
+			return i;
+		i = tape->entries[i].next;
+	}
+	return -1;
+}
+
+const char *ben_tape_span(const struct ben_tape *tape, size_t i, size_t *len)
+{
+	const struct ben_token *last = &tape->entries[tape->entries[i].next - 1].token;
+	size_t start = tape->entries[i].token.off;
+
+	*len = last->off + last->len - start;
+	return tape->data + start;
+}
+
+struct bencode *ben_tape_decode(const struct ben_tape *tape, size_t i, int *error)
+{
+	size_t len;
+	size_t off = 0;
+	const char *span = ben_tape_span(tape, i, &len);
+
+	return ben_decode_view(span, len, &off, error);
+}
+
+struct bencode *ben_decode3(const void *data, size_t len, size_t *off, int *error, struct bencode_type *types[128])
+{
+	struct ben_decode_ctx ctx = {.data = data, .len = len, .off = *off,
+				     .types = types};
+	struct bencode *b = ben_ctx_decode(&ctx);
+	*off = ctx.off;
+	if (error != NULL) {
+		assert((b != NULL) ^ (ctx.error != 0));
+		*error = ctx.error;
+	}
+	return b;
+}
+
+static struct bencode *decode_printed_bool(struct ben_decode_ctx *ctx)
+{
+	struct bencode *b;
+	int bval = -1;
 
 	if (try_match(ctx, "True")) {	
 		if (ben_need_bytes(ctx, 4))
@@ -1164,7 +1757,7 @@ static struct bencode *decode_printed_str(struct ben_decode_ctx *ctx)
 	if (pos >= ctx->len)
 		return ben_insufficient_ptr(ctx);
 
-	s = malloc(len + 1);
+	s = ben_malloc(len + 1);
 	if (s == NULL)
 		return ben_oom_ptr(ctx);
 
@@ -1218,13 +1811,13 @@ static struct bencode *decode_printed_str(struct ben_decode_ctx *ctx)
 
 	b = internal_blob(s, len);
 	if (b == NULL) {
-		free(s);
+		ben_dealloc(s, len + 1);
 		return ben_oom_ptr(ctx);
 	}
 	return b;
 
 invalid:
-	free(s);
+	ben_dealloc(s, len + 1);
 	return ben_invalid_ptr(ctx);
 }
 
@@ -1299,36 +1892,185 @@ struct bencode *ben_decode_printed2(const void *data, size_t len, size_t *off, s
 	return b;
 }
 
-static void free_dict(struct bencode_dict *d)
+struct walk_frame {
+	const struct bencode *b; /* a dict or a list */
+	size_t i; /* next child. walk_next() counts dict keys and values separately */
+	struct bencode_keyvalue *pairs; /* visit a dict in this order instead */
+};
+
+struct walk_stack {
+	struct walk_frame *frames;
+	size_t n;
+	size_t alloc;
+	struct walk_frame inline_frames[STACK_INLINE_DEPTH];
+};
+
+static void walk_init(struct walk_stack *stack)
+{
+	stack->frames = stack->inline_frames;
+	stack->n = 0;
+	stack->alloc = STACK_INLINE_DEPTH;
+}
+
+static void walk_release(struct walk_stack *stack)
+{
+	if (stack->frames != stack->inline_frames)
+		free(stack->frames);
+}
+
+static int walk_grow(struct walk_stack *stack)
 {
+	struct walk_frame *newframes = grow_stack(stack->frames, &stack->alloc,
+						  stack->inline_frames,
+						  sizeof(newframes[0]));
+	if (newframes == NULL)
+		return -1;
+	stack->frames = newframes;
+	return 0;
+}
+
+/* Returns -1 if the stack could not grow */
+static inline int walk_push(struct walk_stack *stack, const struct bencode *b,
+			    struct bencode_keyvalue *pairs)
+{
+	struct walk_frame *f;
+	if (stack->n == stack->alloc && walk_grow(stack))
+		return -1;
+	f = &stack->frames[stack->n++];
+	f->b = b;
+	f->i = 0;
+	f->pairs = pairs;
+	return 0;
+}
+
+/* The next child of the innermost container, or NULL if it has no more */
+static struct bencode *walk_next(struct walk_stack *stack)
+{
+	struct walk_frame *f = &stack->frames[stack->n - 1];
+	const struct bencode_dict *d;
+	const struct bencode_list *l;
 	size_t pos;
+
+	if (f->b->type == BENCODE_LIST) {
+		l = ben_list_const_cast(f->b);
+		return f->i < l->n ? l->values[f->i++] : NULL;
+	}
+	d = ben_dict_const_cast(f->b);
+	if (f->i >= 2 * d->n)
+		return NULL;
+	pos = f->i / 2;
+	if (f->i++ % 2 == 0)
+		return f->pairs != NULL ? f->pairs[pos].key : d->nodes[pos].key;
+	return f->pairs != NULL ? f->pairs[pos].value : d->nodes[pos].value;
+}
+
+/* Whether freeing 'b' means freeing children as well */
+static int owns_children(const struct bencode *b)
+{
+	if (b->type == BENCODE_DICT)
+		return !ben_dict_const_cast(b)->shared;
+	if (b->type == BENCODE_LIST)
+		return !ben_list_const_cast(b)->shared;
+	return 0;
+}
+
+/* Whether 'b' is encoded from its children rather than copied from a span */
+static int encodes_children(const struct bencode *b)
+{
+	if (b->type == BENCODE_DICT)
+		return ben_dict_const_cast(b)->span == NULL;
+	if (b->type == BENCODE_LIST)
+		return ben_list_const_cast(b)->span == NULL;
+	return 0;
+}
+
+static void free_dict(struct bencode_dict *d)
+{
 	if (d->shared)
 		return;
-	for (pos = 0; pos < d->n; pos++) {
-		ben_free(d->nodes[pos].key);
-		ben_free(d->nodes[pos].value);
-		d->nodes[pos].key = NULL;
-		d->nodes[pos].value = NULL;
-	}
-	free(d->buckets);
-	free(d->nodes);
+	ben_dealloc(d->buckets, sizeof(d->buckets[0]) * d->alloc);
+	ben_dealloc(d->nodes, sizeof(d->nodes[0]) * d->alloc);
 }
 
 static void free_list(struct bencode_list *list)
 {
-	size_t pos;
 	if (list->shared)
 		return;
-	for (pos = 0; pos < list->n; pos++) {
-		ben_free(list->values[pos]);
-		list->values[pos] = NULL;
+	ben_dealloc(list->values, sizeof(list->values[0]) * list->alloc);
+}
+
+/* Turn what was staged since the last chunk into a chunk */
+static void sink_cut(struct ben_encode_ctx *ctx)
+{
+	if (ctx->pos == ctx->staged)
+		return;
+	ctx->chunks[ctx->chunks_n++] = (struct ben_chunk) {
+		.data = ctx->data + ctx->staged,
+		.len = ctx->pos - ctx->staged,
+	};
+	ctx->sunk += ctx->pos - ctx->staged;
+	ctx->staged = ctx->pos;
+}
+
+static int sink_flush(struct ben_encode_ctx *ctx)
+{
+	sink_cut(ctx);
+	if (ctx->chunks_n > 0 &&
+	    ctx->sink->write(ctx->sink->opaque, ctx->chunks, ctx->chunks_n))
+		return -1;
+	ctx->chunks_n = 0;
+	ctx->pos = 0;
+	ctx->staged = 0;
+	return 0;
+}
+
+/* Pass 'buf' to the sink as it is. It must stay valid until it is flushed. */
+static int sink_ref(struct ben_encode_ctx *ctx, const void *buf, size_t len)
+{
+	/* Room for the staged bytes before it, itself, and what is staged after */
+	if (ctx->chunks_n + 3 > BEN_SINK_CHUNKS && sink_flush(ctx))
+		return -1;
+	sink_cut(ctx);
+	ctx->chunks[ctx->chunks_n++] = (struct ben_chunk) {.data = buf, .len = len};
+	ctx->sunk += len;
+	return 0;
+}
+
+/* Make room for 'len' more bytes, or fail if the buffer can't grow */
+static int grow_encode(struct ben_encode_ctx *ctx, size_t len)
+{
+	size_t newsize = ctx->size > 0 ? ctx->size : 256;
+	char *newdata;
+
+	if (ctx->sink != NULL)
+		return (sink_flush(ctx) || len > ctx->size) ? -1 : 0;
+	if (!ctx->grow)
+		return -1;
+	while ((newsize - ctx->pos) < len) {
+		if (newsize > ((size_t) -1) / 2)
+			return -1;
+		newsize *= 2;
+	}
+	newdata = realloc(ctx->data, newsize);
+	if (newdata == NULL) {
+		warn("No memory to encode\n");
+		return -1;
 	}
-	free(list->values);
+	ctx->data = newdata;
+	ctx->size = newsize;
+	return 0;
+}
+
+static inline int reserve(struct ben_encode_ctx *ctx, size_t len)
+{
+	if ((ctx->size - ctx->pos) >= len)
+		return 0;
+	return grow_encode(ctx, len);
 }
 
 int ben_put_char(struct ben_encode_ctx *ctx, char c)
 {
-	if (ctx->pos >= ctx->size)
+	if (reserve(ctx, 1))
 		return -1;
 	ctx->data[ctx->pos] = c;
 	ctx->pos++;
@@ -1337,13 +2079,60 @@ int ben_put_char(struct ben_encode_ctx *ctx, char c)
 
 int ben_put_buffer(struct ben_encode_ctx *ctx, const void *buf, size_t len)
 {
-	if ((ctx->pos + len) > ctx->size)
+	if (ctx->sink != NULL && len > ctx->size) {
+		/* Too big to stage, so it has to go before 'buf' is gone */
+		return (sink_ref(ctx, buf, len) || sink_flush(ctx)) ? -1 : 0;
+	}
+	if (reserve(ctx, len))
 		return -1;
 	memcpy(ctx->data + ctx->pos, buf, len);
 	ctx->pos += len;
 	return 0;
 }
 
+/* Number of decimal digits in 'v' */
+static inline int count_digits(unsigned long long v)
+{
+	int n = 1;
+	while (v >= 10000) {
+		v /= 10000;
+		n += 4;
+	}
+	return n + (v >= 10) + (v >= 100) + (v >= 1000);
+}
+
+static const char digit_pairs[201] =
+	"00010203040506070809"
+	"10111213141516171819"
+	"20212223242526272829"
+	"30313233343536373839"
+	"40414243444546474849"
+	"50515253545556575859"
+	"60616263646566676869"
+	"70717273747576777879"
+	"80818283848586878889"
+	"90919293949596979899";
+
+/* Write the 'n' digits of 'v' to 'p', two at a time from the end */
+static void write_digits(char *p, int n, unsigned long long v)
+{
+	while (n >= 2) {
+		unsigned int pair = (unsigned int) (v % 100) * 2;
+		v /= 100;
+		n -= 2;
+		p[n] = digit_pairs[pair];
+		p[n + 1] = digit_pairs[pair + 1];
+	}
+	if (n)
+		p[0] = '0' + (char) v;
+}
+
+static unsigned long long magnitude(long long ll)
+{
+	/* Negating in unsigned arithmetic works for LLONG_MIN too */
+	return ll < 0 ? -(unsigned long long) ll : (unsigned long long) ll;
+}
+
 static int puthexchar(struct ben_encode_ctx *ctx, unsigned char hex)
 {
 	char buf[5];
@@ -1352,20 +2141,21 @@ static int puthexchar(struct ben_encode_ctx *ctx, unsigned char hex)
 	return ben_put_buffer(ctx, buf, len);
 }
 
-static int putlonglong(struct ben_encode_ctx *ctx, long long ll)
+static int putunsignedlonglong(struct ben_encode_ctx *ctx, unsigned long long llu)
 {
-	char buf[LONGLONGSIZE];
-	int len = snprintf(buf, sizeof buf, "%lld", ll);
-	assert(len > 0);
-	return ben_put_buffer(ctx, buf, len);
+	int n = count_digits(llu);
+	if (reserve(ctx, n))
+		return -1;
+	write_digits(ctx->data + ctx->pos, n, llu);
+	ctx->pos += n;
+	return 0;
 }
 
-static int putunsignedlonglong(struct ben_encode_ctx *ctx, unsigned long long llu)
+static int putlonglong(struct ben_encode_ctx *ctx, long long ll)
 {
-	char buf[LONGLONGSIZE];
-	int len = snprintf(buf, sizeof buf, "%llu", llu);
-	assert(len > 0);
-	return ben_put_buffer(ctx, buf, len);
+	if (ll < 0 && ben_put_char(ctx, '-'))
+		return -1;
+	return putunsignedlonglong(ctx, magnitude(ll));
 }
 
 static int putstr(struct ben_encode_ctx *ctx, char *s)
@@ -1532,16 +2322,23 @@ static size_t get_printed_size(const struct bencode *b)
 	}
 }
 
-int ben_ctx_encode(struct ben_encode_ctx *ctx, const struct bencode *b)
+/* Put bytes of the tree or its input, which outlive the encoding */
+static inline int put_lasting(struct ben_encode_ctx *ctx, const void *buf, size_t len)
+{
+	if (ctx->sink != NULL && len >= SINK_REF_MIN)
+		return sink_ref(ctx, buf, len);
+	return ben_put_buffer(ctx, buf, len);
+}
+
+/* Encode anything but a dict or list that has to be encoded from its children */
+static int encode_leaf(struct ben_encode_ctx *ctx, const struct bencode *b)
 {
 	const struct bencode_bool *boolean;
+	const struct bencode_dict *d;
 	const struct bencode_int *integer;
 	const struct bencode_list *list;
 	const struct bencode_str *s;
 	const struct bencode_user *u;
-	size_t i;
-	size_t len;
-	struct bencode_keyvalue *pairs;
 
 	switch (b->type) {
 	case BENCODE_BOOL:
@@ -1549,28 +2346,8 @@ int ben_ctx_encode(struct ben_encode_ctx *ctx, const struct bencode *b)
 		return putstr(ctx, boolean->b ? "b1" : "b0");
 
 	case BENCODE_DICT:
-		if (ben_put_char(ctx, 'd'))
-			return -1;
-
-		pairs = ben_dict_ordered_items(b);
-		if (pairs == NULL) {
-			warn("No memory for dict serialization\n");
-			return -1;
-		}
-
-		len = ben_dict_len(b);
-		for (i = 0; i < len; i++) {
-			if (ben_ctx_encode(ctx, pairs[i].key))
-				break;
-			if (ben_ctx_encode(ctx, pairs[i].value))
-				break;
-		}
-		free(pairs);
-		pairs = NULL;
-		if (i < len)
-			return -1;
-
-		return ben_put_char(ctx, 'e');
+		d = ben_dict_const_cast(b);
+		return put_lasting(ctx, d->span, d->span_len);
 
 	case BENCODE_INT:
 		if (ben_put_char(ctx, 'i'))
@@ -1581,16 +2358,8 @@ int ben_ctx_encode(struct ben_encode_ctx *ctx, const struct bencode *b)
 		return ben_put_char(ctx, 'e');
 
 	case BENCODE_LIST:
-		if (ben_put_char(ctx, 'l'))
-			return -1;
-
 		list = ben_list_const_cast(b);
-		for (i = 0; i < list->n; i++) {
-			if (ben_ctx_encode(ctx, list->values[i]))
-				return -1;
-		}
-
-		return ben_put_char(ctx, 'e');
+		return put_lasting(ctx, list->span, list->span_len);
 
 	case BENCODE_STR:
 		s = ben_str_const_cast(b);
@@ -1598,7 +2367,7 @@ int ben_ctx_encode(struct ben_encode_ctx *ctx, const struct bencode *b)
 			return -1;
 		if (ben_put_char(ctx, ':'))
 			return -1;
-		return ben_put_buffer(ctx, s->s, s->len);
+		return put_lasting(ctx, s->s, s->len);
 
 	case BENCODE_USER:
 		u = ben_user_const_cast(b);
@@ -1609,38 +2378,126 @@ int ben_ctx_encode(struct ben_encode_ctx *ctx, const struct bencode *b)
 	}
 }
 
-static size_t get_size(const struct bencode *b)
+/* Write the 'd' or 'l' of 'b' and push it, so its children come next */
+static int encode_open(struct ben_encode_ctx *ctx, struct walk_stack *stack,
+		       const struct bencode *b)
 {
-	size_t pos;
+	struct bencode_keyvalue *pairs = NULL;
+
+	if (b->type == BENCODE_LIST)
+		return ben_put_char(ctx, 'l') || walk_push(stack, b, NULL);
+
+	if (ben_put_char(ctx, 'd'))
+		return -1;
+	/* Only dicts that have lost their order need to be copied and sorted */
+	if (ben_dict_const_cast(b)->unsorted) {
+		pairs = ben_dict_ordered_items(b);
+		if (pairs == NULL) {
+			warn("No memory for dict serialization\n");
+			return -1;
+		}
+	}
+	if (walk_push(stack, b, pairs)) {
+		free(pairs);
+		return -1;
+	}
+	return 0;
+}
+
+int ben_ctx_encode(struct ben_encode_ctx *ctx, const struct bencode *b)
+{
+	struct walk_stack stack;
+	struct walk_frame *f;
 	const struct bencode_dict *d;
-	const struct bencode_int *i;
 	const struct bencode_list *l;
+	const struct bencode *child;
+	size_t i;
+	int ret = -1;
+
+	walk_init(&stack);
+	if (encodes_children(b) ? encode_open(ctx, &stack, b) : encode_leaf(ctx, b))
+		goto out;
+
+	/*
+	 * Encode the leaves of the innermost container in a tight loop, and
+	 * only come back out here to descend into a child or to close it
+	 */
+	while (stack.n > 0) {
+		f = &stack.frames[stack.n - 1];
+		if (f->b->type == BENCODE_LIST) {
+			l = (const struct bencode_list *) f->b;
+			for (i = f->i; i < l->n; i++) {
+				child = l->values[i];
+				if (encodes_children(child))
+					break;
+				if (encode_leaf(ctx, child))
+					goto out;
+			}
+			if (i < l->n) {
+				f->i = i + 1;
+				if (encode_open(ctx, &stack, child))
+					goto out;
+				continue;
+			}
+		} else {
+			d = (const struct bencode_dict *) f->b;
+			for (i = f->i; i < d->n; i++) {
+				if (f->pairs != NULL) {
+					child = f->pairs[i].value;
+					if (encode_leaf(ctx, f->pairs[i].key))
+						goto out;
+				} else {
+					child = d->nodes[i].value;
+					if (encode_leaf(ctx, d->nodes[i].key))
+						goto out;
+				}
+				if (encodes_children(child))
+					break;
+				if (encode_leaf(ctx, child))
+					goto out;
+			}
+			if (i < d->n) {
+				f->i = i + 1;
+				if (encode_open(ctx, &stack, child))
+					goto out;
+				continue;
+			}
+		}
+
+		stack.n--;
+		if (f->pairs != NULL)
+			free(f->pairs);
+		if (ben_put_char(ctx, 'e'))
+			goto out;
+	}
+	ret = 0;
+
+out:
+	while (stack.n > 0)
+		free(stack.frames[--stack.n].pairs);
+	walk_release(&stack);
+	return ret;
+}
+
+static size_t get_leaf_size(const struct bencode *b)
+{
+	const struct bencode_int *i;
 	const struct bencode_str *s;
 	const struct bencode_user *u;
-	size_t size = 0;
-	char buf[1];
 
 	switch (b->type) {
 	case BENCODE_BOOL:
 		return 2;
 	case BENCODE_DICT:
-		d = ben_dict_const_cast(b);
-		for (pos = 0; pos < d->n; pos++) {
-			size += get_size(d->nodes[pos].key);
-			size += get_size(d->nodes[pos].value);
-		}
-		return size + 2;
+		return ben_dict_const_cast(b)->span_len;
 	case BENCODE_INT:
 		i = ben_int_const_cast(b);
-		return 2 + snprintf(buf, 0, "%lld", i->ll);
+		return 2 + (i->ll < 0) + count_digits(magnitude(i->ll));
 	case BENCODE_LIST:
-		l = ben_list_const_cast(b);
-		for (pos = 0; pos < l->n; pos++)
-			size += get_size(l->values[pos]);
-		return size + 2;
+		return ben_list_const_cast(b)->span_len;
 	case BENCODE_STR:
 		s = ben_str_const_cast(b);
-		return snprintf(buf, 0, "%zu", s->len) + 1 + s->len;
+		return count_digits(s->len) + 1 + s->len;
 	case BENCODE_USER:
 		u = ben_user_const_cast(b);
 		return u->info->get_size(b);
@@ -1649,27 +2506,55 @@ static size_t get_size(const struct bencode *b)
 	}
 }
 
+static size_t get_size(const struct bencode *b)
+{
+	struct walk_stack stack;
+	size_t size = 0;
+
+	walk_init(&stack);
+	for (;;) {
+		if (!encodes_children(b))
+			size += get_leaf_size(b);
+		else if (walk_push(&stack, b, NULL))
+			size += get_size(b); /* starts with a fresh inline stack */
+		else
+			size += 2; /* the 'd' or 'l' and the 'e' */
+
+		while ((b = stack.n > 0 ? walk_next(&stack) : NULL) == NULL) {
+			if (stack.n == 0) {
+				walk_release(&stack);
+				return size;
+			}
+			stack.n--;
+		}
+	}
+}
+
 size_t ben_encoded_size(const struct bencode *b)
 {
 	return get_size(b);
 }
 
+/*
+ * Encodes in one pass, growing the buffer as it goes. That is cheaper than
+ * walking the whole tree first to size it exactly. Unmodified containers
+ * decoded with ben_decode_view() are copied from their spans either way.
+ */
 void *ben_encode(size_t *len, const struct bencode *b)
 {
-	size_t size = get_size(b);
-	void *data = malloc(size);
-	struct ben_encode_ctx ctx = {.data = data, .size = size};
-	if (data == NULL) {
-		warn("No memory to encode\n");
-		return NULL;
-	}
+	struct ben_encode_ctx ctx = {.grow = 1};
 	if (ben_ctx_encode(&ctx, b)) {
 		free(ctx.data);
 		return NULL;
 	}
-	assert(ctx.pos == size);
+	if (ctx.data == NULL) {
+		/* A user type may encode to nothing */
+		ctx.data = malloc(1);
+		if (ctx.data == NULL)
+			return NULL;
+	}
 	*len = ctx.pos;
-	return data;
+	return ctx.data;
 }
 
 size_t ben_encode2(char *data, size_t maxlen, const struct bencode *b)
@@ -1680,13 +2565,33 @@ size_t ben_encode2(char *data, size_t maxlen, const struct bencode *b)
 	return ctx.pos;
 }
 
-void ben_free(struct bencode *b)
+int ben_encode_sink(const struct ben_sink *sink, const struct bencode *b, size_t *len)
+{
+	struct ben_chunk chunks[BEN_SINK_CHUNKS];
+	struct ben_encode_ctx ctx = {.size = BEN_SINK_BUFFER, .sink = sink,
+				     .chunks = chunks};
+	int ret = -1;
+
+	ctx.data = malloc(ctx.size);
+	if (ctx.data == NULL) {
+		warn("No memory to encode\n");
+		return -1;
+	}
+	if (ben_ctx_encode(&ctx, b) == 0 && sink_flush(&ctx) == 0) {
+		*len = ctx.sunk;
+		ret = 0;
+	}
+	free(ctx.data);
+	return ret;
+}
+
+/* Free 'b' itself, but not the children of a dict or list */
+static void free_node(struct bencode *b)
 {
 	struct bencode_str *s;
 	struct bencode_user *u;
 	size_t size;
-	if (b == NULL)
-		return;
+
 	switch (b->type) {
 	case BENCODE_BOOL:
 		break;
@@ -1700,7 +2605,8 @@ void ben_free(struct bencode *b)
 		break;
 	case BENCODE_STR:
 		s = ben_str_cast(b);
-		free(s->s);
+		if (!s->view)
+			ben_dealloc(s->s, s->len + 1);
 		break;
 	case BENCODE_USER:
 		u = ben_user_cast(b);
@@ -1716,7 +2622,35 @@ void ben_free(struct bencode *b)
 	else
 		size = type_size(b->type);
 	memset(b, -1, size); /* data poison */
-	free(b);
+	ben_dealloc(b, size);
+}
+
+void ben_free(struct bencode *b)
+{
+	struct walk_stack stack;
+	struct bencode *child;
+
+	if (b == NULL)
+		return;
+	if (!owns_children(b)) {
+		free_node(b);
+		return;
+	}
+
+	walk_init(&stack);
+	walk_push(&stack, b, NULL);
+	while (stack.n > 0) {
+		child = walk_next(&stack);
+		if (child == NULL) {
+			free_node((struct bencode *) stack.frames[--stack.n].b);
+		} else if (!owns_children(child)) {
+			free_node(child);
+		} else if (walk_push(&stack, child, NULL)) {
+			/* A fresh call starts with a fresh inline stack */
+			ben_free(child);
+		}
+	}
+	walk_release(&stack);
 }
 
 struct bencode *ben_blob(const void *data, size_t len)
@@ -1725,9 +2659,9 @@ struct bencode *ben_blob(const void *data, size_t len)
 	if (b == NULL)
 		return NULL;
 	/* Allocate one extra byte for zero termination for convenient use */
-	b->s = malloc(len + 1);
+	b->s = ben_malloc(len + 1);
 	if (b->s == NULL) {
-		free(b);
+		ben_dealloc(b, sizeof(*b));
 		return NULL;
 	}
 	memcpy(b->s, data, len);
@@ -1753,8 +2687,17 @@ struct bencode *ben_dict(void)
 struct bencode *ben_dict_get(const struct bencode *dict, const struct bencode *key)
 {
 	const struct bencode_dict *d = ben_dict_const_cast(dict);
-	long long hash = ben_hash(key);
-	size_t pos = hash_bucket_head(hash, d);
+	long long hash;
+	size_t pos;
+	int found;
+
+	if (d->buckets == NULL) {
+		pos = small_find(d, key, &found);
+		return found ? d->nodes[pos].value : NULL;
+	}
+
+	hash = ben_hash(key);
+	pos = hash_bucket_head(hash, d);
 	while (pos != -1) {
 		assert(pos < d->n);
 		if (d->nodes[pos].hash == hash &&
@@ -1772,6 +2715,7 @@ struct bencode *ben_dict_get(const struct bencode *dict, const struct bencode *k
 static void inplace_ben_str(struct bencode_str *b, const char *s, size_t len)
 {
 	b->type = BENCODE_STR;
+	b->view = 1;
 	b->len = len;
 	b->s = (char *) s;
 }
@@ -1796,6 +2740,47 @@ struct bencode *ben_dict_get_by_int(const struct bencode *dict, long long key)
 	return ben_dict_get(dict, (struct bencode *) &i);
 }
 
+void ben_key_init(struct ben_key *key, const char *s)
+{
+	key->s = s;
+	key->len = strlen(s);
+	key->hash = str_hash((const unsigned char *) s, key->len);
+}
+
+struct bencode *ben_dict_get_by_key(const struct bencode *dict, const struct ben_key *key)
+{
+	const struct bencode_dict *d = ben_dict_const_cast(dict);
+	const struct bencode_str *nodekey;
+	size_t pos;
+
+	if (d->buckets == NULL) {
+		/* Few enough that comparing lengths first beats a search */
+		for (pos = 0; pos < d->n; pos++) {
+			if (d->nodes[pos].key->type != BENCODE_STR)
+				continue;
+			nodekey = ben_str_const_cast(d->nodes[pos].key);
+			if (nodekey->len == key->len &&
+			    memcmp(nodekey->s, key->s, key->len) == 0)
+				return d->nodes[pos].value;
+		}
+		return NULL;
+	}
+
+	pos = hash_bucket_head(key->hash, d);
+	while (pos != -1) {
+		assert(pos < d->n);
+		if (d->nodes[pos].hash == key->hash &&
+		    d->nodes[pos].key->type == BENCODE_STR) {
+			nodekey = ben_str_const_cast(d->nodes[pos].key);
+			if (nodekey->len == key->len &&
+			    memcmp(nodekey->s, key->s, key->len) == 0)
+				return d->nodes[pos].value;
+		}
+		pos = d->nodes[pos].next;
+	}
+	return NULL;
+}
+
 struct bencode_keyvalue *ben_dict_ordered_items(const struct bencode *b)
 {
 	struct bencode_keyvalue *pairs;
@@ -1810,7 +2795,8 @@ struct bencode_keyvalue *ben_dict_ordered_items(const struct bencode *b)
 		pairs[i].key = dict->nodes[i].key;
 		pairs[i].value = dict->nodes[i].value;
 	}
-	qsort(pairs, dict->n, sizeof(pairs[0]), ben_cmp_qsort);
+	if (dict->unsorted)
+		qsort(pairs, dict->n, sizeof(pairs[0]), ben_cmp_qsort);
 	return pairs;
 }
 
@@ -1863,6 +2849,23 @@ static struct bencode *dict_pop(struct bencode_dict *d,
 	if (d->n == 0)
 		return NULL;
 	struct bencode *value;
+	int found;
+
+	if (d->buckets == NULL) {
+		size_t pos = small_find(d, key, &found);
+		if (!found)
+			return NULL;
+		ben_mark_modified((struct bencode *) d);
+		value = d->nodes[pos].value;
+		ben_free(d->nodes[pos].key);
+		memmove(&d->nodes[pos], &d->nodes[pos + 1],
+			(d->n - pos - 1) * sizeof(d->nodes[0]));
+		d->n--;
+		if (d->n <= (d->alloc / 4) && d->alloc >= 8)
+			resize_dict(d, d->alloc / 2);
+		return value;
+	}
+
 	size_t removebucket = hash_bucket(hash, d);
 	size_t tailpos = d->n - 1;
 	size_t tailhash = d->nodes[tailpos].hash;
@@ -1873,6 +2876,7 @@ static struct bencode *dict_pop(struct bencode_dict *d,
 	if (removepos == -1)
 		return NULL;
 	key = NULL; /* avoid using the pointer again, it may not be valid */
+	ben_mark_modified((struct bencode *) d);
 
 	/*
 	 * WARNING: complicated code follows.
@@ -1886,8 +2890,10 @@ static struct bencode *dict_pop(struct bencode_dict *d,
 	 * in a for loop.
 	 */
 	dict_unlink(d, removebucket, removepos);
-	if (removepos != tailpos)
+	if (removepos != tailpos) {
 		dict_unlink(d, tailbucket, tailpos);
+		d->unsorted = 1;
+	}
 
 	/* Then read the removed node and free its key */
 	value = d->nodes[removepos].value;
@@ -1918,7 +2924,8 @@ static struct bencode *dict_pop(struct bencode_dict *d,
 struct bencode *ben_dict_pop(struct bencode *dict, const struct bencode *key)
 {
 	struct bencode_dict *d = ben_dict_cast(dict);
-	return dict_pop(d, key, ben_hash(key));
+	/* small dicts don't use the hash */
+	return dict_pop(d, key, d->buckets != NULL ? ben_hash(key) : 0);
 }
 
 struct bencode *ben_dict_pop_by_str(struct bencode *dict, const char *key)
@@ -1928,6 +2935,13 @@ struct bencode *ben_dict_pop_by_str(struct bencode *dict, const char *key)
 	return ben_dict_pop(dict, (struct bencode *) &s);
 }
 
+struct bencode *ben_dict_pop_by_key(struct bencode *dict, const struct ben_key *key)
+{
+	struct bencode_str s;
+	inplace_ben_str(&s, key->s, key->len);
+	return dict_pop(ben_dict_cast(dict), (struct bencode *) &s, key->hash);
+}
+
 struct bencode *ben_dict_pop_by_int(struct bencode *dict, long long key)
 {
 	struct bencode_int i;
@@ -1947,12 +2961,40 @@ struct bencode *ben_dict_pop_current(struct bencode *dict, size_t *pos)
 int ben_dict_set(struct bencode *dict, struct bencode *key, struct bencode *value)
 {
 	struct bencode_dict *d = ben_dict_cast(dict);
-	long long hash = ben_hash(key);
+	long long hash;
 	size_t bucket;
 	size_t pos;
+	int found;
 
 	assert(value != NULL);
 
+	ben_mark_modified(dict);
+	if (d->buckets == NULL) {
+		pos = small_find(d, key, &found);
+		if (found) {
+			ben_free(d->nodes[pos].key);
+			ben_free(d->nodes[pos].value);
+			d->nodes[pos].key = key;
+			d->nodes[pos].value = value;
+			return 0;
+		}
+		assert(d->n <= d->alloc);
+		if (d->n == d->alloc && resize_dict(d, -1))
+			return -1;
+		if (d->buckets == NULL) {
+			memmove(&d->nodes[pos + 1], &d->nodes[pos],
+				(d->n - pos) * sizeof(d->nodes[0]));
+			d->nodes[pos] = (struct bencode_dict_node) {.key = key,
+								    .value = value};
+			d->n++;
+			return 0;
+		}
+		/* Grew past BEN_DICT_SMALL_MAX: the key is surely new */
+		hash = ben_hash(key);
+		goto append;
+	}
+
+	hash = ben_hash(key);
 	pos = hash_bucket_head(hash, d);
 	for (; pos != -1; pos = d->nodes[pos].next) {
 		assert(pos < d->n);
@@ -1970,8 +3012,11 @@ int ben_dict_set(struct bencode *dict, struct bencode *key, struct bencode *valu
 	if (d->n == d->alloc && resize_dict(d, -1))
 		return -1;
 
+append:
 	bucket = hash_bucket(hash, d);
 	pos = d->n;
+	if (pos > 0 && !d->unsorted && ben_cmp(d->nodes[pos - 1].key, key) > 0)
+		d->unsorted = 1;
 	d->nodes[pos] = (struct bencode_dict_node) {.hash = hash,
 						    .key = key,
 						    .value = value,
@@ -2034,6 +3079,7 @@ int ben_list_append(struct bencode *list, struct bencode *b)
 	assert(b != NULL);
 	l->values[l->n] = b;
 	l->n++;
+	ben_mark_modified(list);
 	return 0;
 }
 
@@ -2067,6 +3113,7 @@ struct bencode *ben_list_pop(struct bencode *list, size_t pos)
 
 	l->values[l->n - 1] = NULL;
 	l->n--;
+	ben_mark_modified(list);
 	return value;
 }
 
@@ -2079,6 +3126,21 @@ void ben_list_set(struct bencode *list, size_t i, struct bencode *b)
 	ben_free(l->values[i]);
 	assert(b != NULL);
 	l->values[i] = b;
+	ben_mark_modified(list);
+}
+
+void ben_mark_modified(struct bencode *b)
+{
+	switch (b->type) {
+	case BENCODE_DICT:
+		ben_dict_cast(b)->span = NULL;
+		break;
+	case BENCODE_LIST:
+		ben_list_cast(b)->span = NULL;
+		break;
+	default:
+		break;
+	}
 }
 
 char *ben_print(const struct bencode *b)
@@ -2104,6 +3166,38 @@ struct bencode *ben_str(const char *s)
 	return ben_blob(s, strlen(s));
 }
 
+int ben_str_set(struct bencode *b, const void *data, size_t len)
+{
+	struct bencode_str *s = ben_str_cast(b);
+	char *copy = ben_malloc(len + 1);
+	if (copy == NULL)
+		return -1;
+	memcpy(copy, data, len);
+	copy[len] = 0;
+	if (!s->view)
+		ben_dealloc(s->s, s->len + 1);
+	s->s = copy;
+	s->len = len;
+	s->view = 0;
+	return 0;
+}
+
+int ben_str_own(struct bencode *b)
+{
+	struct bencode_str *s = ben_str_cast(b);
+	char *data;
+	if (!s->view)
+		return 0;
+	data = ben_malloc(s->len + 1);
+	if (data == NULL)
+		return -1;
+	memcpy(data, s->s, s->len);
+	data[s->len] = 0;
+	s->s = data;
+	s->view = 0;
+	return 0;
+}
+
 const char *ben_strerror(int error)
 {
 	switch (error) {
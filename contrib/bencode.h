@@ -48,6 +48,13 @@ struct bencode_bool {
 	char b;
 };
 
+/*
+ * Dicts with at most this many keys keep their nodes sorted by key, and
+ * are searched without hashing (buckets is NULL and hash is unset). A dict
+ * that grows past this gets hash buckets, and keeps them.
+ */
+#define BEN_DICT_SMALL_MAX 16
+
 struct bencode_dict_node {
 	long long hash;
 	struct bencode *key;
@@ -59,10 +66,18 @@ struct bencode_dict {
 	char type;
 	char shared; /* non-zero means that the internal data is shared with
 			other instances and should not be freed */
+	char unsorted; /* non-zero once nodes are not in key order, which
+			  only happens to hashed dicts */
 	size_t n;
 	size_t alloc;
 	size_t *buckets;
 	struct bencode_dict_node *nodes;
+	/*
+	 * Where this dict was in the input of ben_decode_view(), or NULL.
+	 * Cleared as soon as the dict is modified.
+	 */
+	const char *span;
+	size_t span_len;
 };
 
 struct bencode_int {
@@ -77,10 +92,15 @@ struct bencode_list {
 	size_t n;
 	size_t alloc;
 	struct bencode **values;
+	const char *span; /* same as in struct bencode_dict */
+	size_t span_len;
 };
 
 struct bencode_str {
 	char type;
+	char view; /* non-zero means that s points into a buffer owned by
+		      somebody else, see ben_decode_view(). It is not zero
+		      terminated and must not be freed. */
 	size_t len;
 	char *s;
 };
@@ -102,12 +122,44 @@ struct bencode_user {
 	struct bencode_type *info;
 };
 
+/*
+ * Memory functions used for everything that is part of a tree: the nodes
+ * themselves, dict and list storage and string data. Buffers handed back
+ * to the caller (ben_encode(), ben_print(), ...) always use malloc().
+ * realloc_ and free_ are given the current size of the block, so simple
+ * allocators don't need to keep track of it.
+ */
+struct ben_allocator {
+	void *(*malloc_) (void *opaque, size_t size);
+	void *(*realloc_) (void *opaque, void *ptr, size_t old_size, size_t new_size);
+	void (*free_) (void *opaque, void *ptr, size_t size);
+	void *opaque;
+};
+
 struct bencode_error {
 	int error;  /* 0 if no errors */
 	int line;   /* Error line: 0 is the first line */
 	size_t off; /* Error offset in bytes from the start */
 };
 
+/*
+ * Use 'allocator' for all trees created, modified or freed by the calling
+ * thread from now on, or go back to malloc() if it is NULL. Trees must be
+ * freed with the allocator they were built with. The allocator must stay
+ * valid while it is set.
+ */
+void ben_set_allocator(const struct ben_allocator *allocator);
+
+#define BEN_DEFAULT_MAX_DEPTH 256
+
+/*
+ * Decoding fails with BEN_INVALID when dicts and lists are nested deeper
+ * than 'depth' in the calling thread from now on, or BEN_DEFAULT_MAX_DEPTH
+ * if 'depth' is not positive. Decoding, encoding and freeing don't
+ * recurse, so a deeper limit costs heap memory rather than stack.
+ */
+void ben_set_max_depth(int depth);
+
 /* Allocate an instance of a user-defined type */
 void *ben_alloc_user(struct bencode_type *type);
 
@@ -197,6 +249,148 @@ struct bencode *ben_decode2(const void *data, size_t len, size_t *off, int *erro
  */
 struct bencode *ben_decode3(const void *data, size_t len, size_t *off, int *error, struct bencode_type *types[128]);
 
+/*
+ * Same as ben_decode2(), but strings are not copied. They point straight
+ * into 'data', which must stay valid and unchanged until the returned
+ * object is freed. Such strings have 'view' set and are NOT zero
+ * terminated, so always use their length. Use ben_str_own() to get a
+ * private, zero terminated copy of one before modifying it.
+ */
+struct bencode *ben_decode_view(const void *data, size_t len, size_t *off, int *error);
+
+enum {
+	BEN_TOKEN_DICT = 1, /* 'd', the start of a dict */
+	BEN_TOKEN_LIST,     /* 'l', the start of a list */
+	BEN_TOKEN_END,      /* 'e', the end of the innermost dict or list */
+	BEN_TOKEN_KEY,      /* a string that is a dict key */
+	BEN_TOKEN_STR,      /* any other string */
+	BEN_TOKEN_INT,
+	BEN_TOKEN_BOOL,
+};
+
+struct ben_token {
+	int type;      /* BEN_TOKEN_* */
+	size_t off;    /* where the token starts, counted from the start of all input */
+	size_t len;    /* number of input bytes it takes up, e.g. 5 for "3:foo" */
+	const char *s; /* strings and keys. Points into the input, NOT zero terminated */
+	size_t s_len;
+	long long ll;  /* ints and bools */
+};
+
+#define BEN_TOKENIZER_MAX_DEPTH 256
+
+/*
+ * Reads one bencoded value as a stream of tokens, without building a tree
+ * or allocating anything. Also see ben_tokenizer_init() and
+ * ben_next_token().
+ */
+struct ben_tokenizer {
+	const char *data; /* current chunk */
+	size_t len;
+	size_t pos;       /* next byte to read from data */
+	size_t base;      /* offset of data from the start of all input */
+	int depth;
+	char stack[BEN_TOKENIZER_MAX_DEPTH]; /* what each open dict or list expects next */
+	int done;         /* the whole value has been read */
+	int error;
+};
+
+/*
+ * Start tokenizing 'data', which may be the whole input or just its first
+ * chunk.
+ */
+void ben_tokenizer_init(struct ben_tokenizer *t, const void *data, size_t len);
+
+/*
+ * Continue with the next chunk of input after ben_next_token() reported
+ * BEN_INSUFFICIENT. Tokens are never split over chunks, so the chunk must
+ * begin with the bytes that were not used from the previous one, that is
+ * t->len - t->pos bytes from t->data + t->pos. Those bytes stay in the
+ * input offsets as before.
+ */
+void ben_tokenizer_feed(struct ben_tokenizer *t, const void *data, size_t len);
+
+/*
+ * Read the next token into 'token'. Returns 1 if there was one, 0 once the
+ * whole value has been read (t->pos is then just past it), and -1 on
+ * errors, which are left in t->error: BEN_INVALID, or BEN_INSUFFICIENT if
+ * the chunk ends in the middle of a token. Unlike ben_decode(), only
+ * strings are allowed as dict keys, and keys are not checked to be sorted
+ * or unique.
+ */
+int ben_next_token(struct ben_tokenizer *t, struct ben_token *token);
+
+struct ben_tape_entry {
+	struct ben_token token;
+	/*
+	 * Index of the entry after this value. For dicts and lists, that is
+	 * one past their BEN_TOKEN_END entry.
+	 */
+	size_t next;
+};
+
+/*
+ * All tokens of a bencoded value in one flat array, so that big inputs can
+ * be searched without building a tree. Entry 0 is the value itself. Build
+ * with ben_tape_build(), and free with ben_tape_free().
+ */
+struct ben_tape {
+	const char *data;
+	size_t len;
+	struct ben_tape_entry *entries;
+	size_t n;
+	size_t alloc;
+};
+
+/*
+ * Tokenize one bencoded value from 'data' into 'tape'. Returns 0 on
+ * success, and sets '*off' just past the value if 'off' is not NULL.
+ * Otherwise returns an error code as ben_decode2() does, and the tape is
+ * left empty. The tape points into 'data', so 'data' must outlive it.
+ */
+int ben_tape_build(struct ben_tape *tape, const void *data, size_t len, size_t *off);
+
+void ben_tape_free(struct ben_tape *tape);
+
+/* Index of the value after the one at 'i', skipping over its children */
+static inline size_t ben_tape_next(const struct ben_tape *tape, size_t i)
+{
+	return tape->entries[i].next;
+}
+
+/*
+ * Index of the value for 'key' in the dict at 'dict', or -1 if there is
+ * no such key or 'dict' is not a dict. Keys are searched one by one.
+ */
+size_t ben_tape_dict_get_by_str(const struct ben_tape *tape, size_t dict, const char *key);
+
+/* Index of the value at 'pos' in the list at 'list', or -1 */
+size_t ben_tape_list_get(const struct ben_tape *tape, size_t list, size_t pos);
+
+/*
+ * Where the value at 'i' is in the input, including any children. '*len'
+ * is set to its length.
+ */
+const char *ben_tape_span(const struct ben_tape *tape, size_t i, size_t *len);
+
+/*
+ * Decode just the value at 'i' into a tree, with ben_decode_view(), so the
+ * tree points into the tape's input too. Returns NULL and sets '*error' on
+ * failure.
+ */
+struct bencode *ben_tape_decode(const struct ben_tape *tape, size_t i, int *error);
+
+/*
+ * Dicts and lists decoded with ben_decode_view() remember the bytes they
+ * came from, and are encoded by copying those bytes as long as they are
+ * not modified. Modifying a dict or a list through this API forgets its
+ * bytes, but it can't know about the containers it is in, nor about
+ * strings changed in place with ben_str_set() or ben_str_own(). Call
+ * ben_mark_modified() on each of those containers, up to the root.
+ * Does nothing for other types.
+ */
+void ben_mark_modified(struct bencode *b);
+
 /*
  * Same as ben_decode(), but decodes data encoded with ben_print(). This is
  * whitespace tolerant, so intended Python syntax can also be read.
@@ -228,6 +422,36 @@ void *ben_encode(size_t *len, const struct bencode *b);
  */
 size_t ben_encode2(char *data, size_t maxlen, const struct bencode *b);
 
+/* A piece of encoded output handed to a ben_sink */
+struct ben_chunk {
+	const void *data;
+	size_t len;
+};
+
+/*
+ * Receives the output of ben_encode_sink() in order, a few chunks at a
+ * time. Chunks only stay valid until 'write' returns. Returning non-zero
+ * stops the encoding.
+ */
+struct ben_sink {
+	int (*write)(void *opaque, const struct ben_chunk *chunks, int chunks_n);
+	void *opaque;
+};
+
+/* Bytes staged before they are handed to the sink */
+#define BEN_SINK_BUFFER 65536
+/* Most chunks passed to the sink at once */
+#define BEN_SINK_CHUNKS 64
+
+/*
+ * Encode 'b' to 'sink' in constant memory, without building the output.
+ * Small pieces are copied into a staging buffer. The spans of unmodified
+ * containers and long strings are passed to the sink as they are. Returns
+ * 0 and sets '*len' to the number of bytes written, or returns -1 if the
+ * sink stopped it or memory ran out.
+ */
+int ben_encode_sink(const struct ben_sink *sink, const struct bencode *b, size_t *len);
+
 /*
  * You must use ben_free() for all allocated bencode structures after use.
  * If b == NULL, ben_free does nothing.
@@ -259,6 +483,23 @@ struct bencode *ben_dict_get(const struct bencode *d, const struct bencode *key)
 struct bencode *ben_dict_get_by_str(const struct bencode *d, const char *key);
 struct bencode *ben_dict_get_by_int(const struct bencode *d, long long key);
 
+/*
+ * A string key whose hash has been worked out in advance, for when the
+ * same key is looked up in many dicts. 's' is not copied, so it must
+ * outlive the key. Set up with ben_key_init().
+ */
+struct ben_key {
+	const char *s;
+	size_t len;
+	long long hash;
+};
+
+void ben_key_init(struct ben_key *key, const char *s);
+
+/* Same as ben_dict_get_by_str() and ben_dict_pop_by_str(), without hashing */
+struct bencode *ben_dict_get_by_key(const struct bencode *d, const struct ben_key *key);
+struct bencode *ben_dict_pop_by_key(struct bencode *d, const struct ben_key *key);
+
 struct bencode_keyvalue {
 	struct bencode *key;
 	struct bencode *value;
@@ -334,6 +575,20 @@ char *ben_print(const struct bencode *b);
 /* Create a string from C string (note bencode string may contain '\0'. */
 struct bencode *ben_str(const char *s);
 
+/*
+ * If 's' is a view (see ben_decode_view()), copy its data so that it owns
+ * a zero terminated string like any other. Does nothing otherwise.
+ * Returns 0 on success, -1 if there is no memory.
+ */
+int ben_str_own(struct bencode *s);
+
+/*
+ * Replace the contents of string 's' with a copy of 'len' bytes of 'data'.
+ * Returns 0 on success, -1 if there is no memory, in which case 's' is
+ * left as it was.
+ */
+int ben_str_set(struct bencode *s, const void *data, size_t len);
+
 /* Return a human readable explanation of error returned with ben_decode2() */
 const char *ben_strerror(int error);
 
@@ -565,8 +820,8 @@ static inline long long ben_int_val(const struct bencode *b)
 }
 
 /*
- * Note: the string is always zero terminated. Also, the string may
- * contain more than one zero.
+ * Note: the string is zero terminated, unless it came from
+ * ben_decode_view(). Also, the string may contain more than one zero.
  * bencode strings are not compatible with C strings.
  */
 static inline const char *ben_str_val(const struct bencode *b)
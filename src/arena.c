@@ -0,0 +1,124 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "arena.h"
+#include "err.h"
+
+#ifndef GRN_ARENA_CHUNK_SIZE
+#define GRN_ARENA_CHUNK_SIZE ( 64 * 1024 )
+#endif
+
+// enough for anything malloc would return
+union grn_arena_align {
+	long double ld;
+	long long ll;
+	void *p;
+};
+#define GRN_ARENA_ALIGN sizeof( union grn_arena_align )
+#define GRN_ARENA_ROUND( n ) ( ( ( n ) + GRN_ARENA_ALIGN - 1 ) / GRN_ARENA_ALIGN * GRN_ARENA_ALIGN )
+
+struct grn_arena_chunk {
+	struct grn_arena_chunk *next;
+	size_t size; // usable bytes after the header
+};
+
+#define GRN_ARENA_HEADER_SIZE GRN_ARENA_ROUND( sizeof( struct grn_arena_chunk ) )
+
+static char *chunk_data( struct grn_arena_chunk *chunk ) {
+	return ( char * )chunk + GRN_ARENA_HEADER_SIZE;
+}
+
+static void use_chunk( struct grn_arena *arena, struct grn_arena_chunk *chunk ) {
+	arena->current = chunk;
+	arena->cursor = chunk_data( chunk );
+	arena->end = arena->cursor + chunk->size;
+	arena->last = NULL;
+}
+
+static struct grn_arena_chunk *malloc_chunk( size_t size, int *out_err ) {
+	*out_err = GRN_OK;
+
+	struct grn_arena_chunk *chunk = malloc( GRN_ARENA_HEADER_SIZE + size );
+	ERR_NULL( chunk == NULL, GRN_ERR_OOM );
+	chunk->next = NULL;
+	chunk->size = size;
+	return chunk;
+}
+
+void *grn_arena_alloc( struct grn_arena *arena, size_t size, int *out_err ) {
+	*out_err = GRN_OK;
+	size = GRN_ARENA_ROUND( size > 0 ? size : 1 );
+
+	// big ones would waste most of a chunk, so they are kept on their own
+	if ( size > GRN_ARENA_CHUNK_SIZE / 4 ) {
+		struct grn_arena_chunk *chunk = malloc_chunk( size, out_err );
+		ERR_FW_NULL();
+		chunk->next = arena->big;
+		arena->big = chunk;
+		return chunk_data( chunk );
+	}
+
+	if ( arena->cursor == NULL || ( size_t )( arena->end - arena->cursor ) < size ) {
+		struct grn_arena_chunk *next = arena->current != NULL ? arena->current->next : arena->chunks;
+		if ( next == NULL ) {
+			next = malloc_chunk( GRN_ARENA_CHUNK_SIZE, out_err );
+			ERR_FW_NULL();
+			if ( arena->current != NULL ) {
+				arena->current->next = next;
+			} else {
+				arena->chunks = next;
+			}
+		}
+		use_chunk( arena, next );
+	}
+
+	arena->last = arena->cursor;
+	arena->cursor += size;
+	return arena->last;
+}
+
+void *grn_arena_realloc( struct grn_arena *arena, void *ptr, size_t old_size, size_t new_size, int *out_err ) {
+	*out_err = GRN_OK;
+
+	if ( ptr == NULL ) {
+		return grn_arena_alloc( arena, new_size, out_err );
+	}
+	// lists and dicts usually grow while nothing else is being allocated
+	if ( ptr == arena->last && GRN_ARENA_ROUND( new_size ) <= ( size_t )( arena->end - arena->last ) ) {
+		arena->cursor = arena->last + GRN_ARENA_ROUND( new_size > 0 ? new_size : 1 );
+		return ptr;
+	}
+	if ( new_size <= old_size ) {
+		return ptr;
+	}
+
+	void *to_return = grn_arena_alloc( arena, new_size, out_err );
+	ERR_FW_NULL();
+	memcpy( to_return, ptr, old_size );
+	return to_return;
+}
+
+static void free_big( struct grn_arena *arena ) {
+	while ( arena->big != NULL ) {
+		struct grn_arena_chunk *next = arena->big->next;
+		free( arena->big );
+		arena->big = next;
+	}
+}
+
+void grn_arena_reset( struct grn_arena *arena ) {
+	free_big( arena );
+	if ( arena->chunks != NULL ) {
+		use_chunk( arena, arena->chunks );
+	}
+}
+
+void grn_arena_free( struct grn_arena *arena ) {
+	free_big( arena );
+	while ( arena->chunks != NULL ) {
+		struct grn_arena_chunk *next = arena->chunks->next;
+		free( arena->chunks );
+		arena->chunks = next;
+	}
+	memset( arena, 0, sizeof( struct grn_arena ) );
+}
@@ -0,0 +1,30 @@
+#ifndef H_GRN_ARENA
+#define H_GRN_ARENA
+
+#include <stddef.h>
+
+struct grn_arena_chunk;
+
+/**
+ * Bump allocator for things that all die at the same time, like the bencode tree of a single file.
+ * Individual allocations are never freed; grn_arena_reset gives everything back at once but keeps the
+ * memory around for next time. A zeroed struct is a valid, empty arena.
+ */
+struct grn_arena {
+	struct grn_arena_chunk *chunks; // first chunk. Chunks are reused in order after a reset.
+	struct grn_arena_chunk *current; // chunk being allocated from
+	struct grn_arena_chunk *big; // allocations too big for a chunk get their own, freed on reset
+	char *cursor;
+	char *end;
+	char *last; // most recent allocation, which can be grown in place
+};
+
+void *grn_arena_alloc( struct grn_arena *arena, size_t size, int *out_err );
+// like realloc, but the old size has to be passed in since the arena doesn't record it
+void *grn_arena_realloc( struct grn_arena *arena, void *ptr, size_t old_size, size_t new_size, int *out_err );
+// invalidates everything allocated so far
+void grn_arena_reset( struct grn_arena *arena );
+// releases all memory. The arena is empty but still usable afterwards.
+void grn_arena_free( struct grn_arena *arena );
+
+#endif
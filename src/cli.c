@@ -5,6 +5,7 @@
 #include <string.h>
 #include <stdbool.h>
 #include <getopt.h>
+#include <pthread.h>
 
 #include "libannouncebulk.h"
 #include "vector.h"
@@ -17,12 +18,24 @@ struct cli_ctx {
 	struct vector *files;
 
 	char *orpheus_user_announce;
+	int threads_n;
+	char *index_path; // points into argv
+	int watch;
 
 #define X_CLIENT(x_machine, x_enum, x_human) int x_machine;
 #include "x_clients.h"
 #undef X_CLIENT
 
 	struct grn_ctx *grn_ctx;
+	struct grn_watch *grn_watch;
+
+	// BEGIN finding files, which goes on in its own thread while the ones found so far are transformed
+	pthread_t cat_thread;
+	bool cat_running; // started and not joined yet
+	char **paths; // the files and directories given on the command line
+	int paths_n;
+	int cat_err; // what stopped it early. Only read once it's joined.
+	// END finding files
 };
 
 static void die_silent( struct cli_ctx *cli_ctx );
@@ -38,12 +51,19 @@ static void cli_ctx_free( struct cli_ctx *cli_ctx );
 static void handle_opts( struct cli_ctx *cli_ctx, int *argind, int argc, char **argv );
 static void cat_transforms( struct cli_ctx *cli_ctx );
 // uses the mutilated argv from getopt_long which only has files in it now
-// argind is optind
+// argind is optind. Starts a thread that pushes the files into the context, and then keeps watching if asked to.
 static void cat_files( struct cli_ctx *cli_ctx, int argind, int argc, char **argv );
+static void *cat_files_main( void *arg );
+// start watching the same files that cat_transforms and cat_files add
+static void watch_files( struct cli_ctx *cli_ctx, int argind, int argc, char **argv );
 
 static void seal( struct cli_ctx *cli_ctx );
 
 static void main_loop( struct cli_ctx *cli_ctx );
+// transform files until the context is done. Only reports errors, unless verbose.
+static void process_files( struct cli_ctx *cli_ctx, bool verbose );
+// runs on the thread started by cat_files, and only returns if something goes wrong
+static void watch_loop( struct cli_ctx *cli_ctx, int *out_err );
 
 char help_text[] = "USAGE:\n"
                    "\n"
@@ -54,6 +74,14 @@ char help_text[] = "USAGE:\n"
                    "  -h               Show this help text.\n"
                    "  -v               Show the version.\n"
                    "  -t               Specify a custom transform.\n"
+                   "  -j N             Process N files at once. Defaults to 1.\n"
+                   "  --index FILE     Remember which files needed no changes in FILE, and skip them next time\n"
+                   "                   unless they or the transformations have changed.\n"
+#ifdef GRN_USE_IO_URING
+                   "                   Files are read without io_uring then, since most are never opened.\n"
+#endif
+                   "  --watch          Keep running, and transform torrents as soon as they are added to the given\n"
+                   "                   directories and clients. Linux only.\n"
                    "\n"
                    "  --orpheus        Use the preset to transform for Orpheus. This is the default.\n"
                    "\n"
@@ -71,10 +99,14 @@ int main( int argc, char **argv ) {
 
 	int argind;
 	handle_opts( &cli_ctx, &argind, argc, argv );
+	// before anything is listed, so that nothing added in the meantime is missed
+	if ( cli_ctx.watch ) {
+		watch_files( &cli_ctx, argind, argc, argv );
+	}
 	cat_transforms( &cli_ctx );
-	cat_files( &cli_ctx, argind, argc, argv );
 
 	seal( &cli_ctx );
+	cat_files( &cli_ctx, argind, argc, argv );
 	main_loop( &cli_ctx );
 
 	exit_kindly( &cli_ctx );
@@ -108,6 +140,7 @@ static void cli_ctx_alloc( struct cli_ctx *cli_ctx ) {
 	die_if( cli_ctx, in_err );
 	cli_ctx->grn_ctx = grn_ctx_alloc( &in_err );
 	die_if( cli_ctx, in_err );
+	cli_ctx->threads_n = 1;
 }
 
 static void cli_ctx_free_cats( struct cli_ctx *cli_ctx ) {
@@ -124,16 +157,23 @@ static void cli_ctx_free( struct cli_ctx *cli_ctx ) {
 
 	cli_ctx_free_cats( cli_ctx );
 	grn_free( cli_ctx->orpheus_user_announce );
+	if ( cli_ctx->cat_running ) {
+		// it may be waiting for files to be written, so it can't be joined. We're about to exit, so it's left to use
+		// the context and the watch until then.
+		grn_ctx_cancel_files( cli_ctx->grn_ctx );
+		return;
+	}
 	if ( cli_ctx->grn_ctx != NULL ) {
 		grn_ctx_free( cli_ctx->grn_ctx, &in_err );
 		if ( in_err ) {
 			printf( "Error freeing Greeny context: %s", grn_err_to_string( in_err ) );
 		}
 	}
+	grn_watch_free( cli_ctx->grn_watch );
 }
 
 static void handle_opts( struct cli_ctx *cli_ctx, int *argind, int argc, char **argv ) {
-	char shortopts[] = "t:hv";
+	char shortopts[] = "t:j:hv";
 	struct option longopts[] = {
 		{
 			.name = "help",
@@ -153,6 +193,18 @@ static void handle_opts( struct cli_ctx *cli_ctx, int *argind, int argc, char **
 			.flag = NULL,
 			.val = 1337,
 		},
+		{
+			.name = "index",
+			.has_arg = 1,
+			.flag = NULL,
+			.val = 1338,
+		},
+		{
+			.name = "watch",
+			.has_arg = 0,
+			.flag = &cli_ctx->watch,
+			.val = 1,
+		},
 #define X_CLIENT(x_machine, x_enum, x_human) { \
 	.name = #x_machine, \
 	.has_arg = 0, \
@@ -176,6 +228,10 @@ static void handle_opts( struct cli_ctx *cli_ctx, int *argind, int argc, char **
 				}
 				strcpy( cli_ctx->orpheus_user_announce, optarg );
 				break;
+			case 1338:
+				;
+				cli_ctx->index_path = optarg;
+				break;
 			// unknown option
 			case '?':
 				;
@@ -185,6 +241,15 @@ static void handle_opts( struct cli_ctx *cli_ctx, int *argind, int argc, char **
 				;
 				puts( "Not implemented yet." );
 				break;
+			case 'j':
+				;
+				char *threads_end;
+				long threads_n = strtol( optarg, &threads_end, 10 );
+				if ( *threads_end != '\0' || threads_n < 1 || threads_n > 1024 ) {
+					die_if( cli_ctx, GRN_ERR_CLI_OPT_VALUE );
+				}
+				cli_ctx->threads_n = threads_n;
+				break;
 			case 'h':
 				;
 				puts( help_text );
@@ -207,7 +272,7 @@ static void cat_transforms( struct cli_ctx *cli_ctx ) {
 
 	// add client-specific files
 #define X_CLIENT(x_machine, x_enum, x_human) if ( cli_ctx->x_machine ) { \
-	grn_cat_client( cli_ctx->files, x_enum, &in_err); \
+	grn_cat_client( cli_ctx->files, x_enum, grn_ctx_get_seen( cli_ctx->grn_ctx ), &in_err); \
 	die_if(cli_ctx, in_err); \
 }
 #include "x_clients.h"
@@ -220,22 +285,61 @@ static void cat_transforms( struct cli_ctx *cli_ctx ) {
 }
 
 static void cat_files( struct cli_ctx *cli_ctx, int argind, int argc, char **argv ) {
-	int in_err;
+	cli_ctx->paths = argv + argind;
+	cli_ctx->paths_n = argc - argind;
+	if ( pthread_create( &cli_ctx->cat_thread, NULL, cat_files_main, cli_ctx ) ) {
+		die_if( cli_ctx, GRN_ERR_THREAD );
+	}
+	cli_ctx->cat_running = true;
+}
+
+static void *cat_files_main( void *arg ) {
+	struct cli_ctx *cli_ctx = arg;
+	int in_err = GRN_OK;
 
 	// add normal files
-	for ( ; argind < argc; argind++ ) {
-		printf( "Adding %s and subdirectories.\n", argv[argind] );
-		grn_cat_torrent_files( cli_ctx->files, argv[argind], NULL, &in_err );
+	for ( int i = 0; i < cli_ctx->paths_n; i++ ) {
+		printf( "Adding %s and subdirectories.\n", cli_ctx->paths[i] );
+		grn_cat_torrent_files_ctx( cli_ctx->grn_ctx, cli_ctx->paths[i], NULL, &in_err );
 		if ( grn_err_is_single_file( in_err ) ) {
-			printf( "Error adding %s -- %s.\n", argv[argind], grn_err_to_string( in_err ) );
+			printf( "Error adding %s -- %s.\n", cli_ctx->paths[i], grn_err_to_string( in_err ) );
 			in_err = GRN_OK;
 		}
+		if ( in_err ) {
+			break;
+		}
+	}
+	if ( !in_err && cli_ctx->watch ) {
+		watch_loop( cli_ctx, &in_err );
+	}
+	cli_ctx->cat_err = in_err;
+	grn_ctx_close_files( cli_ctx->grn_ctx );
+	return NULL;
+}
+
+static void watch_files( struct cli_ctx *cli_ctx, int argind, int argc, char **argv ) {
+	int in_err;
+
+	cli_ctx->grn_watch = grn_watch_alloc( &in_err );
+	die_if( cli_ctx, in_err );
+#define X_CLIENT(x_machine, x_enum, x_human) if ( cli_ctx->x_machine ) { \
+	grn_watch_client( cli_ctx->grn_watch, x_enum, &in_err); \
+	die_if(cli_ctx, in_err); \
+}
+#include "x_clients.h"
+#undef X_CLIENT
+
+	for ( ; argind < argc; argind++ ) {
+		grn_watch_add( cli_ctx->grn_watch, argv[argind], NULL, &in_err );
+		if ( in_err ) {
+			printf( "Error watching %s -- %s.\n", argv[argind], grn_err_to_string( in_err ) );
+		}
 		die_if( cli_ctx, in_err );
 	}
 }
 
 static void seal( struct cli_ctx *cli_ctx ) {
-	int files_n = vector_length( cli_ctx->files );
+	int in_err;
 	int transforms_n = vector_length( cli_ctx->transforms );
 
 	// TODO: should we have a defined error for this instead?
@@ -244,33 +348,92 @@ static void seal( struct cli_ctx *cli_ctx ) {
 		die_silent( cli_ctx );
 	}
 
-	printf( "About to process %d files with %d transformations.\n", files_n, transforms_n );
-	if ( files_n == 0 ) {
-		exit_kindly( cli_ctx );
-	}
+	printf( "About to process files with %d transformations.\n", transforms_n );
 
+	// the clients' files, which were found already; the rest are pushed as they are found
 	grn_ctx_set_files_v( cli_ctx->grn_ctx, cli_ctx->files );
-	grn_ctx_set_transforms_v( cli_ctx->grn_ctx, cli_ctx->transforms );
+	grn_ctx_set_transforms_v( cli_ctx->grn_ctx, cli_ctx->transforms, &in_err );
 	cli_ctx->files = NULL;
 	cli_ctx->transforms = NULL;
 	cli_ctx_free_cats( cli_ctx );
+	die_if( cli_ctx, in_err );
+
+	if ( cli_ctx->index_path != NULL ) {
+		grn_ctx_set_index( cli_ctx->grn_ctx, cli_ctx->index_path, &in_err );
+		die_if( cli_ctx, in_err );
+	}
+	grn_ctx_open_files( cli_ctx->grn_ctx, &in_err );
+	die_if( cli_ctx, in_err );
+	if ( cli_ctx->watch ) {
+		grn_ctx_track_written( cli_ctx->grn_ctx, &in_err );
+		die_if( cli_ctx, in_err );
+	}
+	grn_ctx_run_parallel( cli_ctx->grn_ctx, cli_ctx->threads_n, &in_err );
+	die_if( cli_ctx, in_err );
 }
 
-static void main_loop( struct cli_ctx *cli_ctx ) {
+static void process_files( struct cli_ctx *cli_ctx, bool verbose ) {
 	int in_err;
 
-	// on this blessed day, all files and transforms are in place. Let's do the thing!
 	while ( true ) {
-		char *next_file_path = grn_ctx_get_next_path( cli_ctx->grn_ctx );
 		if ( grn_one_file( cli_ctx->grn_ctx, &in_err ) ) {
 			break;
 		}
+		die_if( cli_ctx, in_err );
 		int single_file_err = grn_ctx_get_c_error( cli_ctx->grn_ctx );
 		if ( single_file_err ) {
-			printf( "%s for %s\n", grn_err_to_string( single_file_err ), next_file_path );
+			printf( "%s for %s\n", grn_err_to_string( single_file_err ), grn_ctx_get_c_path( cli_ctx->grn_ctx ) );
+		} else if ( verbose && !grn_ctx_get_c_unchanged( cli_ctx->grn_ctx ) ) {
+			printf( "Transformed %s\n", grn_ctx_get_c_path( cli_ctx->grn_ctx ) );
 		}
-		die_if( cli_ctx, in_err );
 	}
+}
+
+static void main_loop( struct cli_ctx *cli_ctx ) {
+	// on this blessed day, all transforms are in place, and files are on their way. Let's do the thing!
+	// when watching, files turn up one by one for as long as it runs, so each one is worth mentioning
+	process_files( cli_ctx, cli_ctx->watch );
+	pthread_join( cli_ctx->cat_thread, NULL );
+	cli_ctx->cat_running = false;
+	die_if( cli_ctx, cli_ctx->cat_err );
+
+	printf(
+	    "Transformed %d files, %d of which had errors and %d of which needed no changes.\n",
+	    grn_ctx_get_files_n( cli_ctx->grn_ctx ),
+	    grn_ctx_get_errs_n( cli_ctx->grn_ctx ),
+	    grn_ctx_get_unchanged_n( cli_ctx->grn_ctx )
+	);
+	if ( cli_ctx->index_path != NULL ) {
+		printf( "%d files were unchanged since the last run and were skipped.\n", grn_ctx_get_skipped_n( cli_ctx->grn_ctx ) );
+	}
+	if ( grn_ctx_get_dupes_n( cli_ctx->grn_ctx ) > 0 ) {
+		printf( "%d files were found more than once, and were only transformed once.\n", grn_ctx_get_dupes_n( cli_ctx->grn_ctx ) );
+	}
+}
+
+static void watch_loop( struct cli_ctx *cli_ctx, int *out_err ) {
+	*out_err = GRN_OK;
 
-	printf( "Transformed %d files, %d of which had errors.\n", grn_ctx_get_files_n( cli_ctx->grn_ctx ), grn_ctx_get_errs_n( cli_ctx->grn_ctx ) );
+	puts( "Watching for new torrents. Press Ctrl+C to stop." );
+	while ( true ) {
+		struct vector *files = vector_alloc( sizeof( char * ), out_err );
+		ERR_FW();
+		grn_watch_wait( cli_ctx->grn_watch, files, out_err );
+		if ( *out_err ) {
+			vector_free_all( files );
+			return;
+		}
+		for ( size_t i = 0; i < vector_length( files ); i++ ) {
+			char *file = * ( char ** ) vector_get( files, i );
+			// our own writes show up here as well. Not every transform leaves a file alone the second time around, so
+			// they mustn't be transformed again.
+			if ( *out_err || grn_ctx_take_written( cli_ctx->grn_ctx, file ) ) {
+				free( file );
+				continue;
+			}
+			grn_ctx_push_file( cli_ctx->grn_ctx, file, out_err );
+		}
+		vector_free( files );
+		ERR_FW();
+	}
 }
@@ -23,6 +23,11 @@ enum {
 	GRN_ERR_UNKNOWN_CLI_OPT,
 	GRN_ERR_USER_CANCELLED,
 	GRN_ERR_NO_FILES,
+	GRN_ERR_THREAD,
+	GRN_ERR_CLI_OPT_VALUE,
+	GRN_ERR_IO_URING,
+	GRN_ERR_INDEX,
+	GRN_ERR_WATCH,
 };
 
 static char *grn_err_to_string( int err ) {
@@ -45,6 +50,11 @@ static char *grn_err_to_string( int err ) {
 			X_ERR( GRN_ERR_UNKNOWN_CLI_OPT, "Unrecognized CLI option" )
 			X_ERR( GRN_ERR_USER_CANCELLED, "Operation cancelled" );
 			X_ERR( GRN_ERR_NO_FILES, "No files or clients selected" );
+			X_ERR( GRN_ERR_THREAD, "Unable to start a worker thread" );
+			X_ERR( GRN_ERR_CLI_OPT_VALUE, "Invalid value for CLI option" );
+			X_ERR( GRN_ERR_IO_URING, "io_uring is not available" );
+			X_ERR( GRN_ERR_INDEX, "Unable to use the scan index; is another Greeny using it?" );
+			X_ERR( GRN_ERR_WATCH, "Unable to watch for new files" );
 #undef X_ERR
 	};
 	assert( false );
@@ -114,32 +124,33 @@ static bool grn_err_is_single_file( int err ) {
 #define GRN_LOG_FILE stderr
 #endif
 
+// msg may be all there is: the comma before the arguments is dropped then (a GNU extension, also in clang and mingw)
 #define GRN_LOG(msg, level, ...) do { \
-	if ( fprintf(GRN_LOG_FILE, "GREENY %s: '" msg "' at %s line %d\n", level, __VA_ARGS__, __FILE__, __LINE__) < 0 ) { \
+	if ( fprintf(GRN_LOG_FILE, "GREENY %s: '" msg "' at %s line %d\n", level, ##__VA_ARGS__, __FILE__, __LINE__) < 0 ) { \
 		puts("Greeny failed to log -- make sure that GRN_LOG_FILE is writable."); \
 	} \
 } while (0)
 
 #if GRN_LOG_LEVEL >= 4
-#define GRN_LOG_DP(msg, ...) GRN_LOG(msg, "DEBUG PLUS", __VA_ARGS__)
+#define GRN_LOG_DP(msg, ...) GRN_LOG(msg, "DEBUG PLUS", ##__VA_ARGS__)
 #else
 #define GRN_LOG_DP(...) ;
 #endif
 
 #if GRN_LOG_LEVEL >= 3
-#define GRN_LOG_DEBUG(msg, ...) GRN_LOG(msg, "DEBUG", __VA_ARGS__)
+#define GRN_LOG_DEBUG(msg, ...) GRN_LOG(msg, "DEBUG", ##__VA_ARGS__)
 #else
 #define GRN_LOG_DEBUG(...) ;
 #endif
 
 #if GRN_LOG_LEVEL >= 2
-#define GRN_LOG_WARNING(msg, ...) GRN_LOG(msg, "WARNING", __VA_ARGS__)
+#define GRN_LOG_WARNING(msg, ...) GRN_LOG(msg, "WARNING", ##__VA_ARGS__)
 #else
 #define GRN_LOG_WARNING(...) ;
 #endif
 
 #if GRN_LOG_LEVEL >= 1
-#define GRN_LOG_ERROR(msg, ...) GRN_LOG(msg, "ERROR", __VA_ARGS__)
+#define GRN_LOG_ERROR(msg, ...) GRN_LOG(msg, "ERROR", ##__VA_ARGS__)
 #else
 #define GRN_LOG_ERROR(...) ;
 #endif
@@ -1,6 +1,7 @@
 #include <stdlib.h>
 #include <string.h>
 #include <assert.h>
+#include <pthread.h>
 #include <iup.h>
 
 #include "libannouncebulk.h"
@@ -18,6 +19,14 @@ Ihandle *main_dlg = NULL,
 struct vector *ui_files = NULL;
 struct grn_ctx *grn_run_ctx = NULL;
 
+// BEGIN finding files, which goes on in its own thread while the ones found so far are transformed
+pthread_t cat_thread;
+bool cat_running = false; // started and not joined yet
+char **cat_paths = NULL; // the ui_files at the time, which the UI may add to in the meantime
+int cat_paths_n = 0;
+int cat_err = GRN_OK; // the first error, to be shown once it's joined
+// END finding files
+
 static void ui_open();
 
 static void exit_with_code( int code );
@@ -35,6 +44,9 @@ static void summarize();
 static void progress_loop();
 static void add_file( const char *path );
 static void cat_files_to_runner();
+static void *cat_files_main( void *arg );
+// stop finding files, if that's still going on. Has to happen before grn_run_ctx is freed.
+static void join_cat_files();
 static void cat_transforms_to_runner( int *out_err );
 static void seal();
 
@@ -72,6 +84,7 @@ static void ui_open() {
 static void exit_with_code( int code ) {
 	int in_err;
 
+	join_cat_files();
 	vector_free( ui_files );
 	grn_ctx_free( grn_run_ctx, &in_err );
 	if ( main_dlg != NULL ) {
@@ -126,6 +139,15 @@ static int cb_run() {
 	}
 	IupShowXY( progress_dlg, IUP_CENTERPARENT, IUP_CENTERPARENT );
 	progress_loop( &in_err );
+	if ( !in_err ) {
+		join_cat_files();
+		in_err = cat_err;
+		// a file that couldn't be found still leaves the others done
+		if ( grn_err_is_single_file( in_err ) ) {
+			popup_err( in_err );
+			in_err = GRN_OK;
+		}
+	}
 	if ( in_err ) {
 		// TODO: the IupLoopStep causes the main loop to exit if IUP_CLOSE is returned by anything (the cancel button), which isn't
 		// what the docs say and isn't desirable, either.
@@ -167,38 +189,63 @@ static void add_file( const char *path ) {
 	IupRefresh( label );
 }
 
+// the clients' files are found straight away, and the dropped ones are pushed as they are found, once the runner has
+// been started
 static void cat_files_to_runner( int *out_err ) {
 	*out_err = GRN_OK;
 
 	struct vector *tmp_all_files = vector_alloc( sizeof( char * ), out_err );
 	ERR_FW();
-	for ( int i = 0; i < vector_length( ui_files ); i++ ) {
-		char *this_ui_file = * ( char ** ) vector_get( ui_files, i );
-		GRN_LOG_DEBUG( "Sealing with UI file: '%s'", this_ui_file );
-		grn_cat_torrent_files( tmp_all_files, this_ui_file, NULL, out_err );
-		if ( *out_err ) {
-			if ( grn_err_is_single_file( *out_err ) ) {
-				popup_err( *out_err );
-				*out_err = GRN_OK;
-			} else {
-				return;
-			}
-		}
-	}
 
 #define X_CLIENT(var, enum, human) if (var##_val) { \
-	grn_cat_client( tmp_all_files, enum, out_err ); \
+	grn_cat_client( tmp_all_files, enum, grn_ctx_get_seen( grn_run_ctx ), out_err ); \
 	ERR_FW_CLEANUP(); \
 }
 #include "x_clients.h"
 #undef X_CLIENT
 
 	grn_ctx_set_files_v( grn_run_ctx, tmp_all_files );
+	grn_ctx_open_files( grn_run_ctx, out_err );
+	ERR_FW();
+
+	grn_free( cat_paths );
+	cat_paths_n = vector_length( ui_files );
+	cat_paths = grn_malloc( ( cat_paths_n + 1 ) * sizeof( char * ), out_err );
+	ERR_FW();
+	memcpy( cat_paths, ui_files->buffer, cat_paths_n * sizeof( char * ) );
+	cat_err = GRN_OK;
 	return;
 cleanup:
 	vector_free_all( tmp_all_files );
 }
 
+static void *cat_files_main( void *arg ) {
+	int in_err;
+
+	for ( int i = 0; i < cat_paths_n; i++ ) {
+		GRN_LOG_DEBUG( "Sealing with UI file: '%s'", cat_paths[i] );
+		grn_cat_torrent_files_ctx( grn_run_ctx, cat_paths[i], NULL, &in_err );
+		if ( in_err && !cat_err ) {
+			cat_err = in_err;
+		}
+		if ( in_err && !grn_err_is_single_file( in_err ) ) {
+			break;
+		}
+	}
+	grn_ctx_close_files( grn_run_ctx );
+	return NULL;
+}
+
+static void join_cat_files() {
+	if ( !cat_running ) {
+		return;
+	}
+	// finishes early if the run was cancelled
+	grn_ctx_cancel_files( grn_run_ctx );
+	pthread_join( cat_thread, NULL );
+	cat_running = false;
+}
+
 static void cat_transforms_to_runner( int *out_err ) {
 	// we have a separate in_err because some errors cause a program exit, while some are forwarded
 	*out_err = GRN_OK;
@@ -219,12 +266,14 @@ static void cat_transforms_to_runner( int *out_err ) {
 		exit_badly();
 	}
 
-	grn_ctx_set_transforms_v( grn_run_ctx, tmp_all_transforms );
+	grn_ctx_set_transforms_v( grn_run_ctx, tmp_all_transforms, &in_err );
+	exit_if_err( in_err );
 }
 
 static void seal( int *out_err ) {
 	*out_err = GRN_OK;
 
+	join_cat_files();
 	grn_ctx_free( grn_run_ctx, out_err );
 	ERR_FW();
 	grn_run_ctx = grn_ctx_alloc( out_err );
@@ -233,6 +282,10 @@ static void seal( int *out_err ) {
 	ERR_FW();
 	cat_files_to_runner( out_err );
 	ERR_FW();
+	grn_ctx_run_parallel( grn_run_ctx, grn_cpu_count(), out_err );
+	ERR_FW();
+	ERR( pthread_create( &cat_thread, NULL, cat_files_main, NULL ), GRN_ERR_THREAD );
+	cat_running = true;
 }
 
 static void progress_loop( int *out_err ) {
@@ -240,10 +293,16 @@ static void progress_loop( int *out_err ) {
 	int in_err;
 	assert( grn_run_ctx != NULL );
 
-	IupSetInt( progress_dlg, "TOTALCOUNT", grn_ctx_get_files_n( grn_run_ctx ) );
+	IupSetAttribute( progress_dlg, "DESCRIPTION", "Finding and transforming your torrents" );
 	while ( ! grn_ctx_get_is_done( grn_run_ctx ) ) {
 		grn_one_file( grn_run_ctx, &in_err );
 		exit_if_err( in_err );
+		// the total keeps growing for as long as files are being found, so it's kept ahead of the count until then
+		bool files_open = grn_ctx_get_files_open( grn_run_ctx );
+		if ( !files_open ) {
+			IupSetAttribute( progress_dlg, "DESCRIPTION", "Transforming your torrents" );
+		}
+		IupSetInt( progress_dlg, "TOTALCOUNT", grn_ctx_get_files_n( grn_run_ctx ) + files_open );
 		IupSetInt( progress_dlg, "COUNT", grn_ctx_get_files_c( grn_run_ctx ) );
 		if ( IupLoopStep() == IUP_CLOSE ) {
 			*out_err = GRN_ERR_USER_CANCELLED;
@@ -256,7 +315,14 @@ static void summarize() {
 	assert( grn_run_ctx != NULL );
 
 	char summary_text[512];
-	sprintf( summary_text, "Done.\n%d files transformed, %d had errors.", grn_ctx_get_files_n( grn_run_ctx ), grn_ctx_get_errs_n( grn_run_ctx ) );
+	sprintf(
+	    summary_text,
+	    "Done.\n%d files transformed, %d had errors, %d needed no changes.\n%d found more than once were only done once.",
+	    grn_ctx_get_files_n( grn_run_ctx ),
+	    grn_ctx_get_errs_n( grn_run_ctx ),
+	    grn_ctx_get_unchanged_n( grn_run_ctx ),
+	    grn_ctx_get_dupes_n( grn_run_ctx )
+	);
 
 	show_text_dlg( "Transforms complete", summary_text );
 }
@@ -0,0 +1,371 @@
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#ifndef _WIN32
+#include <sys/mman.h>
+#endif
+
+#include "index.h"
+#include "util.h"
+#include "err.h"
+
+#define INDEX_MAGIC "GRNINDEX"
+#define INDEX_SLOTS_MIN 4096
+
+// BEGIN hash
+
+static inline uint64_t hash_read64( const unsigned char *p ) {
+	uint64_t v;
+	memcpy( &v, p, sizeof( v ) );
+	return v;
+}
+
+// multiply, then fold the high half of the product into the low half
+static inline uint64_t hash_mix( uint64_t a, uint64_t b ) {
+#ifdef __SIZEOF_INT128__
+	__uint128_t r = ( __uint128_t ) a * b;
+	return ( uint64_t ) r ^ ( uint64_t )( r >> 64 );
+#else
+	uint64_t ha = a >> 32, la = ( uint32_t ) a;
+	uint64_t hb = b >> 32, lb = ( uint32_t ) b;
+	uint64_t hh = ha * hb, hl = ha * lb, lh = la * hb, ll = la * lb;
+	uint64_t t = ll + ( hl << 32 );
+	uint64_t lo = t + ( lh << 32 );
+	uint64_t hi = hh + ( hl >> 32 ) + ( lh >> 32 ) + ( t < ll ) + ( lo < t );
+	return lo ^ hi;
+#endif
+}
+
+// the same wyhash-style mixing as the bencode dict keys use, 16 bytes at a time
+uint64_t grn_hash_bytes( const void *buffer, size_t buffer_n, uint64_t seed ) {
+	const uint64_t p0 = 0xa0761d6478bd642fULL;
+	const uint64_t p1 = 0xe7037ed1a0b428dbULL;
+	const unsigned char *s = buffer;
+	size_t i = buffer_n;
+	seed ^= p0;
+	for ( ; i >= 16; s += 16, i -= 16 ) {
+		seed = hash_mix( hash_read64( s ) ^ p1, hash_read64( s + 8 ) ^ seed );
+	}
+	unsigned char tail[16] = { 0 };
+	memcpy( tail, s, i );
+	return hash_mix( p1 ^ buffer_n, hash_mix( hash_read64( tail ) ^ p1, hash_read64( tail + 8 ) ^ seed ) );
+}
+
+// END hash
+
+// BEGIN entries
+
+static uint64_t entry_check( const struct grn_index_entry *entry ) {
+	// 1 so that an all-zero slot never looks intact
+	return grn_hash_bytes( entry, offsetof( struct grn_index_entry, check ), 1 ) | 1;
+}
+
+void grn_index_entry_stat( struct grn_index_entry *entry, const struct stat *st ) {
+	memset( entry, 0, sizeof( *entry ) );
+	entry->dev = st->st_dev;
+	entry->ino = st->st_ino;
+	entry->size = st->st_size;
+	entry->mtime_s = st->st_mtime;
+	entry->ctime_s = st->st_ctime;
+#if defined __APPLE__
+	entry->mtime_ns = st->st_mtimespec.tv_nsec;
+	entry->ctime_ns = st->st_ctimespec.tv_nsec;
+#elif !defined _WIN32
+	entry->mtime_ns = st->st_mtim.tv_nsec;
+	entry->ctime_ns = st->st_ctim.tv_nsec;
+#endif
+}
+
+bool grn_index_entry_same_stat( const struct grn_index_entry *a, const struct grn_index_entry *b ) {
+	return a->dev == b->dev &&
+	       a->ino == b->ino &&
+	       a->size == b->size &&
+	       a->mtime_s == b->mtime_s &&
+	       a->mtime_ns == b->mtime_ns &&
+	       // anything that writes the file while keeping its mtime still moves its ctime
+	       a->ctime_s == b->ctime_s &&
+	       a->ctime_ns == b->ctime_ns;
+}
+
+// END entries
+
+#ifdef _WIN32
+
+struct grn_index *grn_index_open( const char *path, int *out_err ) {
+	ERR_NULL( GRN_ERR_INDEX );
+}
+
+void grn_index_close( struct grn_index *index ) {
+}
+
+bool grn_index_get( struct grn_index *index, uint64_t dev, uint64_t ino, struct grn_index_entry *entry ) {
+	return false;
+}
+
+void grn_index_put( struct grn_index *index, const struct grn_index_entry *entry, int *out_err ) {
+	ERR( GRN_ERR_INDEX );
+}
+
+#else
+
+// BEGIN table
+
+// at the start of the file, followed by the slots
+struct index_header {
+	char magic[8];
+	uint32_t version;
+	uint32_t entry_size;
+	uint64_t slots_n; // always a power of 2
+	uint64_t used_n;
+	uint64_t run; // how many times it was opened
+	char padding[24];
+};
+
+struct grn_index {
+	int fd;
+	pthread_mutex_t lock;
+	// everything below is protected by lock
+	void *map;
+	size_t map_n;
+	struct index_header *header;
+	struct grn_index_entry *slots; // ino 0 marks an empty slot, since no file has it
+};
+
+static size_t index_map_n( uint64_t slots_n ) {
+	return sizeof( struct index_header ) + slots_n * sizeof( struct grn_index_entry );
+}
+
+static size_t index_slot( uint64_t dev, uint64_t ino, uint64_t slots_n ) {
+	return hash_mix( ino ^ 0xe7037ed1a0b428dbULL, dev ^ 0xa0761d6478bd642fULL ) & ( slots_n - 1 );
+}
+
+static void index_map( struct grn_index *index, size_t map_n, int *out_err ) {
+	*out_err = GRN_OK;
+	void *map = mmap( NULL, map_n, PROT_READ | PROT_WRITE, MAP_SHARED, index->fd, 0 );
+	ERR( map == MAP_FAILED, GRN_ERR_INDEX );
+	index->map = map;
+	index->map_n = map_n;
+	index->header = map;
+	index->slots = ( struct grn_index_entry * )( index->header + 1 );
+}
+
+// an empty table, replacing whatever was in the file
+static void index_reset( struct grn_index *index, int *out_err ) {
+	*out_err = GRN_OK;
+	size_t map_n = index_map_n( INDEX_SLOTS_MIN );
+	ERR( ftruncate( index->fd, 0 ) || ftruncate( index->fd, map_n ), GRN_ERR_INDEX );
+	index_map( index, map_n, out_err );
+	ERR_FW();
+	memcpy( index->header->magic, INDEX_MAGIC, sizeof( index->header->magic ) );
+	index->header->version = GRN_INDEX_VERSION;
+	index->header->entry_size = sizeof( struct grn_index_entry );
+	index->header->slots_n = INDEX_SLOTS_MIN;
+}
+
+static bool index_valid( struct grn_index *index, size_t file_n ) {
+	struct index_header *header = index->header;
+	return memcmp( header->magic, INDEX_MAGIC, sizeof( header->magic ) ) == 0 &&
+	       header->version == GRN_INDEX_VERSION &&
+	       header->entry_size == sizeof( struct grn_index_entry ) &&
+	       header->slots_n >= INDEX_SLOTS_MIN &&
+	       ( header->slots_n & ( header->slots_n - 1 ) ) == 0 &&
+	       header->used_n < header->slots_n &&
+	       index_map_n( header->slots_n ) == file_n;
+}
+
+static void index_sweep( struct grn_index *index );
+
+struct grn_index *grn_index_open( const char *path, int *out_err ) {
+	*out_err = GRN_OK;
+
+	struct grn_index *index = calloc( 1, sizeof( struct grn_index ) );
+	ERR_NULL( index == NULL, GRN_ERR_OOM );
+	pthread_mutex_init( &index->lock, NULL );
+	index->fd = open( path, O_RDWR | O_CREAT | O_CLOEXEC, 0666 );
+	if ( index->fd < 0 ) {
+		*out_err = GRN_ERR_INDEX;
+		goto cleanup;
+	}
+	// a second greeny on the same index, like an overlapping cron job, would be writing over our entries
+	struct flock lock = {
+		.l_type = F_WRLCK,
+		.l_whence = SEEK_SET,
+	};
+	struct stat st;
+	if ( fcntl( index->fd, F_SETLK, &lock ) || fstat( index->fd, &st ) ) {
+		*out_err = GRN_ERR_INDEX;
+		goto cleanup;
+	}
+
+	if ( ( size_t ) st.st_size >= sizeof( struct index_header ) ) {
+		index_map( index, st.st_size, out_err );
+		ERR_FW_CLEANUP();
+		if ( index_valid( index, st.st_size ) ) {
+			index->header->run++;
+			return index;
+		}
+		munmap( index->map, index->map_n );
+		index->map = NULL;
+	}
+	// it's only a cache, so anything unrecognizable is started over
+	index_reset( index, out_err );
+	ERR_FW_CLEANUP();
+	index->header->run++;
+	return index;
+cleanup:
+	grn_index_close( index );
+	return NULL;
+}
+
+void grn_index_close( struct grn_index *index ) {
+	if ( index == NULL ) {
+		return;
+	}
+	if ( index->map != NULL ) {
+		index_sweep( index );
+		munmap( index->map, index->map_n );
+	}
+	// also releases the lock
+	if ( index->fd >= 0 ) {
+		close( index->fd );
+	}
+	pthread_mutex_destroy( &index->lock );
+	free( index );
+}
+
+// slot for dev and ino: either the one holding them, or the empty one where they would go
+static struct grn_index_entry *index_find( struct grn_index *index, uint64_t dev, uint64_t ino ) {
+	uint64_t slots_n = index->header->slots_n;
+	size_t i = index_slot( dev, ino, slots_n );
+	while ( index->slots[i].ino != 0 && ( index->slots[i].ino != ino || index->slots[i].dev != dev ) ) {
+		i = ( i + 1 ) & ( slots_n - 1 );
+	}
+	return &index->slots[i];
+}
+
+bool grn_index_get( struct grn_index *index, uint64_t dev, uint64_t ino, struct grn_index_entry *entry ) {
+	if ( ino == 0 ) {
+		return false;
+	}
+	pthread_mutex_lock( &index->lock );
+	// gone if growing it failed
+	bool found = index->map != NULL;
+	if ( found ) {
+		struct grn_index_entry *slot = index_find( index, dev, ino );
+		*entry = *slot;
+		found = entry->ino != 0 && entry->check == entry_check( entry );
+		if ( found ) {
+			slot->run = index->header->run;
+		}
+	}
+	pthread_mutex_unlock( &index->lock );
+	return found;
+}
+
+// doubles the number of slots. The old entries are copied out first, since remapping may move them.
+static void index_grow( struct grn_index *index, int *out_err ) {
+	*out_err = GRN_OK;
+
+	uint64_t old_slots_n = index->header->slots_n;
+	uint64_t used_n = index->header->used_n;
+	struct grn_index_entry *old_slots = malloc( old_slots_n * sizeof( struct grn_index_entry ) );
+	ERR( old_slots == NULL, GRN_ERR_OOM );
+	memcpy( old_slots, index->slots, old_slots_n * sizeof( struct grn_index_entry ) );
+
+	uint64_t slots_n = old_slots_n * 2;
+	size_t map_n = index_map_n( slots_n );
+	if ( ftruncate( index->fd, map_n ) ) {
+		free( old_slots );
+		ERR( GRN_ERR_INDEX );
+	}
+	munmap( index->map, index->map_n );
+	index->map = NULL;
+	index_map( index, map_n, out_err );
+	if ( *out_err ) {
+		free( old_slots );
+		return;
+	}
+	memset( index->slots, 0, slots_n * sizeof( struct grn_index_entry ) );
+	index->header->slots_n = slots_n;
+	index->header->used_n = used_n;
+	for ( uint64_t i = 0; i < old_slots_n; i++ ) {
+		if ( old_slots[i].ino != 0 ) {
+			*index_find( index, old_slots[i].dev, old_slots[i].ino ) = old_slots[i];
+		}
+	}
+	free( old_slots );
+}
+
+// drops the entries that are too old or not intact, by putting the rest back into an empty table. Leaves everything
+// as it is if the rest can't be copied out, since it's only a cache.
+static void index_sweep( struct grn_index *index ) {
+	uint64_t slots_n = index->header->slots_n;
+	uint64_t run = index->header->run;
+	uint64_t kept_n = 0;
+	for ( uint64_t i = 0; i < slots_n; i++ ) {
+		struct grn_index_entry *slot = &index->slots[i];
+		kept_n += slot->ino != 0 && slot->run + GRN_INDEX_KEEP_RUNS > run && slot->check == entry_check( slot );
+	}
+	if ( kept_n == index->header->used_n ) {
+		return;
+	}
+	struct grn_index_entry *kept = malloc( kept_n * sizeof( struct grn_index_entry ) + 1 );
+	if ( kept == NULL ) {
+		return;
+	}
+	kept_n = 0;
+	for ( uint64_t i = 0; i < slots_n; i++ ) {
+		struct grn_index_entry *slot = &index->slots[i];
+		if ( slot->ino != 0 && slot->run + GRN_INDEX_KEEP_RUNS > run && slot->check == entry_check( slot ) ) {
+			kept[kept_n++] = *slot;
+		}
+	}
+	memset( index->slots, 0, slots_n * sizeof( struct grn_index_entry ) );
+	for ( uint64_t i = 0; i < kept_n; i++ ) {
+		*index_find( index, kept[i].dev, kept[i].ino ) = kept[i];
+	}
+	index->header->used_n = kept_n;
+	free( kept );
+}
+
+void grn_index_put( struct grn_index *index, const struct grn_index_entry *entry, int *out_err ) {
+	*out_err = GRN_OK;
+	if ( entry->ino == 0 ) {
+		return;
+	}
+
+	pthread_mutex_lock( &index->lock );
+	if ( index->map == NULL ) {
+		pthread_mutex_unlock( &index->lock );
+		ERR( GRN_ERR_INDEX );
+	}
+	struct grn_index_entry *slot = index_find( index, entry->dev, entry->ino );
+	if ( slot->ino == 0 ) {
+		// at most 3/4 full, so that probes stay short
+		if ( ( index->header->used_n + 1 ) * 4 > index->header->slots_n * 3 ) {
+			index_grow( index, out_err );
+			if ( *out_err ) {
+				pthread_mutex_unlock( &index->lock );
+				return;
+			}
+			slot = index_find( index, entry->dev, entry->ino );
+		}
+		index->header->used_n++;
+	}
+	*slot = *entry;
+	slot->check = entry_check( slot );
+	slot->run = index->header->run;
+	pthread_mutex_unlock( &index->lock );
+}
+
+// END table
+
+#endif
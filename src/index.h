@@ -0,0 +1,59 @@
+#ifndef H_GRN_INDEX
+#define H_GRN_INDEX
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/stat.h>
+
+// bump whenever transforms could start giving different results for the same file and transform set, so that older
+// indexes are thrown away rather than trusted
+#define GRN_INDEX_VERSION 1
+// how many times an index can be opened without an entry being looked up or put before the entry is dropped. More
+// than 1, so that runs over only some of the files don't throw out everything else.
+#define GRN_INDEX_KEEP_RUNS 16
+
+/**
+ * What a file looked like the last time every transform left it alone. As long as it still looks exactly like this,
+ * and the transforms are the same, there is no need to read it again.
+ */
+struct grn_index_entry {
+	uint64_t dev;
+	uint64_t ino;
+	int64_t size;
+	int64_t mtime_s;
+	int64_t mtime_ns;
+	int64_t ctime_s;
+	int64_t ctime_ns;
+	uint64_t content_hash; // grn_hash_bytes of the whole file
+	uint64_t fingerprint; // of the whole set of transforms that left it alone
+	uint64_t check; // of everything above, so that an entry torn by a crash halfway through writing it is ignored
+	// which opening of the index this was last looked up or put in. Left out of check, so that a lookup doesn't have to
+	// rewrite it.
+	uint64_t run;
+};
+
+/**
+ * A hash table of grn_index_entry by dev and inode, memory-mapped from a file so that it lasts between runs.
+ * The file is locked while open, so only one process uses it at a time. Safe to use from several threads.
+ */
+struct grn_index;
+
+// creates the file if it doesn't exist. One that is unreadable or from another version is started over.
+// Fails with GRN_ERR_INDEX if it can't be opened, mapped or locked.
+struct grn_index *grn_index_open( const char *path, int *out_err );
+// drops entries that weren't looked up or put for GRN_INDEX_KEEP_RUNS runs, and ones that aren't intact. Noop if NULL.
+void grn_index_close( struct grn_index *index );
+// false if there is no (intact) entry for dev and ino
+bool grn_index_get( struct grn_index *index, uint64_t dev, uint64_t ino, struct grn_index_entry *entry );
+// adds the entry, or replaces the one with the same dev and ino. Fails with GRN_ERR_INDEX if the file can't grow.
+void grn_index_put( struct grn_index *index, const struct grn_index_entry *entry, int *out_err );
+// the entry describing st. The hashes are left 0.
+void grn_index_entry_stat( struct grn_index_entry *entry, const struct stat *st );
+// whether two entries describe the same file in the same state, going by everything but the hashes
+bool grn_index_entry_same_stat( const struct grn_index_entry *a, const struct grn_index_entry *b );
+
+// a fast, non-cryptographic hash. Depends on byte order, which is fine since indexes don't move between machines.
+uint64_t grn_hash_bytes( const void *buffer, size_t buffer_n, uint64_t seed );
+
+#endif
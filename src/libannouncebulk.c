@@ -3,50 +3,258 @@
 #include <stdlib.h>
 #include <assert.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <string.h>
 #include <stdio.h>
 #include <unistd.h>
-#include <ftw.h>
+#include <fcntl.h>
 #include <ctype.h>
 #include <regex.h>
 #include <errno.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#ifndef _WIN32
+#include <sys/uio.h>
+#endif
 
 #include <bencode.h>
 
 #include "libannouncebulk.h"
 #include "vector.h"
 #include "util.h"
+#include "arena.h"
+#include "walk.h"
+#include "index.h"
+#include "mapped.h"
 #include "err.h"
 
 // BEGIN context filesystem
 
+#ifndef O_BINARY
+#define O_BINARY 0
+#endif
+
+// files at least this large are memory-mapped instead of being read into the scratch buffer
+#ifndef GRN_MMAP_THRESHOLD
+#define GRN_MMAP_THRESHOLD ( 1 << 20 )
+#endif
+
+struct grn_ctx *root_ctx( struct grn_ctx *ctx );
+
+// the path of file_i. Workers look it up on their owner, whose list may be replaced by a longer copy while files are
+// pushed to it. Older copies stay around until feed_recycle_ctx, so a path that was looked up stays valid while its
+// file is being processed.
+char *file_path_ctx( struct grn_ctx *ctx, int file_i ) {
+	struct grn_ctx *root = root_ctx( ctx );
+	return __atomic_load_n( &root->files, __ATOMIC_ACQUIRE )[file_i - root->files_base];
+}
+
+// give back ctx->buffer however it was obtained. The scratch buffer itself stays around for the next file.
+void release_buffer_ctx( struct grn_ctx *ctx ) {
+	switch ( ctx->buffer_type ) {
+		case GRN_BUFFER_HEAP:
+			;
+			grn_free( ctx->buffer );
+			break;
+		case GRN_BUFFER_SCRATCH:
+			;
+			break;
+#ifndef _WIN32
+		case GRN_BUFFER_MMAP:
+			;
+			grn_mapped_close( ctx->buffer, ctx->map_n, ctx->map_i );
+			break;
+#endif
+		default:
+			;
+			assert( false );
+			break;
+	}
+	ctx->buffer = NULL;
+	ctx->buffer_type = GRN_BUFFER_HEAP;
+}
+
+// read exactly n bytes, retrying on short reads. Returns false on error or early EOF.
+bool read_all( int fd, char *buffer, size_t n ) {
+	while ( n > 0 ) {
+		ssize_t got = read( fd, buffer, n );
+		if ( got < 0 && errno == EINTR ) {
+			continue;
+		}
+		if ( got <= 0 ) {
+			return false;
+		}
+		buffer += got;
+		n -= got;
+	}
+	return true;
+}
+
+bool write_all( int fd, const char *buffer, size_t n ) {
+	while ( n > 0 ) {
+		ssize_t put = write( fd, buffer, n );
+		if ( put < 0 && errno == EINTR ) {
+			continue;
+		}
+		if ( put <= 0 ) {
+			return false;
+		}
+		buffer += put;
+		n -= put;
+	}
+	return true;
+}
+
+#ifndef _WIN32
+// like write_all, for several buffers at once. Modifies iov to keep track of what's left.
+bool writev_all( int fd, struct iovec *iov, int iov_n ) {
+	while ( iov_n > 0 ) {
+		ssize_t put = writev( fd, iov, iov_n );
+		if ( put < 0 && errno == EINTR ) {
+			continue;
+		}
+		if ( put <= 0 ) {
+			return false;
+		}
+		// a short write can stop part way through a buffer
+		while ( iov_n > 0 && ( size_t )put >= iov->iov_len ) {
+			put -= iov->iov_len;
+			iov++;
+			iov_n--;
+		}
+		if ( iov_n > 0 ) {
+			iov->iov_base = ( char * )iov->iov_base + put;
+			iov->iov_len -= put;
+		}
+	}
+	return true;
+}
+#endif
+
+// bencode sink writing to the fd that opaque points at
+int fd_sink_write( void *opaque, const struct ben_chunk *chunks, int chunks_n ) {
+	int fd = *( int * )opaque;
+#ifndef _WIN32
+	struct iovec iov[BEN_SINK_CHUNKS];
+	for ( int i = 0; i < chunks_n; i++ ) {
+		iov[i].iov_base = ( void * )chunks[i].data;
+		iov[i].iov_len = chunks[i].len;
+	}
+	return !writev_all( fd, iov, chunks_n );
+#else
+	for ( int i = 0; i < chunks_n; i++ ) {
+		if ( !write_all( fd, chunks[i].data, chunks[i].len ) ) {
+			return 1;
+		}
+	}
+	return 0;
+#endif
+}
+
 void fread_ctx( struct grn_ctx *ctx, int *out_err ) {
 	*out_err = GRN_OK;
 	assert( ctx->state == GRN_CTX_READ );
-	assert( ctx->fh != NULL );
-
-	// we can't just do fread(buffer, 1, some_massive_num, fh) because we can't be sure whether
-	// the whole file was read or not.
-	ERR( fseek( ctx->fh, 0, SEEK_END ), GRN_ERR_FS_SEEK );
-	ctx->buffer_n = ftell( ctx->fh );
+	assert( ctx->fd >= 0 );
+	assert( ctx->buffer == NULL );
+
+	struct stat st;
+	ERR( fstat( ctx->fd, &st ), GRN_ERR_FS_READ );
+	ctx->buffer_n = st.st_size;
+	// from before reading, so that a change while reading can't be mistaken for what was read
+	grn_index_entry_stat( &ctx->file_entry, &st );
 	GRN_LOG_DEBUG( "File size: %d bytes", ( int )ctx->buffer_n );
-	ERR( fseek( ctx->fh, 0, SEEK_SET ), GRN_ERR_FS_SEEK );
 
-	ctx->buffer = malloc( ctx->buffer_n + 1 );
-	ERR( ctx->buffer == NULL, GRN_ERR_OOM );
-	if ( fread( ctx->buffer, ctx->buffer_n, 1, ctx->fh ) != 1 ) {
-		free( ctx->buffer );
-		ctx->buffer = NULL;
-		ERR( GRN_ERR_FS_READ );
+#ifndef _WIN32
+	// big files are handed to the decoder straight from the page cache rather than copied
+	if ( ctx->buffer_n >= GRN_MMAP_THRESHOLD ) {
+		void *map = grn_mapped_open( ctx->fd, ctx->buffer_n, &ctx->map_i );
+		// some filesystems can't be mapped; plain reads still work there
+		if ( map != NULL ) {
+			ctx->buffer = map;
+			ctx->buffer_type = GRN_BUFFER_MMAP;
+			ctx->map_n = ctx->buffer_n;
+			return;
+		}
+		GRN_LOG_WARNING( "mmap failed, falling back to read: %s", strerror( errno ) );
+	}
+#endif
+
+	// small files are read into a buffer that is reused across files.
+	// one extra byte so that the contents can be null terminated in place.
+	if ( ctx->scratch_n < ctx->buffer_n + 1 ) {
+		size_t scratch_n_new = ctx->scratch_n > 0 ? ctx->scratch_n : 4096;
+		while ( scratch_n_new < ctx->buffer_n + 1 ) {
+			scratch_n_new *= 2;
+		}
+		char *scratch_new = realloc( ctx->scratch, scratch_n_new );
+		ERR( scratch_new == NULL, GRN_ERR_OOM );
+		ctx->scratch = scratch_new;
+		ctx->scratch_n = scratch_n_new;
 	}
+	ERR( !read_all( ctx->fd, ctx->scratch, ctx->buffer_n ), GRN_ERR_FS_READ );
+	ctx->buffer = ctx->scratch;
+	ctx->buffer_type = GRN_BUFFER_SCRATCH;
+}
+
+// whether the file was truncated by someone else while it was mapped, in which case some of what was read is zeroes
+bool map_truncated_ctx( struct grn_ctx *ctx ) {
+	return ctx->buffer_type == GRN_BUFFER_MMAP && grn_mapped_truncated( ctx->map_i );
 }
 
 void fwrite_ctx( struct grn_ctx *ctx, int *out_err ) {
 	*out_err = GRN_OK;
 	assert( ctx->state == GRN_CTX_WRITE );
-	assert( ctx->fh != NULL );
+	assert( ctx->fd >= 0 );
+
+	if ( ctx->tree != NULL ) {
+		// the encoder only ever holds a small piece of the file
+		struct ben_sink sink = {
+			.write = fd_sink_write,
+			.opaque = &ctx->fd,
+		};
+		size_t written_n;
+		ERR( ben_encode_sink( &sink, ctx->tree, &written_n ), GRN_ERR_FS_WRITE );
+		GRN_LOG_DEBUG( "Newly encoded file size: %d", ( int )written_n );
+		return;
+	}
+	ERR( !write_all( ctx->fd, ctx->buffer, ctx->buffer_n ), GRN_ERR_FS_WRITE );
+}
+
+// once the replacement file is completely written and closed, it takes the original's place. Noop if the file was
+// written in place.
+void replace_with_tmp_ctx( struct grn_ctx *ctx, int *out_err ) {
+	*out_err = GRN_OK;
+	if ( ctx->tmp_path == NULL ) {
+		return;
+	}
+	ERR( rename( ctx->tmp_path, file_path_ctx( ctx, ctx->files_c ) ), GRN_ERR_FS_WRITE );
+	free( ctx->tmp_path );
+	ctx->tmp_path = NULL;
+}
+
+void written_record_ctx( struct grn_ctx *ctx, int fd );
+
+// close the file once it has been written, so that close errors belong to the right file
+void fclose_ctx( struct grn_ctx *ctx, int *out_err ) {
+	*out_err = GRN_OK;
+	assert( ctx->fd >= 0 );
+
+	int fd = ctx->fd;
+	ctx->fd = -1;
+	written_record_ctx( ctx, fd );
+	ERR( close( fd ), GRN_ERR_FS_CLOSE );
+	replace_with_tmp_ctx( ctx, out_err );
+}
 
-	ERR( fwrite( ctx->buffer, ctx->buffer_n, 1, ctx->fh ) != 1, GRN_ERR_FS_WRITE );
+// remove a replacement file that never made it
+void discard_tmp_ctx( struct grn_ctx *ctx ) {
+	if ( ctx->tmp_path == NULL ) {
+		return;
+	}
+	unlink( ctx->tmp_path );
+	free( ctx->tmp_path );
+	ctx->tmp_path = NULL;
 }
 
 // END context filesystem
@@ -61,17 +269,40 @@ struct grn_ctx *grn_ctx_alloc( int *out_err ) {
 
 	ctx->state = GRN_CTX_NEXT;
 	ctx->files_c = -1;
+	ctx->fd = -1;
+	ctx->seen = grn_walk_seen_alloc( out_err );
+	if ( *out_err ) {
+		free( ctx );
+		return NULL;
+	}
 	return ctx;
 }
 
+void free_parallel_ctx( struct grn_ctx *ctx );
+void free_feed_ctx( struct grn_ctx *ctx );
+void free_written_ctx( struct grn_ctx *ctx );
+void free_io_ctx( struct grn_ctx *ctx );
+void compile_plan_ctx( struct grn_ctx *ctx, int *out_err );
+void free_plan( struct grn_plan *plan );
+uint64_t transforms_fingerprint( struct grn_transform *transforms, int transforms_n );
+
 void grn_ctx_free( struct grn_ctx *ctx, int *out_err ) {
 	*out_err = GRN_OK;
 
 	if ( ctx == NULL ) {
 		return;
 	}
-	if ( ctx->files != NULL ) {
-		for ( int i = 0; i < ctx->files_n; i++ ) {
+	// workers may be waiting for files that won't come now
+	if ( ctx->feed != NULL ) {
+		grn_ctx_cancel_files( ctx );
+	}
+	// workers still point at our files and transforms, so they have to go first
+	free_parallel_ctx( ctx );
+	// and the kernel may still be reading into our buffers
+	free_io_ctx( ctx );
+	// files and transforms of a worker belong to its owner
+	if ( ctx->owner == NULL && ctx->files != NULL ) {
+		for ( int i = 0; i < ctx->files_n - ctx->files_base; i++ ) {
 			if ( ctx->files[i] == NULL ) {
 				break;
 			}
@@ -79,20 +310,30 @@ void grn_ctx_free( struct grn_ctx *ctx, int *out_err ) {
 		}
 		free( ctx->files );
 	}
+	free_feed_ctx( ctx );
+	free_written_ctx( ctx );
 
-	if ( ctx->transforms != NULL ) {
+	if ( ctx->owner == NULL && ctx->transforms != NULL ) {
 		for ( int i = 0; i < ctx->transforms_n; i++ ) {
 			grn_free_transform( ctx->transforms + i );
 		}
 		free( ctx->transforms );
+		free_plan( ctx->plan );
 	}
-	grn_free( ctx->buffer );
-	if ( ctx->fh != NULL ) {
-		// we still want to continue when the fclose fails, to free the ctx
-		if ( fclose( ctx->fh ) ) {
+	if ( ctx->owner == NULL ) {
+		grn_index_close( ctx->index );
+	}
+	release_buffer_ctx( ctx );
+	grn_free( ctx->scratch );
+	grn_arena_free( &ctx->arena );
+	if ( ctx->fd >= 0 ) {
+		// we still want to continue when the close fails, to free the ctx
+		if ( close( ctx->fd ) ) {
 			*out_err = GRN_ERR_FS_CLOSE;
 		}
 	}
+	discard_tmp_ctx( ctx );
+	grn_walk_seen_free( ctx->seen );
 	free( ctx );
 }
 
@@ -106,13 +347,67 @@ void grn_ctx_set_files_v( struct grn_ctx *ctx, struct vector *files ) {
 	ctx->files = ( char ** ) vector_export( files, &ctx->files_n );
 }
 
-void grn_ctx_set_transforms( struct grn_ctx *ctx, struct grn_transform *transforms, int transforms_n ) {
+void resume_io_ctx( struct grn_ctx *ctx );
+
+void grn_ctx_add_files_v( struct grn_ctx *ctx, struct vector *files, int *out_err ) {
+	*out_err = GRN_OK;
+	assert( ctx->owner == NULL );
+
+	int files_n = vector_length( files );
+	if ( ctx->feed != NULL ) {
+		for ( int i = 0; i < files_n; i++ ) {
+			char *file = * ( char ** ) vector_get( files, i );
+			if ( *out_err ) {
+				free( file );
+				continue;
+			}
+			grn_ctx_push_file( ctx, file, out_err );
+		}
+		vector_free( files );
+		return;
+	}
+	// workers read files_n without a lock
+	assert( ctx->parallel == NULL );
+
+	if ( files_n == 0 ) {
+		vector_free( files );
+		return;
+	}
+	char **all_files = realloc( ctx->files, ( ctx->files_n + files_n ) * sizeof( char * ) );
+	if ( all_files == NULL ) {
+		vector_free_all( files );
+		ERR( GRN_ERR_OOM );
+	}
+	memcpy( all_files + ctx->files_n, files->buffer, files_n * sizeof( char * ) );
+	vector_free( files );
+	ctx->files = all_files;
+	if ( ctx->state == GRN_CTX_DONE ) {
+		// pick up where it left off, at the first of the new files
+		ctx->state = GRN_CTX_NEXT;
+		resume_io_ctx( ctx );
+	}
+	ctx->files_n += files_n;
+}
+
+void grn_ctx_set_transforms( struct grn_ctx *ctx, struct grn_transform *transforms, int transforms_n, int *out_err ) {
 	ctx->transforms = transforms;
 	ctx->transforms_n = transforms_n;
+	ctx->fingerprint = transforms_fingerprint( transforms, transforms_n );
+	compile_plan_ctx( ctx, out_err );
 }
 
-void grn_ctx_set_transforms_v( struct grn_ctx *ctx, struct vector *transforms ) {
+void grn_ctx_set_transforms_v( struct grn_ctx *ctx, struct vector *transforms, int *out_err ) {
 	ctx->transforms = ( struct grn_transform * ) vector_export( transforms, &ctx->transforms_n );
+	ctx->fingerprint = transforms_fingerprint( ctx->transforms, ctx->transforms_n );
+	compile_plan_ctx( ctx, out_err );
+}
+
+void grn_ctx_set_index( struct grn_ctx *ctx, const char *path, int *out_err ) {
+	*out_err = GRN_OK;
+	assert( ctx->owner == NULL && ctx->index == NULL );
+	assert( ctx->files_c == -1 );
+
+	ctx->index = grn_index_open( path, out_err );
 }
 
 int bencode_error_to_anb( int bencode_error ) {
@@ -252,6 +547,302 @@ void grn_cat_transforms_orpheus( struct vector *vec, char *user_announce, int *o
 	ERR_FW();
 }
 
+// BEGIN regex literals
+
+void free_literals( char **literals ) {
+	if ( literals == NULL ) {
+		return;
+	}
+	for ( int i = 0; literals[i] != NULL; i++ ) {
+		free( literals[i] );
+	}
+	free( literals );
+}
+
+// length of the shortest literal in the list
+size_t literals_min_n( char **literals ) {
+	size_t min_n = SIZE_MAX;
+	for ( int i = 0; literals[i] != NULL; i++ ) {
+		size_t literal_n = strlen( literals[i] );
+		min_n = literal_n < min_n ? literal_n : min_n;
+	}
+	return min_n;
+}
+
+// length of the quantifier at str, or 0 if there isn't one. optional is set if it allows zero repetitions.
+int regex_quantifier_n( const char *str, bool *optional ) {
+	*optional = false;
+	switch ( *str ) {
+		case '?':
+		case '*':
+			;
+			*optional = true;
+			return 1;
+		case '+':
+			;
+			return 1;
+		case '{':
+			;
+			const char *close = strchr( str, '}' );
+			if ( close == NULL ) {
+				return 0;
+			}
+			*optional = atoi( str + 1 ) == 0;
+			return close - str + 1;
+		default:
+			;
+			return 0;
+	}
+}
+
+// length of the bracket expression starting at str, which must be a '['
+int regex_bracket_n( const char *str ) {
+	int i = 1;
+	if ( str[i] == '^' ) {
+		i++;
+	}
+	// a leading ] is part of the list
+	if ( str[i] == ']' ) {
+		i++;
+	}
+	while ( str[i] != '\0' && str[i] != ']' ) {
+		// [:alpha:] and friends can contain a ]
+		if ( str[i] == '[' && str[i + 1] != '\0' && strchr( ":=.", str[i + 1] ) != NULL ) {
+			const char delim[] = { str[i + 1], ']', '\0' };
+			const char *close = strstr( str + i + 2, delim );
+			if ( close == NULL ) {
+				break;
+			}
+			i = close - str + 2;
+			continue;
+		}
+		i++;
+	}
+	return str[i] == ']' ? i + 1 : i;
+}
+
+// copy a run of plain regex characters, dropping the backslashes
+char *regex_unescape( const char *start, const char *end, int *out_err ) {
+	*out_err = GRN_OK;
+
+	char *to_return = malloc( end - start + 1 );
+	ERR_NULL( to_return == NULL, GRN_ERR_OOM );
+	char *out = to_return;
+	while ( start < end ) {
+		if ( *start == '\\' ) {
+			start++;
+		}
+		*out++ = *start++;
+	}
+	*out = '\0';
+	return to_return;
+}
+
+/**
+ * Parse the group starting at str, which must be a '('.
+ * @param out_alts set to the group's alternatives if all of them are plain, non-empty literals. Otherwise, NULL.
+ * @return a pointer just past the closing ')'
+ */
+const char *regex_group( const char *str, char ***out_alts, int *out_err ) {
+	*out_err = GRN_OK;
+	*out_alts = NULL;
+
+	bool plain = true;
+	int depth = 1, alts_n = 1;
+	const char *c = str + 1;
+	while ( *c != '\0' ) {
+		if ( *c == '\\' ) {
+			if ( c[1] == '\0' ) {
+				break;
+			}
+			// \w, \b, back references and so on
+			if ( isalnum( ( unsigned char )c[1] ) ) {
+				plain = false;
+			}
+			c += 2;
+			continue;
+		}
+		if ( *c == '[' ) {
+			plain = false;
+			c += regex_bracket_n( c );
+			continue;
+		}
+		if ( *c == '(' ) {
+			plain = false;
+			depth++;
+		} else if ( *c == ')' ) {
+			if ( --depth == 0 ) {
+				break;
+			}
+		} else if ( *c == '|' ) {
+			alts_n++;
+		} else if ( strchr( ".^$*+?{", *c ) != NULL ) {
+			plain = false;
+		}
+		c++;
+	}
+	// unterminated, regcomp would have complained
+	if ( *c != ')' ) {
+		return c;
+	}
+	if ( !plain ) {
+		return c + 1;
+	}
+
+	char **alts = calloc( alts_n + 1, sizeof( char * ) );
+	ERR_NULL( alts == NULL, GRN_ERR_OOM );
+	const char *alt_start = str + 1;
+	for ( int i = 0; i < alts_n; i++ ) {
+		const char *alt_end = alt_start;
+		while ( *alt_end != '|' && alt_end != c ) {
+			alt_end += *alt_end == '\\' ? 2 : 1;
+		}
+		alts[i] = regex_unescape( alt_start, alt_end, out_err );
+		if ( *out_err ) {
+			free_literals( alts );
+			return NULL;
+		}
+		alt_start = alt_end + 1;
+	}
+	// an empty alternative can match anywhere
+	if ( literals_min_n( alts ) == 0 ) {
+		free_literals( alts );
+	} else {
+		*out_alts = alts;
+	}
+	return c + 1;
+}
+
+// keep whichever of the two lists has the longer shortest literal, preferring best on a tie, and free the other
+char **pick_literals( char **best, char **candidate ) {
+	if ( candidate == NULL ) {
+		return best;
+	}
+	if ( best == NULL || literals_min_n( candidate ) > literals_min_n( best ) ) {
+		free_literals( best );
+		return candidate;
+	}
+	free_literals( candidate );
+	return best;
+}
+
+/**
+ * Works out literal strings such that every match of an extended regex contains at least one of them, so that
+ * buffers with none of them in it can be skipped without running the regex, or even decoding them.
+ * This is very conservative: anything it doesn't understand just breaks up the literals, and alternation at the
+ * top level gives up entirely. Of all the candidates, the one whose shortest literal is longest wins.
+ * @return a NULL-terminated, dynamically allocated list, or NULL if there was nothing useful.
+ */
+char **regex_literals( const char *regstr, int *out_err ) {
+	*out_err = GRN_OK;
+
+	char **best = NULL, **group = NULL;
+	char *run = malloc( strlen( regstr ) + 1 );
+	ERR_NULL( run == NULL, GRN_ERR_OOM );
+	size_t run_n = 0;
+
+	const char *c = regstr;
+	bool done = false;
+	while ( !done ) {
+		bool is_literal = false;
+		char literal = '\0';
+
+		switch ( *c ) {
+			case '\0':
+				;
+				done = true;
+				break;
+			case '|':
+				;
+				// the whole thing is an alternation, which we don't bother with
+				free_literals( best );
+				best = NULL;
+				run_n = 0;
+				goto cleanup;
+			case '(':
+				;
+				c = regex_group( c, &group, out_err );
+				ERR_FW_CLEANUP();
+				break;
+			case '[':
+				;
+				c += regex_bracket_n( c );
+				break;
+			case '\\':
+				;
+				if ( c[1] == '\0' ) {
+					done = true;
+					break;
+				}
+				is_literal = !isalnum( ( unsigned char )c[1] );
+				literal = c[1];
+				c += 2;
+				break;
+			case '.':
+			case '^':
+			case '$':
+			case ')':
+			case '*':
+			case '+':
+			case '?':
+			case '{':
+				;
+				c++;
+				break;
+			default:
+				;
+				is_literal = true;
+				literal = *c++;
+				break;
+		}
+
+		bool optional;
+		int quantifier_n = regex_quantifier_n( c, &optional );
+		c += quantifier_n;
+		if ( is_literal && !optional ) {
+			run[run_n++] = literal;
+		}
+		// the run ends at anything that isn't a literal that must be there exactly once
+		if ( !is_literal || quantifier_n > 0 || done ) {
+			if ( run_n > 0 ) {
+				char **run_literals = calloc( 2, sizeof( char * ) );
+				if ( run_literals == NULL ) {
+					*out_err = GRN_ERR_OOM;
+					goto cleanup;
+				}
+				run_literals[0] = malloc( run_n + 1 );
+				if ( run_literals[0] == NULL ) {
+					free( run_literals );
+					*out_err = GRN_ERR_OOM;
+					goto cleanup;
+				}
+				memcpy( run_literals[0], run, run_n );
+				run_literals[0][run_n] = '\0';
+				best = pick_literals( best, run_literals );
+				run_n = 0;
+			}
+		}
+		if ( group != NULL ) {
+			if ( optional ) {
+				free_literals( group );
+			} else {
+				best = pick_literals( best, group );
+			}
+			group = NULL;
+		}
+	}
+	goto cleanup;
+cleanup:
+	free( run );
+	if ( *out_err ) {
+		free_literals( best );
+		return NULL;
+	}
+	return best;
+}
+
+// END regex literals
+
 struct grn_transform grn_mktransform_set_string( char *key, char *val ) {
 	return ( struct grn_transform ) {
 		.operation = GRN_TRANSFORM_SET_STRING,
@@ -313,6 +904,16 @@ struct grn_transform grn_mktransform_substitute_regex( char *find_regstr, char *
 		return to_return;
 	}
 
+	to_return.payload.substitute_regex.literals = regex_literals( find_regstr, out_err );
+	if ( *out_err ) {
+		regfree( &to_return.payload.substitute_regex.find );
+		return to_return;
+	}
+	to_return.payload.substitute_regex.source = grn_strcpy_malloc( find_regstr, out_err );
+	if ( *out_err ) {
+		regfree( &to_return.payload.substitute_regex.find );
+		free_literals( to_return.payload.substitute_regex.literals );
+	}
 	return to_return;
 }
 
@@ -330,6 +931,8 @@ void grn_free_transform( struct grn_transform *transform ) {
 	if ( bits & GRN_DYNAMIC_TRANSFORM_FIRST ) {
 		if ( transform->operation == GRN_TRANSFORM_SUBSTITUTE_REGEX ) {
 			regfree( &transform->payload.substitute_regex.find );
+			free_literals( transform->payload.substitute_regex.literals );
+			free( transform->payload.substitute_regex.source );
 		} else {
 			free( transform->payload.delete_.key );
 		}
@@ -358,85 +961,105 @@ void grn_free_transforms_v( struct vector *vec ) {
 
 // END preset and semi-presets
 
-/**
-* @brief replaces in a string based on the index of the start and end of the needle
-*
-* @param haystack the string to replace inside of
-* @param replace the string to replace with
-* @param start_i The zero-indexed start of the found needle
-* @param end_i The zero-indexed end of the needl in haystack
-* @return the dynamically-allocated replaced haystack with replacements
-*/
-char *strsubst_by_indices( const char *haystack, const char *replace, int start_i, int find_n, int *out_err ) {
-	*out_err = GRN_OK;
-
-	assert( start_i >= 0 );
-	assert( find_n >= 0 );
-	const int haystack_n = strlen( haystack ),
-	          replace_n = strlen( replace );
-
-	char *to_return = malloc( haystack_n + replace_n + 1 );
-	ERR_NULL( to_return == NULL, GRN_ERR_OOM );
-	to_return[0] = '\0';
-	strncat( to_return, haystack, start_i );
-
-	// copy substitution
-	// intentionally ignore null byte on replace
-	strcat( to_return, replace );
-
-	// copy suffix
-	strcat( to_return, haystack + start_i + find_n );
-
-	return to_return;
-}
-
-// returns dynamically allocated
+// replaces the first occurrence of find. Returns dynamically allocated.
 char *strsubst( const char *haystack, const char *find, const char *replace, int *out_err ) {
 	*out_err = GRN_OK;
 	char *to_return;
 
-	char *needle_start = strstr( haystack, find );
+	const size_t haystack_n = strlen( haystack );
+	const char *needle_start = strstr( haystack, find );
 	// not contained
 	if ( needle_start == NULL ) {
-		to_return = malloc( strlen( haystack ) + 1 );
+		to_return = malloc( haystack_n + 1 );
 		ERR_NULL( to_return == NULL, GRN_ERR_OOM );
-		strcpy( to_return, haystack );
+		memcpy( to_return, haystack, haystack_n + 1 );
 		RETURN_OK( to_return );
 	}
-	to_return = strsubst_by_indices( haystack, replace, needle_start - haystack, strlen( find ), out_err );
-	ERR_FW_NULL();
+	const size_t start_i = needle_start - haystack,
+	             find_n = strlen( find ),
+	             replace_n = strlen( replace );
+	to_return = malloc( haystack_n - find_n + replace_n + 1 );
+	ERR_NULL( to_return == NULL, GRN_ERR_OOM );
+	memcpy( to_return, haystack, start_i );
+	memcpy( to_return + start_i, replace, replace_n );
+	memcpy( to_return + start_i + replace_n, needle_start + find_n, haystack_n - start_i - find_n + 1 );
 	return to_return;
 }
 
+// append src to the null terminated *buf, growing it geometrically so that appending is linear overall
+void append_grow( char **buf, size_t *buf_n, size_t *buf_alloc, const char *src, size_t src_n, int *out_err ) {
+	*out_err = GRN_OK;
+
+	if ( *buf_n + src_n + 1 > *buf_alloc ) {
+		size_t new_alloc = *buf_alloc * 2;
+		if ( new_alloc < *buf_n + src_n + 1 ) {
+			new_alloc = *buf_n + src_n + 1;
+		}
+		char *new_buf = realloc( *buf, new_alloc );
+		ERR( new_buf == NULL, GRN_ERR_OOM );
+		*buf = new_buf;
+		*buf_alloc = new_alloc;
+	}
+	memcpy( *buf + *buf_n, src, src_n );
+	*buf_n += src_n;
+	( *buf )[*buf_n] = '\0';
+}
+
 // free the result. Will always return NULL on error.
-char *regsubst( const char *haystack_arg, regex_t *find, const char *replace, bool global, int *out_err ) {
+// Every match is found in the original haystack, in a single pass.
+char *regsubst( const char *haystack, regex_t *find, const char *replace, bool global, int *out_err ) {
 	*out_err = GRN_OK;
 	regmatch_t match[1];
 
-	char *haystack = malloc( strlen( haystack_arg ) + 1 );
-	ERR_NULL( haystack == NULL, GRN_ERR_OOM );
-	strcpy( haystack, haystack_arg );
-
-	// I'm stupidly proud of this little eo management shit
-	int last_eo = 0;
+	const size_t haystack_n = strlen( haystack ),
+	             replace_n = strlen( replace );
+	// usually about the same size as the input, so start there
+	size_t out_n = 0, out_alloc = haystack_n + 1;
+	char *out = malloc( out_alloc );
+	ERR_NULL( out == NULL, GRN_ERR_OOM );
+	out[0] = '\0';
+
+	size_t pos = 0;
+	// where the previous match ended, if there was one
+	bool matched = false;
+	size_t matched_eo = 0;
 	do {
-		int regexec_res = regexec( find, haystack + last_eo, 1, match, 0 );
+		// later matches aren't at the beginning of the line, even though we start the search there
+		int regexec_res = regexec( find, haystack + pos, 1, match, pos > 0 ? REG_NOTBOL : 0 );
 		// supposedly it can only fail in case of no match -- not OOM
 		if ( regexec_res ) {
 			break;
 		}
-		int abs_so = match->rm_so + last_eo;
-		int abs_eo = match->rm_eo + last_eo;
-		last_eo += match->rm_eo;
-		char *next_haystack = strsubst_by_indices( haystack, replace, abs_so, abs_eo - abs_so, out_err );
-		// this is a bit of a break from our normal error handling but it should be fine
-		free( haystack );
-		ERR_FW_NULL();
-
-		haystack = next_haystack;
+		size_t abs_so = pos + match->rm_so;
+		size_t abs_eo = pos + match->rm_eo;
+		// like sed, an empty match right where the previous match ended isn't one, so x* turns axb into -a-b-
+		bool adjacent_empty = matched && abs_so == abs_eo && abs_so == matched_eo;
+		if ( !adjacent_empty ) {
+			append_grow( &out, &out_n, &out_alloc, haystack + pos, abs_so - pos, out_err );
+			ERR_FW_CLEANUP();
+			append_grow( &out, &out_n, &out_alloc, replace, replace_n, out_err );
+			ERR_FW_CLEANUP();
+			pos = abs_eo;
+			matched = true;
+			matched_eo = abs_eo;
+		}
+		// an empty match would be found again at the same place, so step over one character
+		if ( abs_so == abs_eo ) {
+			if ( pos == haystack_n ) {
+				break;
+			}
+			append_grow( &out, &out_n, &out_alloc, haystack + pos, 1, out_err );
+			ERR_FW_CLEANUP();
+			pos++;
+		}
 	} while ( global );
 
-	return haystack;
+	append_grow( &out, &out_n, &out_alloc, haystack + pos, haystack_n - pos, out_err );
+	ERR_FW_CLEANUP();
+	return out;
+cleanup:
+	free( out );
+	return NULL;
 }
 
 /**
@@ -461,12 +1084,13 @@ void ben_free_grn( struct bencode *ben ) {
 	}
 }
 
+// strings in the result point into buffer, so it has to outlive the result. See ben_decode_view.
 struct bencode *ben_decode_grn( const void *buffer, size_t buffer_n, int *out_err ) {
 	*out_err = GRN_OK;
 
 	int bencode_error;
 	size_t off = 0;
-	struct bencode *to_return = ben_decode2( buffer, buffer_n, &off, &bencode_error );
+	struct bencode *to_return = ben_decode_view( buffer, buffer_n, &off, &bencode_error );
 	if ( bencode_error ) {
 		// TODO: rename anb
 		*out_err = bencode_error_to_anb( bencode_error );
@@ -483,256 +1107,2270 @@ void *ben_encode_grn( struct bencode *ben, size_t *buffer_n, int *out_err ) {
 	return to_return;
 }
 
+// bencode allocator backed by a grn_arena, passed as the opaque pointer
+void *ben_arena_malloc( void *arena, size_t size ) {
+	int in_err;
+	return grn_arena_alloc( arena, size, &in_err );
+}
+
+void *ben_arena_realloc( void *arena, void *ptr, size_t old_size, size_t new_size ) {
+	int in_err;
+	return grn_arena_realloc( arena, ptr, old_size, new_size, &in_err );
+}
+
+void ben_arena_free( void *arena, void *ptr, size_t size ) {
+	// it all goes at once when the arena is reset
+}
+
 /**
  * Replace a bencode string with a different one, in-place
  * The previous string will be freed.
  * @param ben the bencode string object to mutate
- * @param replace_with the string to use as the new one. *must* be dynamically allocated.
+ * @param replace_with the string to use as the new one. *must* be dynamically allocated. It is copied into the
+ * tree's own memory and then freed.
  */
-void ben_str_swap( struct bencode *ben, char *replace_with ) {
+void ben_str_swap( struct bencode *ben, char *replace_with, int *out_err ) {
+	*out_err = GRN_OK;
 	assert( ben->type == BENCODE_STR );
-	struct bencode_str *benstr = ( struct bencode_str * ) ben;
-	free( benstr->s );
-	benstr->s = replace_with;
-	benstr->len = strlen( replace_with );
+
+	int ben_err = ben_str_set( ben, replace_with, strlen( replace_with ) );
+	free( replace_with );
+	ERR( ben_err, GRN_ERR_OOM );
 }
 
-void mutate_string_subst( struct bencode *ben, struct grn_op_substitute payload, int *out_err ) {
+// the mutate_* functions and transform_buffer_single return whether they changed anything
+bool mutate_string_subst( struct bencode *ben, struct grn_op_substitute payload, int *out_err ) {
 	*out_err = GRN_OK;
 	if ( ben->type != BENCODE_STR ) {
-		return;
+		return false;
 	}
+	// decoded strings point into the file and aren't null terminated, so look before copying
+	if ( grn_memmem( ben_str_val( ben ), ben_str_len( ben ), payload.find, strlen( payload.find ) ) == NULL ) {
+		return false;
+	}
+	ERR_NULL( ben_str_own( ben ), GRN_ERR_OOM );
 	GRN_LOG_DEBUG( "Substituting %s for %s", payload.find, payload.replace );
 
 	char *substituted = strsubst( ben_str_val( ben ), payload.find, payload.replace, out_err );
-	ERR_FW();
-	ben_str_swap( ben, substituted );
+	ERR_FW_NULL();
+	ben_str_swap( ben, substituted, out_err );
+	ERR_FW_NULL();
+	return true;
 }
 
-void mutate_string_subst_regex( struct bencode *ben, struct grn_op_substitute_regex payload, int *out_err ) {
+bool mutate_string_subst_regex( struct bencode *ben, struct grn_op_substitute_regex payload, int *out_err ) {
 	*out_err = GRN_OK;
 	if ( ben->type != BENCODE_STR ) {
-		return;
+		return false;
+	}
+	// most strings are hashes, names and such, which won't have any of the literals
+	if ( payload.literals != NULL ) {
+		bool may_match = false;
+		for ( int i = 0; payload.literals[i] != NULL && !may_match; i++ ) {
+			may_match = grn_memmem( ben_str_val( ben ), ben_str_len( ben ), payload.literals[i], strlen( payload.literals[i] ) ) != NULL;
+		}
+		if ( !may_match ) {
+			return false;
+		}
 	}
+	// regexec needs a null terminated string
+	ERR_NULL( ben_str_own( ben ), GRN_ERR_OOM );
 
 	char *substituted = regsubst( ben_str_val( ben ), &payload.find, payload.replace, false, out_err );
-	ERR_FW();
-	ben_str_swap( ben, substituted );
+	ERR_FW_NULL();
+	if ( strcmp( substituted, ben_str_val( ben ) ) == 0 ) {
+		free( substituted );
+		return false;
+	}
+	ben_str_swap( ben, substituted, out_err );
+	ERR_FW_NULL();
+	return true;
 }
 
-void cat_descendants( struct vector *vec, struct bencode *ben, int *out_err ) {
-	*out_err = GRN_OK;
-
-	struct bencode *key, *val;
-	size_t pos;
-	switch ( ben->type ) {
-		case BENCODE_DICT:
+// the key a delete or set works on, which is all that the transform looks up in a dict
+void transform_payload_key( struct grn_transform *transform, struct ben_key *payload_key ) {
+	switch ( transform->operation ) {
+		case GRN_TRANSFORM_DELETE:
 			;
-			ben_dict_for_each( key, val, pos, ben ) {
-				vector_push( vec, &val, out_err );
-				ERR_FW();
+			ben_key_init( payload_key, transform->payload.delete_.key );
+			break;
+		case GRN_TRANSFORM_SET_STRING:
+			;
+			ben_key_init( payload_key, transform->payload.set_string.key );
+			break;
+		default:
+			;
+			*payload_key = ( struct ben_key ) { 0 };
+			break;
+	}
+}
+
+/**
+ * Same as transform_buffer_single, but with the key from transform_payload_key, so that it doesn't need to be hashed
+ * again for every dict.
+ */
+bool transform_buffer_keyed( struct bencode *ben, struct grn_transform transform, const struct ben_key *payload_key, int *out_err ) {
+	*out_err = GRN_OK;
+	bool changed = false;
+
+	GRN_LOG_DEBUG( "Executing transform, %d", transform.operation );
+	switch ( transform.operation ) {
+		case GRN_TRANSFORM_DELETE:
+			;
+			// it returns a "standalone" pointer to the value, that must be freed. It modifies
+			// the main_dict in place
+			if ( ben->type != BENCODE_DICT ) {
+				break;
+			}
+			struct bencode *popped_val = ben_dict_pop_by_key( ben, payload_key );
+			if ( popped_val != NULL ) {
+				ben_free( popped_val );
+				changed = true;
 			}
 			break;
-		case BENCODE_LIST:
+		case GRN_TRANSFORM_SET_STRING:
 			;
-			ben_list_for_each( val, pos, ben ) {
-				vector_push( vec, &val, out_err );
-				ERR_FW();
+			if ( ben->type != BENCODE_DICT ) {
+				break;
+			}
+			struct grn_op_set_string setstr_payload = transform.payload.set_string;
+			struct bencode *old_val = ben_dict_get_by_key( ben, payload_key );
+			if (
+			    old_val != NULL &&
+			    old_val->type == BENCODE_STR &&
+			    ben_str_len( old_val ) == strlen( setstr_payload.val ) &&
+			    memcmp( ben_str_val( old_val ), setstr_payload.val, ben_str_len( old_val ) ) == 0
+			) {
+				break;
 			}
+			ERR_NULL( ben_dict_set_str_by_str( ben, setstr_payload.key, setstr_payload.val ), GRN_ERR_OOM );
+			changed = true;
+			break;
+		case GRN_TRANSFORM_SUBSTITUTE:
+			;
+			changed = mutate_string_subst( ben, transform.payload.substitute, out_err );
+			ERR_FW_NULL();
+			break;
+		case GRN_TRANSFORM_SUBSTITUTE_REGEX:
+			;
+			changed = mutate_string_subst_regex( ben, transform.payload.substitute_regex, out_err );
+			ERR_FW_NULL();
+			break;
+		default:
+			;
+			assert( false );
+			break;
+	}
+	return changed;
+}
+
+// transforms a buffer based on a single transform and does not filter
+bool transform_buffer_single( struct bencode *ben, struct grn_transform transform, int *out_err ) {
+	struct ben_key payload_key;
+	transform_payload_key( &transform, &payload_key );
+	return transform_buffer_keyed( ben, transform, &payload_key, out_err );
+}
+
+// false only if the raw buffer has nothing that the transform could possibly change
+bool transform_may_match( struct grn_transform transform, const char *buffer, size_t buffer_n ) {
+	const char *needle;
+	switch ( transform.operation ) {
+		case GRN_TRANSFORM_DELETE:
+			;
+			// the key has to be in there somewhere for a dict to have it
+			needle = transform.payload.delete_.key;
+			break;
+		case GRN_TRANSFORM_SUBSTITUTE:
+			;
+			needle = transform.payload.substitute.find;
+			break;
+		case GRN_TRANSFORM_SUBSTITUTE_REGEX:
+			;
+			char **literals = transform.payload.substitute_regex.literals;
+			if ( literals == NULL ) {
+				return true;
+			}
+			for ( int i = 0; literals[i] != NULL; i++ ) {
+				if ( grn_memmem( buffer, buffer_n, literals[i], strlen( literals[i] ) ) != NULL ) {
+					return true;
+				}
+			}
+			return false;
+		default:
+			;
+			// setting a string can add a key that wasn't there
+			return true;
+	}
+	return grn_memmem( buffer, buffer_n, needle, strlen( needle ) ) != NULL;
+}
+
+// BEGIN transform plan
+
+/**
+ * The key paths of all transforms, merged into a trie so that a single walk over the file applies every transform.
+ * A transform is applied when the walk reaches the end of its key path, either on the way down ("pre") or on the
+ * way back up ("post"), whichever keeps it in the same order as the earlier transforms it could interfere with.
+ * When neither does, it starts a new stage, which is another trie that is walked after the previous one.
+ */
+struct grn_plan_node {
+	const char *key; // borrowed from a transform. "" matches every child. NULL at the root of a stage
+	struct ben_key ben_key; // key, hashed once here rather than in every file
+	int child_i; // first child, -1 if none. Children are in the order they were added, which is also index order
+	int sibling_i; // next child of the same parent, or -1
+	int pre_i; // first transform applied on the way down. The rest are chained through grn_plan.next_i. -1 if none
+	int post_i; // same, but on the way back up
+};
+
+struct grn_plan {
+	struct vector *nodes;
+	int *roots; // root node of each stage
+	int roots_n;
+	// the rest are indexed by transform
+	int *next_i; // next transform applied at the same node and in the same direction, or -1
+	int *stage_of;
+	bool *post;
+	// the dict key that deletes and sets work on, hashed in advance. Unused for other operations.
+	struct ben_key *payload_keys;
+	// no transform adds keys to the root, so that each top-level entry can be transformed on its own
+	bool by_entry;
+};
+
+void free_plan( struct grn_plan *plan ) {
+	if ( plan == NULL ) {
+		return;
+	}
+	vector_free( plan->nodes );
+	free( plan->roots );
+	free( plan->next_i );
+	free( plan->stage_of );
+	free( plan->post );
+	free( plan->payload_keys );
+	free( plan );
+}
+
+int plan_child( struct grn_plan *plan, int node_i, const char *key ) {
+	int child_i = ( ( struct grn_plan_node * ) vector_get( plan->nodes, node_i ) )->child_i;
+	while ( child_i != -1 ) {
+		struct grn_plan_node *child = vector_get( plan->nodes, child_i );
+		if ( strcmp( child->key, key ) == 0 ) {
+			break;
+		}
+		child_i = child->sibling_i;
+	}
+	return child_i;
+}
+
+int plan_add_node( struct grn_plan *plan, int parent_i, const char *key, int *out_err ) {
+	*out_err = GRN_OK;
+
+	struct grn_plan_node node = {
+		.key = key,
+		.child_i = -1,
+		.sibling_i = -1,
+		.pre_i = -1,
+		.post_i = -1,
+	};
+	if ( key != NULL ) {
+		ben_key_init( &node.ben_key, key );
+	}
+	vector_push( plan->nodes, &node, out_err );
+	ERR_FW_NULL();
+	int node_i = vector_length( plan->nodes ) - 1;
+	if ( parent_i == -1 ) {
+		return node_i;
+	}
+
+	// vector_push may have moved the nodes, so only look them up now
+	int *link = &( ( struct grn_plan_node * ) vector_get( plan->nodes, parent_i ) )->child_i;
+	while ( *link != -1 ) {
+		link = &( ( struct grn_plan_node * ) vector_get( plan->nodes, *link ) )->sibling_i;
+	}
+	*link = node_i;
+	return node_i;
+}
+
+// the path of the part of the tree a transform looks at or changes
+struct grn_footprint {
+	char **key;
+	int key_n;
+	const char *child; // dict key under the end of the path that gets changed, or NULL for the node itself
+};
+
+struct grn_footprint transform_footprint( struct grn_transform *transform ) {
+	struct grn_footprint footprint = { .key = transform->key, .child = NULL };
+	footprint.key_n = 0;
+	while ( transform->key[footprint.key_n] != NULL ) {
+		footprint.key_n++;
+	}
+	switch ( transform->operation ) {
+		case GRN_TRANSFORM_DELETE:
+			;
+			footprint.child = transform->payload.delete_.key;
+			break;
+		case GRN_TRANSFORM_SET_STRING:
+			;
+			footprint.child = transform->payload.set_string.key;
 			break;
 		default:
 			;
 			break;
 	}
+	return footprint;
+}
+
+bool plan_keys_may_match( const char *a, const char *b ) {
+	return a[0] == '\0' || b[0] == '\0' || strcmp( a, b ) == 0;
+}
+
+// whether two transforms might touch the same node, in which case they have to be applied in order
+bool transforms_may_interfere( struct grn_transform *a, struct grn_transform *b ) {
+	struct grn_footprint fa = transform_footprint( a ), fb = transform_footprint( b );
+	for ( int i = 0; i < fa.key_n && i < fb.key_n; i++ ) {
+		if ( !plan_keys_may_match( fa.key[i], fb.key[i] ) ) {
+			return false;
+		}
+	}
+	if ( fa.key_n == fb.key_n ) {
+		return fa.child == NULL || fb.child == NULL || plan_keys_may_match( fa.child, fb.child );
+	}
+	// the shorter one has to change a whole subtree that the longer one may be in
+	struct grn_footprint shorter = fa.key_n < fb.key_n ? fa : fb,
+	                     longer = fa.key_n < fb.key_n ? fb : fa;
+	return shorter.child != NULL && plan_keys_may_match( shorter.child, longer.key[shorter.key_n] );
+}
+
+// whether the walk applies transform i before transform j, if j were added to the same stage as i
+bool plan_applies_before( struct grn_plan *plan, struct grn_transform *transforms, int i, int j, bool j_post ) {
+	char **key_i = transforms[i].key, **key_j = transforms[j].key;
+	int node_i = plan->roots[plan->stage_of[i]];
+	int depth = 0;
+	while ( key_i[depth] != NULL && key_j[depth] != NULL && strcmp( key_i[depth], key_j[depth] ) == 0 ) {
+		node_i = plan_child( plan, node_i, key_i[depth] );
+		depth++;
+	}
+	if ( key_i[depth] == NULL && key_j[depth] == NULL ) {
+		// same node, where transforms in the same direction are applied in the order they were added
+		return j_post || !plan->post[i];
+	}
+	if ( key_i[depth] == NULL ) {
+		return !plan->post[i];
+	}
+	if ( key_j[depth] == NULL ) {
+		return j_post;
+	}
+	// the paths split here, and the walk goes through the children in the order they were added
+	int child_j = plan_child( plan, node_i, key_j[depth] );
+	return child_j == -1 || plan_child( plan, node_i, key_i[depth] ) < child_j;
+}
+
+bool plan_fits( struct grn_plan *plan, struct grn_transform *transforms, int j, bool j_post ) {
+	for ( int i = 0; i < j; i++ ) {
+		if (
+		    plan->stage_of[i] == plan->roots_n - 1 &&
+		    transforms_may_interfere( &transforms[i], &transforms[j] ) &&
+		    !plan_applies_before( plan, transforms, i, j, j_post )
+		) {
+			return false;
+		}
+	}
+	return true;
+}
+
+void compile_plan_ctx( struct grn_ctx *ctx, int *out_err ) {
+	*out_err = GRN_OK;
+
+	free_plan( ctx->plan );
+	ctx->plan = NULL;
+
+	struct grn_plan *plan = calloc( 1, sizeof( struct grn_plan ) );
+	ERR( plan == NULL, GRN_ERR_OOM );
+	ctx->plan = plan;
+	plan->nodes = vector_alloc( sizeof( struct grn_plan_node ), out_err );
+	ERR_FW();
+	// + 1 so that there's something to allocate when there are no transforms
+	int alloc_n = ctx->transforms_n + 1;
+	plan->roots = malloc( alloc_n * sizeof( int ) );
+	plan->next_i = malloc( alloc_n * sizeof( int ) );
+	plan->stage_of = malloc( alloc_n * sizeof( int ) );
+	plan->post = malloc( alloc_n * sizeof( bool ) );
+	plan->payload_keys = malloc( alloc_n * sizeof( struct ben_key ) );
+	ERR( plan->roots == NULL || plan->next_i == NULL || plan->stage_of == NULL || plan->post == NULL || plan->payload_keys == NULL, GRN_ERR_OOM );
+
+	for ( int j = 0; j < ctx->transforms_n; j++ ) {
+		struct grn_transform *transform = &ctx->transforms[j];
+		assert( transform->key != NULL );
+		transform_payload_key( transform, &plan->payload_keys[j] );
+
+		bool fits = false, post = false;
+		if ( plan->roots_n > 0 ) {
+			fits = plan_fits( plan, ctx->transforms, j, false );
+			if ( !fits ) {
+				fits = post = plan_fits( plan, ctx->transforms, j, true );
+			}
+		}
+		if ( !fits ) {
+			GRN_LOG_DEBUG( "Transform %d starts a new stage", j );
+			plan->roots[plan->roots_n] = plan_add_node( plan, -1, NULL, out_err );
+			ERR_FW();
+			plan->roots_n++;
+		}
+		plan->stage_of[j] = plan->roots_n - 1;
+		plan->post[j] = post;
+		plan->next_i[j] = -1;
+
+		int node_i = plan->roots[plan->roots_n - 1];
+		for ( int k = 0; transform->key[k] != NULL; k++ ) {
+			int child_i = plan_child( plan, node_i, transform->key[k] );
+			if ( child_i == -1 ) {
+				child_i = plan_add_node( plan, node_i, transform->key[k], out_err );
+				ERR_FW();
+			}
+			node_i = child_i;
+		}
+
+		struct grn_plan_node *node = vector_get( plan->nodes, node_i );
+		int *link = post ? &node->post_i : &node->pre_i;
+		while ( *link != -1 ) {
+			link = &plan->next_i[*link];
+		}
+		*link = j;
+	}
+
+	plan->by_entry = true;
+	for ( int j = 0; j < ctx->transforms_n; j++ ) {
+		if ( ctx->transforms[j].key[0] == NULL && ctx->transforms[j].operation == GRN_TRANSFORM_SET_STRING ) {
+			plan->by_entry = false;
+		}
+	}
+}
+
+bool apply_plan_transforms( struct grn_ctx *ctx, int transform_i, struct bencode *ben, int *out_err ) {
+	*out_err = GRN_OK;
+
+	bool changed = false;
+	for ( ; transform_i != -1; transform_i = ctx->plan->next_i[transform_i] ) {
+		changed |= transform_buffer_keyed( ben, ctx->transforms[transform_i], &ctx->plan->payload_keys[transform_i], out_err );
+		ERR_FW_NULL();
+	}
+	return changed;
+}
+
+/**
+ * Apply the part of the plan below node_i to ben.
+ * @return whether anything in ben changed, in which case it is marked so that it gets encoded again
+ */
+bool apply_plan_node( struct grn_ctx *ctx, int node_i, struct bencode *ben, int *out_err ) {
+	*out_err = GRN_OK;
+
+	// nodes aren't added after compiling, so this pointer stays good
+	struct grn_plan_node *node = vector_get( ctx->plan->nodes, node_i );
+	bool changed = apply_plan_transforms( ctx, node->pre_i, ben, out_err );
+	ERR_FW_NULL();
+
+	for ( int child_i = node->child_i; child_i != -1; ) {
+		struct grn_plan_node *child = vector_get( ctx->plan->nodes, child_i );
+		struct bencode *key, *val;
+		size_t pos;
+
+		if ( strlen( child->key ) == 0 ) {
+			// wildcard
+			if ( ben->type == BENCODE_DICT ) {
+				ben_dict_for_each( key, val, pos, ben ) {
+					changed |= apply_plan_node( ctx, child_i, val, out_err );
+					ERR_FW_NULL();
+				}
+			} else if ( ben->type == BENCODE_LIST ) {
+				ben_list_for_each( val, pos, ben ) {
+					changed |= apply_plan_node( ctx, child_i, val, out_err );
+					ERR_FW_NULL();
+				}
+			}
+		} else if ( ben->type == BENCODE_DICT ) {
+			val = ben_dict_get_by_key( ben, &child->ben_key );
+			if ( val != NULL ) {
+				changed |= apply_plan_node( ctx, child_i, val, out_err );
+				ERR_FW_NULL();
+			}
+		}
+		child_i = child->sibling_i;
+	}
+
+	changed |= apply_plan_transforms( ctx, node->post_i, ben, out_err );
+	ERR_FW_NULL();
+	if ( changed ) {
+		// the bytes it was decoded from are out of date now
+		ben_mark_modified( ben );
+	}
+	return changed;
+}
+
+// END transform plan
+
+// BEGIN entry split
+
+/**
+ * Files like uTorrent's resume.dat are one big dict with an entry per torrent. As long as no transform adds keys to
+ * that dict, the entries are decoded, transformed and encoded on several threads, then put back together in the
+ * original order, which is also key order. The result is byte for byte what transforming the whole tree would give.
+ */
+#define GRN_SPLIT_MIN_ENTRIES 256
+// entries claimed by a thread at once
+#define GRN_SPLIT_CHUNK_N 16
+
+struct grn_split_entry {
+	size_t key_off; // where the key starts. The value follows it
+	size_t val_off;
+	size_t val_n;
+	bool deleted; // a transform on the root deleted this entry
+	char *encoded; // the new value, malloc'd. NULL if no transform changed it
+	size_t encoded_n;
+	int error;
+};
+
+struct grn_split {
+	struct grn_ctx *ctx;
+	struct grn_split_entry *entries;
+	int entries_n;
+	int next_i; // next entry to claim. Only touched atomically
+};
+
+struct grn_split_thread {
+	struct grn_split *split;
+	pthread_t thread;
+	// each thread decodes into its own arena, since arenas aren't thread safe
+	struct grn_arena arena;
+};
+
+/**
+ * Find the top-level entries of ctx->buffer without decoding anything.
+ * @return NULL if the buffer is not a dict whose keys are strings in strictly increasing order. Those are left to the
+ * normal path, which will either report the same error or, for int keys, handle them.
+ */
+struct vector *split_entries_ctx( struct grn_ctx *ctx, int *out_err ) {
+	*out_err = GRN_OK;
+
+	struct ben_tokenizer t;
+	struct ben_token token;
+	const char *last_key = NULL;
+	size_t last_key_n = 0;
+
+	ben_tokenizer_init( &t, ctx->buffer, ctx->buffer_n );
+	if ( ben_next_token( &t, &token ) != 1 || token.type != BEN_TOKEN_DICT ) {
+		return NULL;
+	}
+
+	struct vector *entries = vector_alloc( sizeof( struct grn_split_entry ), out_err );
+	ERR_FW_NULL();
+	struct grn_split_entry entry = { 0 };
+	bool want_val = false;
+	int res;
+	while ( ( res = ben_next_token( &t, &token ) ) == 1 && t.depth > 0 ) {
+		if ( token.type == BEN_TOKEN_KEY && t.depth == 1 ) {
+			size_t cmp_n = last_key_n < token.s_len ? last_key_n : token.s_len;
+			int cmp = last_key == NULL ? -1 : memcmp( last_key, token.s, cmp_n );
+			if ( cmp > 0 || ( cmp == 0 && last_key_n >= token.s_len ) ) {
+				goto invalid;
+			}
+			last_key = token.s;
+			last_key_n = token.s_len;
+			entry = ( struct grn_split_entry ) { .key_off = token.off };
+			want_val = true;
+			continue;
+		}
+		if ( want_val ) {
+			entry.val_off = token.off;
+			want_val = false;
+		}
+		if ( t.depth == 1 ) {
+			entry.val_n = token.off + token.len - entry.val_off;
+			vector_push( entries, &entry, out_err );
+			ERR_FW_CLEANUP();
+		}
+	}
+	if ( res == 1 ) {
+		// the root dict ended
+		return entries;
+	}
+	goto invalid;
+invalid:
+	vector_free( entries );
+	return NULL;
+cleanup:
+	vector_free( entries );
+	return NULL;
+}
+
+// whether one of the transforms applied to the root deletes the entry with this key. Substitutes do nothing to dicts.
+bool plan_deletes_entry( struct grn_ctx *ctx, int transform_i, const char *key, size_t key_n ) {
+	for ( ; transform_i != -1; transform_i = ctx->plan->next_i[transform_i] ) {
+		struct grn_transform *transform = &ctx->transforms[transform_i];
+		if (
+		    transform->operation == GRN_TRANSFORM_DELETE &&
+		    strlen( transform->payload.delete_.key ) == key_n &&
+		    memcmp( transform->payload.delete_.key, key, key_n ) == 0
+		) {
+			return true;
+		}
+	}
+	return false;
+}
+
+/**
+ * Apply the whole plan to a single top-level entry, in the same order as the walk from the root would.
+ * @return whether anything changed, including the entry being deleted
+ */
+bool apply_plan_entry( struct grn_ctx *ctx, const char *key, size_t key_n, struct bencode *val, bool *deleted, int *out_err ) {
+	*out_err = GRN_OK;
+
+	bool changed = false;
+	for ( int i = 0; i < ctx->plan->roots_n; i++ ) {
+		struct grn_plan_node *root = vector_get( ctx->plan->nodes, ctx->plan->roots[i] );
+		if ( plan_deletes_entry( ctx, root->pre_i, key, key_n ) ) {
+			*deleted = true;
+			return true;
+		}
+		for ( int child_i = root->child_i; child_i != -1; ) {
+			struct grn_plan_node *child = vector_get( ctx->plan->nodes, child_i );
+			size_t child_key_n = strlen( child->key );
+			if ( child_key_n == 0 || ( child_key_n == key_n && memcmp( child->key, key, key_n ) == 0 ) ) {
+				changed |= apply_plan_node( ctx, child_i, val, out_err );
+				ERR_FW_NULL();
+			}
+			child_i = child->sibling_i;
+		}
+		if ( plan_deletes_entry( ctx, root->post_i, key, key_n ) ) {
+			*deleted = true;
+			return true;
+		}
+	}
+	return changed;
+}
+
+void split_transform_entry( struct grn_split_thread *thread, struct grn_split_entry *entry, int *out_err ) {
+	*out_err = GRN_OK;
+	struct grn_ctx *ctx = thread->split->ctx;
+
+	struct bencode *val = ben_decode_grn( ctx->buffer + entry->val_off, entry->val_n, out_err );
+	ERR_FW();
+	// the key is known to be a string, whose data comes right after the colon
+	const char *key = ( const char * )memchr( ctx->buffer + entry->key_off, ':', entry->val_off - entry->key_off ) + 1;
+	bool changed = apply_plan_entry( ctx, key, ctx->buffer + entry->val_off - key, val, &entry->deleted, out_err );
+	ERR_FW();
+	if ( changed && !entry->deleted ) {
+		// allocated with plain malloc, so it outlives the arena
+		entry->encoded = ben_encode_grn( val, &entry->encoded_n, out_err );
+		ERR_FW();
+	}
+}
+
+void *split_thread_main( void *arg ) {
+	struct grn_split_thread *thread = arg;
+	struct grn_split *split = thread->split;
+	struct ben_allocator arena_allocator = {
+		.malloc_ = ben_arena_malloc,
+		.realloc_ = ben_arena_realloc,
+		.free_ = ben_arena_free,
+		.opaque = &thread->arena,
+	};
+	ben_set_allocator( &arena_allocator );
+
+	int start_i;
+	while ( ( start_i = __atomic_fetch_add( &split->next_i, GRN_SPLIT_CHUNK_N, __ATOMIC_RELAXED ) ) < split->entries_n ) {
+		int end_i = start_i + GRN_SPLIT_CHUNK_N < split->entries_n ? start_i + GRN_SPLIT_CHUNK_N : split->entries_n;
+		for ( int i = start_i; i < end_i; i++ ) {
+			split_transform_entry( thread, &split->entries[i], &split->entries[i].error );
+			grn_arena_reset( &thread->arena );
+		}
+	}
+
+	ben_set_allocator( NULL );
+	return NULL;
+}
+
+/**
+ * Transform ctx->buffer entry by entry on ctx->split_threads_n threads.
+ * @return false if the file can't be split, in which case nothing was done
+ */
+bool transform_split_ctx( struct grn_ctx *ctx, int *out_err ) {
+	*out_err = GRN_OK;
+
+	struct grn_split split = { .ctx = ctx };
+	struct grn_split_thread *threads = NULL;
+	int threads_n = 0;
+
+	struct vector *entries_v = split_entries_ctx( ctx, out_err );
+	ERR_FW_NULL();
+	if ( entries_v == NULL || ( int )vector_length( entries_v ) < GRN_SPLIT_MIN_ENTRIES ) {
+		vector_free( entries_v );
+		return false;
+	}
+	// frees the vector
+	split.entries = vector_export( entries_v, &split.entries_n );
+	ERR_NULL( split.entries == NULL, GRN_ERR_OOM );
+	GRN_LOG_DEBUG( "Transforming %d entries on %d threads", split.entries_n, ctx->split_threads_n );
+	// from here on, any error is the file's
+
+	threads = calloc( ctx->split_threads_n, sizeof( struct grn_split_thread ) );
+	if ( threads == NULL ) {
+		*out_err = GRN_ERR_OOM;
+		goto cleanup;
+	}
+	for ( int i = 0; i < ctx->split_threads_n; i++ ) {
+		threads[i].split = &split;
+	}
+	// this thread does its share too, as threads[0]
+	for ( threads_n = 1; threads_n < ctx->split_threads_n; threads_n++ ) {
+		if ( pthread_create( &threads[threads_n].thread, NULL, split_thread_main, &threads[threads_n] ) ) {
+			// the threads that did start will get through all the entries anyway
+			break;
+		}
+	}
+	split_thread_main( &threads[0] );
+	for ( int i = 1; i < threads_n; i++ ) {
+		pthread_join( threads[i].thread, NULL );
+	}
+
+	// the error that the earliest entry ran into, like a walk over the whole tree would have stopped at
+	size_t out_n = 2;
+	bool changed = false;
+	for ( int i = 0; i < split.entries_n; i++ ) {
+		struct grn_split_entry *entry = &split.entries[i];
+		*out_err = entry->error;
+		ERR_FW_CLEANUP();
+		changed |= entry->encoded != NULL || entry->deleted;
+		if ( !entry->deleted ) {
+			out_n += entry->val_off - entry->key_off + ( entry->encoded != NULL ? entry->encoded_n : entry->val_n );
+		}
+	}
+	if ( !changed ) {
+		GRN_LOG_DEBUG( "No transform applied, leaving the file alone" );
+		ctx->file_unchanged = true;
+		goto cleanup;
+	}
+
+	char *out = malloc( out_n );
+	if ( out == NULL ) {
+		*out_err = GRN_ERR_OOM;
+		goto cleanup;
+	}
+	size_t pos = 0;
+	out[pos++] = 'd';
+	for ( int i = 0; i < split.entries_n; i++ ) {
+		struct grn_split_entry *entry = &split.entries[i];
+		if ( entry->deleted ) {
+			continue;
+		}
+		memcpy( out + pos, ctx->buffer + entry->key_off, entry->val_off - entry->key_off );
+		pos += entry->val_off - entry->key_off;
+		if ( entry->encoded != NULL ) {
+			memcpy( out + pos, entry->encoded, entry->encoded_n );
+			pos += entry->encoded_n;
+		} else {
+			memcpy( out + pos, ctx->buffer + entry->val_off, entry->val_n );
+			pos += entry->val_n;
+		}
+	}
+	out[pos++] = 'e';
+	assert( pos == out_n );
+
+	if ( out_n == ctx->buffer_n && memcmp( out, ctx->buffer, out_n ) == 0 ) {
+		GRN_LOG_DEBUG( "Encoded file is identical to the original" );
+		free( out );
+		ctx->file_unchanged = true;
+		goto cleanup;
+	}
+	release_buffer_ctx( ctx );
+	ctx->buffer = out;
+	ctx->buffer_n = out_n;
+	GRN_LOG_DEBUG( "Newly encoded file size: %d", ( int )ctx->buffer_n );
+	goto cleanup;
+cleanup:
+	if ( threads != NULL ) {
+		for ( int i = 0; i < ctx->split_threads_n; i++ ) {
+			grn_arena_free( &threads[i].arena );
+		}
+		free( threads );
+	}
+	for ( int i = 0; i < split.entries_n; i++ ) {
+		grn_free( split.entries[i].encoded );
+	}
+	grn_free( split.entries );
+	return true;
+}
+
+// END entry split
+
+struct grn_compare_sink {
+	const char *buffer;
+	size_t buffer_n;
+	size_t off;
+};
+
+// bencode sink that stops at the first byte that differs from the buffer
+int compare_sink_write( void *opaque, const struct ben_chunk *chunks, int chunks_n ) {
+	struct grn_compare_sink *cmp = opaque;
+	for ( int i = 0; i < chunks_n; i++ ) {
+		if ( chunks[i].len > cmp->buffer_n - cmp->off || memcmp( cmp->buffer + cmp->off, chunks[i].data, chunks[i].len ) ) {
+			return 1;
+		}
+		cmp->off += chunks[i].len;
+	}
+	return 0;
+}
+
+// whether ben encodes to exactly buffer. Usually a change is near the start, so this stops early.
+bool encodes_same( struct bencode *ben, const char *buffer, size_t buffer_n ) {
+	struct grn_compare_sink cmp = {
+		.buffer = buffer,
+		.buffer_n = buffer_n,
+	};
+	struct ben_sink sink = {
+		.write = compare_sink_write,
+		.opaque = &cmp,
+	};
+	size_t encoded_n;
+	return ben_encode_sink( &sink, ben, &encoded_n ) == 0 && encoded_n == buffer_n;
+}
+
+void transform_buffer( struct grn_ctx *ctx, int *out_err ) {
+	*out_err = GRN_OK;
+	assert( ctx->state == GRN_CTX_TRANSFORM );
+
+	struct bencode *main_dict = NULL;
+
+	// don't even decode files that no transform could match
+	bool may_match = false;
+	for ( int i = 0; i < ctx->transforms_n && !may_match; i++ ) {
+		may_match = transform_may_match( ctx->transforms[i], ctx->buffer, ctx->buffer_n );
+	}
+	if ( !may_match ) {
+		GRN_LOG_DEBUG( "No transform could match, skipping decode" );
+		ctx->file_unchanged = true;
+		return;
+	}
+
+	// BEGIN SHITTY DELUGE FUCKING SHIT THAT NEEDS TO BE LESIONED
+	if ( str_ends_with( grn_ctx_get_c_path( ctx ), "torrents.state" ) ) {
+		GRN_LOG_DEBUG( "Doing deluge .state transform" );
+		assert( ctx->transforms[0].operation = GRN_TRANSFORM_SUBSTITUTE_REGEX );
+
+		// we need to add the null byte so the file is a proper string
+		char *buffer_null;
+		if ( ctx->buffer_type == GRN_BUFFER_SCRATCH ) {
+			// the scratch buffer always has room for the null byte
+			buffer_null = ctx->buffer;
+		} else {
+			// mapped files are read-only, so they need a copy anyway
+			buffer_null = malloc( ctx->buffer_n + 1 );
+			ERR( buffer_null == NULL, GRN_ERR_OOM );
+			memcpy( buffer_null, ctx->buffer, ctx->buffer_n );
+		}
+		// it's unintuitive, but because it's zero indexed this is still actually one beyond the previous
+		// length
+		buffer_null[ctx->buffer_n] = '\0';
+
+		char *substituted = regsubst( buffer_null, &ctx->transforms[0].payload.substitute_regex.find, ctx->transforms[0].payload.substitute_regex.replace, true, out_err );
+		if ( buffer_null != ctx->buffer ) {
+			free( buffer_null );
+		}
+		ERR_FW();
+		if ( strlen( substituted ) == ctx->buffer_n && memcmp( substituted, ctx->buffer, ctx->buffer_n ) == 0 ) {
+			free( substituted );
+			ctx->file_unchanged = true;
+			return;
+		}
+		release_buffer_ctx( ctx );
+		ctx->buffer = substituted;
+		// intentionally not adding the null byte because there shouldn't be one.
+		ctx->buffer_n = strlen( ctx->buffer );
+		return;
+	}
+	// END SHITTY DELUGE FUCKING SHIT THAT NEEDS TO BE LESIONED
+
+	// big files made of independent entries are spread over several threads
+	if ( ctx->split_threads_n > 1 && ctx->plan->by_entry ) {
+		bool split = transform_split_ctx( ctx, out_err );
+		ERR_FW();
+		if ( split ) {
+			return;
+		}
+	}
+
+	// build the tree in the arena, so that it doesn't need to be freed node by node
+	struct ben_allocator arena_allocator = {
+		.malloc_ = ben_arena_malloc,
+		.realloc_ = ben_arena_realloc,
+		.free_ = ben_arena_free,
+		.opaque = &ctx->arena,
+	};
+	ben_set_allocator( &arena_allocator );
+
+	main_dict = ben_decode_grn( ctx->buffer, ctx->buffer_n, out_err );
+	ERR_FW_CLEANUP();
+
+	assert( ctx->plan != NULL );
+	bool changed = false;
+	for ( int i = 0; i < ctx->plan->roots_n; i++ ) {
+		changed |= apply_plan_node( ctx, ctx->plan->roots[i], main_dict, out_err );
+		ERR_FW_CLEANUP();
+	}
+
+	if ( !changed ) {
+		GRN_LOG_DEBUG( "No transform applied, leaving the file alone" );
+		ctx->file_unchanged = true;
+		goto cleanup;
+	}
+
+	if ( ctx->io == NULL ) {
+		// a transform can put back exactly what was there, eg substituting a string for itself
+		if ( encodes_same( main_dict, ctx->buffer, ctx->buffer_n ) ) {
+			GRN_LOG_DEBUG( "Encoded file is identical to the original" );
+			ctx->file_unchanged = true;
+			goto cleanup;
+		}
+		// encoded as it is written, rather than building the whole file in memory first
+		ctx->tree = main_dict;
+		goto cleanup;
+	}
+
+	// io_uring writes from a buffer
+	size_t encoded_n;
+	char *encoded = ben_encode_grn( main_dict, &encoded_n, out_err );
+	ERR_FW_CLEANUP();
+	if ( encoded_n == ctx->buffer_n && memcmp( encoded, ctx->buffer, encoded_n ) == 0 ) {
+		GRN_LOG_DEBUG( "Encoded file is identical to the original" );
+		free( encoded );
+		ctx->file_unchanged = true;
+		goto cleanup;
+	}
+	release_buffer_ctx( ctx );
+	ctx->buffer = encoded;
+	ctx->buffer_n = encoded_n;
+	GRN_LOG_DEBUG( "Newly encoded file size: %d", ( int )ctx->buffer_n );
+	goto cleanup;
+cleanup:
+	// main_dict is in the arena, which is reset before the next file
+	ben_set_allocator( NULL );
+	return;
+}
+
+#ifndef _WIN32
+/**
+ * Opens a new file next to the current one, to be renamed over it once written. Leaves ctx->fd closed if that can't
+ * be done without the file ending up different from the original in anything but contents: symlinks and hard links
+ * would be replaced instead of written through, and only root can give the file someone else's owner.
+ */
+void open_tmp_ctx( struct grn_ctx *ctx, int *out_err ) {
+	*out_err = GRN_OK;
+	const char *path = file_path_ctx( ctx, ctx->files_c );
+
+	struct stat st;
+	ERR( lstat( path, &st ), GRN_ERR_FS_OPEN );
+	if ( !S_ISREG( st.st_mode ) || st.st_nlink != 1 ) {
+		return;
+	}
+	const char suffix[] = ".greeny-XXXXXX";
+	size_t path_n = strlen( path );
+	ctx->tmp_path = malloc( path_n + sizeof( suffix ) );
+	ERR( ctx->tmp_path == NULL, GRN_ERR_OOM );
+	memcpy( ctx->tmp_path, path, path_n );
+	memcpy( ctx->tmp_path + path_n, suffix, sizeof( suffix ) );
+
+	int fd = mkstemp( ctx->tmp_path );
+	if ( fd < 0 ) {
+		// eg the directory isn't writable, even though the file is
+		free( ctx->tmp_path );
+		ctx->tmp_path = NULL;
+		return;
+	}
+	ctx->fd = fd;
+	if ( fchmod( fd, st.st_mode & 07777 ) || fchown( fd, st.st_uid, st.st_gid ) ) {
+		close( fd );
+		ctx->fd = -1;
+		discard_tmp_ctx( ctx );
+	}
+}
+#endif
+
+/**
+ * Opens the file for writing: a replacement for it where possible, else the file itself, truncated.
+ */
+void freopen_ctx( struct grn_ctx *ctx, int *out_err ) {
+	*out_err = GRN_OK;
+	if ( ctx->fd >= 0 ) {
+		close( ctx->fd );
+		ctx->fd = -1;
+	}
+
+#ifndef _WIN32
+	// encoding can still fail part way through, and so can writing, and the tree may point into a mapping of the file,
+	// so it goes to a new file that only takes the original's place once it's complete
+	open_tmp_ctx( ctx, out_err );
+	ERR_FW();
+	if ( ctx->fd >= 0 ) {
+		return;
+	}
+#endif
+	if ( ctx->tree != NULL ) {
+		// so it's written in place after all, from memory, and nothing is truncated unless it's ready
+		size_t encoded_n;
+		char *encoded = ben_encode_grn( ctx->tree, &encoded_n, out_err );
+		ERR_FW();
+		if ( map_truncated_ctx( ctx ) ) {
+			free( encoded );
+			ERR( GRN_ERR_FS_READ );
+		}
+		ctx->tree = NULL;
+		release_buffer_ctx( ctx );
+		ctx->buffer = encoded;
+		ctx->buffer_n = encoded_n;
+	}
+
+	// it will get closed by the caller with grn_ctx_free
+	ctx->fd = open( file_path_ctx( ctx, ctx->files_c ), O_WRONLY | O_CREAT | O_TRUNC | O_BINARY, 0666 );
+	ERR( ctx->fd < 0, GRN_ERR_FS_OPEN );
+}
+
+// BEGIN feed
+
+// how many pushed files may be waiting to be started on before grn_ctx_push_file waits as well
+#ifndef GRN_FEED_QUEUE_N
+#define GRN_FEED_QUEUE_N 4096
+#endif
+
+// what claim_file_ctx returns instead of a file index
+#define CLAIM_DONE -1 // there won't be any more
+#define CLAIM_LATER -2 // there are none yet, but more are being pushed
+
+struct grn_feed {
+	pthread_mutex_t lock;
+	pthread_cond_t pushed; // a file was pushed, or no more are coming
+	pthread_cond_t claimed; // a file was started on, so there is room for another
+	// everything below is protected by lock, as are the owner's files, files_n and files_claimed
+	int files_alloc;
+	// lists that the owner's files replaced, which workers may still be reading paths from
+	struct vector *old_files;
+	bool closed;
+	bool cancelled;
+};
+
+void grn_ctx_open_files( struct grn_ctx *ctx, int *out_err ) {
+	*out_err = GRN_OK;
+	assert( ctx->owner == NULL && ctx->parallel == NULL && ctx->feed == NULL );
+	assert( ctx->files_c == -1 );
+
+	struct grn_feed *feed = calloc( 1, sizeof( struct grn_feed ) );
+	ERR( feed == NULL, GRN_ERR_OOM );
+	feed->old_files = vector_alloc( sizeof( char ** ), out_err );
+	if ( *out_err ) {
+		free( feed );
+		return;
+	}
+	pthread_mutex_init( &feed->lock, NULL );
+	pthread_cond_init( &feed->pushed, NULL );
+	pthread_cond_init( &feed->claimed, NULL );
+	feed->files_alloc = ctx->files_n;
+	ctx->feed = feed;
+}
+
+// doubles the room for files. The old list can't be freed yet, since workers may be reading from it.
+void feed_grow_ctx( struct grn_ctx *ctx, int *out_err ) {
+	*out_err = GRN_OK;
+	struct grn_feed *feed = ctx->feed;
+
+	int files_alloc = feed->files_alloc > 0 ? feed->files_alloc * 2 : 64;
+	char **files = malloc( files_alloc * sizeof( char * ) );
+	ERR( files == NULL, GRN_ERR_OOM );
+	if ( ctx->files != NULL ) {
+		vector_push( feed->old_files, &ctx->files, out_err );
+		if ( *out_err ) {
+			free( files );
+			return;
+		}
+		memcpy( files, ctx->files, ( ctx->files_n - ctx->files_base ) * sizeof( char * ) );
+	}
+	__atomic_store_n( &ctx->files, files, __ATOMIC_RELEASE );
+	feed->files_alloc = files_alloc;
+}
+
+void grn_ctx_push_file( struct grn_ctx *ctx, char *path, int *out_err ) {
+	*out_err = GRN_OK;
+	struct grn_feed *feed = ctx->feed;
+	assert( feed != NULL );
+
+	pthread_mutex_lock( &feed->lock );
+	assert( !feed->closed || feed->cancelled );
+	while ( ctx->files_n - ctx->files_claimed >= GRN_FEED_QUEUE_N && !feed->cancelled ) {
+		pthread_cond_wait( &feed->claimed, &feed->lock );
+	}
+	if ( feed->cancelled ) {
+		*out_err = GRN_ERR_USER_CANCELLED;
+		goto cleanup;
+	}
+	if ( ctx->files_n - ctx->files_base == feed->files_alloc ) {
+		feed_grow_ctx( ctx, out_err );
+		ERR_FW_CLEANUP();
+	}
+	ctx->files[ctx->files_n - ctx->files_base] = path;
+	path = NULL;
+	// so that anyone reading files_n without the lock also sees the path
+	__atomic_store_n( &ctx->files_n, ctx->files_n + 1, __ATOMIC_RELEASE );
+	pthread_cond_signal( &feed->pushed );
+	goto cleanup;
+cleanup:
+	pthread_mutex_unlock( &feed->lock );
+	grn_free( path );
+}
+
+void grn_ctx_close_files( struct grn_ctx *ctx ) {
+	struct grn_feed *feed = ctx->feed;
+	assert( feed != NULL );
+
+	pthread_mutex_lock( &feed->lock );
+	feed->closed = true;
+	pthread_cond_broadcast( &feed->pushed );
+	pthread_mutex_unlock( &feed->lock );
+}
+
+void grn_ctx_cancel_files( struct grn_ctx *ctx ) {
+	struct grn_feed *feed = ctx->feed;
+	assert( feed != NULL );
+
+	pthread_mutex_lock( &feed->lock );
+	feed->closed = true;
+	feed->cancelled = true;
+	pthread_cond_broadcast( &feed->pushed );
+	pthread_cond_broadcast( &feed->claimed );
+	pthread_mutex_unlock( &feed->lock );
+}
+
+bool grn_ctx_get_files_open( struct grn_ctx *ctx ) {
+	struct grn_feed *feed = ctx->feed;
+	if ( feed == NULL ) {
+		return false;
+	}
+	pthread_mutex_lock( &feed->lock );
+	bool open = !feed->closed;
+	pthread_mutex_unlock( &feed->lock );
+	return open;
+}
+
+// claim_file_ctx for a context with a feed
+int feed_claim_ctx( struct grn_ctx *ctx, bool wait ) {
+	struct grn_feed *feed = ctx->feed;
+
+	pthread_mutex_lock( &feed->lock );
+	while ( wait && ctx->files_claimed == ctx->files_n && !feed->closed ) {
+		pthread_cond_wait( &feed->pushed, &feed->lock );
+	}
+	int file_i = feed->closed ? CLAIM_DONE : CLAIM_LATER;
+	// a cancelled feed isn't worth finishing
+	if ( ctx->files_claimed < ctx->files_n && !feed->cancelled ) {
+		file_i = ctx->files_claimed++;
+		pthread_cond_signal( &feed->claimed );
+	}
+	pthread_mutex_unlock( &feed->lock );
+	return file_i;
+}
+
+/**
+ * Once every file pushed so far was reported, and grn_one_* was called again so the last path isn't needed either, the
+ * paths are freed, keeping the list for the next ones. That way a context that is fed for as long as it runs, like when
+ * watching, doesn't keep growing. Only called on the owner, as it starts on the next file; when running in parallel,
+ * with the parallel lock held, so that the results can go too. Returns whether it recycled.
+ */
+bool feed_recycle_ctx( struct grn_ctx *ctx ) {
+	struct grn_feed *feed = ctx->feed;
+	assert( ctx->owner == NULL );
+	if ( feed == NULL ) {
+		return false;
+	}
+
+	pthread_mutex_lock( &feed->lock );
+	// a reported file was claimed and finished, so no worker or read ahead still has one of these, and none can claim
+	// another until the lock is released
+	bool recycle = ctx->files_c + 1 == ctx->files_n && ctx->files_n > ctx->files_base;
+	if ( recycle ) {
+		for ( int i = 0; i < ctx->files_n - ctx->files_base; i++ ) {
+			free( ctx->files[i] );
+		}
+		for ( size_t i = 0; i < vector_length( feed->old_files ); i++ ) {
+			free( * ( char *** ) vector_get( feed->old_files, i ) );
+		}
+		vector_clear( feed->old_files );
+		ctx->files_base = ctx->files_n;
+	}
+	pthread_mutex_unlock( &feed->lock );
+	return recycle;
+}
+
+void free_feed_ctx( struct grn_ctx *ctx ) {
+	struct grn_feed *feed = ctx->feed;
+	if ( feed == NULL ) {
+		return;
+	}
+	for ( size_t i = 0; i < vector_length( feed->old_files ); i++ ) {
+		free( * ( char *** ) vector_get( feed->old_files, i ) );
+	}
+	vector_free( feed->old_files );
+	pthread_cond_destroy( &feed->claimed );
+	pthread_cond_destroy( &feed->pushed );
+	pthread_mutex_destroy( &feed->lock );
+	free( feed );
+	ctx->feed = NULL;
+}
+
+void push_found( void *ctx, char *path, int *out_err ) {
+	grn_ctx_push_file( ctx, path, out_err );
+}
+
+void grn_cat_torrent_files_ctx( struct grn_ctx *ctx, const char *path, const char *extension, int *out_err ) {
+	grn_walk_torrent_files_each( path, extension, 0, ctx->seen, push_found, ctx, out_err );
+}
+
+// END feed
+
+// BEGIN written files
+
+// what each file looked like right after the context wrote it, by dev and inode
+struct grn_written {
+	pthread_mutex_t lock;
+	// open addressing with backward shift deletion. No inode is 0, so that marks an empty slot.
+	struct grn_index_entry *slots;
+	size_t slots_n; // always a power of 2
+	size_t used_n;
+};
+
+void grn_ctx_track_written( struct grn_ctx *ctx, int *out_err ) {
+	*out_err = GRN_OK;
+	assert( ctx->owner == NULL && ctx->parallel == NULL && ctx->written == NULL );
+
+	struct grn_written *written = calloc( 1, sizeof( struct grn_written ) );
+	ERR( written == NULL, GRN_ERR_OOM );
+	pthread_mutex_init( &written->lock, NULL );
+	ctx->written = written;
+}
+
+void free_written_ctx( struct grn_ctx *ctx ) {
+	struct grn_written *written = ctx->written;
+	if ( written == NULL || ctx->owner != NULL ) {
+		return;
+	}
+	pthread_mutex_destroy( &written->lock );
+	grn_free( written->slots );
+	free( written );
+	ctx->written = NULL;
+}
+
+size_t written_home( const struct grn_written *written, const struct grn_index_entry *entry ) {
+	// dev and ino come first
+	return grn_hash_bytes( entry, 2 * sizeof( uint64_t ), 0 ) & ( written->slots_n - 1 );
+}
+
+// the slot with entry's dev and ino, or the empty one where it would go
+size_t written_slot( const struct grn_written *written, const struct grn_index_entry *entry ) {
+	size_t i = written_home( written, entry );
+	while ( written->slots[i].ino != 0 && ( written->slots[i].ino != entry->ino || written->slots[i].dev != entry->dev ) ) {
+		i = ( i + 1 ) & ( written->slots_n - 1 );
+	}
+	return i;
+}
+
+bool written_grow( struct grn_written *written ) {
+	struct grn_written grown = {
+		.slots_n = written->slots_n ? written->slots_n * 2 : 64,
+		.used_n = written->used_n,
+	};
+	grown.slots = calloc( grown.slots_n, sizeof( struct grn_index_entry ) );
+	if ( grown.slots == NULL ) {
+		return false;
+	}
+	for ( size_t i = 0; i < written->slots_n; i++ ) {
+		if ( written->slots[i].ino != 0 ) {
+			grown.slots[written_slot( &grown, written->slots + i )] = written->slots[i];
+		}
+	}
+	grn_free( written->slots );
+	written->slots = grown.slots;
+	written->slots_n = grown.slots_n;
+	return true;
+}
+
+// empties slot i, moving up entries that would no longer be found past the gap
+void written_remove( struct grn_written *written, size_t i ) {
+	size_t mask = written->slots_n - 1;
+	for ( size_t j = ( i + 1 ) & mask; written->slots[j].ino != 0; j = ( j + 1 ) & mask ) {
+		// the entry can fill the gap unless its home is between the gap and where it is now
+		size_t home = written_home( written, written->slots + j );
+		if ( ( ( j - home ) & mask ) >= ( ( j - i ) & mask ) ) {
+			written->slots[i] = written->slots[j];
+			i = j;
+		}
+	}
+	memset( written->slots + i, 0, sizeof( struct grn_index_entry ) );
+	written->used_n--;
+}
+
+// whether a and b are the same file with the same contents. Renaming a replacement into place moves its ctime, so
+// that isn't compared.
+bool written_same( const struct grn_index_entry *a, const struct grn_index_entry *b ) {
+	return a->dev == b->dev &&
+	       a->ino == b->ino &&
+	       a->size == b->size &&
+	       a->mtime_s == b->mtime_s &&
+	       a->mtime_ns == b->mtime_ns;
+}
+
+// remember the file open as fd, now that it's completely written. A file that isn't remembered is only taken for
+// someone else's change, so nothing here is worth failing over.
+void written_record_ctx( struct grn_ctx *ctx, int fd ) {
+	struct grn_written *written = root_ctx( ctx )->written;
+	if ( written == NULL ) {
+		return;
+	}
+	struct stat st;
+	if ( fstat( fd, &st ) ) {
+		return;
+	}
+	struct grn_index_entry entry;
+	grn_index_entry_stat( &entry, &st );
+
+	pthread_mutex_lock( &written->lock );
+	if ( ( written->used_n + 1 ) * 2 <= written->slots_n || written_grow( written ) ) {
+		size_t i = written_slot( written, &entry );
+		written->used_n += written->slots[i].ino == 0;
+		written->slots[i] = entry;
+	}
+	pthread_mutex_unlock( &written->lock );
+}
+
+bool grn_ctx_take_written( struct grn_ctx *ctx, const char *path ) {
+	struct grn_written *written = ctx->written;
+	if ( written == NULL ) {
+		return false;
+	}
+	struct stat st;
+	if ( stat( path, &st ) ) {
+		return false;
+	}
+	struct grn_index_entry entry;
+	grn_index_entry_stat( &entry, &st );
+
+	bool ours = false;
+	pthread_mutex_lock( &written->lock );
+	if ( written->slots_n > 0 ) {
+		size_t i = written_slot( written, &entry );
+		if ( written->slots[i].ino != 0 ) {
+			ours = written_same( written->slots + i, &entry );
+			written_remove( written, i );
+		}
+	}
+	pthread_mutex_unlock( &written->lock );
+	return ours;
+}
+
+// END written files
+
+// BEGIN parallel execution
+
+struct grn_file_result {
+	int file_i;
+	int error;
+	bool unchanged;
+};
+
+struct grn_parallel {
+	pthread_t *threads;
+	struct grn_ctx **workers;
+	int workers_n;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	// everything below is protected by lock, except for stop
+	int workers_running;
+	// files in the order workers finished them. The owner reads them back one per grn_one_file.
+	struct grn_file_result *results;
+	int results_n;
+	int results_base; // index of results[0], once feed_recycle_ctx dropped the ones that were all reported
+	int results_alloc; // only grows when files are pushed while workers run
+	int c_file_i; // results[files_c].file_i, for the owner to read without the lock
+	int fatal_err; // first non-file error any worker ran into
+	bool stop; // tells workers not to claim more files. Only touched atomically.
+};
+
+// counters live on the owner so that they are correct no matter which worker processed the file
+struct grn_ctx *root_ctx( struct grn_ctx *ctx ) {
+	return ctx->owner != NULL ? ctx->owner : ctx;
+}
+
+void count_error_ctx( struct grn_ctx *ctx ) {
+	__atomic_add_fetch( &root_ctx( ctx )->errs_n, 1, __ATOMIC_RELAXED );
+}
+
+// called by a worker once it is done with ctx->files_c, successfully or not
+void publish_result_ctx( struct grn_ctx *ctx ) {
+	struct grn_parallel *parallel = ctx->owner->parallel;
+
+	pthread_mutex_lock( &parallel->lock );
+	if ( parallel->results_n - parallel->results_base == parallel->results_alloc ) {
+		int results_alloc = parallel->results_alloc * 2;
+		struct grn_file_result *results = realloc( parallel->results, results_alloc * sizeof( struct grn_file_result ) );
+		if ( results == NULL ) {
+			// a result that can't be reported is as good as a lost file, so everything stops
+			if ( !parallel->fatal_err ) {
+				parallel->fatal_err = GRN_ERR_OOM;
+			}
+			__atomic_store_n( &parallel->stop, true, __ATOMIC_RELAXED );
+			pthread_cond_signal( &parallel->cond );
+			pthread_mutex_unlock( &parallel->lock );
+			return;
+		}
+		parallel->results = results;
+		parallel->results_alloc = results_alloc;
+	}
+	parallel->results[parallel->results_n++ - parallel->results_base] = ( struct grn_file_result ) {
+		.file_i = ctx->files_c,
+		.error = ctx->file_error,
+		.unchanged = ctx->file_unchanged,
+	};
+	pthread_cond_signal( &parallel->cond );
+	pthread_mutex_unlock( &parallel->lock );
+}
+
+int feed_claim_ctx( struct grn_ctx *ctx, bool wait );
+
+// index of the next file to process, or CLAIM_DONE if there is nothing left. With files still being pushed, waits for
+// the next one, or returns CLAIM_LATER unless wait.
+int claim_file_ctx( struct grn_ctx *ctx, bool wait ) {
+	if ( ctx->owner != NULL && __atomic_load_n( &ctx->owner->parallel->stop, __ATOMIC_RELAXED ) ) {
+		return CLAIM_DONE;
+	}
+	if ( root_ctx( ctx )->feed != NULL ) {
+		return feed_claim_ctx( root_ctx( ctx ), wait );
+	}
+	if ( ctx->owner == NULL ) {
+		return ctx->files_claimed < ctx->files_n ? ctx->files_claimed++ : CLAIM_DONE;
+	}
+	int file_i = __atomic_fetch_add( &ctx->owner->files_claimed, 1, __ATOMIC_RELAXED );
+	return file_i < ctx->files_n ? file_i : CLAIM_DONE;
+}
+
+void *worker_main( void *arg ) {
+	struct grn_ctx *worker = arg;
+	struct grn_parallel *parallel = worker->owner->parallel;
+	int in_err = GRN_OK;
+
+	while ( !grn_one_step( worker, &in_err ) && !in_err );
+
+	pthread_mutex_lock( &parallel->lock );
+	if ( in_err && !parallel->fatal_err ) {
+		parallel->fatal_err = in_err;
+		__atomic_store_n( &parallel->stop, true, __ATOMIC_RELAXED );
+	}
+	parallel->workers_running--;
+	pthread_cond_signal( &parallel->cond );
+	pthread_mutex_unlock( &parallel->lock );
+	return NULL;
+}
+
+void grn_ctx_run_parallel( struct grn_ctx *ctx, int threads_n, int *out_err ) {
+	*out_err = GRN_OK;
+	assert( ctx->owner == NULL );
+	assert( ctx->parallel == NULL );
+	assert( ctx->state == GRN_CTX_NEXT && ctx->files_c == -1 );
+
+	// also spread over these when a file is too big for one thread; see transform_split_ctx
+	ctx->split_threads_n = threads_n;
+	// there's no telling how many files are still to come
+	if ( threads_n > ctx->files_n && ctx->feed == NULL ) {
+		threads_n = ctx->files_n;
+	}
+	if ( threads_n < 2 ) {
+		return;
+	}
+
+	struct grn_parallel *parallel = calloc( 1, sizeof( struct grn_parallel ) );
+	ERR( parallel == NULL, GRN_ERR_OOM );
+	pthread_mutex_init( &parallel->lock, NULL );
+	pthread_cond_init( &parallel->cond, NULL );
+	// from here on, grn_ctx_free takes care of everything
+	ctx->parallel = parallel;
+
+	parallel->results_alloc = ctx->files_n > 0 ? ctx->files_n : 64;
+	parallel->results = malloc( parallel->results_alloc * sizeof( struct grn_file_result ) );
+	ERR( parallel->results == NULL, GRN_ERR_OOM );
+	parallel->threads = malloc( threads_n * sizeof( pthread_t ) );
+	ERR( parallel->threads == NULL, GRN_ERR_OOM );
+	parallel->workers = malloc( threads_n * sizeof( struct grn_ctx * ) );
+	ERR( parallel->workers == NULL, GRN_ERR_OOM );
+
+	for ( int i = 0; i < threads_n; i++ ) {
+		struct grn_ctx *worker = grn_ctx_alloc( out_err );
+		ERR_FW();
+		worker->owner = ctx;
+		worker->files = ctx->files;
+		worker->files_n = ctx->files_n;
+		worker->transforms = ctx->transforms;
+		worker->transforms_n = ctx->transforms_n;
+		worker->plan = ctx->plan;
+		// the threads left over once each file has a worker
+		worker->split_threads_n = ctx->split_threads_n / threads_n;
+
+		pthread_mutex_lock( &parallel->lock );
+		parallel->workers_running++;
+		pthread_mutex_unlock( &parallel->lock );
+		if ( pthread_create( &parallel->threads[i], NULL, worker_main, worker ) ) {
+			pthread_mutex_lock( &parallel->lock );
+			parallel->workers_running--;
+			pthread_mutex_unlock( &parallel->lock );
+			grn_ctx_free( worker, out_err );
+			ERR( GRN_ERR_THREAD );
+		}
+		parallel->workers[i] = worker;
+		parallel->workers_n++;
+	}
+}
+
+// what grn_one_step does on the owner once workers are running: wait for them to finish another file
+void parallel_step_ctx( struct grn_ctx *ctx, int *out_err ) {
+	*out_err = GRN_OK;
+	struct grn_parallel *parallel = ctx->parallel;
+
+	pthread_mutex_lock( &parallel->lock );
+	if ( feed_recycle_ctx( ctx ) ) {
+		// every result was read back too
+		parallel->results_base = parallel->results_n;
+	}
+	while (
+	    ctx->files_c + 1 == parallel->results_n &&
+	    ( parallel->results_n < grn_ctx_get_files_n( ctx ) || grn_ctx_get_files_open( ctx ) ) &&
+	    parallel->workers_running > 0 &&
+	    !parallel->fatal_err
+	) {
+		pthread_cond_wait( &parallel->cond, &parallel->lock );
+	}
+	int fatal_err = parallel->fatal_err;
+	bool have_result = ctx->files_c + 1 < parallel->results_n;
+	if ( have_result ) {
+		ctx->files_c++;
+		struct grn_file_result *result = parallel->results + ctx->files_c - parallel->results_base;
+		parallel->c_file_i = result->file_i;
+		ctx->file_error = result->error;
+		ctx->file_unchanged = result->unchanged;
+	}
+	pthread_mutex_unlock( &parallel->lock );
+
+	ERR( fatal_err, fatal_err );
+	ctx->state = have_result ? GRN_CTX_NEXT : GRN_CTX_DONE;
+}
+
+// stops and joins the workers, abandoning whatever files they had not started yet
+void free_parallel_ctx( struct grn_ctx *ctx ) {
+	int in_err;
+	struct grn_parallel *parallel = ctx->parallel;
+	if ( parallel == NULL ) {
+		return;
+	}
+
+	__atomic_store_n( &parallel->stop, true, __ATOMIC_RELAXED );
+	for ( int i = 0; i < parallel->workers_n; i++ ) {
+		pthread_join( parallel->threads[i], NULL );
+		// the worker already finished or gave up on all of its files, so a close error is meaningless here
+		grn_ctx_free( parallel->workers[i], &in_err );
+	}
+	pthread_cond_destroy( &parallel->cond );
+	pthread_mutex_destroy( &parallel->lock );
+	grn_free( parallel->threads );
+	grn_free( parallel->workers );
+	grn_free( parallel->results );
+	free( parallel );
+	ctx->parallel = NULL;
+}
+
+// END parallel execution
+
+// BEGIN io_uring
+
+#ifdef GRN_USE_IO_URING
+
+#include <linux/stat.h>
+
+#include "uring.h"
+
+#ifndef AT_FDCWD
+#define AT_FDCWD -100
+#endif
+
+// how many files to open and read ahead of the one being transformed
+#ifndef GRN_IO_URING_WINDOW
+#define GRN_IO_URING_WINDOW 16
+#endif
+
+// what a request was for. Stored in the low bits of its user_data, above which is the slot.
+enum grn_io_op {
+	GRN_IO_OPEN,
+	GRN_IO_STATX,
+	GRN_IO_READ,
+	GRN_IO_WRITE,
+	GRN_IO_CLOSE,
+	GRN_IO_CLOSE_QUIET, // files that were only read. Nobody waits for these, and errors don't matter.
+};
+#define GRN_IO_OP_BITS 4
+// the slot number of the file being written
+#define GRN_IO_WRITE_SLOT GRN_IO_URING_WINDOW
+
+// a file being read ahead or written back
+struct grn_io_file {
+	int file_i; // -1 if the slot is free
+	int fd;
+	int ops_n; // requests in flight
+	int error;
+	char *buffer;
+	size_t buffer_n;
+	size_t done_n; // bytes read or written so far
+	struct statx stx;
+	bool stated;
+	// read into, if it's big enough, instead of a fresh buffer. Taken by the context as its scratch buffer once the
+	// file is read, in exchange for the one it had.
+	char *spare;
+	size_t spare_n;
+};
+
+struct grn_io {
+	struct grn_uring ring;
+	// files being read, queued in the order they were claimed, which is the order they are processed in
+	struct grn_io_file reads[GRN_IO_URING_WINDOW];
+	int reads_head;
+	int reads_n;
+	bool claimed_all;
+	struct grn_io_file write; // borrows ctx->buffer
+	int quiet_n; // GRN_IO_CLOSE_QUIET in flight
+	bool draining; // being freed, so don't start anything new
+};
+
+struct grn_io_file *io_file( struct grn_io *io, int slot_i ) {
+	return slot_i == GRN_IO_WRITE_SLOT ? &io->write : &io->reads[slot_i];
+}
+
+void init_io_ctx( struct grn_ctx *ctx, int *out_err ) {
+	*out_err = GRN_OK;
+
+	struct grn_io *io = calloc( 1, sizeof( struct grn_io ) );
+	ERR( io == NULL, GRN_ERR_OOM );
+	// each file has at most two requests in flight, plus closes that nobody waits for
+	grn_uring_init( &io->ring, GRN_IO_URING_WINDOW * 4, out_err );
+	if ( *out_err ) {
+		// old kernels, seccomp and the like. The normal blocking calls work there.
+		GRN_LOG_WARNING( "io_uring unavailable, using blocking IO" );
+		free( io );
+		*out_err = GRN_OK;
+		return;
+	}
+	for ( int i = 0; i < GRN_IO_URING_WINDOW; i++ ) {
+		io->reads[i].file_i = -1;
+		io->reads[i].fd = -1;
+	}
+	io->write.file_i = -1;
+	io->write.fd = -1;
+	ctx->io = io;
+}
+
+struct io_uring_sqe *io_sqe_ctx( struct grn_ctx *ctx, int slot_i, enum grn_io_op op, int *out_err ) {
+	*out_err = GRN_OK;
+	struct grn_io *io = ctx->io;
+
+	struct io_uring_sqe *sqe = grn_uring_get_sqe( &io->ring );
+	if ( sqe == NULL ) {
+		// the queue is full, so hand it to the kernel to make room
+		grn_uring_submit( &io->ring, 0, out_err );
+		ERR_FW_NULL();
+		sqe = grn_uring_get_sqe( &io->ring );
+		ERR_NULL( sqe == NULL, GRN_ERR_IO_URING );
+	}
+	sqe->user_data = ( ( uint64_t )slot_i << GRN_IO_OP_BITS ) | op;
+	if ( op == GRN_IO_CLOSE_QUIET ) {
+		io->quiet_n++;
+	} else {
+		io_file( io, slot_i )->ops_n++;
+	}
+	return sqe;
+}
+
+void io_close_ctx( struct grn_ctx *ctx, int slot_i, enum grn_io_op op, int *out_err ) {
+	*out_err = GRN_OK;
+	struct grn_io_file *file = io_file( ctx->io, slot_i );
+
+	struct io_uring_sqe *sqe = io_sqe_ctx( ctx, slot_i, op, out_err );
+	ERR_FW();
+	sqe->opcode = IORING_OP_CLOSE;
+	sqe->fd = file->fd;
+	if ( op == GRN_IO_CLOSE_QUIET ) {
+		file->fd = -1;
+	}
+}
+
+// ask for the next chunk of a file to be read or written
+void io_transfer_ctx( struct grn_ctx *ctx, int slot_i, enum grn_io_op op, int *out_err ) {
+	*out_err = GRN_OK;
+	struct grn_io_file *file = io_file( ctx->io, slot_i );
+
+	struct io_uring_sqe *sqe = io_sqe_ctx( ctx, slot_i, op, out_err );
+	ERR_FW();
+	size_t left_n = file->buffer_n - file->done_n;
+	sqe->opcode = op == GRN_IO_READ ? IORING_OP_READ : IORING_OP_WRITE;
+	sqe->fd = file->fd;
+	sqe->addr = ( uintptr_t )( file->buffer + file->done_n );
+	// the length is only 32 bits, so huge files take a few goes
+	sqe->len = left_n < ( 1u << 30 ) ? left_n : ( 1u << 30 );
+	sqe->off = file->done_n;
+}
+
+// a read-ahead file is ready once it has been read, or there was an error
+bool io_read_done( struct grn_io_file *file ) {
+	return file->ops_n == 0 && file->fd < 0 && ( file->error || file->buffer != NULL );
+}
+
+// start whatever comes next for a file, once its previous requests are done
+void io_advance_ctx( struct grn_ctx *ctx, int slot_i, int *out_err ) {
+	*out_err = GRN_OK;
+	struct grn_io *io = ctx->io;
+	struct grn_io_file *file = io_file( io, slot_i );
+
+	if ( file->ops_n > 0 || file->fd < 0 ) {
+		return;
+	}
+
+	if ( slot_i == GRN_IO_WRITE_SLOT ) {
+		if ( file->error || io->draining || file->done_n == file->buffer_n ) {
+			if ( !file->error && !io->draining ) {
+				written_record_ctx( ctx, file->fd );
+			}
+			io_close_ctx( ctx, slot_i, io->draining ? GRN_IO_CLOSE_QUIET : GRN_IO_CLOSE, out_err );
+			ERR_FW();
+			return;
+		}
+		io_transfer_ctx( ctx, slot_i, GRN_IO_WRITE, out_err );
+		ERR_FW();
+		return;
+	}
+
+	if ( file->error || io->draining ) {
+		io_close_ctx( ctx, slot_i, GRN_IO_CLOSE_QUIET, out_err );
+		ERR_FW();
+		return;
+	}
+	if ( file->buffer == NULL ) {
+		assert( file->stated );
+		file->buffer_n = file->stx.stx_size;
+		GRN_LOG_DEBUG( "File size: %d bytes", ( int )file->buffer_n );
+		// one extra byte, like the scratch buffer, so that it can be null terminated
+		if ( file->spare_n < file->buffer_n + 1 ) {
+			grn_free( file->spare );
+			file->spare_n = 0;
+			file->spare = malloc( file->buffer_n + 1 );
+			ERR( file->spare == NULL, GRN_ERR_OOM );
+			file->spare_n = file->buffer_n + 1;
+		}
+		file->buffer = file->spare;
+	}
+	if ( file->done_n < file->buffer_n ) {
+		io_transfer_ctx( ctx, slot_i, GRN_IO_READ, out_err );
+		ERR_FW();
+		return;
+	}
+	// all read, and the fd isn't needed for anything else
+	io_close_ctx( ctx, slot_i, GRN_IO_CLOSE_QUIET, out_err );
+	ERR_FW();
 }
 
-// transforms a buffer based on a single transform and does not filter
-void transform_buffer_single( struct bencode *ben, struct grn_transform transform, int *out_err ) {
+void io_complete_ctx( struct grn_ctx *ctx, struct io_uring_cqe *cqe, int *out_err ) {
 	*out_err = GRN_OK;
+	struct grn_io *io = ctx->io;
 
-	GRN_LOG_DEBUG( "Executing transform, %d", transform.operation );
-	switch ( transform.operation ) {
-		case GRN_TRANSFORM_DELETE:
+	enum grn_io_op op = cqe->user_data & ( ( 1 << GRN_IO_OP_BITS ) - 1 );
+	int slot_i = cqe->user_data >> GRN_IO_OP_BITS;
+	if ( op == GRN_IO_CLOSE_QUIET ) {
+		io->quiet_n--;
+		return;
+	}
+	struct grn_io_file *file = io_file( io, slot_i );
+	file->ops_n--;
+
+	int error = GRN_OK;
+	switch ( op ) {
+		case GRN_IO_OPEN:
 			;
-			// it returns a "standalone" pointer to the value, that must be freed. It modifies
-			// the main_dict in place
-			if ( ben->type != BENCODE_DICT ) {
+			if ( cqe->res < 0 ) {
+				error = GRN_ERR_FS_OPEN;
 				break;
 			}
-			struct bencode *popped_val = ben_dict_pop_by_str( ben, transform.payload.delete_.key );
-			if ( popped_val != NULL ) {
-				ben_free( popped_val );
+			file->fd = cqe->res;
+			break;
+		case GRN_IO_STATX:
+			;
+			if ( cqe->res < 0 ) {
+				error = GRN_ERR_FS_READ;
+				break;
 			}
+			file->stated = true;
 			break;
-		case GRN_TRANSFORM_SET_STRING:
+		case GRN_IO_READ:
 			;
-			if ( ben->type != BENCODE_DICT ) {
+			// running into the end early means the file shrank under us
+			if ( cqe->res <= 0 ) {
+				error = GRN_ERR_FS_READ;
 				break;
 			}
-			struct grn_op_set_string setstr_payload = transform.payload.set_string;
-			ERR( ben_dict_set_str_by_str( ben, setstr_payload.key, setstr_payload.val ), GRN_ERR_OOM );
+			file->done_n += cqe->res;
 			break;
-		case GRN_TRANSFORM_SUBSTITUTE:
+		case GRN_IO_WRITE:
 			;
-			mutate_string_subst( ben, transform.payload.substitute, out_err );
-			ERR_FW();
+			if ( cqe->res <= 0 ) {
+				error = GRN_ERR_FS_WRITE;
+				break;
+			}
+			file->done_n += cqe->res;
 			break;
-		case GRN_TRANSFORM_SUBSTITUTE_REGEX:
+		case GRN_IO_CLOSE:
 			;
-			mutate_string_subst_regex( ben, transform.payload.substitute_regex, out_err );
-			ERR_FW();
+			file->fd = -1;
+			if ( cqe->res < 0 ) {
+				error = GRN_ERR_FS_CLOSE;
+			}
 			break;
 		default:
 			;
 			assert( false );
 			break;
 	}
+	// the first error is what gets reported
+	if ( !file->error ) {
+		file->error = error;
+	}
+	io_advance_ctx( ctx, slot_i, out_err );
+	ERR_FW();
 }
 
-void transform_buffer( struct grn_ctx *ctx, int *out_err ) {
+// submit everything queued up and handle whatever has completed. If wait, block for at least one completion.
+void io_pump_ctx( struct grn_ctx *ctx, bool wait, int *out_err ) {
 	*out_err = GRN_OK;
-	assert( ctx->state == GRN_CTX_TRANSFORM );
+	struct grn_io *io = ctx->io;
 
-	struct bencode *main_dict = NULL;
+	grn_uring_submit( &io->ring, wait ? 1 : 0, out_err );
+	ERR_FW();
+	struct io_uring_cqe cqe;
+	while ( grn_uring_pop_cqe( &io->ring, &cqe ) ) {
+		io_complete_ctx( ctx, &cqe, out_err );
+		ERR_FW();
+	}
+	// completions usually lead to more requests, which shouldn't sit around until the next wait
+	if ( io->ring.sq_pending > 0 ) {
+		grn_uring_submit( &io->ring, 0, out_err );
+		ERR_FW();
+	}
+}
 
-	// BEGIN SHITTY DELUGE FUCKING SHIT THAT NEEDS TO BE LESIONED
-	if ( str_ends_with( grn_ctx_get_c_path( ctx ), "torrents.state" ) ) {
-		GRN_LOG_DEBUG( "Doing deluge .state transform%s", "" );
-		assert( ctx->transforms[0].operation = GRN_TRANSFORM_SUBSTITUTE_REGEX );
+// claim files until the read-ahead window is full, and start opening them. Only waits for files that are still being
+// pushed if wait, and there's nothing else to get on with.
+void io_claim_ctx( struct grn_ctx *ctx, bool wait, int *out_err ) {
+	*out_err = GRN_OK;
+	struct grn_io *io = ctx->io;
 
-		// we need to add the null byte so the file is a proper string
-		char *buffer_null = realloc( ctx->buffer, ctx->buffer_n + 1 );
-		// when realloc fails, the original pointer is still valid for free'ing
-		ERR( buffer_null == NULL, GRN_ERR_OOM );
-		ctx->buffer = NULL;
-		// it's unintuitive, but because it's zero indexed this is still actually one beyond the previous
-		// length
-		buffer_null[ctx->buffer_n] = '\0';
+	while ( io->reads_n < GRN_IO_URING_WINDOW && !io->claimed_all ) {
+		int file_i = claim_file_ctx( ctx, wait && io->reads_n == 0 );
+		if ( file_i == CLAIM_LATER ) {
+			break;
+		}
+		if ( file_i == CLAIM_DONE ) {
+			io->claimed_all = true;
+			break;
+		}
+		int slot_i = ( io->reads_head + io->reads_n ) % GRN_IO_URING_WINDOW;
+		struct grn_io_file *file = &io->reads[slot_i];
+		*file = ( struct grn_io_file ) {
+			.file_i = file_i,
+			.fd = -1,
+			.spare = file->spare,
+			.spare_n = file->spare_n,
+		};
+		io->reads_n++;
+
+		// the size is looked up by path at the same time, so the read can start as soon as the file is open
+		struct io_uring_sqe *sqe = io_sqe_ctx( ctx, slot_i, GRN_IO_OPEN, out_err );
+		ERR_FW();
+		sqe->opcode = IORING_OP_OPENAT;
+		sqe->fd = AT_FDCWD;
+		sqe->addr = ( uintptr_t )file_path_ctx( ctx, file_i );
+		sqe->open_flags = O_RDONLY | O_BINARY;
+		sqe = io_sqe_ctx( ctx, slot_i, GRN_IO_STATX, out_err );
+		ERR_FW();
+		sqe->opcode = IORING_OP_STATX;
+		sqe->fd = AT_FDCWD;
+		sqe->addr = ( uintptr_t )file_path_ctx( ctx, file_i );
+		sqe->len = STATX_SIZE;
+		sqe->off = ( uintptr_t )&file->stx;
+	}
+	io_pump_ctx( ctx, false, out_err );
+	ERR_FW();
+}
+
+// pick the oldest read-ahead file as the next one, or false if there are none left
+bool io_next_file_ctx( struct grn_ctx *ctx, int *out_err ) {
+	*out_err = GRN_OK;
+	struct grn_io *io = ctx->io;
+
+	io_claim_ctx( ctx, true, out_err );
+	ERR_FW_NULL();
+	if ( io->reads_n == 0 ) {
+		return false;
+	}
+	ctx->files_c = io->reads[io->reads_head].file_i;
+	return true;
+}
+
+// wait for the current file to be read, then take its buffer
+void io_read_ctx( struct grn_ctx *ctx, int *out_err ) {
+	*out_err = GRN_OK;
+	assert( ctx->state == GRN_CTX_READ );
+	assert( ctx->buffer == NULL );
+	struct grn_io *io = ctx->io;
+	struct grn_io_file *file = &io->reads[io->reads_head];
+	assert( io->reads_n > 0 && file->file_i == ctx->files_c );
 
-		ctx->buffer = regsubst( buffer_null, &ctx->transforms[0].payload.substitute_regex.find, ctx->transforms[0].payload.substitute_regex.replace, true, out_err );
-		free( buffer_null );
+	while ( !io_read_done( file ) ) {
+		io_pump_ctx( ctx, true, out_err );
 		ERR_FW();
-		// intentionally not adding the null byte because there shouldn't be one.
-		ctx->buffer_n = strlen( ctx->buffer );
-		return;
 	}
-	// END SHITTY DELUGE FUCKING SHIT THAT NEEDS TO BE LESIONED
+	io->reads_head = ( io->reads_head + 1 ) % GRN_IO_URING_WINDOW;
+	io->reads_n--;
+	file->file_i = -1;
+	int error = file->error;
+	if ( !error ) {
+		char *scratch = ctx->scratch;
+		size_t scratch_n = ctx->scratch_n;
+		ctx->scratch = file->spare;
+		ctx->scratch_n = file->spare_n;
+		ctx->buffer = ctx->scratch;
+		ctx->buffer_n = file->buffer_n;
+		ctx->buffer_type = GRN_BUFFER_SCRATCH;
+		// a buffer for a file that's big enough to be mapped by fread_ctx isn't worth keeping for every slot
+		if ( scratch_n > GRN_MMAP_THRESHOLD ) {
+			grn_free( scratch );
+			scratch = NULL;
+			scratch_n = 0;
+		}
+		file->spare = scratch;
+		file->spare_n = scratch_n;
+	}
+	file->buffer = NULL;
 
-	struct vector *f_to_traverse = NULL, *f_traversing = NULL, *f_out;
+	// keep the window full while this one is transformed, but without holding it up
+	io_claim_ctx( ctx, false, out_err );
+	ERR_FW();
+	ERR( error );
+}
 
-	// TODO: this
-	f_to_traverse = vector_alloc( sizeof( struct bencode * ), out_err );
-	ERR_FW_CLEANUP();
-	f_traversing = vector_alloc( sizeof( struct bencode * ), out_err );
-	ERR_FW_CLEANUP();
+// start writing back the current file, to a replacement like freopen_ctx does, or else in place. io_write_ctx waits for
+// it to finish.
+void io_reopen_ctx( struct grn_ctx *ctx, int *out_err ) {
+	*out_err = GRN_OK;
+	struct grn_io_file *file = &ctx->io->write;
+	assert( file->file_i == -1 );
+
+	*file = ( struct grn_io_file ) {
+		.file_i = ctx->files_c,
+		.fd = -1,
+		.buffer = ctx->buffer,
+		.buffer_n = ctx->buffer_n,
+	};
+	// mkstemp and fchown have no io_uring equivalent, but the writes themselves still go through the ring
+	open_tmp_ctx( ctx, out_err );
+	ERR_FW();
+	if ( ctx->fd >= 0 ) {
+		file->fd = ctx->fd;
+		ctx->fd = -1;
+		io_advance_ctx( ctx, GRN_IO_WRITE_SLOT, out_err );
+		ERR_FW();
+		io_pump_ctx( ctx, false, out_err );
+		ERR_FW();
+		return;
+	}
+	struct io_uring_sqe *sqe = io_sqe_ctx( ctx, GRN_IO_WRITE_SLOT, GRN_IO_OPEN, out_err );
+	ERR_FW();
+	sqe->opcode = IORING_OP_OPENAT;
+	sqe->fd = AT_FDCWD;
+	sqe->addr = ( uintptr_t )file_path_ctx( ctx, ctx->files_c );
+	sqe->open_flags = O_WRONLY | O_CREAT | O_TRUNC | O_BINARY;
+	sqe->len = 0666;
+	io_pump_ctx( ctx, false, out_err );
+	ERR_FW();
+}
 
-	main_dict = ben_decode_grn( ctx->buffer, ctx->buffer_n, out_err );
-	ERR_FW_CLEANUP();
+void io_write_ctx( struct grn_ctx *ctx, int *out_err ) {
+	*out_err = GRN_OK;
+	struct grn_io_file *file = &ctx->io->write;
+	assert( file->file_i == ctx->files_c );
 
-	for ( int i = 0; i < ctx->transforms_n; i++ ) {
-		struct grn_transform transform = ctx->transforms[i];
-		assert( transform.key != NULL );
+	// reads for the next files keep going in the meantime
+	while ( file->ops_n > 0 || file->fd >= 0 ) {
+		io_pump_ctx( ctx, true, out_err );
+		ERR_FW();
+	}
+	file->file_i = -1;
+	file->buffer = NULL;
+	if ( file->error ) {
+		ERR( file->error );
+	}
+	replace_with_tmp_ctx( ctx, out_err );
+}
 
-		// first, filter down by the keys in the transform
-		vector_clear( f_to_traverse );
-		vector_clear( f_traversing );
-		vector_push( f_to_traverse, &main_dict, out_err );
-		ERR_FW_CLEANUP();
+int io_in_flight( struct grn_io *io ) {
+	int in_flight = io->write.ops_n + io->quiet_n;
+	for ( int i = 0; i < GRN_IO_URING_WINDOW; i++ ) {
+		in_flight += io->reads[i].ops_n;
+	}
+	return in_flight;
+}
 
-		char *filter_key;
-		int k = 0;
-		while ( ( filter_key = transform.key[k++] ) != NULL ) {
-			GRN_LOG_DEBUG( "Filtering by key: '%s' ", filter_key );
-			// essentially, we want to make f_to_traverse empty and start traversing the former to_traverse
-			struct vector *f_tmp = f_traversing;
-			f_traversing = f_to_traverse;
-			f_to_traverse = f_tmp;
-			vector_clear( f_to_traverse );
-
-			while ( vector_length( f_traversing ) > 0 ) {
-				struct bencode *traversing = * ( struct bencode ** ) vector_pop( f_traversing );
-
-				// wildcard
-				if ( strlen( filter_key ) == 0 ) {
-					GRN_LOG_DEBUG( "Performing wildcard filter%s", "" );
-					cat_descendants( f_to_traverse, traversing, out_err );
-					ERR_FW_CLEANUP();
-				} else {
-					GRN_LOG_DEBUG( "Non-wildcard filter%s", "" );
-					if ( traversing->type != BENCODE_DICT ) {
-						GRN_LOG_DEBUG( "Skipping because not a dictionary%s", "" );
-						continue;
-					}
-					struct bencode *maybe_val = ben_dict_get_by_str( traversing, filter_key );
-					if ( maybe_val != NULL ) {
-						vector_push( f_to_traverse, &maybe_val, out_err );
-						ERR_FW_CLEANUP();
-					}
-				}
-			}
-		}
-		f_out = f_to_traverse;
+void free_io_ctx( struct grn_ctx *ctx ) {
+	int in_err;
+	struct grn_io *io = ctx->io;
+	if ( io == NULL ) {
+		return;
+	}
 
-		while ( vector_length( f_out ) > 0 ) {
-			struct bencode *filtered = * ( struct bencode ** ) vector_pop( f_out );
-			transform_buffer_single( filtered, transform, out_err );
-			if ( *out_err ) {
-				goto cleanup;
-			}
+	// requests still in flight could write into the buffers, so let them finish first
+	io->draining = true;
+	while ( io_in_flight( io ) > 0 ) {
+		io_pump_ctx( ctx, true, &in_err );
+		if ( in_err ) {
+			// the ring is broken, and closing it is all that's left
+			break;
 		}
 	}
+	grn_uring_free( &io->ring );
+	for ( int i = 0; i < GRN_IO_URING_WINDOW; i++ ) {
+		// buffer, if set, is the spare
+		grn_free( io->reads[i].spare );
+		if ( io->reads[i].fd >= 0 ) {
+			close( io->reads[i].fd );
+		}
+	}
+	// the write buffer belongs to the ctx
+	if ( io->write.fd >= 0 ) {
+		close( io->write.fd );
+	}
+	free( io );
+	ctx->io = NULL;
+}
 
-	free( ctx->buffer );
-	ctx->buffer = ben_encode_grn( main_dict, &ctx->buffer_n, out_err );
-	ERR_FW_CLEANUP();
-	GRN_LOG_DEBUG( "Newly encoded file size: %d", ( int )ctx->buffer_n );
-	goto cleanup;
-cleanup:
-	if ( main_dict != NULL ) {
-		ben_free( main_dict );
+// more files were added after all of them had been claimed
+void resume_io_ctx( struct grn_ctx *ctx ) {
+	if ( ctx->io != NULL ) {
+		ctx->io->claimed_all = false;
 	}
-	vector_free( f_traversing );
-	vector_free( f_to_traverse );
-	return;
 }
 
-/**
- * Truncates the file and opens in writing mode.
- */
-void freopen_ctx( struct grn_ctx *ctx, int *out_err ) {
+#else
+
+// without io_uring, ctx->io is always NULL and none of these get past the first
+void init_io_ctx( struct grn_ctx *ctx, int *out_err ) {
 	*out_err = GRN_OK;
-	// it will get fclosed by the caller with grn_ctx_free
-	ctx->fh = freopen( ctx->files[ctx->files_c], "wb", ctx->fh );
-	ERR( ctx->fh == NULL, GRN_ERR_FS_OPEN );
 }
 
+bool io_next_file_ctx( struct grn_ctx *ctx, int *out_err ) {
+	assert( false );
+	return false;
+}
+
+void io_read_ctx( struct grn_ctx *ctx, int *out_err ) {
+	assert( false );
+}
+
+void io_reopen_ctx( struct grn_ctx *ctx, int *out_err ) {
+	assert( false );
+}
+
+void io_write_ctx( struct grn_ctx *ctx, int *out_err ) {
+	assert( false );
+}
+
+void free_io_ctx( struct grn_ctx *ctx ) {
+}
+
+void resume_io_ctx( struct grn_ctx *ctx ) {
+}
+
+#endif
+
+// END io_uring
+
+// BEGIN scan index
+
+uint64_t fingerprint_str( uint64_t hash, const char *str ) {
+	// a string can't contain a null byte, so this can't be mistaken for one
+	return str != NULL ? grn_hash_bytes( str, strlen( str ), hash ) : grn_hash_bytes( "", 1, hash );
+}
+
+// everything that decides what the transforms do to a file, in order
+uint64_t transforms_fingerprint( struct grn_transform *transforms, int transforms_n ) {
+	uint64_t hash = GRN_INDEX_VERSION;
+	for ( int i = 0; i < transforms_n; i++ ) {
+		struct grn_transform *transform = &transforms[i];
+		int operation = transform->operation;
+		hash = grn_hash_bytes( &operation, sizeof( operation ), hash );
+		for ( int j = 0; transform->key != NULL && transform->key[j] != NULL; j++ ) {
+			hash = fingerprint_str( hash, transform->key[j] );
+		}
+		hash = fingerprint_str( hash, NULL );
+		switch ( transform->operation ) {
+			case GRN_TRANSFORM_DELETE:
+				;
+				hash = fingerprint_str( hash, transform->payload.delete_.key );
+				break;
+			case GRN_TRANSFORM_SET_STRING:
+				;
+				hash = fingerprint_str( hash, transform->payload.set_string.key );
+				hash = fingerprint_str( hash, transform->payload.set_string.val );
+				break;
+			case GRN_TRANSFORM_SUBSTITUTE:
+				;
+				hash = fingerprint_str( hash, transform->payload.substitute.find );
+				hash = fingerprint_str( hash, transform->payload.substitute.replace );
+				break;
+			case GRN_TRANSFORM_SUBSTITUTE_REGEX:
+				;
+				hash = fingerprint_str( hash, transform->payload.substitute_regex.source );
+				hash = fingerprint_str( hash, transform->payload.substitute_regex.replace );
+				break;
+		}
+	}
+	return hash;
+}
+
+// whether the current file is still exactly as it was when the same transforms last left it alone
+bool index_skip_ctx( struct grn_ctx *ctx ) {
+	struct grn_ctx *root = root_ctx( ctx );
+	if ( root->index == NULL ) {
+		return false;
+	}
+	struct stat st;
+	// opening it will report whatever is wrong
+	if ( stat( file_path_ctx( ctx, ctx->files_c ), &st ) ) {
+		return false;
+	}
+	struct grn_index_entry now, then;
+	grn_index_entry_stat( &now, &st );
+	return grn_index_get( root->index, now.dev, now.ino, &then ) &&
+	       then.fingerprint == root->fingerprint &&
+	       grn_index_entry_same_stat( &now, &then );
+}
+
+// hashes the contents before anything looks at them. A mapped file can still change after that, and the hash has to
+// be of the bytes the transforms were run on, or of older ones, never newer.
+void index_hash_ctx( struct grn_ctx *ctx ) {
+	if ( root_ctx( ctx )->index != NULL ) {
+		ctx->file_entry.content_hash = grn_hash_bytes( ctx->buffer, ctx->buffer_n, 0 );
+	}
+}
+
+// a file that was only touched, or copied back over itself, still has the contents the index knows need nothing.
+// Hashing is cheaper than decoding.
+bool index_same_content_ctx( struct grn_ctx *ctx ) {
+	struct grn_ctx *root = root_ctx( ctx );
+	struct grn_index_entry then;
+	if (
+	    root->index == NULL ||
+	    !grn_index_get( root->index, ctx->file_entry.dev, ctx->file_entry.ino, &then ) ||
+	    then.fingerprint != root->fingerprint ||
+	    then.size != ctx->file_entry.size
+	) {
+		return false;
+	}
+	return ctx->file_entry.content_hash == then.content_hash;
+}
+
+// remember that the transforms left the current file alone, using the hash from index_hash_ctx
+void index_record_ctx( struct grn_ctx *ctx ) {
+	struct grn_ctx *root = root_ctx( ctx );
+	if ( root->index == NULL ) {
+		return;
+	}
+	int in_err;
+	ctx->file_entry.fingerprint = root->fingerprint;
+	grn_index_put( root->index, &ctx->file_entry, &in_err );
+	if ( in_err ) {
+		// nothing is lost but time: the file will be read again next run
+		GRN_LOG_WARNING( "Could not add %s to the index", file_path_ctx( ctx, ctx->files_c ) );
+	}
+}
+
+// END scan index
+
 // cleanup after a potentially failed single file then proceed to the next file
 void next_file_ctx( struct grn_ctx *ctx, int *out_err ) {
 	*out_err = GRN_OK;
 
-	GRN_LOG_DEBUG( "Next: file %d to %d", ctx->files_c, ctx->files_c + 1 );
-	ctx->files_c++;
+	ctx->tree = NULL;
+	release_buffer_ctx( ctx );
+	grn_arena_reset( &ctx->arena );
+	// successful files were already closed after writing, so this is only left over from an error. That one is what the
+	// file is charged with, but a close error still counts if somehow there was none.
+	if ( ctx->fd >= 0 ) {
+		if ( close( ctx->fd ) && !ctx->file_error ) {
+			ctx->file_error = GRN_ERR_FS_CLOSE;
+			count_error_ctx( ctx );
+		}
+		ctx->fd = -1;
+	}
+	discard_tmp_ctx( ctx );
+	if ( ctx->owner != NULL && ctx->files_c >= 0 ) {
+		publish_result_ctx( ctx );
+	} else if ( ctx->owner == NULL ) {
+		feed_recycle_ctx( ctx );
+	}
+
 	ctx->file_error = GRN_OK;
+	ctx->file_unchanged = false;
 
-	grn_free( ctx->buffer );
-	ctx->buffer = NULL;
-	// close the previously processing file
-	if ( ctx->fh != NULL ) {
-		// TODO: have a separate GRN_CTX_CLOSE state
-		if ( fclose( ctx->fh ) ) {
-			*out_err = GRN_ERR_FS_CLOSE;
+	// with an index, most files are never opened, so there would be nothing to read ahead
+	if ( ctx->files_c == -1 && root_ctx( ctx )->index == NULL ) {
+		init_io_ctx( ctx, out_err );
+		ERR_FW();
+	}
+	if ( ctx->io != NULL ) {
+		// the file was opened, and is probably being read already
+		if ( !io_next_file_ctx( ctx, out_err ) ) {
+			ERR_FW();
+			ctx->files_c = grn_ctx_get_files_n( ctx );
+			ctx->state = GRN_CTX_DONE;
+			return;
 		}
-		ctx->fh = NULL;
+		ctx->state = GRN_CTX_READ;
+		return;
 	}
 
+	int files_c_next = claim_file_ctx( ctx, true );
+	GRN_LOG_DEBUG( "Next: file %d to %d", ctx->files_c, files_c_next );
+
 	// are we done?
-	if ( ctx->files_c >= ctx->files_n ) {
+	if ( files_c_next == CLAIM_DONE ) {
+		ctx->files_c = grn_ctx_get_files_n( ctx );
 		ctx->state = GRN_CTX_DONE;
 		return;
 	}
+	ctx->files_c = files_c_next;
+	if ( index_skip_ctx( ctx ) ) {
+		GRN_LOG_DEBUG( "Unchanged since it was indexed: %s", file_path_ctx( ctx, ctx->files_c ) );
+		ctx->file_unchanged = true;
+		__atomic_add_fetch( &root_ctx( ctx )->unchanged_n, 1, __ATOMIC_RELAXED );
+		__atomic_add_fetch( &root_ctx( ctx )->skipped_n, 1, __ATOMIC_RELAXED );
+		// done with it already
+		ctx->state = GRN_CTX_NEXT;
+		return;
+	}
 
 	// prepare the next file for reading
-	ERR( ( ctx->fh = fopen( ctx->files[ctx->files_c], "rb" ) ) == NULL, GRN_ERR_FS_OPEN );
+	ERR( ( ctx->fd = open( file_path_ctx( ctx, ctx->files_c ), O_RDONLY | O_BINARY ) ) < 0, GRN_ERR_FS_OPEN );
 	ctx->state = GRN_CTX_READ;
 }
 
@@ -741,12 +3379,17 @@ void next_file_ctx( struct grn_ctx *ctx, int *out_err ) {
 bool grn_one_step( struct grn_ctx *ctx, int *out_err ) {
 	*out_err = GRN_OK;
 
+	if ( ctx->parallel != NULL ) {
+		parallel_step_ctx( ctx, out_err );
+		return ctx->state == GRN_CTX_DONE;
+	}
+
 #define GRN_STEP_ERR() do { \
 	if ( *out_err ) { \
 		if ( grn_err_is_single_file ( *out_err ) ) { \
 			GRN_LOG_DEBUG("File error: %s.", grn_err_to_string( *out_err ) ); \
 			ctx->file_error = *out_err; \
-			ctx->errs_n++; \
+			count_error_ctx( ctx ); \
 			ctx->state = GRN_CTX_NEXT; \
 			*out_err = GRN_OK; \
 		} \
@@ -761,7 +3404,11 @@ bool grn_one_step( struct grn_ctx *ctx, int *out_err ) {
 			break;
 		case GRN_CTX_REOPEN:
 			;
-			freopen_ctx( ctx, out_err );
+			if ( ctx->io != NULL ) {
+				io_reopen_ctx( ctx, out_err );
+			} else {
+				freopen_ctx( ctx, out_err );
+			}
 			GRN_STEP_ERR();
 			ctx->state = GRN_CTX_WRITE;
 			break;
@@ -770,21 +3417,56 @@ bool grn_one_step( struct grn_ctx *ctx, int *out_err ) {
 			// means we should continue reading the current file
 			// fread_ctx will only "throw" an error if it's not an FS problem (which indicates file specific problem).
 			// TODO: consider and maybe actually do what is described just above
-			fread_ctx( ctx, out_err );
+			if ( ctx->io != NULL ) {
+				io_read_ctx( ctx, out_err );
+			} else {
+				fread_ctx( ctx, out_err );
+			}
 			GRN_STEP_ERR();
 			ctx->state = GRN_CTX_TRANSFORM;
 			// TODO: once we add non-blocking, call grn_one_step again here
 			break;
 		case GRN_CTX_WRITE:
 			;
+			if ( ctx->io != NULL ) {
+				// closes it too
+				io_write_ctx( ctx, out_err );
+				GRN_STEP_ERR();
+				ctx->state = GRN_CTX_NEXT;
+				break;
+			}
 			fwrite_ctx( ctx, out_err );
 			GRN_STEP_ERR();
+			// before the file takes the original's place
+			if ( map_truncated_ctx( ctx ) ) {
+				*out_err = GRN_ERR_FS_READ;
+				GRN_STEP_ERR();
+			}
+			fclose_ctx( ctx, out_err );
+			GRN_STEP_ERR();
 			ctx->state = GRN_CTX_NEXT;
 			break;
 		case GRN_CTX_TRANSFORM:
 			;
-			transform_buffer( ctx, out_err );
-			GRN_STEP_ERR();
+			index_hash_ctx( ctx );
+			if ( index_same_content_ctx( ctx ) ) {
+				GRN_LOG_DEBUG( "Same contents as when it was indexed" );
+				ctx->file_unchanged = true;
+			} else {
+				transform_buffer( ctx, out_err );
+				GRN_STEP_ERR();
+			}
+			if ( map_truncated_ctx( ctx ) ) {
+				*out_err = GRN_ERR_FS_READ;
+				GRN_STEP_ERR();
+			}
+			if ( ctx->file_unchanged ) {
+				index_record_ctx( ctx );
+				// don't truncate and rewrite the file just to put the same bytes back
+				__atomic_add_fetch( &root_ctx( ctx )->unchanged_n, 1, __ATOMIC_RELAXED );
+				ctx->state = GRN_CTX_NEXT;
+				break;
+			}
 			ctx->state = GRN_CTX_REOPEN;
 			// TODO: run grn_one_step again
 			break;
@@ -821,12 +3503,12 @@ bool grn_one_file( struct grn_ctx *ctx, int *out_err ) {
 	return ctx->state == GRN_CTX_DONE;
 }
 
-void grn_one_ctx( struct grn_ctx *ctx, int *out_err ) {
+void grn_one_context( struct grn_ctx *ctx, int *out_err ) {
 	*out_err = GRN_OK;
 
 	while ( ctx->state != GRN_CTX_DONE ) {
 		grn_one_step( ctx, out_err );
-		if ( out_err ) {
+		if ( *out_err ) {
 			return;
 		}
 	}
@@ -835,62 +3517,14 @@ void grn_one_ctx( struct grn_ctx *ctx, int *out_err ) {
 // END mainish functions
 
 
-// global because nftw doesn't support a custom callback argument
-struct vector *cat_vec;
-const char *cat_ext;
-
-// used as nftw callback below
-int cat_nftw_cb( const char *path, const struct stat *st, int file_type, struct FTW *ftw_info ) {
-	int in_err;
-
-	// ignore non-files and files without the correct extension
-	if (
-	    file_type != FTW_F ||
-	    !str_ends_with( path, cat_ext ) ||
-	    // not a perfect way to determine if the file is readable (it only checks the owner), but better performance than access
-	    !( st->st_mode & S_IRUSR )
-	) {
-		return 0;
-	}
-
-	// the path might not be dynamic (it might actually change between callback runs, if nftw uses readdir internally?)
-	char *path_cp = malloc( strlen( path ) + 1 );
-	if ( path_cp == NULL ) {
-		return GRN_ERR_OOM;
-	}
-	strcpy( path_cp, path );
-	vector_push( cat_vec, &path_cp, &in_err );
-	return in_err;
-}
-
 void grn_cat_torrent_files( struct vector *vec, const char *path, const char *extension, int *out_err ) {
-	*out_err = GRN_OK;
-
-	cat_vec = vec;
-	cat_ext = extension != NULL ? extension : ".torrent";
-
-	int nftw_err = nftw( path, cat_nftw_cb, 16, 0 );
-	if ( nftw_err == -1 ) {
-		if (
-		    errno == EACCES ||
-		    errno == ENOENT ||
-		    errno == ENOTDIR
-		) {
-			ERR( GRN_ERR_ENOENT );
-		} else {
-			ERR( GRN_ERR_FS_NFTW );
-		}
-	}
-	// error returned by callback
-	if ( nftw_err ) {
-		ERR( nftw_err );
-	}
+	grn_walk_torrent_files( vec, path, extension, 0, GRN_WALK_SORTED, NULL, out_err );
 }
 
-// helper function for use in grn_cat_client
-void cat_client_single_path( struct vector *vec, const char *home, const char *sub, const char *extension, int *out_err ) {
+// helper function for use in grn_cat_client and grn_watch_client. Either of vec and watch may be NULL, and seen is only
+// used with vec.
+void cat_client_single_path( struct vector *vec, struct grn_walk_seen *seen, struct grn_watch *watch, const char *home, const char *sub, const char *extension, int *out_err ) {
 	*out_err = GRN_OK;
-	assert( vec != NULL );
 	assert( home != NULL );
 	assert( sub != NULL );
 
@@ -904,8 +3538,14 @@ void cat_client_single_path( struct vector *vec, const char *home, const char *s
 		*out_err = GRN_ERR_READ_CLIENT_PATH;
 		goto cleanup;
 	}
-	grn_cat_torrent_files( vec, full_path, extension, out_err );
-	ERR_FW_CLEANUP();
+	if ( vec != NULL ) {
+		grn_walk_torrent_files( vec, full_path, extension, 0, GRN_WALK_SORTED, seen, out_err );
+		ERR_FW_CLEANUP();
+	}
+	if ( watch != NULL ) {
+		grn_watch_add( watch, full_path, extension, out_err );
+		ERR_FW_CLEANUP();
+	}
 	goto cleanup;
 cleanup:
 	grn_free( full_path );
@@ -918,7 +3558,7 @@ cleanup:
  *   - qBittorrent: Has separate fastresume files in the same folder as the main torrent. The "trackers" key must be modified.
  *   - uTorrent is also bencode. Each key in the root dict is the name of a .torrent file. Inside is a "trackers" list.
  */
-void grn_cat_client( struct vector *vec, int client, int *out_err ) {
+void cat_client( struct vector *vec, struct grn_walk_seen *seen, struct grn_watch *watch, int client, int *out_err ) {
 	*out_err = GRN_OK;
 
 #ifdef _WIN32
@@ -935,60 +3575,60 @@ void grn_cat_client( struct vector *vec, int client, int *out_err ) {
 		case GRN_CLIENT_QBITTORRENT:
 			;
 #if defined __unix__
-			cat_client_single_path( vec, home_path, "/.local/share/data/qBittorrent/BT_backup", ".torrent", out_err );
+			cat_client_single_path( vec, seen, watch, home_path, "/.local/share/data/qBittorrent/BT_backup", ".torrent", out_err );
 			ERR_FW();
-			cat_client_single_path( vec, home_path, "/.local/share/data/qBittorrent/BT_backup", ".fastresume", out_err );
+			cat_client_single_path( vec, seen, watch, home_path, "/.local/share/data/qBittorrent/BT_backup", ".fastresume", out_err );
 			ERR_FW();
 #elif defined __APPLE__
-			cat_client_single_path( vec, home_path, "/Library/Application Support/qBittorrent/BT_backup", ".torrent", out_err );
+			cat_client_single_path( vec, seen, watch, home_path, "/Library/Application Support/qBittorrent/BT_backup", ".torrent", out_err );
 			ERR_FW();
-			cat_client_single_path( vec, home_path, "/Library/Application Support/qBittorrent/BT_backup", ".fastresume", out_err );
+			cat_client_single_path( vec, seen, watch, home_path, "/Library/Application Support/qBittorrent/BT_backup", ".fastresume", out_err );
 			ERR_FW();
 #elif defined _WIN32
-			cat_client_single_path( vec, home_path, "/AppData/Local/qBittorrent/BT_backup", ".torrent", out_err );
+			cat_client_single_path( vec, seen, watch, home_path, "/AppData/Local/qBittorrent/BT_backup", ".torrent", out_err );
 			ERR_FW();
-			cat_client_single_path( vec, home_path, "/AppData/Local/qBittorrent/BT_backup", ".fastresume", out_err );
+			cat_client_single_path( vec, seen, watch, home_path, "/AppData/Local/qBittorrent/BT_backup", ".fastresume", out_err );
 			ERR_FW();
 #endif
 			break;
 		case GRN_CLIENT_DELUGE:
 			;
 #if defined __unix__ || defined __APPLE__
-			cat_client_single_path( vec, home_path, "/.config/deluge/state", ".torrent", out_err );
+			cat_client_single_path( vec, seen, watch, home_path, "/.config/deluge/state", ".torrent", out_err );
 			ERR_FW();
-			cat_client_single_path( vec, home_path, "/.config/deluge/state/torrents.state", ".state", out_err );
+			cat_client_single_path( vec, seen, watch, home_path, "/.config/deluge/state/torrents.state", ".state", out_err );
 			ERR_FW();
 #elif defined _WIN32
-			cat_client_single_path( vec, appdata_path, "/deluge/state", ".torrent", out_err );
+			cat_client_single_path( vec, seen, watch, appdata_path, "/deluge/state", ".torrent", out_err );
 			ERR_FW();
-			cat_client_single_path( vec, appdata_path, "/deluge/state/torrents.state", ".state", out_err );
+			cat_client_single_path( vec, seen, watch, appdata_path, "/deluge/state/torrents.state", ".state", out_err );
 			ERR_FW();
 #endif
 			break;
 		case GRN_CLIENT_TRANSMISSION:
 			;
 #if defined __unix__
-			cat_client_single_path( vec, home_path, "/.config/transmission/torrents", ".torrent", out_err );
+			cat_client_single_path( vec, seen, watch, home_path, "/.config/transmission/torrents", ".torrent", out_err );
 			ERR_FW();
 #elif defined __APPLE__
-			cat_client_single_path( vec, home_path, "/Library/Application Support/Transmission/torrents", ".torrent", out_err );
+			cat_client_single_path( vec, seen, watch, home_path, "/Library/Application Support/Transmission/torrents", ".torrent", out_err );
 			ERR_FW();
 #elif defined _WIN32
-			cat_client_single_path( vec, home_path, "/AppData/Local/transmission/torrents", ".torrent", out_err );
+			cat_client_single_path( vec, seen, watch, home_path, "/AppData/Local/transmission/torrents", ".torrent", out_err );
 			ERR_FW();
 #endif
 			break;
 		case GRN_CLIENT_TRANSMISSION_DAEMON:
 			;
 #if defined __unix__
-			cat_client_single_path( vec, home_path, "/.config/transmission-daemon/torrents", ".torrent", out_err );
+			cat_client_single_path( vec, seen, watch, home_path, "/.config/transmission-daemon/torrents", ".torrent", out_err );
 			ERR_FW();
 #elif defined __APPLE__
-			cat_client_single_path( vec, home_path, "/Library/Application Support/Transmission/torrents", ".torrent", out_err );
+			cat_client_single_path( vec, seen, watch, home_path, "/Library/Application Support/Transmission/torrents", ".torrent", out_err );
 			ERR_FW();
 			// TODO: check what the status is of transmission daemon on mac. Does it exist at all?
 #elif defined _WIN32
-			cat_client_single_path( vec, home_path, "/AppData/Local/transmission-daemon/torrents", ".torrent", out_err );
+			cat_client_single_path( vec, seen, watch, home_path, "/AppData/Local/transmission-daemon/torrents", ".torrent", out_err );
 			ERR_FW();
 #endif
 			break;
@@ -996,10 +3636,10 @@ void grn_cat_client( struct vector *vec, int client, int *out_err ) {
 		case GRN_CLIENT_UTORRENT:
 			;
 			/*
-			cat_client_single_path( vec, appdata_path, "/uTorrent", ".torrent", out_err );
+			cat_client_single_path( vec, seen, watch, appdata_path, "/uTorrent", ".torrent", out_err );
 			ERR_FW();
 			*/
-			cat_client_single_path( vec, appdata_path, "/uTorrent/resume.dat", ".dat", out_err );
+			cat_client_single_path( vec, seen, watch, appdata_path, "/uTorrent/resume.dat", ".dat", out_err );
 			ERR_FW();
 			break;
 #endif
@@ -1010,6 +3650,14 @@ void grn_cat_client( struct vector *vec, int client, int *out_err ) {
 	}
 }
 
+void grn_cat_client( struct vector *vec, int client, struct grn_walk_seen *seen, int *out_err ) {
+	cat_client( vec, seen, NULL, client, out_err );
+}
+
+void grn_watch_client( struct grn_watch *watch, int client, int *out_err ) {
+	cat_client( NULL, NULL, watch, client, out_err );
+}
+
 // BEGIN get info
 
 bool grn_ctx_get_is_done( struct grn_ctx *ctx ) {
@@ -1018,13 +3666,21 @@ bool grn_ctx_get_is_done( struct grn_ctx *ctx ) {
 
 char *grn_ctx_get_c_path( struct grn_ctx *ctx ) {
 	assert( ctx->files_c >= 0 );
-	assert( ctx->files_c < ctx->files_n );
-	return ctx->files[ctx->files_c];
+	assert( ctx->files_c < grn_ctx_get_files_n( ctx ) );
+	if ( ctx->parallel != NULL ) {
+		// files_c counts finished files here, not their position in the list
+		return file_path_ctx( ctx, ctx->parallel->c_file_i );
+	}
+	return file_path_ctx( ctx, ctx->files_c );
 }
 
 char *grn_ctx_get_next_path( struct grn_ctx *ctx ) {
-	if ( ctx->files_c + 1 < ctx->files_n ) {
-		return ctx->files[ctx->files_c + 1];
+	// workers pick files in whatever order they get to them
+	if ( ctx->parallel != NULL ) {
+		return NULL;
+	}
+	if ( ctx->files_c + 1 < grn_ctx_get_files_n( ctx ) ) {
+		return file_path_ctx( ctx, ctx->files_c + 1 );
 	} else {
 		return NULL;
 	}
@@ -1035,16 +3691,38 @@ int grn_ctx_get_c_error( struct grn_ctx *ctx ) {
 	return ctx->file_error;
 }
 
+bool grn_ctx_get_c_unchanged( struct grn_ctx *ctx ) {
+	assert( ctx->files_c >= 0 );
+	return ctx->file_unchanged;
+}
+
 int grn_ctx_get_files_c( struct grn_ctx *ctx ) {
 	return ctx->files_c + 1;
 }
 
 int grn_ctx_get_files_n( struct grn_ctx *ctx ) {
-	return ctx->files_n;
+	// pushed files are counted as soon as they are there. Workers only have a copy of the list they started with.
+	return __atomic_load_n( &root_ctx( ctx )->files_n, __ATOMIC_ACQUIRE );
 }
 
 int grn_ctx_get_errs_n( struct grn_ctx *ctx ) {
-	return ctx->errs_n;
+	return __atomic_load_n( &ctx->errs_n, __ATOMIC_RELAXED );
+}
+
+int grn_ctx_get_unchanged_n( struct grn_ctx *ctx ) {
+	return __atomic_load_n( &ctx->unchanged_n, __ATOMIC_RELAXED );
+}
+
+int grn_ctx_get_skipped_n( struct grn_ctx *ctx ) {
+	return __atomic_load_n( &ctx->skipped_n, __ATOMIC_RELAXED );
+}
+
+int grn_ctx_get_dupes_n( struct grn_ctx *ctx ) {
+	return grn_walk_seen_get_dupes_n( ctx->seen );
+}
+
+struct grn_walk_seen *grn_ctx_get_seen( struct grn_ctx *ctx ) {
+	return ctx->seen;
 }
 
 // END get info
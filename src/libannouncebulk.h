@@ -6,6 +6,10 @@
 #include <regex.h>
 
 #include "vector.h"
+#include "arena.h"
+#include "index.h"
+#include "watch.h"
+#include "walk.h"
 
 int ben_error_to_anb( int bencode_error );
 
@@ -46,6 +50,11 @@ struct grn_transform {
 			// this is inline so we don't have to allocate memory for it and shit
 			regex_t find;
 			char *replace;
+			// NULL-terminated. Every match contains at least one of these. NULL if we couldn't work any out.
+			// freed along with find.
+			char **literals;
+			// what find was compiled from, to tell transform sets apart. Also freed along with find.
+			char *source;
 		} substitute_regex;
 	} payload;
 	enum grn_dynamic_transform {
@@ -89,18 +98,74 @@ enum grn_ctx_state {
 	GRN_CTX_DONE,
 };
 
+// where grn_ctx.buffer came from, which decides how it is given back
+enum grn_buffer_type {
+	GRN_BUFFER_HEAP, // malloc'd, owned by the ctx
+	GRN_BUFFER_SCRATCH, // points at the ctx's reusable read buffer
+	GRN_BUFFER_MMAP, // read-only mapping of the input file, from grn_mapped_open
+};
+
+// worker threads and their completed files; only exists after grn_ctx_run_parallel
+struct grn_parallel;
+// the key paths of all transforms merged together, so that one walk over a file applies all of them
+struct grn_plan;
+// files that are pushed while the context is already running; only exists after grn_ctx_open_files
+struct grn_feed;
+// files being read ahead and written back through io_uring. Only with GRN_USE_IO_URING, and when the kernel allows it
+struct grn_io;
+// what the files the context wrote looked like afterwards; only exists after grn_ctx_track_written
+struct grn_written;
+
 struct grn_ctx {
 	struct grn_transform *transforms;
 	int transforms_n;
+	struct grn_plan *plan; // built from the transforms when they are set
 	char **files;
 	int files_c; // index to the currently processing file
 	int files_n;
+	// index of files[0]. Non-zero once a feed has recycled the paths of files that were all reported already.
+	int files_base;
 	int file_error; // error during processing current file. Only recoverable errors.
+	bool file_unchanged; // no transform changed the current file, so it was not written back
 	int errs_n;
+	int unchanged_n;
+	int skipped_n; // unchanged files that the index said didn't even need reading
 	int state; // represents what to do next (sometimes this coincides with what is in progress)
-	FILE *fh;
+	int fd;
 	char *buffer;
 	size_t buffer_n;
+	int buffer_type; // enum grn_buffer_type
+	size_t map_n; // length of the mapping when buffer_type is GRN_BUFFER_MMAP
+	int map_i; // which grn_mapped mapping it is, then
+	// reused between files so that small files don't each need a fresh allocation
+	char *scratch;
+	size_t scratch_n;
+	// the bencode tree of the current file lives here, and is thrown away all at once for the next file
+	struct grn_arena arena;
+	// the transformed tree, kept to be encoded straight into the file when it is written. NULL when the output is in
+	// buffer instead.
+	struct bencode *tree;
+	// where the file is written before it is renamed over the original, so that it's never left half written. NULL
+	// when it's written in place after all.
+	char *tmp_path;
+	// BEGIN scan index
+	struct grn_index *index; // NULL unless grn_ctx_set_index was called. Workers use their owner's.
+	uint64_t fingerprint; // of all the transforms, worked out when they are set
+	struct grn_index_entry file_entry; // what the current file looked like when it was read
+	// END scan index
+	struct grn_io *io;
+	struct grn_feed *feed;
+	struct grn_written *written; // workers use their owner's
+	// every file grn_cat_torrent_files_ctx pushed, so that none is pushed twice. See grn_ctx_get_seen.
+	struct grn_walk_seen *seen;
+	// BEGIN parallel
+	// set on worker contexts. The owner's files and transforms are shared, and results are reported to it.
+	struct grn_ctx *owner;
+	int files_claimed; // next file index to start on. Workers share the owner's, which is only touched atomically.
+	// threads that the top-level entries of a single file may be spread over. Set by grn_ctx_run_parallel.
+	int split_threads_n;
+	struct grn_parallel *parallel;
+	// END parallel
 };
 
 struct grn_ctx *grn_ctx_alloc( int *out_err );
@@ -109,19 +174,89 @@ void grn_ctx_set_files( struct grn_ctx *ctx, char **files, int files_n );
 // takes ownership of the vector, do not free it
 // also assumes that all individual files are dynamically allocated
 void grn_ctx_set_files_v( struct grn_ctx *ctx, struct vector *files );
-void grn_ctx_set_transforms( struct grn_ctx *ctx, struct grn_transform *transforms, int transforms_n );
+/**
+ * Queue up more files, for instance ones that grn_watch_wait found. Takes ownership of the vector, even if it fails.
+ * Works at any point, including once the context is done, after which grn_one_* carry on with the new files. Not for
+ * contexts running in parallel, unless files were opened with grn_ctx_open_files, in which case this is the same as
+ * pushing each file.
+ */
+void grn_ctx_add_files_v( struct grn_ctx *ctx, struct vector *files, int *out_err );
+
+/**
+ * Start on files while more are still being found. Call after setting transforms and any files that are already
+ * known, but before grn_ctx_run_parallel and any of the grn_one_* functions. From then on, files are added with
+ * grn_ctx_push_file, and whenever the context runs out, grn_one_* wait for more until grn_ctx_close_files.
+ * grn_ctx_get_files_n keeps growing until then; see grn_ctx_get_files_open.
+ */
+void grn_ctx_open_files( struct grn_ctx *ctx, int *out_err );
+/**
+ * Add a dynamically allocated file, which belongs to the context even if this fails. Safe to call from several threads
+ * at once, but not from the one running the context: once GRN_FEED_QUEUE_N files are waiting to be started on, this
+ * waits for them. Fails with GRN_ERR_USER_CANCELLED after grn_ctx_cancel_files.
+ */
+void grn_ctx_push_file( struct grn_ctx *ctx, char *path, int *out_err );
+// no more files are coming. The context is done once it has processed the ones it has.
+void grn_ctx_close_files( struct grn_ctx *ctx );
+/**
+ * Like grn_ctx_close_files, but files that weren't started on yet are dropped, and grn_ctx_push_file fails from now on,
+ * including calls already waiting. Whatever is pushing files still has to stop before grn_ctx_free.
+ */
+void grn_ctx_cancel_files( struct grn_ctx *ctx );
+// whether more files can still be pushed, so that grn_ctx_get_files_n is not final yet
+bool grn_ctx_get_files_open( struct grn_ctx *ctx );
+/**
+ * Remember what each file looks like once the context has written it, so that grn_ctx_take_written can tell the
+ * context's own changes apart from anyone else's, for instance when its files are being watched. Call before
+ * grn_ctx_run_parallel and any of the grn_one_* functions.
+ */
+void grn_ctx_track_written( struct grn_ctx *ctx, int *out_err );
+/**
+ * Whether path is still exactly as the context left it when it last wrote it. Either way, the file is forgotten, since
+ * whatever changes it next won't be that write. Always false without grn_ctx_track_written.
+ */
+bool grn_ctx_take_written( struct grn_ctx *ctx, const char *path );
+// also works out how to apply them in one walk over each file, which is what can fail
+void grn_ctx_set_transforms( struct grn_ctx *ctx, struct grn_transform *transforms, int transforms_n, int *out_err );
 // takes ownership of the vector, do not free it
-void grn_ctx_set_transforms_v( struct grn_ctx *ctx, struct vector *transforms );
+void grn_ctx_set_transforms_v( struct grn_ctx *ctx, struct vector *transforms, int *out_err );
 
 bool grn_ctx_get_is_done( struct grn_ctx *ctx );
-// the path of the currently / just processed file
+// the path of the currently / just processed file. With a feed, it's only valid until the next grn_one_* call.
 char *grn_ctx_get_c_path( struct grn_ctx *ctx );
 char *grn_ctx_get_next_path( struct grn_ctx *ctx );
 int grn_ctx_get_c_error( struct grn_ctx *ctx );
+// whether the current / just processed file was left alone because nothing in it needed transforming
+bool grn_ctx_get_c_unchanged( struct grn_ctx *ctx );
+// includes files that were pushed but not started on yet
 int grn_ctx_get_files_n( struct grn_ctx *ctx );
 // the number that have been completed
 int grn_ctx_get_files_c( struct grn_ctx *ctx );
 int grn_ctx_get_errs_n (struct grn_ctx *ctx);
+// the number of files that did not need to be written back
+int grn_ctx_get_unchanged_n( struct grn_ctx *ctx );
+// how many of those were known to be unchanged from the index, without reading them
+int grn_ctx_get_skipped_n( struct grn_ctx *ctx );
+// how many files were found more than once, through links or overlapping paths, and left out (see ctx->seen)
+int grn_ctx_get_dupes_n( struct grn_ctx *ctx );
+// the files found for the context so far, to pass to grn_cat_client
+struct grn_walk_seen *grn_ctx_get_seen( struct grn_ctx *ctx );
+
+/**
+ * Process files on several threads at once. Call after setting files and transforms, but before any of the
+ * grn_one_* functions. Those keep working as before, except that each grn_one_file call now reports whichever
+ * file a worker finished next, so files are not reported in order, and grn_ctx_get_next_path returns NULL.
+ * @param threads_n number of worker threads. Less than 2 leaves the context single-threaded. With fewer files than
+ * threads, the rest are used to transform the entries of files like uTorrent's resume.dat in parallel.
+ */
+void grn_ctx_run_parallel( struct grn_ctx *ctx, int threads_n, int *out_err );
+
+/**
+ * Remember which files the transforms left alone in an index file, and skip those files on later runs for as long as
+ * they and the transforms stay the same. Call before any of the grn_one_* functions. io_uring is not used with an
+ * index, since most files are never opened.
+ * Fails with GRN_ERR_INDEX if the index can't be opened, for instance because another Greeny is using it.
+ */
+void grn_ctx_set_index( struct grn_ctx *ctx, const char *path, int *out_err );
 
 /**
  * Free a context
@@ -182,13 +317,17 @@ enum grn_torrent_client {
 *
 * @param vec The vector to add the file paths to
 * @param client The enum value of the client (see x_clients.h)
+* @param seen Files in here are left out, and the rest are added to it (see grn_walk_torrent_files). May be NULL.
 */
-void grn_cat_client( struct vector *vec, int client, int *out_err );
+void grn_cat_client( struct vector *vec, int client, struct grn_walk_seen *seen, int *out_err );
+// watch the same files that grn_cat_client would add (see <watch.h>)
+void grn_watch_client( struct grn_watch *watch, int client, int *out_err );
 
 // END client-specific
 
 /**
- * Adds .torrent files to a vector. The paths will all be dynamically allocated.
+ * Adds .torrent files to a vector. The paths will all be dynamically allocated, and sorted.
+ * Directories are read on several threads; see grn_walk_torrent_files in walk.h for more control over that.
  * @param vec the vector to add files to (see <vector.h>)
  * @param path a file or directory
  * @param extension the file extension of torrents. If NULL, uses ".torrent". Does not apply to single files; only when searching directories
@@ -196,6 +335,9 @@ void grn_cat_client( struct vector *vec, int client, int *out_err );
  * but attempt to continue and return an accurate value anyway.
  */
 void grn_cat_torrent_files( struct vector *vec, const char *path, const char *extension, int *out_err );
+// the same, except that each file is pushed to ctx as soon as it's found (see grn_ctx_open_files), and not sorted.
+// Files that were pushed already by this or grn_cat_client with ctx->seen are left out.
+void grn_cat_torrent_files_ctx( struct grn_ctx *ctx, const char *path, const char *extension, int *out_err );
 
 // BEGIN transform catting
 // ONE DAY, we will have a proper vector implementation that can just append a whole buffer to itself
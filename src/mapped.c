@@ -0,0 +1,132 @@
+#define _GNU_SOURCE
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <unistd.h>
+#ifndef _WIN32
+#include <sys/mman.h>
+#endif
+
+#include "mapped.h"
+
+#ifdef _WIN32
+
+void *grn_mapped_open( int fd, size_t map_n, int *out_i ) {
+	errno = ENOSYS;
+	return NULL;
+}
+
+void grn_mapped_close( void *map, size_t map_n, int i ) {
+}
+
+bool grn_mapped_truncated( int i ) {
+	return false;
+}
+
+#else
+
+// files mapped at once. Any more are read instead.
+#ifndef GRN_MAPPED_N
+#define GRN_MAPPED_N 256
+#endif
+
+// the handler can't take locks, so everything it looks at is only touched atomically
+struct mapped_slot {
+	int used;
+	// set after len and cleared before the mapping goes away, so the handler never sees a stale range
+	char *start;
+	size_t len;
+	int truncated;
+};
+
+struct mapped_slot mapped_slots[GRN_MAPPED_N];
+pthread_once_t mapped_once = PTHREAD_ONCE_INIT;
+struct sigaction mapped_old_action;
+bool mapped_handling;
+uintptr_t mapped_page_n;
+
+void mapped_sigbus( int sig, siginfo_t *info, void *context ) {
+	char *addr = info->si_addr;
+	for ( int i = 0; i < GRN_MAPPED_N; i++ ) {
+		char *start = __atomic_load_n( &mapped_slots[i].start, __ATOMIC_ACQUIRE );
+		size_t len = __atomic_load_n( &mapped_slots[i].len, __ATOMIC_RELAXED );
+		if ( start == NULL || addr < start || addr >= start + len ) {
+			continue;
+		}
+		// everything from the missing page on reads as zeroes from now on, including the access that faulted
+		char *page = ( char * )( ( uintptr_t ) addr & ~( mapped_page_n - 1 ) );
+		void *zeroes = mmap( page, start + len - page, PROT_READ, MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED, -1, 0 );
+		if ( zeroes == MAP_FAILED ) {
+			break;
+		}
+		__atomic_store_n( &mapped_slots[i].truncated, 1, __ATOMIC_RELEASE );
+		return;
+	}
+
+	if ( mapped_old_action.sa_flags & SA_SIGINFO ) {
+		mapped_old_action.sa_sigaction( sig, info, context );
+	} else if ( mapped_old_action.sa_handler != SIG_DFL && mapped_old_action.sa_handler != SIG_IGN ) {
+		mapped_old_action.sa_handler( sig );
+	} else {
+		// returning runs into the same fault again, which then does what it would have without us
+		signal( SIGBUS, SIG_DFL );
+	}
+}
+
+void mapped_install( void ) {
+	mapped_page_n = sysconf( _SC_PAGESIZE );
+	struct sigaction action = {
+		.sa_sigaction = mapped_sigbus,
+		.sa_flags = SA_SIGINFO | SA_RESTART,
+	};
+	sigemptyset( &action.sa_mask );
+	mapped_handling = sigaction( SIGBUS, &action, &mapped_old_action ) == 0;
+}
+
+void *grn_mapped_open( int fd, size_t map_n, int *out_i ) {
+	pthread_once( &mapped_once, mapped_install );
+	if ( !mapped_handling ) {
+		errno = ENOTSUP;
+		return NULL;
+	}
+	int i = 0;
+	for ( ; i < GRN_MAPPED_N; i++ ) {
+		int unused = 0;
+		if ( __atomic_compare_exchange_n( &mapped_slots[i].used, &unused, 1, false, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED ) ) {
+			break;
+		}
+	}
+	if ( i == GRN_MAPPED_N ) {
+		errno = ENOMEM;
+		return NULL;
+	}
+
+	void *map = mmap( NULL, map_n, PROT_READ, MAP_PRIVATE, fd, 0 );
+	if ( map == MAP_FAILED ) {
+		int mmap_errno = errno;
+		__atomic_store_n( &mapped_slots[i].used, 0, __ATOMIC_RELEASE );
+		errno = mmap_errno;
+		return NULL;
+	}
+	__atomic_store_n( &mapped_slots[i].truncated, 0, __ATOMIC_RELAXED );
+	__atomic_store_n( &mapped_slots[i].len, map_n, __ATOMIC_RELAXED );
+	__atomic_store_n( &mapped_slots[i].start, map, __ATOMIC_RELEASE );
+	*out_i = i;
+	return map;
+}
+
+void grn_mapped_close( void *map, size_t map_n, int i ) {
+	__atomic_store_n( &mapped_slots[i].start, NULL, __ATOMIC_RELEASE );
+	munmap( map, map_n );
+	__atomic_store_n( &mapped_slots[i].used, 0, __ATOMIC_RELEASE );
+}
+
+bool grn_mapped_truncated( int i ) {
+	return __atomic_load_n( &mapped_slots[i].truncated, __ATOMIC_ACQUIRE );
+}
+
+#endif
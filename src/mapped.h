@@ -0,0 +1,22 @@
+#ifndef H_GRN_MAPPED
+#define H_GRN_MAPPED
+
+#include <stdbool.h>
+#include <stddef.h>
+
+/**
+ * Read-only mappings of whole files that survive the file being truncated while they are in use. Touching the part of
+ * a plain mapping that the file no longer has raises SIGBUS, which would kill the process. Here a SIGBUS handler puts
+ * zeroes there instead and notes that it did, so whatever was made from the mapping can be thrown away afterwards.
+ * The handler is installed the first time a file is mapped, and passes any other SIGBUS on to the handler that was
+ * there before. Safe to use from several threads.
+ */
+
+// NULL if the file can't be mapped, or not safely, in which case it should be read instead. errno says why.
+// *out_i identifies the mapping to the functions below.
+void *grn_mapped_open( int fd, size_t map_n, int *out_i );
+void grn_mapped_close( void *map, size_t map_n, int i );
+// whether the file turned out shorter than the mapping, so that some of what was read from it was made up
+bool grn_mapped_truncated( int i );
+
+#endif
@@ -0,0 +1,140 @@
+#define _GNU_SOURCE
+
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#include "uring.h"
+#include "err.h"
+
+static int uring_setup( unsigned entries, struct io_uring_params *params ) {
+	return syscall( __NR_io_uring_setup, entries, params );
+}
+
+static int uring_enter( int fd, unsigned to_submit, unsigned min_complete, unsigned flags ) {
+	return syscall( __NR_io_uring_enter, fd, to_submit, min_complete, flags, NULL, 0 );
+}
+
+void grn_uring_init( struct grn_uring *ring, unsigned entries, int *out_err ) {
+	*out_err = GRN_OK;
+	memset( ring, 0, sizeof( *ring ) );
+	ring->fd = -1;
+
+	struct io_uring_params params;
+	memset( &params, 0, sizeof( params ) );
+	ring->fd = uring_setup( entries, &params );
+	ERR( ring->fd < 0, GRN_ERR_IO_URING );
+	// this arrived in the same release as openat, statx and close, which we can't do without
+	if ( !( params.features & IORING_FEAT_RW_CUR_POS ) ) {
+		grn_uring_free( ring );
+		ERR( GRN_ERR_IO_URING );
+	}
+
+	ring->sq_map_n = params.sq_off.array + params.sq_entries * sizeof( unsigned );
+	ring->cq_map_n = params.cq_off.cqes + params.cq_entries * sizeof( struct io_uring_cqe );
+	if ( params.features & IORING_FEAT_SINGLE_MMAP ) {
+		if ( ring->cq_map_n > ring->sq_map_n ) {
+			ring->sq_map_n = ring->cq_map_n;
+		}
+		ring->cq_map_n = 0;
+	}
+	ring->sq_map = mmap( NULL, ring->sq_map_n, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING );
+	if ( ring->sq_map == MAP_FAILED ) {
+		ring->sq_map = NULL;
+		grn_uring_free( ring );
+		ERR( GRN_ERR_IO_URING );
+	}
+	if ( params.features & IORING_FEAT_SINGLE_MMAP ) {
+		ring->cq_map = ring->sq_map;
+	} else {
+		ring->cq_map = mmap( NULL, ring->cq_map_n, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING );
+		if ( ring->cq_map == MAP_FAILED ) {
+			ring->cq_map = NULL;
+			grn_uring_free( ring );
+			ERR( GRN_ERR_IO_URING );
+		}
+	}
+	ring->sqes_map_n = params.sq_entries * sizeof( struct io_uring_sqe );
+	ring->sqes = mmap( NULL, ring->sqes_map_n, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES );
+	if ( ring->sqes == MAP_FAILED ) {
+		ring->sqes = NULL;
+		grn_uring_free( ring );
+		ERR( GRN_ERR_IO_URING );
+	}
+
+	char *sq = ring->sq_map, *cq = ring->cq_map;
+	ring->sq_head = ( unsigned * )( sq + params.sq_off.head );
+	ring->sq_tail = ( unsigned * )( sq + params.sq_off.tail );
+	ring->sq_mask = ( unsigned * )( sq + params.sq_off.ring_mask );
+	ring->sq_array = ( unsigned * )( sq + params.sq_off.array );
+	ring->sq_entries = params.sq_entries;
+	ring->cq_head = ( unsigned * )( cq + params.cq_off.head );
+	ring->cq_tail = ( unsigned * )( cq + params.cq_off.tail );
+	ring->cq_mask = ( unsigned * )( cq + params.cq_off.ring_mask );
+	ring->cqes = ( struct io_uring_cqe * )( cq + params.cq_off.cqes );
+}
+
+void grn_uring_free( struct grn_uring *ring ) {
+	if ( ring->sqes != NULL ) {
+		munmap( ring->sqes, ring->sqes_map_n );
+	}
+	if ( ring->cq_map != NULL && ring->cq_map != ring->sq_map ) {
+		munmap( ring->cq_map, ring->cq_map_n );
+	}
+	if ( ring->sq_map != NULL ) {
+		munmap( ring->sq_map, ring->sq_map_n );
+	}
+	if ( ring->fd >= 0 ) {
+		close( ring->fd );
+	}
+	memset( ring, 0, sizeof( *ring ) );
+	ring->fd = -1;
+}
+
+struct io_uring_sqe *grn_uring_get_sqe( struct grn_uring *ring ) {
+	unsigned head = __atomic_load_n( ring->sq_head, __ATOMIC_ACQUIRE );
+	unsigned tail = *ring->sq_tail + ring->sq_pending;
+	if ( tail - head >= ring->sq_entries ) {
+		return NULL;
+	}
+	unsigned index = tail & *ring->sq_mask;
+	struct io_uring_sqe *sqe = &ring->sqes[index];
+	memset( sqe, 0, sizeof( *sqe ) );
+	ring->sq_array[index] = index;
+	ring->sq_pending++;
+	return sqe;
+}
+
+void grn_uring_submit( struct grn_uring *ring, unsigned wait_n, int *out_err ) {
+	*out_err = GRN_OK;
+
+	// the kernel may only look at the new requests once the tail says they are there
+	__atomic_store_n( ring->sq_tail, *ring->sq_tail + ring->sq_pending, __ATOMIC_RELEASE );
+	unsigned to_submit = ring->sq_pending;
+	ring->sq_pending = 0;
+	while ( to_submit > 0 || wait_n > 0 ) {
+		int res = uring_enter( ring->fd, to_submit, wait_n, wait_n > 0 ? IORING_ENTER_GETEVENTS : 0 );
+		if ( res < 0 && errno == EINTR ) {
+			continue;
+		}
+		// only fails if the ring itself is broken, or is out of memory for the requests
+		ERR( res < 0, errno == ENOMEM || errno == EAGAIN ? GRN_ERR_OOM : GRN_ERR_IO_URING );
+		// nothing taken means nothing ever will be, and asking again would spin forever
+		ERR( res == 0 && to_submit > 0, GRN_ERR_IO_URING );
+		to_submit -= res;
+		// whatever completed so far counts, callers loop if they wanted something specific
+		wait_n = 0;
+	}
+}
+
+bool grn_uring_pop_cqe( struct grn_uring *ring, struct io_uring_cqe *cqe ) {
+	unsigned head = *ring->cq_head;
+	if ( head == __atomic_load_n( ring->cq_tail, __ATOMIC_ACQUIRE ) ) {
+		return false;
+	}
+	*cqe = ring->cqes[head & *ring->cq_mask];
+	__atomic_store_n( ring->cq_head, head + 1, __ATOMIC_RELEASE );
+	return true;
+}
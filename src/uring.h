@@ -0,0 +1,48 @@
+#ifndef H_GRN_URING
+#define H_GRN_URING
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <linux/io_uring.h>
+
+/**
+ * Just enough of io_uring to queue up requests and collect their completions, talking to the kernel directly so
+ * that liburing isn't needed. Only for use by one thread at a time.
+ */
+struct grn_uring {
+	int fd;
+	// submission queue
+	unsigned *sq_head;
+	unsigned *sq_tail;
+	unsigned *sq_mask;
+	unsigned *sq_array;
+	unsigned sq_entries;
+	struct io_uring_sqe *sqes;
+	unsigned sq_pending; // handed out by grn_uring_get_sqe but not submitted yet
+	// completion queue
+	unsigned *cq_head;
+	unsigned *cq_tail;
+	unsigned *cq_mask;
+	struct io_uring_cqe *cqes;
+	// mappings, for cleaning up
+	void *sq_map;
+	size_t sq_map_n;
+	void *cq_map; // same as sq_map on kernels that map both queues at once
+	size_t cq_map_n;
+	size_t sqes_map_n;
+};
+
+/**
+ * Set up a ring with room for at least entries requests at a time.
+ * Fails with GRN_ERR_IO_URING on kernels without io_uring or too old for file operations (before 5.6).
+ */
+void grn_uring_init( struct grn_uring *ring, unsigned entries, int *out_err );
+void grn_uring_free( struct grn_uring *ring );
+// a zeroed request to fill in, or NULL if the submission queue is full, in which case submit first
+struct io_uring_sqe *grn_uring_get_sqe( struct grn_uring *ring );
+// submit all pending requests, then wait until at least wait_n completions are ready
+void grn_uring_submit( struct grn_uring *ring, unsigned wait_n, int *out_err );
+// copy the oldest completion into cqe and remove it from the queue. False if there is none.
+bool grn_uring_pop_cqe( struct grn_uring *ring, struct io_uring_cqe *cqe );
+
+#endif
@@ -1,6 +1,13 @@
+#define _XOPEN_SOURCE 500
+
 #include <stdlib.h>
 #include <string.h>
 #include <ctype.h>
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <unistd.h>
+#endif
 
 #include "err.h"
 
@@ -57,3 +64,35 @@ void grn_decode_url( char *dst, const char *src ) {
 	}
 	*dst++ = '\0';
 }
+
+const void *grn_memmem( const void *haystack, size_t haystack_n, const void *needle, size_t needle_n ) {
+	if ( needle_n == 0 ) {
+		return haystack;
+	}
+	const char *cursor = haystack;
+	const char *end = cursor + haystack_n;
+	const char *needle_c = needle;
+	// memchr is vectorized in any libc worth using, so let it skip ahead to candidates
+	while ( ( size_t )( end - cursor ) >= needle_n ) {
+		cursor = memchr( cursor, needle_c[0], end - cursor - needle_n + 1 );
+		if ( cursor == NULL ) {
+			return NULL;
+		}
+		if ( memcmp( cursor + 1, needle_c + 1, needle_n - 1 ) == 0 ) {
+			return cursor;
+		}
+		cursor++;
+	}
+	return NULL;
+}
+
+int grn_cpu_count( void ) {
+#ifdef _WIN32
+	SYSTEM_INFO info;
+	GetSystemInfo( &info );
+	return info.dwNumberOfProcessors;
+#else
+	long cpus_n = sysconf( _SC_NPROCESSORS_ONLN );
+	return cpus_n > 0 ? cpus_n : 1;
+#endif
+}
@@ -5,5 +5,9 @@ void grn_free( void *arg );
 void *grn_malloc( size_t size, int *out_err );
 char *grn_strcpy_malloc( const char *in, int *out_err );
 void grn_decode_url( char *dst, const char *src );
+// like the GNU memmem, which isn't available everywhere
+const void *grn_memmem( const void *haystack, size_t haystack_n, const void *needle, size_t needle_n );
+// number of online processors, at least 1
+int grn_cpu_count( void );
 
 #endif
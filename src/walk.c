@@ -0,0 +1,829 @@
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#ifdef _WIN32
+#include <ftw.h>
+#else
+#include <dirent.h>
+#endif
+
+#include "walk.h"
+#include "vector.h"
+#include "util.h"
+#include "err.h"
+
+#ifndef O_CLOEXEC
+#define O_CLOEXEC 0
+#endif
+
+bool walk_has_extension( const char *name, size_t name_n, const char *ext, size_t ext_n ) {
+	return name_n >= ext_n && memcmp( name + name_n - ext_n, ext, ext_n ) == 0;
+}
+
+char *walk_join( const char *dir, const char *name, int *out_err ) {
+	*out_err = GRN_OK;
+	size_t dir_n = strlen( dir );
+	size_t name_n = strlen( name );
+	bool slash = dir_n > 0 && dir[dir_n - 1] != '/';
+	char *path = malloc( dir_n + slash + name_n + 1 );
+	ERR_NULL( path == NULL, GRN_ERR_OOM );
+	memcpy( path, dir, dir_n );
+	path[dir_n] = '/';
+	memcpy( path + dir_n + slash, name, name_n + 1 );
+	return path;
+}
+
+int walk_path_cmp( const void *a, const void *b ) {
+	return strcmp( * ( char *const * ) a, * ( char *const * ) b );
+}
+
+// what a path that can't even be looked at turns into
+int walk_stat_err( int stat_errno ) {
+	return stat_errno == EACCES || stat_errno == ENOENT || stat_errno == ENOTDIR ? GRN_ERR_ENOENT : GRN_ERR_FS_NFTW;
+}
+
+// BEGIN id sets
+
+// a file or directory, as far as telling whether it was seen before goes
+struct walk_id {
+	dev_t dev;
+	ino_t ino;
+};
+
+// open addressing, since there are only ever insertions. No inode is 0, so that marks an empty slot.
+struct walk_id_set {
+	struct walk_id *slots;
+	size_t slots_n; // always a power of 2
+	size_t used_n;
+};
+
+size_t walk_id_hash( struct walk_id id ) {
+	uint64_t h = ( uint64_t ) id.ino * 0x9e3779b97f4a7c15ull ^ ( uint64_t ) id.dev;
+	return h ^ h >> 29;
+}
+
+// whether id was new. Inserting may fail, in which case it counts as new, and reading a directory or file twice is the
+// worst that can happen.
+bool walk_id_set_add( struct walk_id_set *set, struct walk_id id ) {
+	if ( id.ino == 0 ) {
+		return true;
+	}
+	if ( ( set->used_n + 1 ) * 2 > set->slots_n ) {
+		size_t slots_n = set->slots_n ? set->slots_n * 2 : 64;
+		struct walk_id *slots = calloc( slots_n, sizeof( struct walk_id ) );
+		if ( slots == NULL ) {
+			return true;
+		}
+		for ( size_t i = 0; i < set->slots_n; i++ ) {
+			if ( set->slots[i].ino == 0 ) {
+				continue;
+			}
+			size_t j = walk_id_hash( set->slots[i] ) & ( slots_n - 1 );
+			while ( slots[j].ino != 0 ) {
+				j = ( j + 1 ) & ( slots_n - 1 );
+			}
+			slots[j] = set->slots[i];
+		}
+		grn_free( set->slots );
+		set->slots = slots;
+		set->slots_n = slots_n;
+	}
+	size_t i = walk_id_hash( id ) & ( set->slots_n - 1 );
+	for ( ; set->slots[i].ino != 0; i = ( i + 1 ) & ( set->slots_n - 1 ) ) {
+		if ( set->slots[i].ino == id.ino && set->slots[i].dev == id.dev ) {
+			return false;
+		}
+	}
+	set->slots[i] = id;
+	set->used_n++;
+	return true;
+}
+
+struct grn_walk_seen {
+	pthread_mutex_t lock;
+	struct walk_id_set files;
+	int dupes_n;
+};
+
+struct grn_walk_seen *grn_walk_seen_alloc( int *out_err ) {
+	*out_err = GRN_OK;
+	struct grn_walk_seen *seen = calloc( 1, sizeof( struct grn_walk_seen ) );
+	ERR_NULL( seen == NULL, GRN_ERR_OOM );
+	pthread_mutex_init( &seen->lock, NULL );
+	return seen;
+}
+
+void grn_walk_seen_free( struct grn_walk_seen *seen ) {
+	if ( seen == NULL ) {
+		return;
+	}
+	pthread_mutex_destroy( &seen->lock );
+	grn_free( seen->files.slots );
+	free( seen );
+}
+
+int grn_walk_seen_get_dupes_n( struct grn_walk_seen *seen ) {
+	pthread_mutex_lock( &seen->lock );
+	int dupes_n = seen->dupes_n;
+	pthread_mutex_unlock( &seen->lock );
+	return dupes_n;
+}
+
+// whether the file should be handed over. Always true without a set.
+bool walk_seen_add( struct grn_walk_seen *seen, dev_t dev, ino_t ino ) {
+	if ( seen == NULL ) {
+		return true;
+	}
+	pthread_mutex_lock( &seen->lock );
+	bool is_new = walk_id_set_add( &seen->files, ( struct walk_id ) {
+		.dev = dev,
+		.ino = ino,
+	} );
+	if ( !is_new ) {
+		seen->dupes_n++;
+	}
+	pthread_mutex_unlock( &seen->lock );
+	return is_new;
+}
+
+// END id sets
+
+#ifdef _WIN32
+
+// BEGIN nftw walk
+// there's no openat or d_type to speed things up here, so this stays the plain single-threaded walk
+
+// global because nftw doesn't support a custom callback argument, hence the lock
+pthread_mutex_t cat_lock = PTHREAD_MUTEX_INITIALIZER;
+struct vector *cat_vec;
+const char *cat_ext;
+struct grn_walk_seen *cat_seen;
+
+// used as nftw callback below
+int cat_nftw_cb( const char *path, const struct stat *st, int file_type, struct FTW *ftw_info ) {
+	int in_err;
+
+	// ignore non-files and files without the correct extension
+	if (
+	    file_type != FTW_F ||
+	    !walk_has_extension( path, strlen( path ), cat_ext, strlen( cat_ext ) ) ||
+	    // not a perfect way to determine if the file is readable (it only checks the owner), but better performance than access
+	    !( st->st_mode & S_IRUSR ) ||
+	    !walk_seen_add( cat_seen, st->st_dev, st->st_ino )
+	) {
+		return 0;
+	}
+
+	// the path might not be dynamic (it might actually change between callback runs, if nftw uses readdir internally?)
+	char *path_cp = grn_strcpy_malloc( path, &in_err );
+	if ( in_err ) {
+		return in_err;
+	}
+	vector_push( cat_vec, &path_cp, &in_err );
+	if ( in_err ) {
+		free( path_cp );
+	}
+	return in_err;
+}
+
+void grn_walk_torrent_files( struct vector *vec, const char *path, const char *extension, int threads_n, int flags, struct grn_walk_seen *seen, int *out_err ) {
+	*out_err = GRN_OK;
+	size_t start_n = vector_length( vec );
+
+	pthread_mutex_lock( &cat_lock );
+	cat_vec = vec;
+	cat_ext = extension != NULL ? extension : ".torrent";
+	cat_seen = seen;
+	int nftw_err = nftw( path, cat_nftw_cb, 16, 0 );
+	int nftw_errno = errno;
+	pthread_mutex_unlock( &cat_lock );
+
+	if ( flags & GRN_WALK_SORTED ) {
+		qsort( ( char ** ) vec->buffer + start_n, vector_length( vec ) - start_n, sizeof( char * ), walk_path_cmp );
+	}
+	ERR( nftw_err == -1, walk_stat_err( nftw_errno ) );
+	// error returned by callback
+	ERR( nftw_err, nftw_err );
+}
+
+// nftw has to finish before anything can be handed over, so this just hands everything over at the end
+void grn_walk_torrent_files_each( const char *path, const char *extension, int threads_n, struct grn_walk_seen *seen, grn_walk_found_fn found, void *found_arg, int *out_err ) {
+	*out_err = GRN_OK;
+	int in_err;
+
+	struct vector *vec = vector_alloc( sizeof( char * ), out_err );
+	ERR_FW();
+	grn_walk_torrent_files( vec, path, extension, threads_n, 0, seen, &in_err );
+	for ( size_t i = 0; i < vector_length( vec ); i++ ) {
+		char *file = * ( char ** ) vector_get( vec, i );
+		if ( *out_err ) {
+			free( file );
+			continue;
+		}
+		found( found_arg, file, out_err );
+	}
+	vector_free( vec );
+	ERR_FW();
+	ERR( in_err, in_err );
+}
+
+// END nftw walk
+
+#else
+
+// BEGIN parallel walk
+
+struct grn_walk;
+
+// a directory being read or waiting to be, as far as telling whether a link loops back into it goes. Only kept for
+// sorted walks, where each one is read through every path that leads to it, so that the smallest can be picked. Freed
+// once the directory has been read and nothing queued under it is left.
+struct walk_node {
+	struct walk_node *parent;
+	struct walk_id id;
+	long refs; // only touched atomically
+};
+
+// drops a reference to node, and to whatever it leads up to that isn't needed anymore. Noop if NULL.
+void walk_node_release( struct walk_node *node ) {
+	while ( node != NULL && __atomic_sub_fetch( &node->refs, 1, __ATOMIC_SEQ_CST ) == 0 ) {
+		struct walk_node *parent = node->parent;
+		free( node );
+		node = parent;
+	}
+}
+
+// whether id is node or one of the directories above it
+bool walk_node_loops( struct walk_node *node, struct walk_id id ) {
+	for ( ; node != NULL; node = node->parent ) {
+		if ( node->id.ino == id.ino && node->id.dev == id.dev ) {
+			return true;
+		}
+	}
+	return false;
+}
+
+struct walk_queued {
+	char *path;
+	struct walk_node *parent; // a reference is held as long as this is queued
+};
+
+// a file that was found, with what it takes to tell aliases apart after sorting
+struct walk_found {
+	char *path;
+	size_t name_at; // where the last component starts
+	struct walk_id dir;
+	struct walk_id file;
+};
+
+// the same entry of the same directory next to each other, smallest path first
+int walk_found_alias_cmp( const void *a, const void *b ) {
+	const struct walk_found *fa = a, *fb = b;
+	if ( fa->dir.dev != fb->dir.dev ) {
+		return fa->dir.dev < fb->dir.dev ? -1 : 1;
+	}
+	if ( fa->dir.ino != fb->dir.ino ) {
+		return fa->dir.ino < fb->dir.ino ? -1 : 1;
+	}
+	int cmp = strcmp( fa->path + fa->name_at, fb->path + fb->name_at );
+	return cmp ? cmp : strcmp( fa->path, fb->path );
+}
+
+int walk_found_path_cmp( const void *a, const void *b ) {
+	return strcmp( ( ( const struct walk_found * ) a )->path, ( ( const struct walk_found * ) b )->path );
+}
+
+struct walk_worker {
+	struct grn_walk *walk;
+	pthread_t thread;
+	// paths of directories that still have to be read. The worker itself takes the newest, which keeps it close to
+	// where it just was, and idle workers steal the oldest, which tend to be the biggest subtrees.
+	pthread_mutex_t lock;
+	struct walk_queued *dirs;
+	int dirs_start;
+	int dirs_end;
+	int dirs_alloc;
+	// struct walk_found for everything this worker found, merged into the caller's vector at the end. Unused when the
+	// walk has found.
+	struct vector *files;
+};
+
+struct grn_walk {
+	struct walk_worker *workers;
+	int workers_n;
+	const char *ext;
+	size_t ext_n;
+	// files are handed to this as soon as they are found, if set
+	grn_walk_found_fn found;
+	void *found_arg;
+	// files found by this or earlier walks, if set. Only looked at once everything is sorted, for sorted walks.
+	struct grn_walk_seen *seen;
+	bool sorted;
+	// directories queued or being read. Once it hits 0, nothing more can turn up. Only touched atomically.
+	long pending;
+	// directories sitting in some worker's queue. Only touched atomically.
+	long queued;
+	// workers waiting for something to be queued. Only touched atomically.
+	int idle_n;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	// everything below is protected by lock
+	int err; // first error, which stops the walk
+	struct walk_id_set dirs_seen; // unused for sorted walks, which go by walk_node instead
+};
+
+void walk_fail( struct grn_walk *walk, int err ) {
+	pthread_mutex_lock( &walk->lock );
+	if ( !walk->err ) {
+		walk->err = err;
+	}
+	pthread_cond_broadcast( &walk->cond );
+	pthread_mutex_unlock( &walk->lock );
+}
+
+bool walk_stopped( struct grn_walk *walk ) {
+	pthread_mutex_lock( &walk->lock );
+	bool stopped = walk->err != GRN_OK;
+	pthread_mutex_unlock( &walk->lock );
+	return stopped;
+}
+
+// takes ownership of path and of a reference to parent
+void walk_push_dir( struct walk_worker *worker, char *path, struct walk_node *parent, int *out_err ) {
+	*out_err = GRN_OK;
+	struct grn_walk *walk = worker->walk;
+
+	pthread_mutex_lock( &worker->lock );
+	if ( worker->dirs_end == worker->dirs_alloc ) {
+		if ( worker->dirs_start > worker->dirs_alloc / 2 ) {
+			// mostly stolen from, so there's room at the front
+			memmove( worker->dirs, worker->dirs + worker->dirs_start, ( worker->dirs_end - worker->dirs_start ) * sizeof( struct walk_queued ) );
+			worker->dirs_end -= worker->dirs_start;
+			worker->dirs_start = 0;
+		} else {
+			int dirs_alloc = worker->dirs_alloc ? worker->dirs_alloc * 2 : 16;
+			struct walk_queued *dirs = realloc( worker->dirs, dirs_alloc * sizeof( struct walk_queued ) );
+			if ( dirs == NULL ) {
+				pthread_mutex_unlock( &worker->lock );
+				free( path );
+				walk_node_release( parent );
+				ERR( GRN_ERR_OOM );
+			}
+			worker->dirs = dirs;
+			worker->dirs_alloc = dirs_alloc;
+		}
+	}
+	// counted before anyone can steal it, so that pending can't reach 0 while it's still around
+	__atomic_add_fetch( &walk->pending, 1, __ATOMIC_SEQ_CST );
+	__atomic_add_fetch( &walk->queued, 1, __ATOMIC_SEQ_CST );
+	worker->dirs[worker->dirs_end++] = ( struct walk_queued ) {
+		.path = path,
+		.parent = parent,
+	};
+	pthread_mutex_unlock( &worker->lock );
+
+	// pairs with walk_wait, which counts itself idle before it checks queued
+	if ( __atomic_load_n( &walk->idle_n, __ATOMIC_SEQ_CST ) > 0 ) {
+		pthread_mutex_lock( &walk->lock );
+		pthread_cond_signal( &walk->cond );
+		pthread_mutex_unlock( &walk->lock );
+	}
+}
+
+struct walk_queued walk_take_dir( struct walk_worker *worker, bool own ) {
+	struct walk_queued dir = { 0 };
+	pthread_mutex_lock( &worker->lock );
+	if ( worker->dirs_start < worker->dirs_end ) {
+		dir = own ? worker->dirs[--worker->dirs_end] : worker->dirs[worker->dirs_start++];
+		if ( worker->dirs_start == worker->dirs_end ) {
+			worker->dirs_start = worker->dirs_end = 0;
+		}
+	}
+	pthread_mutex_unlock( &worker->lock );
+	if ( dir.path != NULL ) {
+		__atomic_sub_fetch( &worker->walk->queued, 1, __ATOMIC_SEQ_CST );
+	}
+	return dir;
+}
+
+struct walk_queued walk_next_dir( struct walk_worker *worker ) {
+	struct walk_queued dir = walk_take_dir( worker, true );
+	struct grn_walk *walk = worker->walk;
+	int self = worker - walk->workers;
+	for ( int i = 1; dir.path == NULL && i < walk->workers_n; i++ ) {
+		dir = walk_take_dir( &walk->workers[( self + i ) % walk->workers_n], false );
+	}
+	return dir;
+}
+
+// sleeps until there may be something to steal. False once the walk is over.
+bool walk_wait( struct grn_walk *walk ) {
+	pthread_mutex_lock( &walk->lock );
+	__atomic_add_fetch( &walk->idle_n, 1, __ATOMIC_SEQ_CST );
+	while (
+	    __atomic_load_n( &walk->queued, __ATOMIC_SEQ_CST ) == 0 &&
+	    __atomic_load_n( &walk->pending, __ATOMIC_SEQ_CST ) > 0 &&
+	    !walk->err
+	) {
+		pthread_cond_wait( &walk->cond, &walk->lock );
+	}
+	__atomic_sub_fetch( &walk->idle_n, 1, __ATOMIC_SEQ_CST );
+	bool more = __atomic_load_n( &walk->pending, __ATOMIC_SEQ_CST ) > 0 && !walk->err;
+	pthread_mutex_unlock( &walk->lock );
+	return more;
+}
+
+// d_type when the filesystem gives one, otherwise whatever the path (or what it links to) turns out to be.
+// DT_UNKNOWN for anything that is gone or is neither a file nor a directory. With out_st, files are always looked at,
+// and out_st is filled in for them.
+int walk_entry_type( DIR *dir, struct dirent *entry, struct stat *out_st ) {
+	int type = DT_UNKNOWN;
+#ifdef _DIRENT_HAVE_D_TYPE
+	type = entry->d_type;
+	if ( type == DT_DIR || ( type == DT_REG && out_st == NULL ) ) {
+		return type;
+	}
+	if ( type != DT_REG && type != DT_LNK && type != DT_UNKNOWN ) {
+		return DT_UNKNOWN;
+	}
+#endif
+	struct stat st;
+	if ( out_st == NULL ) {
+		out_st = &st;
+	}
+	if ( fstatat( dirfd( dir ), entry->d_name, out_st, 0 ) ) {
+		return DT_UNKNOWN;
+	}
+	return S_ISDIR( out_st->st_mode ) ? DT_DIR : S_ISREG( out_st->st_mode ) ? DT_REG : DT_UNKNOWN;
+}
+
+void walk_read_dir( struct walk_worker *worker, const char *path, struct walk_node *parent, int *out_err ) {
+	*out_err = GRN_OK;
+	struct grn_walk *walk = worker->walk;
+
+	int fd = open( path, O_RDONLY | O_DIRECTORY | O_CLOEXEC );
+	// same as nftw: a directory that can't be read is skipped over
+	if ( fd < 0 ) {
+		return;
+	}
+	// one stat per directory rather than per entry, to notice links looping back
+	struct stat st;
+	struct walk_id id = { 0 };
+	if ( !fstat( fd, &st ) ) {
+		id = ( struct walk_id ) {
+			.dev = st.st_dev,
+			.ino = st.st_ino,
+		};
+	}
+	struct walk_node *node = NULL;
+	if ( walk->sorted ) {
+		// a directory reached through several links is read through each of them, so that which path ends up being
+		// kept doesn't depend on which got there first. Only links back up to where they are have to be stopped.
+		if ( id.ino != 0 && walk_node_loops( parent, id ) ) {
+			close( fd );
+			return;
+		}
+		node = malloc( sizeof( struct walk_node ) );
+		if ( node == NULL ) {
+			close( fd );
+			ERR( GRN_ERR_OOM );
+		}
+		*node = ( struct walk_node ) {
+			.parent = parent,
+			.id = id,
+			.refs = 1,
+		};
+		if ( parent != NULL ) {
+			__atomic_add_fetch( &parent->refs, 1, __ATOMIC_SEQ_CST );
+		}
+	} else if ( id.ino != 0 ) {
+		pthread_mutex_lock( &walk->lock );
+		bool is_new = walk_id_set_add( &walk->dirs_seen, id );
+		pthread_mutex_unlock( &walk->lock );
+		if ( !is_new ) {
+			close( fd );
+			return;
+		}
+	}
+	DIR *dir = fdopendir( fd );
+	if ( dir == NULL ) {
+		close( fd );
+		walk_node_release( node );
+		return;
+	}
+
+	struct dirent *entry;
+	while ( errno = 0, ( entry = readdir( dir ) ) != NULL ) {
+		const char *name = entry->d_name;
+		if ( name[0] == '.' && ( name[1] == '\0' || ( name[1] == '.' && name[2] == '\0' ) ) ) {
+			continue;
+		}
+		// most entries are other files, which can be dismissed without looking any further
+		size_t name_n = strlen( name );
+		bool wanted = walk_has_extension( name, name_n, walk->ext, walk->ext_n );
+#ifdef _DIRENT_HAVE_D_TYPE
+		if ( !wanted && entry->d_type == DT_REG ) {
+			continue;
+		}
+#endif
+		// telling whether it's readable and telling duplicates apart both take a stat of each wanted file. d_ino would
+		// do for the latter, but it isn't always the file's st_ino, eg on overlayfs.
+		struct stat entry_st;
+		int type = walk_entry_type( dir, entry, wanted ? &entry_st : NULL );
+		if ( type == DT_UNKNOWN || ( type == DT_REG && !wanted ) ) {
+			continue;
+		}
+		if (
+		    type == DT_REG && (
+		        // not a perfect way to determine if the file is readable (it only checks the owner), but better performance than access
+		        !( entry_st.st_mode & S_IRUSR ) ||
+		        ( !walk->sorted && !walk_seen_add( walk->seen, entry_st.st_dev, entry_st.st_ino ) )
+		    )
+		) {
+			continue;
+		}
+		char *child = walk_join( path, name, out_err );
+		ERR_FW_CLEANUP();
+		if ( type == DT_DIR ) {
+			if ( node != NULL ) {
+				__atomic_add_fetch( &node->refs, 1, __ATOMIC_SEQ_CST );
+			}
+			walk_push_dir( worker, child, node, out_err );
+			ERR_FW_CLEANUP();
+		} else if ( walk->found != NULL ) {
+			walk->found( walk->found_arg, child, out_err );
+			ERR_FW_CLEANUP();
+		} else {
+			struct walk_found found = {
+				.path = child,
+				.name_at = strlen( child ) - name_n,
+				.dir = id,
+				.file = {
+					.dev = entry_st.st_dev,
+					.ino = entry_st.st_ino,
+				},
+			};
+			vector_push( worker->files, &found, out_err );
+			if ( *out_err ) {
+				free( child );
+				goto cleanup;
+			}
+		}
+	}
+	if ( errno ) {
+		*out_err = GRN_ERR_FS_NFTW;
+	}
+	goto cleanup;
+cleanup:
+	closedir( dir );
+	walk_node_release( node );
+}
+
+void *walk_worker_main( void *arg ) {
+	struct walk_worker *worker = arg;
+	struct grn_walk *walk = worker->walk;
+	int in_err;
+
+	while ( !walk_stopped( walk ) ) {
+		struct walk_queued dir = walk_next_dir( worker );
+		if ( dir.path == NULL ) {
+			if ( !walk_wait( walk ) ) {
+				break;
+			}
+			continue;
+		}
+		walk_read_dir( worker, dir.path, dir.parent, &in_err );
+		free( dir.path );
+		walk_node_release( dir.parent );
+		if ( in_err ) {
+			walk_fail( walk, in_err );
+		}
+		if ( __atomic_sub_fetch( &walk->pending, 1, __ATOMIC_SEQ_CST ) == 0 ) {
+			pthread_mutex_lock( &walk->lock );
+			pthread_cond_broadcast( &walk->cond );
+			pthread_mutex_unlock( &walk->lock );
+		}
+	}
+	return NULL;
+}
+
+// sorts the found files by path and leaves out every alias but the first, which for a sorted walk is the only way to
+// tell. Paths that are left out are freed and set to NULL.
+void walk_sort_found( struct walk_found *found, size_t found_n, struct grn_walk_seen *seen ) {
+	// the same directory read through several paths
+	qsort( found, found_n, sizeof( struct walk_found ), walk_found_alias_cmp );
+	for ( size_t i = 1; i < found_n; i++ ) {
+		struct walk_found *prev = &found[i - 1];
+		if (
+		    found[i].dir.ino != 0 &&
+		    found[i].dir.ino == prev->dir.ino && found[i].dir.dev == prev->dir.dev &&
+		    strcmp( found[i].path + found[i].name_at, prev->path + prev->name_at ) == 0
+		) {
+			// the smallest moves along, so that the next one is compared against it
+			struct walk_found smallest = *prev;
+			*prev = found[i];
+			found[i] = smallest;
+			free( prev->path );
+			prev->path = NULL;
+		}
+	}
+	size_t kept_n = 0;
+	for ( size_t i = 0; i < found_n; i++ ) {
+		if ( found[i].path != NULL ) {
+			found[kept_n++] = found[i];
+		}
+	}
+	qsort( found, kept_n, sizeof( struct walk_found ), walk_found_path_cmp );
+	for ( size_t i = 0; i < kept_n; i++ ) {
+		if ( !walk_seen_add( seen, found[i].file.dev, found[i].file.ino ) ) {
+			free( found[i].path );
+			found[i].path = NULL;
+		}
+	}
+	for ( size_t i = kept_n; i < found_n; i++ ) {
+		found[i].path = NULL;
+	}
+}
+
+// moves everything the workers found into vec, then frees the walk
+void walk_finish( struct grn_walk *walk, struct vector *vec, int *out_err ) {
+	*out_err = GRN_OK;
+
+	size_t found_n = 0;
+	for ( int i = 0; i < walk->workers_n; i++ ) {
+		found_n += vector_length( walk->workers[i].files );
+	}
+	struct walk_found *found = NULL;
+	if ( walk->sorted && found_n > 0 ) {
+		found = malloc( found_n * sizeof( struct walk_found ) );
+		if ( found == NULL ) {
+			*out_err = GRN_ERR_OOM;
+		}
+	}
+	size_t found_i = 0;
+	for ( int i = 0; i < walk->workers_n; i++ ) {
+		struct walk_worker *worker = &walk->workers[i];
+		for ( size_t j = 0; j < vector_length( worker->files ); j++ ) {
+			struct walk_found *file = vector_get( worker->files, j );
+			if ( found != NULL ) {
+				found[found_i++] = *file;
+				continue;
+			}
+			if ( !*out_err ) {
+				vector_push( vec, &file->path, out_err );
+			}
+			if ( *out_err ) {
+				free( file->path );
+			}
+		}
+		vector_free( worker->files );
+		// only left over when the walk stopped early
+		for ( int j = worker->dirs_start; j < worker->dirs_end; j++ ) {
+			free( worker->dirs[j].path );
+			walk_node_release( worker->dirs[j].parent );
+		}
+		grn_free( worker->dirs );
+		pthread_mutex_destroy( &worker->lock );
+	}
+	grn_free( walk->workers );
+	grn_free( walk->dirs_seen.slots );
+	pthread_cond_destroy( &walk->cond );
+	pthread_mutex_destroy( &walk->lock );
+
+	if ( found == NULL ) {
+		return;
+	}
+	walk_sort_found( found, found_n, walk->seen );
+	for ( size_t i = 0; i < found_n; i++ ) {
+		if ( found[i].path == NULL ) {
+			continue;
+		}
+		if ( !*out_err ) {
+			vector_push( vec, &found[i].path, out_err );
+		}
+		if ( *out_err ) {
+			free( found[i].path );
+		}
+	}
+	free( found );
+}
+
+void walk_dir( struct vector *vec, grn_walk_found_fn found, void *found_arg, struct grn_walk_seen *seen, const char *path, const char *ext, int threads_n, int flags, int *out_err ) {
+	*out_err = GRN_OK;
+	int in_err;
+
+	struct grn_walk walk = {
+		.ext = ext,
+		.ext_n = strlen( ext ),
+		.found = found,
+		.found_arg = found_arg,
+		.seen = seen,
+		.sorted = flags & GRN_WALK_SORTED,
+	};
+	pthread_mutex_init( &walk.lock, NULL );
+	pthread_cond_init( &walk.cond, NULL );
+	walk.workers = calloc( threads_n, sizeof( struct walk_worker ) );
+	if ( walk.workers == NULL ) {
+		walk_finish( &walk, vec, &in_err );
+		ERR( GRN_ERR_OOM );
+	}
+	for ( ; walk.workers_n < threads_n; walk.workers_n++ ) {
+		struct walk_worker *worker = &walk.workers[walk.workers_n];
+		worker->walk = &walk;
+		pthread_mutex_init( &worker->lock, NULL );
+		worker->files = vector_alloc( sizeof( struct walk_found ), out_err );
+		if ( *out_err ) {
+			pthread_mutex_destroy( &worker->lock );
+			walk_finish( &walk, vec, &in_err );
+			return;
+		}
+	}
+
+	char *root = grn_strcpy_malloc( path, out_err );
+	if ( !*out_err ) {
+		walk_push_dir( &walk.workers[0], root, NULL, out_err );
+	}
+	if ( *out_err ) {
+		walk_finish( &walk, vec, &in_err );
+		return;
+	}
+
+	// the calling thread is the first worker. Fewer threads than asked for only makes the walk slower, so a thread
+	// that can't be started is no reason to fail.
+	int started_n = 1;
+	for ( ; started_n < walk.workers_n; started_n++ ) {
+		if ( pthread_create( &walk.workers[started_n].thread, NULL, walk_worker_main, &walk.workers[started_n] ) ) {
+			break;
+		}
+	}
+	walk_worker_main( &walk.workers[0] );
+	for ( int i = 1; i < started_n; i++ ) {
+		pthread_join( walk.workers[i].thread, NULL );
+	}
+
+	int walk_err = walk.err;
+	walk_finish( &walk, vec, out_err );
+	ERR_FW();
+	ERR( walk_err, walk_err );
+}
+
+// adds to vec, unless found is set
+void walk_torrent_files( struct vector *vec, grn_walk_found_fn found, void *found_arg, struct grn_walk_seen *seen, const char *path, const char *extension, int threads_n, int flags, int *out_err ) {
+	*out_err = GRN_OK;
+	const char *ext = extension != NULL ? extension : ".torrent";
+
+	// symbolic links are followed all the way, including the one we start at
+	struct stat st;
+	ERR( stat( path, &st ), walk_stat_err( errno ) );
+	if ( !S_ISDIR( st.st_mode ) ) {
+		if (
+		    !walk_has_extension( path, strlen( path ), ext, strlen( ext ) ) ||
+		    // not a perfect way to determine if the file is readable (it only checks the owner), but better performance than access
+		    !( st.st_mode & S_IRUSR ) ||
+		    !walk_seen_add( seen, st.st_dev, st.st_ino )
+		) {
+			return;
+		}
+		char *path_cp = grn_strcpy_malloc( path, out_err );
+		ERR_FW();
+		if ( found != NULL ) {
+			found( found_arg, path_cp, out_err );
+			return;
+		}
+		vector_push( vec, &path_cp, out_err );
+		if ( *out_err ) {
+			free( path_cp );
+		}
+		return;
+	}
+
+	if ( threads_n < 1 ) {
+		threads_n = grn_cpu_count() * GRN_WALK_THREADS_PER_CPU;
+		if ( threads_n > GRN_WALK_THREADS_MAX ) {
+			threads_n = GRN_WALK_THREADS_MAX;
+		}
+	}
+	walk_dir( vec, found, found_arg, seen, path, ext, threads_n, flags, out_err );
+}
+
+// whatever was found before an error is still there, and sorted like everything else
+void grn_walk_torrent_files( struct vector *vec, const char *path, const char *extension, int threads_n, int flags, struct grn_walk_seen *seen, int *out_err ) {
+	walk_torrent_files( vec, NULL, NULL, seen, path, extension, threads_n, flags, out_err );
+}
+
+void grn_walk_torrent_files_each( const char *path, const char *extension, int threads_n, struct grn_walk_seen *seen, grn_walk_found_fn found, void *found_arg, int *out_err ) {
+	walk_torrent_files( NULL, found, found_arg, seen, path, extension, threads_n, 0, out_err );
+}
+
+// END parallel walk
+
+#endif
@@ -0,0 +1,54 @@
+#ifndef H_GRN_WALK
+#define H_GRN_WALK
+
+#include "vector.h"
+
+// threads used by grn_walk_torrent_files when none are asked for. Directory listings are mostly waiting on the
+// disk or network, so this is more than the number of processors, up to GRN_WALK_THREADS_MAX.
+#define GRN_WALK_THREADS_PER_CPU 2
+#define GRN_WALK_THREADS_MAX 16
+
+enum grn_walk_flags {
+	// sort the paths that were found, so that the result doesn't depend on which thread got to what first. A file or
+	// directory reachable through several paths is found through the smallest of them, which takes reading such a
+	// directory once for each path.
+	GRN_WALK_SORTED = 1,
+};
+
+/**
+ * Files found so far, by device and inode, so that a file reached through several paths (hard links, symbolic links,
+ * or one starting path inside another) is only found once. Can be shared by several walks, including ones running at
+ * the same time.
+ */
+struct grn_walk_seen;
+
+struct grn_walk_seen *grn_walk_seen_alloc( int *out_err );
+// noop if NULL
+void grn_walk_seen_free( struct grn_walk_seen *seen );
+// how many files were left out for having been found before
+int grn_walk_seen_get_dupes_n( struct grn_walk_seen *seen );
+
+/**
+ * Adds the files under path that end in extension to vec, reading directories on several threads at once. Each path
+ * is dynamically allocated. Symbolic links are followed, and a directory that was already seen (through a link that
+ * loops back, say) is not read again. Safe to call from several threads at once with different vectors.
+ * A path that is not a directory is added if it has the extension. Subdirectories that can't be opened are skipped, and
+ * so are files that the owner can't read, which costs a stat for each file with the extension.
+ * @param threads_n at most this many threads read directories. Less than 1 picks a default.
+ * @param flags see enum grn_walk_flags
+ * @param seen files in here are left out, and the rest are added to it. May be NULL, in which case a file is only left
+ * out if it was reached through a directory that was seen before.
+ * Fails with GRN_ERR_ENOENT if path can't be found, or GRN_ERR_FS_NFTW if a directory couldn't be read to the end,
+ * in which case everything that was found is still added.
+ */
+void grn_walk_torrent_files( struct vector *vec, const char *path, const char *extension, int threads_n, int flags, struct grn_walk_seen *seen, int *out_err );
+
+// takes ownership of path, even when it fails. Failing stops the walk with that error.
+typedef void ( *grn_walk_found_fn )( void *arg, char *path, int *out_err );
+/**
+ * The same as grn_walk_torrent_files, except that each file is handed to found as soon as it turns up, instead of all
+ * of them being collected at the end. found may be called from several threads at once.
+ */
+void grn_walk_torrent_files_each( const char *path, const char *extension, int threads_n, struct grn_walk_seen *seen, grn_walk_found_fn found, void *found_arg, int *out_err );
+
+#endif
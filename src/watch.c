@@ -0,0 +1,560 @@
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#ifdef __linux__
+#include <time.h>
+#include <poll.h>
+#include <dirent.h>
+#include <sys/inotify.h>
+#endif
+
+#include "watch.h"
+#include "walk.h"
+#include "vector.h"
+#include "util.h"
+#include "err.h"
+
+#ifndef __linux__
+
+struct grn_watch *grn_watch_alloc( int *out_err ) {
+	ERR_NULL( GRN_ERR_WATCH );
+}
+
+void grn_watch_free( struct grn_watch *watch ) {
+}
+
+void grn_watch_add( struct grn_watch *watch, const char *path, const char *extension, int *out_err ) {
+	ERR( GRN_ERR_WATCH );
+}
+
+void grn_watch_wait( struct grn_watch *watch, struct vector *vec, int *out_err ) {
+	ERR( GRN_ERR_WATCH );
+}
+
+#else
+
+// written and closed, or renamed into place, which is how most clients save files. Created directories are watched
+// too, in case torrents turn up in them, and directories that are moved away aren't anymore.
+#define WATCH_MASK ( IN_CLOSE_WRITE | IN_MOVED_TO | IN_CREATE | IN_MOVED_FROM | IN_MOVE_SELF | IN_ONLYDIR )
+
+// what to look for in one watched directory. A directory can have several of these, like deluge's state directory,
+// which has both .torrent files and torrents.state in it.
+struct watch_entry {
+	int wd;
+	char *dir;
+	char *match; // an extension, or a file name if exact
+	bool exact;
+	bool root; // passed to grn_watch_add, rather than found under one that was
+	// the directory itself, to tell whether dir still leads to it once something was moved
+	dev_t dev;
+	ino_t ino;
+};
+
+struct grn_watch {
+	int fd;
+	// sorted by wd. The kernel hands out increasing wds, so new entries nearly always go at the end.
+	struct watch_entry *entries;
+	int entries_n;
+	int entries_alloc;
+	// paths that changed since the last batch, possibly more than once
+	struct vector *pending;
+	// the kernel dropped events, so anything could have changed
+	bool overflowed;
+};
+
+long watch_now_ms( void ) {
+	struct timespec ts;
+	clock_gettime( CLOCK_MONOTONIC, &ts );
+	return ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+char *watch_join( const char *dir, const char *name, int *out_err ) {
+	*out_err = GRN_OK;
+	char *path = malloc( strlen( dir ) + 1 + strlen( name ) + 1 );
+	ERR_NULL( path == NULL, GRN_ERR_OOM );
+	strcpy( path, dir );
+	strcat( path, "/" );
+	strcat( path, name );
+	return path;
+}
+
+// index of the first entry with wd, or of where it would go
+int watch_find( struct grn_watch *watch, int wd ) {
+	int lo = 0, hi = watch->entries_n;
+	while ( lo < hi ) {
+		int mid = lo + ( hi - lo ) / 2;
+		if ( watch->entries[mid].wd < wd ) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+	return lo;
+}
+
+// whether entry's dir still leads to the directory it was watched as
+bool watch_entry_current( const struct watch_entry *entry ) {
+	struct stat st;
+	return !stat( entry->dir, &st ) && st.st_dev == entry->dev && st.st_ino == entry->ino;
+}
+
+// false if the directory was already being watched for the same thing, which is also how links looping back are
+// noticed. If it was moved since, it's watched under dir from now on, and that counts as new. Takes ownership of dir
+// either way.
+bool watch_add_entry( struct grn_watch *watch, int wd, char *dir, const char *match, bool exact, bool root, int *out_err ) {
+	*out_err = GRN_OK;
+
+	int i = watch_find( watch, wd );
+	for ( ; i < watch->entries_n && watch->entries[i].wd == wd; i++ ) {
+		struct watch_entry *entry = &watch->entries[i];
+		if ( entry->exact == exact && strcmp( entry->match, match ) == 0 ) {
+			entry->root |= root;
+			if ( watch_entry_current( entry ) ) {
+				free( dir );
+				return false;
+			}
+			free( entry->dir );
+			entry->dir = dir;
+			return true;
+		}
+	}
+	struct stat st;
+	if ( stat( dir, &st ) ) {
+		// gone again already
+		free( dir );
+		return false;
+	}
+	char *match_cp = grn_strcpy_malloc( match, out_err );
+	if ( *out_err ) {
+		free( dir );
+		return false;
+	}
+	if ( watch->entries_n == watch->entries_alloc ) {
+		int entries_alloc = watch->entries_alloc ? watch->entries_alloc * 2 : 16;
+		struct watch_entry *entries = realloc( watch->entries, entries_alloc * sizeof( struct watch_entry ) );
+		if ( entries == NULL ) {
+			free( dir );
+			free( match_cp );
+			ERR_NULL( GRN_ERR_OOM );
+		}
+		watch->entries = entries;
+		watch->entries_alloc = entries_alloc;
+	}
+	memmove( watch->entries + i + 1, watch->entries + i, ( watch->entries_n - i ) * sizeof( struct watch_entry ) );
+	watch->entries[i] = ( struct watch_entry ) {
+		.wd = wd,
+		.dir = dir,
+		.match = match_cp,
+		.exact = exact,
+		.root = root,
+		.dev = st.st_dev,
+		.ino = st.st_ino,
+	};
+	watch->entries_n++;
+	return true;
+}
+
+void watch_remove_wd( struct grn_watch *watch, int wd ) {
+	int start = watch_find( watch, wd );
+	int end = start;
+	for ( ; end < watch->entries_n && watch->entries[end].wd == wd; end++ ) {
+		free( watch->entries[end].dir );
+		free( watch->entries[end].match );
+	}
+	memmove( watch->entries + start, watch->entries + end, ( watch->entries_n - end ) * sizeof( struct watch_entry ) );
+	watch->entries_n -= end - start;
+}
+
+// stops watching dir and everything under it, as far as they were reached through dir. Directories that are still
+// watched through some other path keep being watched.
+void watch_remove_tree( struct grn_watch *watch, const char *dir ) {
+	size_t dir_n = strlen( dir );
+	// at most one of each entry's wd, for the ones that may not be needed anymore
+	int *wds = malloc( watch->entries_n * sizeof( int ) );
+	int wds_n = 0;
+	int kept_n = 0;
+	for ( int i = 0; i < watch->entries_n; i++ ) {
+		struct watch_entry *entry = &watch->entries[i];
+		if ( strncmp( entry->dir, dir, dir_n ) || ( entry->dir[dir_n] != '\0' && entry->dir[dir_n] != '/' ) ) {
+			watch->entries[kept_n++] = *entry;
+			continue;
+		}
+		if ( wds != NULL && ( wds_n == 0 || wds[wds_n - 1] != entry->wd ) ) {
+			wds[wds_n++] = entry->wd;
+		}
+		free( entry->dir );
+		free( entry->match );
+	}
+	watch->entries_n = kept_n;
+	// not removing a watch only costs a watch, since events without entries are ignored
+	for ( int i = 0; i < wds_n; i++ ) {
+		int at = watch_find( watch, wds[i] );
+		if ( at == watch->entries_n || watch->entries[at].wd != wds[i] ) {
+			inotify_rm_watch( watch->fd, wds[i] );
+		}
+	}
+	grn_free( wds );
+}
+
+// wd was moved, so anything that was watched through its old path isn't anymore
+void watch_remove_moved( struct grn_watch *watch, int wd, int *out_err ) {
+	*out_err = GRN_OK;
+
+	while ( true ) {
+		int i = watch_find( watch, wd );
+		while ( i < watch->entries_n && watch->entries[i].wd == wd && watch_entry_current( &watch->entries[i] ) ) {
+			i++;
+		}
+		if ( i == watch->entries_n || watch->entries[i].wd != wd ) {
+			return;
+		}
+		// copied, since it's freed along with the entry
+		char *dir = grn_strcpy_malloc( watch->entries[i].dir, out_err );
+		ERR_FW();
+		watch_remove_tree( watch, dir );
+		free( dir );
+	}
+}
+
+// watches dir and everything under it. Takes ownership of dir.
+void watch_add_tree( struct grn_watch *watch, char *dir, const char *extension, bool root, int *out_err ) {
+	*out_err = GRN_OK;
+
+	int wd = inotify_add_watch( watch->fd, dir, WATCH_MASK );
+	if ( wd < 0 ) {
+		free( dir );
+		ERR( GRN_ERR_WATCH );
+	}
+	if ( !watch_add_entry( watch, wd, dir, extension, false, root, out_err ) ) {
+		return;
+	}
+
+	DIR *listing = opendir( dir );
+	// it may have gone again already, and then there's nothing in it to watch
+	if ( listing == NULL ) {
+		return;
+	}
+	struct dirent *entry;
+	while ( ( entry = readdir( listing ) ) != NULL ) {
+		const char *name = entry->d_name;
+		if ( name[0] == '.' && ( name[1] == '\0' || ( name[1] == '.' && name[2] == '\0' ) ) ) {
+			continue;
+		}
+		if ( entry->d_type != DT_DIR && entry->d_type != DT_LNK && entry->d_type != DT_UNKNOWN ) {
+			continue;
+		}
+		struct stat st;
+		if ( fstatat( dirfd( listing ), name, &st, 0 ) || !S_ISDIR( st.st_mode ) ) {
+			continue;
+		}
+		char *child = watch_join( dir, name, out_err );
+		ERR_FW_CLEANUP();
+		watch_add_tree( watch, child, extension, false, out_err );
+		ERR_FW_CLEANUP();
+	}
+	goto cleanup;
+cleanup:
+	closedir( listing );
+}
+
+struct grn_watch *grn_watch_alloc( int *out_err ) {
+	*out_err = GRN_OK;
+
+	struct grn_watch *watch = calloc( 1, sizeof( struct grn_watch ) );
+	ERR_NULL( watch == NULL, GRN_ERR_OOM );
+	watch->pending = vector_alloc( sizeof( char * ), out_err );
+	if ( *out_err ) {
+		free( watch );
+		return NULL;
+	}
+	watch->fd = inotify_init1( IN_NONBLOCK | IN_CLOEXEC );
+	if ( watch->fd < 0 ) {
+		grn_watch_free( watch );
+		ERR_NULL( GRN_ERR_WATCH );
+	}
+	return watch;
+}
+
+void grn_watch_free( struct grn_watch *watch ) {
+	if ( watch == NULL ) {
+		return;
+	}
+	if ( watch->fd >= 0 ) {
+		close( watch->fd );
+	}
+	for ( int i = 0; i < watch->entries_n; i++ ) {
+		free( watch->entries[i].dir );
+		free( watch->entries[i].match );
+	}
+	grn_free( watch->entries );
+	vector_free_all( watch->pending );
+	free( watch );
+}
+
+void grn_watch_add( struct grn_watch *watch, const char *path, const char *extension, int *out_err ) {
+	*out_err = GRN_OK;
+	const char *ext = extension != NULL ? extension : ".torrent";
+
+	struct stat st;
+	ERR( stat( path, &st ), GRN_ERR_WATCH );
+	if ( S_ISDIR( st.st_mode ) ) {
+		char *dir = grn_strcpy_malloc( path, out_err );
+		ERR_FW();
+		watch_add_tree( watch, dir, ext, true, out_err );
+		return;
+	}
+
+	// files are replaced by renaming new ones over them as often as not, so it's their directory that is watched
+	const char *slash = strrchr( path, '/' );
+	char *dir = slash == NULL ? grn_strcpy_malloc( ".", out_err ) : grn_strcpy_malloc( path, out_err );
+	ERR_FW();
+	if ( slash != NULL ) {
+		// keeps the slash of "/file"
+		dir[slash == path ? 1 : slash - path] = '\0';
+	}
+	int wd = inotify_add_watch( watch->fd, dir, WATCH_MASK );
+	if ( wd < 0 ) {
+		free( dir );
+		ERR( GRN_ERR_WATCH );
+	}
+	watch_add_entry( watch, wd, dir, slash == NULL ? path : slash + 1, true, true, out_err );
+}
+
+void watch_push_pending( struct grn_watch *watch, char *path, int *out_err ) {
+	vector_push( watch->pending, &path, out_err );
+	if ( *out_err ) {
+		free( path );
+	}
+}
+
+void watch_event( struct grn_watch *watch, const struct inotify_event *event, int *out_err ) {
+	*out_err = GRN_OK;
+
+	if ( event->mask & IN_Q_OVERFLOW ) {
+		watch->overflowed = true;
+		return;
+	}
+	if ( event->mask & IN_IGNORED ) {
+		// the directory is gone, or was unmounted
+		watch_remove_wd( watch, event->wd );
+		return;
+	}
+	if ( event->mask & IN_MOVE_SELF ) {
+		watch_remove_moved( watch, event->wd, out_err );
+		return;
+	}
+	if ( event->len == 0 ) {
+		return;
+	}
+	bool is_dir = event->mask & IN_ISDIR;
+	if ( !is_dir && ( event->mask & IN_MOVED_FROM ) ) {
+		return;
+	}
+	if ( !is_dir && !( event->mask & ( IN_CLOSE_WRITE | IN_MOVED_TO ) ) ) {
+		return;
+	}
+
+	int start = watch_find( watch, event->wd );
+	int end = start;
+	while ( end < watch->entries_n && watch->entries[end].wd == event->wd ) {
+		end++;
+	}
+	if ( start == end ) {
+		return;
+	}
+
+	if ( is_dir && ( event->mask & IN_MOVED_FROM ) ) {
+		// moved away, or renamed, in which case it's added again under its new name with IN_MOVED_TO. Joined up front,
+		// since removing entries moves these.
+		char **gone = malloc( ( end - start ) * sizeof( char * ) );
+		ERR( gone == NULL, GRN_ERR_OOM );
+		int gone_n = 0;
+		for ( int i = start; i < end; i++ ) {
+			gone[gone_n] = watch_join( watch->entries[i].dir, event->name, out_err );
+			if ( *out_err ) {
+				break;
+			}
+			gone_n++;
+		}
+		for ( int i = 0; i < gone_n; i++ ) {
+			if ( !*out_err ) {
+				watch_remove_tree( watch, gone[i] );
+			}
+			free( gone[i] );
+		}
+		free( gone );
+		return;
+	}
+	if ( is_dir ) {
+		// copied, since watching the new directory adds entries and may move these
+		struct watch_entry *entries = malloc( ( end - start ) * sizeof( struct watch_entry ) );
+		ERR( entries == NULL, GRN_ERR_OOM );
+		memcpy( entries, watch->entries + start, ( end - start ) * sizeof( struct watch_entry ) );
+		for ( int i = 0; i < end - start; i++ ) {
+			if ( entries[i].exact ) {
+				continue;
+			}
+			char *dir = watch_join( entries[i].dir, event->name, out_err );
+			ERR_FW_CLEANUP();
+			// anything written into it before it was being watched is picked up straight away
+			grn_walk_torrent_files( watch->pending, dir, entries[i].match, 1, 0, NULL, out_err );
+			if ( *out_err && *out_err != GRN_ERR_ENOENT ) {
+				free( dir );
+				goto cleanup;
+			}
+			watch_add_tree( watch, dir, entries[i].match, false, out_err );
+			// it may be gone already, which is no reason to stop watching everything else
+			if ( *out_err == GRN_ERR_WATCH ) {
+				*out_err = GRN_OK;
+			}
+			ERR_FW_CLEANUP();
+		}
+		goto cleanup;
+cleanup:
+		free( entries );
+		return;
+	}
+
+	size_t name_n = strlen( event->name );
+	for ( int i = start; i < end; i++ ) {
+		struct watch_entry *entry = &watch->entries[i];
+		size_t match_n = strlen( entry->match );
+		bool matches = entry->exact ?
+		               strcmp( event->name, entry->match ) == 0 :
+		               name_n >= match_n && strcmp( event->name + name_n - match_n, entry->match ) == 0;
+		if ( matches ) {
+			char *path = watch_join( entry->dir, event->name, out_err );
+			ERR_FW();
+			watch_push_pending( watch, path, out_err );
+			ERR_FW();
+		}
+	}
+}
+
+// reads everything the kernel has queued up so far
+void watch_read( struct grn_watch *watch, int *out_err ) {
+	*out_err = GRN_OK;
+	char buffer[64 * 1024] __attribute__( ( aligned( __alignof__( struct inotify_event ) ) ) );
+
+	while ( true ) {
+		ssize_t read_n = read( watch->fd, buffer, sizeof( buffer ) );
+		if ( read_n < 0 && errno == EINTR ) {
+			continue;
+		}
+		if ( read_n < 0 && errno == EAGAIN ) {
+			return;
+		}
+		ERR( read_n <= 0, GRN_ERR_WATCH );
+		for ( char *at = buffer; at < buffer + read_n; ) {
+			const struct inotify_event *event = ( const struct inotify_event * ) at;
+			watch_event( watch, event, out_err );
+			ERR_FW();
+			at += sizeof( struct inotify_event ) + event->len;
+		}
+	}
+}
+
+// events were lost, so look at everything again
+void watch_rescan( struct grn_watch *watch, int *out_err ) {
+	*out_err = GRN_OK;
+	watch->overflowed = false;
+
+	for ( int i = 0; i < watch->entries_n; i++ ) {
+		struct watch_entry *entry = &watch->entries[i];
+		if ( !entry->root ) {
+			continue;
+		}
+		if ( entry->exact ) {
+			char *path = watch_join( entry->dir, entry->match, out_err );
+			ERR_FW();
+			if ( access( path, F_OK ) ) {
+				free( path );
+				continue;
+			}
+			watch_push_pending( watch, path, out_err );
+			ERR_FW();
+			continue;
+		}
+		grn_walk_torrent_files( watch->pending, entry->dir, entry->match, 0, 0, NULL, out_err );
+		if ( *out_err == GRN_ERR_ENOENT ) {
+			*out_err = GRN_OK;
+		}
+		ERR_FW();
+	}
+}
+
+int watch_path_cmp( const void *a, const void *b ) {
+	return strcmp( * ( char *const * ) a, * ( char *const * ) b );
+}
+
+void grn_watch_wait( struct grn_watch *watch, struct vector *vec, int *out_err ) {
+	*out_err = GRN_OK;
+
+	long first_ms = 0, last_ms = 0;
+	while ( true ) {
+		bool have_changes = vector_length( watch->pending ) > 0 || watch->overflowed;
+		int timeout = -1;
+		if ( have_changes ) {
+			long due_ms = last_ms + GRN_WATCH_QUIET_MS;
+			if ( due_ms > first_ms + GRN_WATCH_LATENCY_MS ) {
+				due_ms = first_ms + GRN_WATCH_LATENCY_MS;
+			}
+			long now_ms = watch_now_ms();
+			if ( now_ms >= due_ms ) {
+				break;
+			}
+			timeout = due_ms - now_ms;
+		}
+
+		struct pollfd poll_fd = {
+			.fd = watch->fd,
+			.events = POLLIN,
+		};
+		int polled = poll( &poll_fd, 1, timeout );
+		if ( polled < 0 && errno == EINTR ) {
+			continue;
+		}
+		ERR( polled < 0, GRN_ERR_WATCH );
+		if ( polled == 0 ) {
+			continue;
+		}
+		size_t pending_n = vector_length( watch->pending );
+		watch_read( watch, out_err );
+		ERR_FW();
+		if ( vector_length( watch->pending ) > pending_n || ( watch->overflowed && !have_changes ) ) {
+			last_ms = watch_now_ms();
+			if ( !have_changes ) {
+				first_ms = last_ms;
+			}
+		}
+	}
+
+	if ( watch->overflowed ) {
+		watch_rescan( watch, out_err );
+		ERR_FW();
+	}
+	// each path once, however many times it was written
+	char **pending = watch->pending->buffer;
+	int pending_n = vector_length( watch->pending );
+	qsort( pending, pending_n, sizeof( char * ), watch_path_cmp );
+	char *last = NULL;
+	for ( int i = 0; i < pending_n; i++ ) {
+		if ( *out_err == GRN_OK && ( last == NULL || strcmp( pending[i], last ) ) ) {
+			vector_push( vec, &pending[i], out_err );
+			if ( *out_err == GRN_OK ) {
+				last = pending[i];
+				continue;
+			}
+		}
+		free( pending[i] );
+	}
+	vector_clear( watch->pending );
+}
+
+#endif
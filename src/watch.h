@@ -0,0 +1,37 @@
+#ifndef H_GRN_WATCH
+#define H_GRN_WATCH
+
+#include "vector.h"
+
+// a batch of changes is handed over once nothing else has changed for this long...
+#ifndef GRN_WATCH_QUIET_MS
+#define GRN_WATCH_QUIET_MS 100
+#endif
+// ...or this long after the first change in it, whichever comes first
+#ifndef GRN_WATCH_LATENCY_MS
+#define GRN_WATCH_LATENCY_MS 500
+#endif
+
+/**
+ * Waits for torrent files to be written or moved into place, using inotify. Linux only; elsewhere grn_watch_alloc
+ * fails with GRN_ERR_WATCH.
+ */
+struct grn_watch;
+
+struct grn_watch *grn_watch_alloc( int *out_err );
+// noop if NULL
+void grn_watch_free( struct grn_watch *watch );
+/**
+ * Watch a directory and all of its subdirectories, including ones created later, for files ending in extension (NULL
+ * for ".torrent"), or watch a single file, whatever its name. Either way it's the same as what grn_cat_torrent_files
+ * would pick up from path.
+ * Fails with GRN_ERR_WATCH if path can't be watched, for instance because of the limit on inotify watches.
+ */
+void grn_watch_add( struct grn_watch *watch, const char *path, const char *extension, int *out_err );
+/**
+ * Block until some watched files have been written, then add their paths to vec, each once and dynamically
+ * allocated. Uses no CPU while waiting.
+ */
+void grn_watch_wait( struct grn_watch *watch, struct vector *vec, int *out_err );
+
+#endif
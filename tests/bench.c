@@ -0,0 +1,176 @@
+#define _POSIX_C_SOURCE 199309L
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include <bencode.h>
+
+// decode and encode benchmarks. Not run by `make test`; use `make bench`.
+
+#define BENCH_FILES_N 20000
+#define BENCH_SECONDS 1.0
+
+double now( void ) {
+	struct timespec ts;
+	clock_gettime( CLOCK_MONOTONIC, &ts );
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// a multi-file torrent like a big discography, where nearly all of the bytes are the file list
+char *make_many_file_torrent( int files_n, size_t *buffer_n ) {
+	size_t alloc = 256 + files_n * 128;
+	char *buffer = malloc( alloc );
+	if ( buffer == NULL ) {
+		return NULL;
+	}
+	size_t n = 0;
+	const char *announce = "https://home.opsfet.ch/abcdef0123456789abcdef0123456789/announce";
+	n += sprintf( buffer + n, "d8:announce%d:%s4:infod5:filesl", ( int )strlen( announce ), announce );
+	for ( int i = 0; i < files_n; i++ ) {
+		char dir[32], file[32];
+		sprintf( dir, "Disc %d", i / 20 + 1 );
+		sprintf( file, "%02d - Track %d.flac", i % 20 + 1, i );
+		n += sprintf( buffer + n, "d6:lengthi%de4:pathl%d:%s%d:%see", 10000000 + i * 7919, ( int )strlen( dir ), dir, ( int )strlen( file ), file );
+	}
+	n += sprintf( buffer + n, "e4:name5:Bench12:piece lengthi262144e6:pieces%d:", files_n * 20 );
+	memset( buffer + n, 'p', files_n * 20 );
+	n += files_n * 20;
+	n += sprintf( buffer + n, "ee" );
+	*buffer_n = n;
+	return buffer;
+}
+
+// uTorrent's resume.dat: one big dict with an entry per torrent
+char *make_resume( int torrents_n, size_t *buffer_n ) {
+	size_t alloc = 16 + torrents_n * 160;
+	char *buffer = malloc( alloc );
+	if ( buffer == NULL ) {
+		return NULL;
+	}
+	size_t n = 0;
+	const char *announce = "https://home.opsfet.ch/abcdef0123456789abcdef0123456789/announce";
+	n += sprintf( buffer + n, "d" );
+	for ( int i = 0; i < torrents_n; i++ ) {
+		n += sprintf( buffer + n, "21:torrent%06d.torrentd5:addedi%de8:trackersl%d:%see", i, 1600000000 + i, ( int )strlen( announce ), announce );
+	}
+	n += sprintf( buffer + n, "e" );
+	*buffer_n = n;
+	return buffer;
+}
+
+void bench_decode( const char *name, const char *buffer, size_t buffer_n ) {
+	// the fastest run is the least disturbed by everything else on the machine
+	double best = -1;
+	double start = now();
+	double run_start;
+	do {
+		size_t off = 0;
+		int error;
+		run_start = now();
+		struct bencode *ben = ben_decode_view( buffer, buffer_n, &off, &error );
+		if ( ben == NULL ) {
+			fprintf( stderr, "%s: decode failed: %s\n", name, ben_strerror( error ) );
+			exit( 1 );
+		}
+		ben_free( ben );
+		double run = now() - run_start;
+		if ( best < 0 || run < best ) {
+			best = run;
+		}
+	} while ( now() - start < BENCH_SECONDS );
+
+	printf( "%-24s %8.3f ms/decode %8.1f MB/s\n", name, best * 1e3, buffer_n / best / 1e6 );
+}
+
+// what writing a modified file back costs, without the spans that let untouched dicts be copied
+void bench_encode( const char *name, const char *buffer, size_t buffer_n ) {
+	size_t off = 0;
+	int error;
+	struct bencode *ben = ben_decode2( buffer, buffer_n, &off, &error );
+	if ( ben == NULL ) {
+		fprintf( stderr, "%s: decode failed: %s\n", name, ben_strerror( error ) );
+		exit( 1 );
+	}
+	double best = -1;
+	double start = now();
+	do {
+		size_t encoded_n;
+		double run_start = now();
+		void *encoded = ben_encode( &encoded_n, ben );
+		double run = now() - run_start;
+		if ( encoded == NULL || encoded_n != buffer_n ) {
+			fprintf( stderr, "%s: encode failed\n", name );
+			exit( 1 );
+		}
+		free( encoded );
+		if ( best < 0 || run < best ) {
+			best = run;
+		}
+	} while ( now() - start < BENCH_SECONDS );
+	ben_free( ben );
+
+	printf( "%-24s %8.3f ms/encode %8.1f MB/s\n", name, best * 1e3, buffer_n / best / 1e6 );
+}
+
+// looks up "path" in each entry of the file list, which is what a transform walking the files does
+void bench_lookup( const char *buffer, size_t buffer_n ) {
+	size_t off = 0;
+	int error;
+	struct bencode *ben = ben_decode_view( buffer, buffer_n, &off, &error );
+	if ( ben == NULL ) {
+		fprintf( stderr, "lookup: decode failed: %s\n", ben_strerror( error ) );
+		exit( 1 );
+	}
+	struct bencode *files = ben_dict_get_by_str( ben_dict_get_by_str( ben, "info" ), "files" );
+	size_t files_n = ben_list_len( files );
+	struct ben_key path_key;
+	ben_key_init( &path_key, "path" );
+
+	for ( int keyed = 0; keyed < 2; keyed++ ) {
+		double best = -1;
+		double start = now();
+		size_t found_n = 0;
+		do {
+			double run_start = now();
+			for ( size_t i = 0; i < files_n; i++ ) {
+				struct bencode *file = ben_list_get( files, i );
+				found_n += ( keyed ? ben_dict_get_by_key( file, &path_key ) : ben_dict_get_by_str( file, "path" ) ) != NULL;
+			}
+			double run = now() - run_start;
+			if ( best < 0 || run < best ) {
+				best = run;
+			}
+		} while ( now() - start < BENCH_SECONDS );
+		if ( found_n == 0 ) {
+			fprintf( stderr, "lookup: nothing found\n" );
+			exit( 1 );
+		}
+		printf( "%-24s %8.1f ns/lookup\n", keyed ? "lookup, prehashed key" : "lookup by string", best * 1e9 / files_n );
+	}
+	ben_free( ben );
+}
+
+int main( void ) {
+	size_t buffer_n;
+	char *buffer = make_many_file_torrent( BENCH_FILES_N, &buffer_n );
+	if ( buffer == NULL ) {
+		fprintf( stderr, "out of memory\n" );
+		return 1;
+	}
+	bench_decode( "many-file torrent", buffer, buffer_n );
+	bench_encode( "many-file torrent", buffer, buffer_n );
+	bench_lookup( buffer, buffer_n );
+	free( buffer );
+
+	buffer = make_resume( BENCH_FILES_N, &buffer_n );
+	if ( buffer == NULL ) {
+		fprintf( stderr, "out of memory\n" );
+		return 1;
+	}
+	bench_decode( "resume.dat", buffer, buffer_n );
+	bench_encode( "resume.dat", buffer, buffer_n );
+	free( buffer );
+	return 0;
+}
@@ -1,16 +1,29 @@
+#define _XOPEN_SOURCE 500
+
 #include <stdlib.h>
 #include <string.h>
 #include <stdbool.h>
+#include <limits.h>
 #include <regex.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <pthread.h>
 
 #include <stdarg.h>
 #include <stddef.h>
 #include <setjmp.h>
 #include <cmocka.h>
 
+#include <bencode.h>
+
 #include "../src/err.h"
 #include "../src/vector.h"
 #include "../src/libannouncebulk.h"
+#include "../src/arena.h"
+#include "../src/util.h"
+#include "../src/walk.h"
+#include "../src/index.h"
 
 #define ASSERT_OK() assert_int_equal( in_err, GRN_OK );
 
@@ -103,9 +116,10 @@ static void test_strsubst( void **state ) {
 }
 
 void transform_buffer( struct grn_ctx *ctx, int *out_err );
+void free_plan( struct grn_plan *plan );
 
 // line numbers aren't reported right when it's a real function. kekek
-void _assert_transform_buffer_single( const char *buffer, struct grn_transform transform, char *expected_buffer ) {
+void _assert_transform_buffer( const char *buffer, struct grn_transform *transforms, int transforms_n, char *expected_buffer ) {
 	int in_err;
 
 	char *boop[] = {
@@ -115,17 +129,36 @@ void _assert_transform_buffer_single( const char *buffer, struct grn_transform t
 		.state = GRN_CTX_TRANSFORM,
 		.buffer = malloc( 256 ),
 		.buffer_n = strlen( buffer ), // they don't need to know about that silly null byte
-		.transforms = &transform,
-		.transforms_n = 1,
 		.files_c = 0,
 		.files_n = 1,
 		.files = boop,
 	};
+	grn_ctx_set_transforms( &my_ctx, transforms, transforms_n, &in_err );
+	ASSERT_OK();
 	strcpy( my_ctx.buffer, buffer );
 	transform_buffer( &my_ctx, &in_err );
 	ASSERT_OK();
-	assert_memory_equal( my_ctx.buffer, expected_buffer, my_ctx.buffer_n );
+	char *out = my_ctx.buffer;
+	size_t out_n = my_ctx.buffer_n;
+	// the tree is only encoded once the file is being written
+	if ( my_ctx.tree != NULL ) {
+		out = ben_encode( &out_n, my_ctx.tree );
+		assert_non_null( out );
+	}
+	assert_int_equal( out_n, strlen( expected_buffer ) );
+	assert_memory_equal( out, expected_buffer, out_n );
+	// the file should only be written back if the transform did something
+	assert_int_equal( my_ctx.file_unchanged, strcmp( buffer, expected_buffer ) == 0 );
+	if ( out != my_ctx.buffer ) {
+		free( out );
+	}
 	free( my_ctx.buffer );
+	grn_arena_free( &my_ctx.arena );
+	free_plan( my_ctx.plan );
+}
+
+void _assert_transform_buffer_single( const char *buffer, struct grn_transform transform, char *expected_buffer ) {
+	_assert_transform_buffer( buffer, &transform, 1, expected_buffer );
 }
 
 // test buffer transforms when they will do the transform as expected.
@@ -169,6 +202,12 @@ static void test_transform_buffer( void **state ) {
 	_assert_transform_buffer_single( "de", transform_del_presto, "de" );
 	_assert_transform_buffer_single( "d6:presto5:largoe", transform_set_presto, "d6:presto5:largoe" );
 	_assert_transform_buffer_single( "d6:presto4:lapde", transform_sub_presto, "d6:presto4:lapde" );
+	// matches, but substitutes the same text back
+	struct grn_transform transform_sub_same = grn_mktransform_substitute( "rgo", "rgo" );
+	transform_sub_same.key = key_dummy;
+	_assert_transform_buffer_single( "5:largo", transform_sub_same, "5:largo" );
+	// rejected before decoding, since there's no m anywhere
+	_assert_transform_buffer_single( "d6:presto5:largoe", transform_regex_presto, "d6:presto5:largoe" );
 
 	// test incorrect types
 	_assert_transform_buffer_single( "6:presto", transform_set_presto, "6:presto" );
@@ -200,10 +239,1692 @@ static void test_transform_buffer( void **state ) {
 	    transform_sub_deep,
 	    "d5:hellod5:listol4:fapd6:retapde4:what2:cde10:helloworld4:flip5:worldd5:listol4:fapd6:retapde4:what2:cdee"
 	);
+
+	// several transforms still apply in order, even though they are done in one walk
+	struct grn_transform transform_sub_inner_presto = transform_sub_presto;
+	transform_sub_inner_presto.key = key_presto;
+	struct grn_transform sub_then_set[] = { transform_sub_inner_presto, transform_set_presto };
+	_assert_transform_buffer( "d6:presto5:largoe", sub_then_set, 2, "d6:presto5:largoe" );
+	struct grn_transform set_then_sub[] = { transform_set_presto, transform_sub_inner_presto };
+	_assert_transform_buffer( "de", set_then_sub, 2, "d6:presto4:lapde" );
+	char *key_any[2];
+	key_any[0] = "";
+	key_any[1] = NULL;
+	struct grn_transform sub_all_then_del[] = { transform_sub_presto, transform_del_presto };
+	sub_all_then_del[0].key = key_any;
+	_assert_transform_buffer( "d6:presto5:largo4:zeta5:largoe", sub_all_then_del, 2, "d4:zeta4:lapde" );
+}
+
+// transform a copy of buffer, spreading its entries over split_threads_n threads
+int _transform_split( const char *buffer, size_t buffer_n, struct grn_transform *transforms, int transforms_n, int split_threads_n, char **out, size_t *out_n ) {
+	int in_err;
+
+	char *boop[] = {
+		"resume.dat",
+	};
+	struct grn_ctx my_ctx = {
+		.state = GRN_CTX_TRANSFORM,
+		.buffer = malloc( buffer_n ),
+		.buffer_n = buffer_n,
+		.files_c = 0,
+		.files_n = 1,
+		.files = boop,
+		.split_threads_n = split_threads_n,
+	};
+	grn_ctx_set_transforms( &my_ctx, transforms, transforms_n, &in_err );
+	ASSERT_OK();
+	memcpy( my_ctx.buffer, buffer, buffer_n );
+	transform_buffer( &my_ctx, &in_err );
+	*out = my_ctx.buffer;
+	*out_n = my_ctx.file_unchanged ? 0 : my_ctx.buffer_n;
+	if ( my_ctx.tree != NULL ) {
+		*out = ben_encode( out_n, my_ctx.tree );
+		assert_non_null( *out );
+		free( my_ctx.buffer );
+	}
+	grn_arena_free( &my_ctx.arena );
+	free_plan( my_ctx.plan );
+	return in_err;
+}
+
+// splitting a big file by entry has to give exactly what transforming the whole tree does
+static void test_transform_split( void **state ) {
+	( void ) state;
+	char *key_trackers[4] = { "", "trackers", "", NULL };
+	char *key_entry[2] = { "", NULL };
+	struct grn_transform transforms[2];
+	transforms[0] = grn_mktransform_substitute( "old.example", "new.example" );
+	transforms[0].key = key_trackers;
+	transforms[1] = grn_mktransform_delete( "junk" );
+	transforms[1].key = key_entry;
+
+	size_t buffer_alloc = 1 << 16;
+	char *buffer = malloc( buffer_alloc );
+	size_t buffer_n = 0;
+	buffer[buffer_n++] = 'd';
+	for ( int i = 0; i < 600; i++ ) {
+		const char *tracker = i % 3 == 0 ? "old.example" : "other.org";
+		buffer_n += sprintf( buffer + buffer_n, "4:%04dd%s4:name5:n%04d8:trackersl%d:%see", i, i % 5 == 0 ? "4:junki1e" : "", i, ( int )strlen( tracker ), tracker );
+	}
+	buffer[buffer_n++] = 'e';
+	assert_true( buffer_n < buffer_alloc );
+
+	char *seq, *par;
+	size_t seq_n, par_n;
+	assert_int_equal( _transform_split( buffer, buffer_n, transforms, 2, 0, &seq, &seq_n ), GRN_OK );
+	assert_int_equal( _transform_split( buffer, buffer_n, transforms, 2, 4, &par, &par_n ), GRN_OK );
+	assert_true( seq_n > 0 );
+	assert_int_equal( seq_n, par_n );
+	assert_memory_equal( seq, par, seq_n );
+	assert_non_null( grn_memmem( par, par_n, "11:new.example", 14 ) );
+	assert_null( grn_memmem( par, par_n, "4:junk", 6 ) );
+	free( seq );
+	free( par );
+
+	// nothing to change
+	struct grn_transform *nothing = &transforms[0];
+	char *key_nothing[4] = { "", "trackers", "absent", NULL };
+	nothing->key = key_nothing;
+	assert_int_equal( _transform_split( buffer, buffer_n, nothing, 1, 4, &par, &par_n ), GRN_OK );
+	assert_int_equal( par_n, 0 );
+	free( par );
+	nothing->key = key_trackers;
+
+	// broken entries and unsorted keys are errors either way, whether the split notices them or the decoder does
+	char *broken = ( char * )grn_memmem( buffer, buffer_n, "4:name5:n0300", 13 );
+	broken[2] = 'z';
+	assert_int_equal( _transform_split( buffer, buffer_n, transforms, 2, 0, &seq, &seq_n ), GRN_ERR_BENCODE_SYNTAX );
+	assert_int_equal( _transform_split( buffer, buffer_n, transforms, 2, 4, &par, &par_n ), GRN_ERR_BENCODE_SYNTAX );
+	free( seq );
+	free( par );
+	broken[2] = 'n';
+	broken[1] = 'x';
+	assert_int_equal( _transform_split( buffer, buffer_n, transforms, 2, 0, &seq, &seq_n ), GRN_ERR_BENCODE_SYNTAX );
+	assert_int_equal( _transform_split( buffer, buffer_n, transforms, 2, 4, &par, &par_n ), GRN_ERR_BENCODE_SYNTAX );
+	free( seq );
+	free( par );
+	broken[1] = ':';
+	broken = ( char * )grn_memmem( buffer, buffer_n, "4:0300d", 7 );
+	memcpy( broken + 2, "0100", 4 );
+	assert_int_equal( _transform_split( buffer, buffer_n, transforms, 2, 0, &seq, &seq_n ), GRN_ERR_BENCODE_SYNTAX );
+	assert_int_equal( _transform_split( buffer, buffer_n, transforms, 2, 4, &par, &par_n ), GRN_ERR_BENCODE_SYNTAX );
+	free( seq );
+	free( par );
+
+	grn_free_transform( &transforms[0] );
+	grn_free_transform( &transforms[1] );
+
+	// the orpheus transforms also delete from and reach into the root by name
+	int in_err;
+	struct vector *orpheus = vector_alloc( sizeof( struct grn_transform ), &in_err );
+	ASSERT_OK();
+	grn_cat_transforms_orpheus( orpheus, "abcdef0123456789abcdef0123456789", &in_err );
+	ASSERT_OK();
+	buffer_n = 0;
+	buffer_n += sprintf( buffer + buffer_n, "d10:.fileguard40:0123456789012345678901234567890123456789" );
+	for ( int i = 0; i < 300; i++ ) {
+		const char *tracker = i % 2 ? "https://mars.apollo.rip/0123456789abcdef0123456789abcdef/announce" : "udp://other.org:80";
+		buffer_n += sprintf( buffer + buffer_n, "5:%05dd8:trackersl%d:%see", i, ( int )strlen( tracker ), tracker );
+	}
+	buffer_n += sprintf( buffer + buffer_n, "8:announce%d:%se", 14, "http://foo.bar" );
+	assert_int_equal( _transform_split( buffer, buffer_n, orpheus->buffer, orpheus->used_n, 0, &seq, &seq_n ), GRN_OK );
+	assert_int_equal( _transform_split( buffer, buffer_n, orpheus->buffer, orpheus->used_n, 3, &par, &par_n ), GRN_OK );
+	assert_true( seq_n > 0 );
+	assert_int_equal( seq_n, par_n );
+	assert_memory_equal( seq, par, seq_n );
+	assert_null( grn_memmem( par, par_n, ".fileguard", 10 ) );
+	assert_non_null( grn_memmem( par, par_n, "home.opsfet.ch", 14 ) );
+	free( seq );
+	free( par );
+	grn_free_transforms_v( orpheus );
+
+	free( buffer );
+}
+
+void fread_ctx( struct grn_ctx *ctx, int *out_err );
+void release_buffer_ctx( struct grn_ctx *ctx );
+
+// small files should land in the scratch buffer, and the scratch buffer should be reused for the next file
+static void test_fread_ctx( void **state ) {
+	( void ) state;
+	int in_err;
+
+	struct grn_ctx my_ctx = {
+		.state = GRN_CTX_READ,
+	};
+	my_ctx.fd = open( "tests/fixtures/basic-in/me.torrent", O_RDONLY );
+	assert_true( my_ctx.fd >= 0 );
+	fread_ctx( &my_ctx, &in_err );
+	ASSERT_OK();
+	assert_int_equal( my_ctx.buffer_type, GRN_BUFFER_SCRATCH );
+	assert_int_equal( my_ctx.buffer[0], 'd' );
+	assert_int_equal( my_ctx.buffer_n, 81 );
+	char *first_scratch = my_ctx.scratch;
+	size_t first_buffer_n = my_ctx.buffer_n;
+	release_buffer_ctx( &my_ctx );
+	assert_null( my_ctx.buffer );
+	close( my_ctx.fd );
+
+	my_ctx.fd = open( "tests/fixtures/basic-in/me.torrent", O_RDONLY );
+	assert_true( my_ctx.fd >= 0 );
+	fread_ctx( &my_ctx, &in_err );
+	ASSERT_OK();
+	assert_ptr_equal( my_ctx.scratch, first_scratch );
+	assert_int_equal( my_ctx.buffer_n, first_buffer_n );
+	release_buffer_ctx( &my_ctx );
+	close( my_ctx.fd );
+	free( my_ctx.scratch );
 }
 
 bool is_string_passphrase( const char * );
 
+// copy the contents of one file into a new one, for tests that modify files in place
+static void copy_file( const char *from, const char *to ) {
+	char buffer[4096];
+	int from_fd = open( from, O_RDONLY );
+	int to_fd = open( to, O_WRONLY | O_CREAT | O_TRUNC, 0666 );
+	assert_true( from_fd >= 0 );
+	assert_true( to_fd >= 0 );
+	ssize_t got;
+	while ( ( got = read( from_fd, buffer, sizeof( buffer ) ) ) > 0 ) {
+		assert_int_equal( write( to_fd, buffer, got ), got );
+	}
+	close( from_fd );
+	close( to_fd );
+}
+
+static void test_run_parallel( void **state ) {
+	( void ) state;
+	int in_err;
+	const int files_n = 64;
+	char expected[256], actual[256];
+
+	int expected_fd = open( "tests/fixtures/basic-out/me.torrent", O_RDONLY );
+	assert_true( expected_fd >= 0 );
+	ssize_t expected_n = read( expected_fd, expected, sizeof( expected ) );
+	close( expected_fd );
+
+	mkdir( ".tmp", 0777 );
+	mkdir( ".tmp/greeny-parallel", 0777 );
+	char **files = malloc( files_n * sizeof( char * ) );
+	assert_non_null( files );
+	for ( int i = 0; i < files_n; i++ ) {
+		files[i] = malloc( 64 );
+		assert_non_null( files[i] );
+		sprintf( files[i], ".tmp/greeny-parallel/%d.torrent", i );
+		copy_file( "tests/fixtures/basic-in/me.torrent", files[i] );
+	}
+	// one file that does not exist, which should be counted as an error but not stop the others
+	unlink( files[files_n / 2] );
+
+	struct vector *transforms = vector_alloc( sizeof( struct grn_transform ), &in_err );
+	ASSERT_OK();
+	grn_cat_transforms_orpheus( transforms, "abcdef0123456789abcdef0123456789", &in_err );
+	ASSERT_OK();
+
+	struct grn_ctx *ctx = grn_ctx_alloc( &in_err );
+	ASSERT_OK();
+	grn_ctx_set_files( ctx, files, files_n );
+	grn_ctx_set_transforms_v( ctx, transforms, &in_err );
+	ASSERT_OK();
+	grn_ctx_run_parallel( ctx, 4, &in_err );
+	ASSERT_OK();
+
+	int reported_n = 0, reported_errs_n = 0;
+	while ( !grn_one_file( ctx, &in_err ) ) {
+		ASSERT_OK();
+		reported_n++;
+		assert_int_equal( grn_ctx_get_files_c( ctx ), reported_n );
+		if ( grn_ctx_get_c_error( ctx ) ) {
+			reported_errs_n++;
+			assert_string_equal( grn_ctx_get_c_path( ctx ), files[files_n / 2] );
+		}
+	}
+	ASSERT_OK();
+	assert_int_equal( reported_n, files_n );
+	assert_int_equal( reported_errs_n, 1 );
+	assert_int_equal( grn_ctx_get_errs_n( ctx ), 1 );
+	assert_int_equal( grn_ctx_get_unchanged_n( ctx ), 0 );
+
+	for ( int i = 0; i < files_n; i++ ) {
+		if ( i == files_n / 2 ) {
+			continue;
+		}
+		int actual_fd = open( files[i], O_RDONLY );
+		assert_true( actual_fd >= 0 );
+		assert_int_equal( read( actual_fd, actual, sizeof( actual ) ), expected_n );
+		close( actual_fd );
+		assert_memory_equal( actual, expected, expected_n );
+		unlink( files[i] );
+	}
+	grn_ctx_free( ctx, &in_err );
+	ASSERT_OK();
+}
+
+// pushes files into a context from another thread, like a directory walk would
+struct feed_producer {
+	struct grn_ctx *ctx;
+	const char *dir; // walked into the context, if set
+	const char *path; // pushed path_n times after that
+	int path_n;
+	int err;
+};
+
+static void *feed_produce( void *arg ) {
+	struct feed_producer *producer = arg;
+
+	if ( producer->dir != NULL ) {
+		grn_cat_torrent_files_ctx( producer->ctx, producer->dir, NULL, &producer->err );
+	}
+	for ( int i = 0; i < producer->path_n && !producer->err; i++ ) {
+		char *path = malloc( strlen( producer->path ) + 1 );
+		if ( path == NULL ) {
+			producer->err = GRN_ERR_OOM;
+			break;
+		}
+		strcpy( path, producer->path );
+		grn_ctx_push_file( producer->ctx, path, &producer->err );
+	}
+	grn_ctx_close_files( producer->ctx );
+	return NULL;
+}
+
+static struct grn_ctx *feed_ctx( char **files, int files_n ) {
+	int in_err;
+	struct vector *transforms = vector_alloc( sizeof( struct grn_transform ), &in_err );
+	ASSERT_OK();
+	grn_cat_transforms_orpheus( transforms, "abcdef0123456789abcdef0123456789", &in_err );
+	ASSERT_OK();
+	struct grn_ctx *ctx = grn_ctx_alloc( &in_err );
+	ASSERT_OK();
+	grn_ctx_set_files( ctx, files, files_n );
+	grn_ctx_set_transforms_v( ctx, transforms, &in_err );
+	ASSERT_OK();
+	grn_ctx_open_files( ctx, &in_err );
+	ASSERT_OK();
+	return ctx;
+}
+
+static void test_feed( void **state ) {
+	( void ) state;
+	int in_err;
+	const int files_n = 40;
+	char path[64];
+
+	system( "rm -rf .tmp/greeny-feed" );
+	mkdir( ".tmp", 0777 );
+	mkdir( ".tmp/greeny-feed", 0777 );
+	mkdir( ".tmp/greeny-feed/found", 0777 );
+	for ( int i = 0; i < files_n; i++ ) {
+		sprintf( path, ".tmp/greeny-feed/found/%d.torrent", i );
+		copy_file( "tests/fixtures/basic-in/me.torrent", path );
+	}
+	// one file is known up front, and is done first
+	char **files = malloc( sizeof( char * ) );
+	assert_non_null( files );
+	files[0] = grn_strcpy_malloc( ".tmp/greeny-feed/first.torrent", &in_err );
+	ASSERT_OK();
+	copy_file( "tests/fixtures/basic-in/me.torrent", files[0] );
+
+	// workers wait for files while the directory is still being read
+	struct grn_ctx *ctx = feed_ctx( files, 1 );
+	grn_ctx_run_parallel( ctx, 4, &in_err );
+	ASSERT_OK();
+	assert_true( grn_ctx_get_files_open( ctx ) );
+	struct feed_producer producer = {
+		.ctx = ctx,
+		.dir = ".tmp/greeny-feed/found",
+	};
+	pthread_t thread;
+	assert_int_equal( pthread_create( &thread, NULL, feed_produce, &producer ), 0 );
+	int reported_n = 0;
+	while ( !grn_one_file( ctx, &in_err ) ) {
+		ASSERT_OK();
+		reported_n++;
+		assert_int_equal( grn_ctx_get_c_error( ctx ), GRN_OK );
+		assert_false( grn_ctx_get_c_unchanged( ctx ) );
+		assert_non_null( strstr( grn_ctx_get_c_path( ctx ), ".tmp/greeny-feed/" ) );
+		assert_true( grn_ctx_get_files_n( ctx ) >= reported_n );
+	}
+	ASSERT_OK();
+	pthread_join( thread, NULL );
+	assert_int_equal( producer.err, GRN_OK );
+	assert_false( grn_ctx_get_files_open( ctx ) );
+	assert_int_equal( reported_n, files_n + 1 );
+	assert_int_equal( grn_ctx_get_files_n( ctx ), files_n + 1 );
+	assert_int_equal( grn_ctx_get_errs_n( ctx ), 0 );
+	// everything was reported, so the paths were freed already
+	assert_int_equal( ctx->files_base, files_n + 1 );
+	grn_ctx_free( ctx, &in_err );
+	ASSERT_OK();
+
+	// files come in batches, like when watching. Once one is all reported, the next is pushed into the same list.
+	ctx = feed_ctx( NULL, 0 );
+	for ( int i = 0; i < 2; i++ ) {
+		// few enough that this doesn't wait for the context, which runs on this thread
+		grn_ctx_push_file( ctx, grn_strcpy_malloc( ".tmp/greeny-feed/first.torrent", &in_err ), &in_err );
+		ASSERT_OK();
+	}
+	for ( int i = 0; i < 2; i++ ) {
+		assert_false( grn_one_file( ctx, &in_err ) );
+		ASSERT_OK();
+		assert_string_equal( grn_ctx_get_c_path( ctx ), ".tmp/greeny-feed/first.torrent" );
+	}
+	producer = ( struct feed_producer ) {
+		.ctx = ctx,
+		.dir = ".tmp/greeny-feed/found",
+	};
+	assert_int_equal( pthread_create( &thread, NULL, feed_produce, &producer ), 0 );
+	reported_n = 2;
+	while ( !grn_one_file( ctx, &in_err ) ) {
+		ASSERT_OK();
+		reported_n++;
+		assert_non_null( strstr( grn_ctx_get_c_path( ctx ), ".tmp/greeny-feed/found/" ) );
+	}
+	ASSERT_OK();
+	pthread_join( thread, NULL );
+	assert_int_equal( producer.err, GRN_OK );
+	assert_int_equal( reported_n, files_n + 2 );
+	assert_int_equal( ctx->files_base, files_n + 2 );
+	grn_ctx_free( ctx, &in_err );
+	ASSERT_OK();
+
+	// a single thread, with more files pushed than fit in the queue, so the producer has to wait for it. The file was
+	// transformed already, so it's left alone each time.
+	ctx = feed_ctx( NULL, 0 );
+	producer = ( struct feed_producer ) {
+		.ctx = ctx,
+		.path = ".tmp/greeny-feed/first.torrent",
+		.path_n = 5000,
+	};
+	assert_int_equal( pthread_create( &thread, NULL, feed_produce, &producer ), 0 );
+	grn_one_context( ctx, &in_err );
+	ASSERT_OK();
+	pthread_join( thread, NULL );
+	assert_int_equal( producer.err, GRN_OK );
+	assert_int_equal( grn_ctx_get_files_n( ctx ), 5000 );
+	assert_int_equal( grn_ctx_get_unchanged_n( ctx ), 5000 );
+	grn_ctx_free( ctx, &in_err );
+	ASSERT_OK();
+
+	// nothing more is taken once it's cancelled
+	ctx = feed_ctx( NULL, 0 );
+	grn_ctx_cancel_files( ctx );
+	assert_false( grn_ctx_get_files_open( ctx ) );
+	grn_ctx_push_file( ctx, grn_strcpy_malloc( ".tmp/greeny-feed/first.torrent", &in_err ), &in_err );
+	assert_int_equal( in_err, GRN_ERR_USER_CANCELLED );
+	grn_one_context( ctx, &in_err );
+	ASSERT_OK();
+	assert_int_equal( grn_ctx_get_files_n( ctx ), 0 );
+	grn_ctx_free( ctx, &in_err );
+	ASSERT_OK();
+	system( "rm -rf .tmp/greeny-feed" );
+}
+
+// write a torrent big enough to be mapped rather than read, with the old announce
+static size_t write_big_torrent( const char *path ) {
+	const char *head = "d8:announce65:https://mars.apollo.rip/abcdef0123456789abcdef0123456789/announce4:infod6:pieces";
+	size_t pieces_n = 1 << 21;
+	char *pieces = malloc( pieces_n );
+	assert_non_null( pieces );
+	memset( pieces, 'p', pieces_n );
+	FILE *file = fopen( path, "wb" );
+	assert_non_null( file );
+	fprintf( file, "%s%zu:", head, pieces_n );
+	assert_int_equal( fwrite( pieces, 1, pieces_n, file ), pieces_n );
+	fprintf( file, "ee" );
+	size_t file_n = ftell( file );
+	fclose( file );
+	free( pieces );
+	return file_n;
+}
+
+static void _assert_big_torrent_transformed( const char *path, size_t original_n ) {
+	struct stat st;
+	assert_int_equal( stat( path, &st ), 0 );
+	// the new announce is one byte shorter
+	assert_int_equal( st.st_size, original_n - 1 );
+	char head[128];
+	FILE *file = fopen( path, "rb" );
+	assert_non_null( file );
+	assert_int_equal( fread( head, 1, sizeof( head ), file ), sizeof( head ) );
+	fclose( file );
+	assert_memory_equal( head, "d8:announce64:https://home.opsfet.ch/abcdef0123456789abcdef0123456789/announce4:info", 83 );
+}
+
+// mapped files are written without building them in memory first, and without truncating the mapping
+static void test_write_mapped( void **state ) {
+	( void ) state;
+	int in_err;
+
+	mkdir( ".tmp", 0777 );
+	mkdir( ".tmp/greeny-mapped", 0777 );
+	char *alone = ".tmp/greeny-mapped/alone.torrent";
+	char *linked = ".tmp/greeny-mapped/linked.torrent";
+	char *link_path = ".tmp/greeny-mapped/linked.link";
+	size_t original_n = write_big_torrent( alone );
+	chmod( alone, 0640 );
+	write_big_torrent( linked );
+	unlink( link_path );
+	assert_int_equal( link( linked, link_path ), 0 );
+	// small files are read rather than mapped, but are still only replaced once they are fully encoded
+	char *small = ".tmp/greeny-mapped/small.torrent";
+	copy_file( "tests/fixtures/basic-in/me.torrent", small );
+	struct stat small_st;
+	assert_int_equal( stat( small, &small_st ), 0 );
+
+	char **files = malloc( 3 * sizeof( char * ) );
+	assert_non_null( files );
+	for ( int i = 0; i < 3; i++ ) {
+		files[i] = malloc( 64 );
+		assert_non_null( files[i] );
+		strcpy( files[i], i == 0 ? alone : i == 1 ? linked : small );
+	}
+	struct vector *transforms = vector_alloc( sizeof( struct grn_transform ), &in_err );
+	ASSERT_OK();
+	grn_cat_transforms_orpheus( transforms, "abcdef0123456789abcdef0123456789", &in_err );
+	ASSERT_OK();
+	struct grn_ctx *ctx = grn_ctx_alloc( &in_err );
+	ASSERT_OK();
+	grn_ctx_set_files( ctx, files, 3 );
+	grn_ctx_set_transforms_v( ctx, transforms, &in_err );
+	ASSERT_OK();
+	grn_one_context( ctx, &in_err );
+	ASSERT_OK();
+	assert_int_equal( grn_ctx_get_errs_n( ctx ), 0 );
+	grn_ctx_free( ctx, &in_err );
+	ASSERT_OK();
+
+	_assert_big_torrent_transformed( alone, original_n );
+	struct stat st;
+	assert_int_equal( stat( alone, &st ), 0 );
+	assert_int_equal( st.st_mode & 0777, 0640 );
+	// a hard link has to see the change too, so that file is written in place
+	_assert_big_torrent_transformed( linked, original_n );
+	_assert_big_torrent_transformed( link_path, original_n );
+	assert_int_equal( stat( link_path, &st ), 0 );
+	assert_int_equal( st.st_nlink, 2 );
+	assert_int_equal( stat( small, &st ), 0 );
+	assert_true( st.st_ino != small_st.st_ino );
+	struct stat expected_st;
+	assert_int_equal( stat( "tests/fixtures/basic-out/me.torrent", &expected_st ), 0 );
+	assert_int_equal( st.st_size, expected_st.st_size );
+
+	unlink( alone );
+	unlink( small );
+	unlink( linked );
+	unlink( link_path );
+	// nothing else, like a leftover temporary file
+	assert_int_equal( rmdir( ".tmp/greeny-mapped" ), 0 );
+}
+
+// a mapped file that something else cuts short fails, rather than crashing us or being written back from made up bytes
+static void test_mapped_truncated( void **state ) {
+	( void ) state;
+	int in_err;
+
+	mkdir( ".tmp", 0777 );
+	char *path = ".tmp/greeny-truncated.torrent";
+	write_big_torrent( path );
+	char **files = malloc( sizeof( char * ) );
+	assert_non_null( files );
+	files[0] = grn_strcpy_malloc( path, &in_err );
+	ASSERT_OK();
+	struct vector *transforms = vector_alloc( sizeof( struct grn_transform ), &in_err );
+	ASSERT_OK();
+	grn_cat_transforms_orpheus( transforms, "abcdef0123456789abcdef0123456789", &in_err );
+	ASSERT_OK();
+	struct grn_ctx *ctx = grn_ctx_alloc( &in_err );
+	ASSERT_OK();
+	grn_ctx_set_files( ctx, files, 1 );
+	grn_ctx_set_transforms_v( ctx, transforms, &in_err );
+	ASSERT_OK();
+	while ( ctx->state != GRN_CTX_TRANSFORM ) {
+		grn_one_step( ctx, &in_err );
+		ASSERT_OK();
+	}
+	// io_uring reads everything into memory
+	bool mapped = ctx->buffer_type == GRN_BUFFER_MMAP;
+	if ( mapped ) {
+		assert_int_equal( truncate( path, 100000 ), 0 );
+	}
+	grn_one_context( ctx, &in_err );
+	ASSERT_OK();
+	assert_int_equal( grn_ctx_get_errs_n( ctx ), mapped );
+	grn_ctx_free( ctx, &in_err );
+	ASSERT_OK();
+
+	if ( mapped ) {
+		struct stat st;
+		assert_int_equal( stat( path, &st ), 0 );
+		assert_int_equal( st.st_size, 100000 );
+	}
+	unlink( path );
+}
+
+static void touch( const char *path ) {
+	int fd = open( path, O_WRONLY | O_CREAT | O_TRUNC, 0666 );
+	assert_true( fd >= 0 );
+	close( fd );
+}
+
+static int strcmp_p( const void *a, const void *b ) {
+	return strcmp( * ( char *const * ) a, * ( char *const * ) b );
+}
+
+static void _assert_walk( const char *path, int threads_n, int flags, char **expected, int expected_n ) {
+	int in_err;
+	struct vector *files = vector_alloc( sizeof( char * ), &in_err );
+	ASSERT_OK();
+	grn_walk_torrent_files( files, path, NULL, threads_n, flags, NULL, &in_err );
+	ASSERT_OK();
+	assert_int_equal( vector_length( files ), expected_n );
+	if ( !( flags & GRN_WALK_SORTED ) ) {
+		qsort( files->buffer, expected_n, sizeof( char * ), strcmp_p );
+	}
+	for ( int i = 0; i < expected_n; i++ ) {
+		assert_string_equal( * ( char ** ) vector_get( files, i ), expected[i] );
+	}
+	vector_free_all( files );
+}
+
+static void test_walk( void **state ) {
+	( void ) state;
+	int in_err;
+
+	system( "rm -rf .tmp/greeny-walk" );
+	mkdir( ".tmp", 0777 );
+	mkdir( ".tmp/greeny-walk", 0777 );
+	mkdir( ".tmp/greeny-walk/d1", 0777 );
+	mkdir( ".tmp/greeny-walk/d1/d11", 0777 );
+	mkdir( ".tmp/greeny-walk/d2", 0777 );
+	touch( ".tmp/greeny-walk/a.torrent" );
+	touch( ".tmp/greeny-walk/b.txt" );
+	touch( ".tmp/greeny-walk/d1/c.torrent" );
+	touch( ".tmp/greeny-walk/d1/d11/e.torrent" );
+	touch( ".tmp/greeny-walk/d2/g.torrent" );
+	touch( ".tmp/greeny-walk/d2/g.torrent.bak" );
+	// links are followed, except back into somewhere that was already read, and when they lead nowhere
+	assert_int_equal( symlink( "../d2/g.torrent", ".tmp/greeny-walk/d1/link.torrent" ), 0 );
+	assert_int_equal( symlink( "..", ".tmp/greeny-walk/d1/loop" ), 0 );
+	assert_int_equal( symlink( "nowhere", ".tmp/greeny-walk/dangling.torrent" ), 0 );
+	// wide enough for every thread to find something to steal
+	char *expected[5 + 20 * 10];
+	int expected_n = 0;
+	expected[expected_n++] = ".tmp/greeny-walk/a.torrent";
+	expected[expected_n++] = ".tmp/greeny-walk/d1/c.torrent";
+	expected[expected_n++] = ".tmp/greeny-walk/d1/d11/e.torrent";
+	expected[expected_n++] = ".tmp/greeny-walk/d1/link.torrent";
+	expected[expected_n++] = ".tmp/greeny-walk/d2/g.torrent";
+	mkdir( ".tmp/greeny-walk/wide", 0777 );
+	for ( int i = 0; i < 20; i++ ) {
+		char path[64];
+		sprintf( path, ".tmp/greeny-walk/wide/%02d", i );
+		mkdir( path, 0777 );
+		for ( int j = 0; j < 10; j++ ) {
+			expected[expected_n] = malloc( 64 );
+			assert_non_null( expected[expected_n] );
+			sprintf( expected[expected_n++], "%s/%d.torrent", path, j );
+			touch( expected[expected_n - 1] );
+		}
+	}
+	qsort( expected, expected_n, sizeof( char * ), strcmp_p );
+
+	_assert_walk( ".tmp/greeny-walk", 1, GRN_WALK_SORTED, expected, expected_n );
+	_assert_walk( ".tmp/greeny-walk", 8, GRN_WALK_SORTED, expected, expected_n );
+	_assert_walk( ".tmp/greeny-walk", 8, 0, expected, expected_n );
+	_assert_walk( ".tmp/greeny-walk/a.torrent", 8, 0, expected, 1 );
+	_assert_walk( ".tmp/greeny-walk/b.txt", 8, 0, NULL, 0 );
+
+	struct vector *files = vector_alloc( sizeof( char * ), &in_err );
+	ASSERT_OK();
+	grn_walk_torrent_files( files, ".tmp/greeny-walk/nowhere", NULL, 0, 0, NULL, &in_err );
+	assert_int_equal( in_err, GRN_ERR_ENOENT );
+	assert_int_equal( vector_length( files ), 0 );
+	vector_free_all( files );
+
+	for ( int i = 0; i < expected_n; i++ ) {
+		if ( strstr( expected[i], "/wide/" ) ) {
+			free( expected[i] );
+		}
+	}
+	system( "rm -rf .tmp/greeny-walk" );
+}
+
+static void _assert_walk_seen( const char *path, struct grn_walk_seen *seen, int expected_n, int dupes_n ) {
+	int in_err;
+	struct vector *files = vector_alloc( sizeof( char * ), &in_err );
+	ASSERT_OK();
+	grn_walk_torrent_files( files, path, NULL, 8, 0, seen, &in_err );
+	ASSERT_OK();
+	assert_int_equal( vector_length( files ), expected_n );
+	assert_int_equal( grn_walk_seen_get_dupes_n( seen ), dupes_n );
+	vector_free_all( files );
+}
+
+// the same file is only found once, however it's reached
+static void test_walk_seen( void **state ) {
+	( void ) state;
+	int in_err;
+
+	system( "rm -rf .tmp/greeny-seen" );
+	mkdir( ".tmp", 0777 );
+	mkdir( ".tmp/greeny-seen", 0777 );
+	mkdir( ".tmp/greeny-seen/sub", 0777 );
+	copy_file( "tests/fixtures/basic-in/me.torrent", ".tmp/greeny-seen/a.torrent" );
+	copy_file( "tests/fixtures/basic-in/me.torrent", ".tmp/greeny-seen/sub/d.torrent" );
+	assert_int_equal( link( ".tmp/greeny-seen/a.torrent", ".tmp/greeny-seen/sub/hard.torrent" ), 0 );
+	assert_int_equal( symlink( "../a.torrent", ".tmp/greeny-seen/sub/soft.torrent" ), 0 );
+
+	struct grn_walk_seen *seen = grn_walk_seen_alloc( &in_err );
+	ASSERT_OK();
+	_assert_walk_seen( ".tmp/greeny-seen", seen, 2, 2 );
+	// nothing new under a path that was walked already, directory or not
+	_assert_walk_seen( ".tmp/greeny-seen/sub", seen, 0, 5 );
+	_assert_walk_seen( ".tmp/greeny-seen/sub/soft.torrent", seen, 0, 6 );
+	grn_walk_seen_free( seen );
+
+	// the same for files pushed to a context, which are each transformed once
+	struct grn_ctx *ctx = feed_ctx( NULL, 0 );
+	grn_cat_torrent_files_ctx( ctx, ".tmp/greeny-seen/sub", NULL, &in_err );
+	ASSERT_OK();
+	grn_cat_torrent_files_ctx( ctx, ".tmp/greeny-seen", NULL, &in_err );
+	ASSERT_OK();
+	grn_ctx_close_files( ctx );
+	grn_one_context( ctx, &in_err );
+	ASSERT_OK();
+	assert_int_equal( grn_ctx_get_files_n( ctx ), 2 );
+	assert_int_equal( grn_ctx_get_dupes_n( ctx ), 5 );
+	assert_int_equal( grn_ctx_get_errs_n( ctx ), 0 );
+	assert_int_equal( grn_ctx_get_unchanged_n( ctx ), 0 );
+	grn_ctx_free( ctx, &in_err );
+	ASSERT_OK();
+	system( "rm -rf .tmp/greeny-seen" );
+}
+
+// a sorted walk always finds a file through the smallest path, whichever thread gets there first
+static void test_walk_alias( void **state ) {
+	( void ) state;
+	int in_err;
+
+	system( "rm -rf .tmp/greeny-alias" );
+	mkdir( ".tmp", 0777 );
+	mkdir( ".tmp/greeny-alias", 0777 );
+	mkdir( ".tmp/greeny-alias/b", 0777 );
+	mkdir( ".tmp/greeny-alias/c", 0777 );
+	touch( ".tmp/greeny-alias/b/x.torrent" );
+	assert_int_equal( link( ".tmp/greeny-alias/b/x.torrent", ".tmp/greeny-alias/c/hard.torrent" ), 0 );
+	assert_int_equal( symlink( "b", ".tmp/greeny-alias/a" ), 0 );
+	assert_int_equal( symlink( "..", ".tmp/greeny-alias/b/up" ), 0 );
+	// only the owner's permissions are looked at
+	touch( ".tmp/greeny-alias/c/unreadable.torrent" );
+	chmod( ".tmp/greeny-alias/c/unreadable.torrent", 0200 );
+
+	char *expected[] = { ".tmp/greeny-alias/a/x.torrent", ".tmp/greeny-alias/c/hard.torrent" };
+	for ( int i = 0; i < 20; i++ ) {
+		_assert_walk( ".tmp/greeny-alias", 8, GRN_WALK_SORTED, expected, 2 );
+
+		struct grn_walk_seen *seen = grn_walk_seen_alloc( &in_err );
+		ASSERT_OK();
+		struct vector *files = vector_alloc( sizeof( char * ), &in_err );
+		ASSERT_OK();
+		grn_walk_torrent_files( files, ".tmp/greeny-alias", NULL, 8, GRN_WALK_SORTED, seen, &in_err );
+		ASSERT_OK();
+		assert_int_equal( vector_length( files ), 1 );
+		assert_string_equal( * ( char ** ) vector_get( files, 0 ), expected[0] );
+		assert_int_equal( grn_walk_seen_get_dupes_n( seen ), 1 );
+		vector_free_all( files );
+		grn_walk_seen_free( seen );
+	}
+	system( "rm -rf .tmp/greeny-alias" );
+}
+
+static struct grn_index_entry index_entry( uint64_t ino ) {
+	return ( struct grn_index_entry ) {
+		.dev = 1,
+		.ino = ino,
+		.size = ino * 3,
+		.mtime_s = 1600000000,
+		.content_hash = ino * 7,
+		.fingerprint = 42,
+	};
+}
+
+static void test_index( void **state ) {
+	( void ) state;
+	int in_err;
+	const char *path = ".tmp/greeny-index";
+	struct grn_index_entry entry;
+
+	mkdir( ".tmp", 0777 );
+	unlink( path );
+	struct grn_index *index = grn_index_open( path, &in_err );
+	ASSERT_OK();
+	assert_false( grn_index_get( index, 1, 1, &entry ) );
+	// enough to grow it a couple of times
+	for ( uint64_t ino = 1; ino <= 10000; ino++ ) {
+		entry = index_entry( ino );
+		grn_index_put( index, &entry, &in_err );
+		ASSERT_OK();
+	}
+	entry = index_entry( 5 );
+	entry.fingerprint = 43;
+	grn_index_put( index, &entry, &in_err );
+	ASSERT_OK();
+	grn_index_close( index );
+
+	// still there next time
+	index = grn_index_open( path, &in_err );
+	ASSERT_OK();
+	for ( uint64_t ino = 1; ino <= 10000; ino++ ) {
+		struct grn_index_entry expected = index_entry( ino );
+		expected.fingerprint = ino == 5 ? 43 : 42;
+		assert_true( grn_index_get( index, 1, ino, &entry ) );
+		assert_true( grn_index_entry_same_stat( &entry, &expected ) );
+		assert_int_equal( entry.content_hash, expected.content_hash );
+		assert_int_equal( entry.fingerprint, expected.fingerprint );
+	}
+	assert_false( grn_index_get( index, 2, 1, &entry ) );
+	assert_false( grn_index_get( index, 1, 10001, &entry ) );
+	grn_index_close( index );
+
+	// an entry that was only half written is ignored, rather than trusted
+	struct stat st;
+	assert_int_equal( stat( path, &st ), 0 );
+	int fd = open( path, O_RDWR );
+	assert_true( fd >= 0 );
+	char *contents = malloc( st.st_size );
+	assert_non_null( contents );
+	assert_int_equal( read( fd, contents, st.st_size ), st.st_size );
+	uint64_t dev_ino[2] = { 1, 77 };
+	char *slot = ( char * ) grn_memmem( contents, st.st_size, dev_ino, sizeof( dev_ino ) );
+	assert_non_null( slot );
+	slot[offsetof( struct grn_index_entry, size )] ^= 1;
+	assert_int_equal( pwrite( fd, contents, st.st_size, 0 ), st.st_size );
+	index = grn_index_open( path, &in_err );
+	ASSERT_OK();
+	assert_false( grn_index_get( index, 1, 77, &entry ) );
+	assert_true( grn_index_get( index, 1, 78, &entry ) );
+	grn_index_close( index );
+
+	// and one that isn't an index at all is started over
+	memcpy( contents, "NOTINDEX", 8 );
+	assert_int_equal( pwrite( fd, contents, st.st_size, 0 ), st.st_size );
+	close( fd );
+	free( contents );
+	index = grn_index_open( path, &in_err );
+	ASSERT_OK();
+	assert_false( grn_index_get( index, 1, 78, &entry ) );
+	grn_index_close( index );
+	unlink( path );
+
+	// entries that nothing looked at for long enough are dropped, and the rest kept
+	index = grn_index_open( path, &in_err );
+	ASSERT_OK();
+	for ( uint64_t ino = 1; ino <= 100; ino++ ) {
+		entry = index_entry( ino );
+		grn_index_put( index, &entry, &in_err );
+		ASSERT_OK();
+	}
+	grn_index_close( index );
+	for ( int i = 0; i < GRN_INDEX_KEEP_RUNS; i++ ) {
+		index = grn_index_open( path, &in_err );
+		ASSERT_OK();
+		for ( uint64_t ino = 1; ino <= 50; ino++ ) {
+			assert_true( grn_index_get( index, 1, ino, &entry ) );
+		}
+		// just in time
+		for ( uint64_t ino = 51; i == GRN_INDEX_KEEP_RUNS - 1 && ino <= 75; ino++ ) {
+			assert_true( grn_index_get( index, 1, ino, &entry ) );
+		}
+		grn_index_close( index );
+	}
+	index = grn_index_open( path, &in_err );
+	ASSERT_OK();
+	for ( uint64_t ino = 1; ino <= 100; ino++ ) {
+		assert_int_equal( grn_index_get( index, 1, ino, &entry ), ino <= 75 );
+	}
+	grn_index_close( index );
+	unlink( path );
+}
+
+// runs the orpheus transforms over path, with an index. The counts are for unchanged and skipped files.
+static void _run_indexed( const char *path, const char *passphrase, int unchanged_n, int skipped_n ) {
+	int in_err;
+	char **files = malloc( sizeof( char * ) );
+	assert_non_null( files );
+	files[0] = malloc( strlen( path ) + 1 );
+	assert_non_null( files[0] );
+	strcpy( files[0], path );
+	struct vector *transforms = vector_alloc( sizeof( struct grn_transform ), &in_err );
+	ASSERT_OK();
+	grn_cat_transforms_orpheus( transforms, ( char * ) passphrase, &in_err );
+	ASSERT_OK();
+
+	struct grn_ctx *ctx = grn_ctx_alloc( &in_err );
+	ASSERT_OK();
+	grn_ctx_set_files( ctx, files, 1 );
+	grn_ctx_set_transforms_v( ctx, transforms, &in_err );
+	ASSERT_OK();
+	grn_ctx_set_index( ctx, ".tmp/greeny-indexed/index", &in_err );
+	ASSERT_OK();
+	grn_one_context( ctx, &in_err );
+	ASSERT_OK();
+	assert_int_equal( grn_ctx_get_errs_n( ctx ), 0 );
+	assert_int_equal( grn_ctx_get_unchanged_n( ctx ), unchanged_n );
+	assert_int_equal( grn_ctx_get_skipped_n( ctx ), skipped_n );
+	grn_ctx_free( ctx, &in_err );
+	ASSERT_OK();
+}
+
+static void test_run_indexed( void **state ) {
+	( void ) state;
+	const char *path = ".tmp/greeny-indexed/me.torrent";
+
+	mkdir( ".tmp", 0777 );
+	mkdir( ".tmp/greeny-indexed", 0777 );
+	unlink( ".tmp/greeny-indexed/index" );
+	copy_file( "tests/fixtures/basic-in/me.torrent", path );
+	// written, so it is read again next time to make sure the transforms leave it alone
+	_run_indexed( path, "abcdef0123456789abcdef0123456789", 0, 0 );
+	_run_indexed( path, "abcdef0123456789abcdef0123456789", 1, 0 );
+	_run_indexed( path, "abcdef0123456789abcdef0123456789", 1, 1 );
+	// rewritten with the same contents, which the index still recognizes once it's read
+	copy_file( "tests/fixtures/basic-out/me.torrent", path );
+	_run_indexed( path, "abcdef0123456789abcdef0123456789", 1, 0 );
+	_run_indexed( path, "abcdef0123456789abcdef0123456789", 1, 1 );
+	// different transforms know nothing about it
+	_run_indexed( path, "0123456789abcdef0123456789abcdef", 0, 0 );
+	_run_indexed( path, "0123456789abcdef0123456789abcdef", 1, 0 );
+	// and neither do changed contents
+	copy_file( "tests/fixtures/basic-in/me.torrent", path );
+	_run_indexed( path, "0123456789abcdef0123456789abcdef", 0, 0 );
+
+	unlink( path );
+	unlink( ".tmp/greeny-indexed/index" );
+	assert_int_equal( rmdir( ".tmp/greeny-indexed" ), 0 );
+}
+
+// waits for the next batch from watch, and checks that it is exactly expected
+static struct vector *_assert_watch( struct grn_watch *watch, const char **expected, int expected_n ) {
+	int in_err;
+	struct vector *files = vector_alloc( sizeof( char * ), &in_err );
+	ASSERT_OK();
+	grn_watch_wait( watch, files, &in_err );
+	ASSERT_OK();
+	assert_int_equal( vector_length( files ), expected_n );
+	for ( int i = 0; i < expected_n; i++ ) {
+		assert_string_equal( * ( char ** ) vector_get( files, i ), expected[i] );
+	}
+	return files;
+}
+
+static void test_watch( void **state ) {
+	( void ) state;
+	int in_err;
+
+	system( "rm -rf .tmp/greeny-watch" );
+	mkdir( ".tmp", 0777 );
+	mkdir( ".tmp/greeny-watch", 0777 );
+	copy_file( "tests/fixtures/basic-in/me.torrent", ".tmp/greeny-watch/old.torrent" );
+	touch( ".tmp/greeny-watch/torrents.state" );
+	struct grn_watch *watch = grn_watch_alloc( &in_err );
+	ASSERT_OK();
+	grn_watch_add( watch, ".tmp/greeny-watch", NULL, &in_err );
+	ASSERT_OK();
+	// the same directory again, for a single file in it
+	grn_watch_add( watch, ".tmp/greeny-watch/torrents.state", NULL, &in_err );
+	ASSERT_OK();
+	grn_watch_add( watch, ".tmp/greeny-watch/nowhere", NULL, &in_err );
+	assert_int_equal( in_err, GRN_ERR_WATCH );
+
+	copy_file( "tests/fixtures/basic-in/me.torrent", ".tmp/greeny-watch/new.torrent" );
+	copy_file( "tests/fixtures/basic-in/me.torrent", ".tmp/greeny-watch/new.torrent" );
+	touch( ".tmp/greeny-watch/ignored.txt" );
+	FILE *state_file = fopen( ".tmp/greeny-watch/torrents.state", "w" );
+	assert_non_null( state_file );
+	fputs( "nothing to replace", state_file );
+	fclose( state_file );
+	// whether this is written before or after the directory is being watched, it is only reported once
+	mkdir( ".tmp/greeny-watch/d", 0777 );
+	copy_file( "tests/fixtures/basic-in/me.torrent", ".tmp/greeny-watch/d/inner.torrent" );
+	const char *first[] = {
+		".tmp/greeny-watch/d/inner.torrent",
+		".tmp/greeny-watch/new.torrent",
+		".tmp/greeny-watch/torrents.state",
+	};
+	struct vector *files = _assert_watch( watch, first, 3 );
+	// and the new directory is watched from now on
+	copy_file( "tests/fixtures/basic-in/me.torrent", ".tmp/greeny-watch/d/later.torrent" );
+	const char *second[] = { ".tmp/greeny-watch/d/later.torrent" };
+	struct vector *later = _assert_watch( watch, second, 1 );
+
+	// a context that is done carries on with files added to it
+	char **old = malloc( sizeof( char * ) );
+	assert_non_null( old );
+	old[0] = grn_strcpy_malloc( ".tmp/greeny-watch/old.torrent", &in_err );
+	ASSERT_OK();
+	struct vector *transforms = vector_alloc( sizeof( struct grn_transform ), &in_err );
+	ASSERT_OK();
+	grn_cat_transforms_orpheus( transforms, "abcdef0123456789abcdef0123456789", &in_err );
+	ASSERT_OK();
+	struct grn_ctx *ctx = grn_ctx_alloc( &in_err );
+	ASSERT_OK();
+	grn_ctx_set_files( ctx, old, 1 );
+	grn_ctx_set_transforms_v( ctx, transforms, &in_err );
+	ASSERT_OK();
+	grn_ctx_track_written( ctx, &in_err );
+	ASSERT_OK();
+	grn_one_context( ctx, &in_err );
+	ASSERT_OK();
+	assert_true( grn_ctx_get_is_done( ctx ) );
+	grn_ctx_add_files_v( ctx, files, &in_err );
+	ASSERT_OK();
+	assert_false( grn_ctx_get_is_done( ctx ) );
+	grn_one_context( ctx, &in_err );
+	ASSERT_OK();
+	grn_ctx_add_files_v( ctx, later, &in_err );
+	ASSERT_OK();
+	grn_one_context( ctx, &in_err );
+	ASSERT_OK();
+	assert_int_equal( grn_ctx_get_files_n( ctx ), 5 );
+	assert_int_equal( grn_ctx_get_errs_n( ctx ), 0 );
+	// torrents.state has no announce URLs in it
+	assert_int_equal( grn_ctx_get_unchanged_n( ctx ), 1 );
+
+	// the context's own writes show up as well, and can be told apart from anyone else's
+	const char *written[] = {
+		".tmp/greeny-watch/d/inner.torrent",
+		".tmp/greeny-watch/d/later.torrent",
+		".tmp/greeny-watch/new.torrent",
+		".tmp/greeny-watch/old.torrent",
+	};
+	copy_file( "tests/fixtures/basic-in/me.torrent", ".tmp/greeny-watch/new.torrent" );
+	files = _assert_watch( watch, written, 4 );
+	for ( int i = 0; i < 4; i++ ) {
+		assert_int_equal( grn_ctx_take_written( ctx, written[i] ), strcmp( written[i], ".tmp/greeny-watch/new.torrent" ) != 0 );
+		// and then forgotten
+		assert_false( grn_ctx_take_written( ctx, written[i] ) );
+	}
+	assert_false( grn_ctx_take_written( ctx, ".tmp/greeny-watch/torrents.state" ) );
+	vector_free_all( files );
+	grn_ctx_free( ctx, &in_err );
+	ASSERT_OK();
+	// a renamed directory is watched under its new name, and what's in it is picked up again under that name
+	assert_int_equal( rename( ".tmp/greeny-watch/d", ".tmp/greeny-watch/e" ), 0 );
+	copy_file( "tests/fixtures/basic-in/me.torrent", ".tmp/greeny-watch/e/renamed.torrent" );
+	const char *third[] = {
+		".tmp/greeny-watch/e/inner.torrent",
+		".tmp/greeny-watch/e/later.torrent",
+		".tmp/greeny-watch/e/renamed.torrent",
+	};
+	vector_free_all( _assert_watch( watch, third, 3 ) );
+	// and one that is moved out isn't watched anymore
+	system( "rm -rf .tmp/greeny-watch-gone" );
+	assert_int_equal( rename( ".tmp/greeny-watch/e", ".tmp/greeny-watch-gone" ), 0 );
+	copy_file( "tests/fixtures/basic-in/me.torrent", ".tmp/greeny-watch-gone/away.torrent" );
+	copy_file( "tests/fixtures/basic-in/me.torrent", ".tmp/greeny-watch/back.torrent" );
+	const char *fourth[] = { ".tmp/greeny-watch/back.torrent" };
+	vector_free_all( _assert_watch( watch, fourth, 1 ) );
+	system( "rm -rf .tmp/greeny-watch-gone" );
+	grn_watch_free( watch );
+	system( "rm -rf .tmp/greeny-watch" );
+}
+
+char **regex_literals( const char *, int * );
+void free_literals( char ** );
+
+// check that the literals for a regex are exactly the expected ones, in order. NULL means none.
+void _assert_regex_literals( const char *regstr, const char **expected ) {
+	int in_err;
+
+	char **literals = regex_literals( regstr, &in_err );
+	ASSERT_OK();
+	if ( expected == NULL ) {
+		assert_null( literals );
+		return;
+	}
+	assert_non_null( literals );
+	int i;
+	for ( i = 0; expected[i] != NULL; i++ ) {
+		assert_non_null( literals[i] );
+		assert_string_equal( literals[i], expected[i] );
+	}
+	assert_null( literals[i] );
+	free_literals( literals );
+}
+
+static void test_regex_literals( void **state ) {
+	( void ) state;
+
+	const char *orpheus[] = { "apollo.rip", "xanax.rip", "opsfet.ch", NULL };
+	_assert_regex_literals( "https?:\\/\\/?((mars|home)\\.)?(apollo\\.rip|xanax\\.rip|opsfet\\.ch)(:2095)?\\/[a-f0-9]{32}\\/announce/?", orpheus );
+	const char *plain[] = { "hello", NULL };
+	_assert_regex_literals( "hello", plain );
+	// the optional o splits it up, and the longer half wins
+	const char *optional[] = { "world", NULL };
+	_assert_regex_literals( "hello?world", optional );
+	const char *plus[] = { "abcd", NULL };
+	_assert_regex_literals( "abcd+e", plus );
+	const char *bracket[] = { "tracker", NULL };
+	_assert_regex_literals( "[]a-z[:digit:]]+tracker[.]", bracket );
+	// nothing we can rely on
+	_assert_regex_literals( "foo|barbaz", NULL );
+	_assert_regex_literals( "(foo|)x?", NULL );
+	_assert_regex_literals( "\\w+", NULL );
+	_assert_regex_literals( "", NULL );
+}
+
+static void test_ben_decode_view( void **state ) {
+	( void ) state;
+	int ben_err;
+	size_t off = 0;
+
+	const char buffer[] = "d3:key5:valuee";
+	struct bencode *dict = ben_decode_view( buffer, strlen( buffer ), &off, &ben_err );
+	assert_int_equal( ben_err, BEN_OK );
+	assert_int_equal( off, strlen( buffer ) );
+
+	struct bencode *val = ben_dict_get_by_str( dict, "key" );
+	assert_non_null( val );
+	// no copy, it's just pointing at the input
+	assert_true( ( ( struct bencode_str * ) val )->view );
+	assert_ptr_equal( ben_str_val( val ), buffer + 8 );
+	assert_int_equal( ben_str_len( val ), 5 );
+
+	assert_int_equal( ben_str_own( val ), 0 );
+	assert_false( ( ( struct bencode_str * ) val )->view );
+	assert_true( ben_str_val( val ) != buffer + 8 );
+	assert_string_equal( ben_str_val( val ), "value" );
+
+	size_t encoded_n;
+	char *encoded = ben_encode( &encoded_n, dict );
+	assert_non_null( encoded );
+	assert_int_equal( encoded_n, strlen( buffer ) );
+	assert_memory_equal( encoded, buffer, encoded_n );
+	free( encoded );
+	ben_free( dict );
+}
+
+// decodes an int, returning the bencode error
+int _ben_decode_int( const char *buffer, long long *ll ) {
+	int ben_err;
+	size_t off = 0;
+	struct bencode *ben = ben_decode2( buffer, strlen( buffer ), &off, &ben_err );
+	if ( ben != NULL ) {
+		*ll = ben_int_val( ben );
+		ben_free( ben );
+	}
+	return ben_err;
+}
+
+// digit runs are read several bytes at a time, so try them at every length and alignment
+static void test_ben_decode_int( void **state ) {
+	( void ) state;
+	long long ll;
+	char buffer[64];
+
+	long long expected = 0;
+	for ( int digits_n = 1; digits_n <= 18; digits_n++ ) {
+		expected = expected * 10 + digits_n % 10;
+		sprintf( buffer, "i%llde", expected );
+		assert_int_equal( _ben_decode_int( buffer, &ll ), BEN_OK );
+		assert_true( ll == expected );
+		sprintf( buffer, "i-%llde", expected );
+		assert_int_equal( _ben_decode_int( buffer, &ll ), BEN_OK );
+		assert_true( ll == -expected );
+	}
+
+	assert_int_equal( _ben_decode_int( "i0e", &ll ), BEN_OK );
+	assert_true( ll == 0 );
+	assert_int_equal( _ben_decode_int( "i9223372036854775807e", &ll ), BEN_OK );
+	assert_true( ll == LLONG_MAX );
+	assert_int_equal( _ben_decode_int( "i-9223372036854775808e", &ll ), BEN_OK );
+	assert_true( ll == LLONG_MIN );
+
+	assert_int_equal( _ben_decode_int( "i9223372036854775808e", &ll ), BEN_INVALID );
+	assert_int_equal( _ben_decode_int( "i-9223372036854775809e", &ll ), BEN_INVALID );
+	assert_int_equal( _ben_decode_int( "i99999999999999999999e", &ll ), BEN_INVALID );
+	assert_int_equal( _ben_decode_int( "i123456789012345678901234567890e", &ll ), BEN_INVALID );
+	assert_int_equal( _ben_decode_int( "i-0e", &ll ), BEN_INVALID );
+	assert_int_equal( _ben_decode_int( "i01e", &ll ), BEN_INVALID );
+	assert_int_equal( _ben_decode_int( "i-01e", &ll ), BEN_INVALID );
+	assert_int_equal( _ben_decode_int( "ie", &ll ), BEN_INVALID );
+	assert_int_equal( _ben_decode_int( "i-e", &ll ), BEN_INVALID );
+	assert_int_equal( _ben_decode_int( "i+1e", &ll ), BEN_INVALID );
+	assert_int_equal( _ben_decode_int( "i 1e", &ll ), BEN_INVALID );
+	assert_int_equal( _ben_decode_int( "i1234567x9e", &ll ), BEN_INVALID );
+	assert_int_equal( _ben_decode_int( "i12345678", &ll ), BEN_INSUFFICIENT );
+	assert_int_equal( _ben_decode_int( "i-", &ll ), BEN_INSUFFICIENT );
+
+	// string lengths go through the same code
+	int ben_err;
+	size_t off = 0;
+	struct bencode *str = ben_decode2( "10:0123456789", 13, &off, &ben_err );
+	assert_int_equal( ben_err, BEN_OK );
+	assert_int_equal( ben_str_len( str ), 10 );
+	ben_free( str );
+	off = 0;
+	assert_null( ben_decode2( "010:0123456789", 14, &off, &ben_err ) );
+	assert_int_equal( ben_err, BEN_INVALID );
+	off = 0;
+	assert_null( ben_decode2( "-1:", 3, &off, &ben_err ) );
+	assert_int_equal( ben_err, BEN_INVALID );
+}
+
+static void test_ben_encode_int( void **state ) {
+	( void ) state;
+	const long long values[] = { 0, 1, -1, 9, 10, 99, 100, -100, 9999, 10000, 123456789, 1000000000000LL, LLONG_MAX, LLONG_MIN };
+	char expected[32];
+	for ( size_t i = 0; i < sizeof( values ) / sizeof( values[0] ); i++ ) {
+		struct bencode *ben = ben_int( values[i] );
+		assert_non_null( ben );
+		sprintf( expected, "i%llde", values[i] );
+		size_t len;
+		char *encoded = ben_encode( &len, ben );
+		assert_non_null( encoded );
+		assert_int_equal( len, strlen( expected ) );
+		assert_int_equal( ben_encoded_size( ben ), len );
+		assert_memory_equal( encoded, expected, len );
+		free( encoded );
+		ben_free( ben );
+	}
+
+	// strings long enough that the buffer has to grow, with lengths of every digit count
+	struct bencode *list = ben_list();
+	assert_non_null( list );
+	size_t total = 2;
+	for ( size_t n = 1; n <= 100000; n *= 10 ) {
+		char *s = malloc( n );
+		assert_non_null( s );
+		memset( s, 'x', n );
+		assert_int_equal( ben_list_append( list, ben_blob( s, n ) ), 0 );
+		total += n + 1 + snprintf( expected, sizeof( expected ), "%zu", n );
+		free( s );
+	}
+	size_t len;
+	char *encoded = ben_encode( &len, list );
+	assert_non_null( encoded );
+	assert_int_equal( len, total );
+	assert_int_equal( ben_encoded_size( list ), total );
+	assert_memory_equal( encoded, "l1:x10:xxxxxxxxxx100:", 21 );
+	free( encoded );
+	ben_free( list );
+}
+
+static void test_ben_deep( void **state ) {
+	( void ) state;
+	const int depth = 100000;
+	char *buffer = malloc( 2 * depth + 3 );
+	assert_non_null( buffer );
+	memset( buffer, 'l', depth );
+	memcpy( buffer + depth, "i1e", 3 );
+	memset( buffer + depth + 3, 'e', depth );
+	size_t buffer_n = 2 * depth + 3;
+
+	size_t off = 0;
+	int ben_err;
+	assert_null( ben_decode2( buffer, buffer_n, &off, &ben_err ) );
+	assert_int_equal( ben_err, BEN_INVALID );
+
+	ben_set_max_depth( depth );
+	off = 0;
+	struct bencode *ben = ben_decode2( buffer, buffer_n, &off, &ben_err );
+	assert_int_equal( ben_err, BEN_OK );
+	assert_non_null( ben );
+	assert_int_equal( ben_encoded_size( ben ), buffer_n );
+	size_t len;
+	char *encoded = ben_encode( &len, ben );
+	assert_non_null( encoded );
+	assert_int_equal( len, buffer_n );
+	assert_memory_equal( encoded, buffer, len );
+	free( encoded );
+	ben_free( ben );
+
+	// errors deep down free everything that was open
+	buffer[depth + 1] = 'x';
+	off = 0;
+	assert_null( ben_decode2( buffer, buffer_n, &off, &ben_err ) );
+	assert_int_equal( ben_err, BEN_INVALID );
+	buffer[depth + 1] = '1';
+	off = 0;
+	assert_null( ben_decode2( buffer, depth + 3, &off, &ben_err ) );
+	assert_int_equal( ben_err, BEN_INSUFFICIENT );
+	ben_set_max_depth( 0 );
+
+	// the default is enough for BEN_DEFAULT_MAX_DEPTH, and no more
+	off = 0;
+	ben = ben_decode2( buffer + depth - BEN_DEFAULT_MAX_DEPTH, 2 * BEN_DEFAULT_MAX_DEPTH + 3, &off, &ben_err );
+	assert_int_equal( ben_err, BEN_OK );
+	ben_free( ben );
+	off = 0;
+	assert_null( ben_decode2( buffer + depth - BEN_DEFAULT_MAX_DEPTH - 1, 2 * BEN_DEFAULT_MAX_DEPTH + 5, &off, &ben_err ) );
+	assert_int_equal( ben_err, BEN_INVALID );
+	free( buffer );
+}
+
+struct sink_collect {
+	char *out;
+	size_t out_n;
+	int writes_n;
+	int refs_n; // chunks that pointed into input, rather than being copied
+	const char *input;
+	size_t input_n;
+	int fail_at;
+};
+
+int sink_collect_write( void *opaque, const struct ben_chunk *chunks, int chunks_n ) {
+	struct sink_collect *collect = opaque;
+	assert_true( chunks_n > 0 && chunks_n <= BEN_SINK_CHUNKS );
+	if ( ++collect->writes_n == collect->fail_at ) {
+		return 1;
+	}
+	for ( int i = 0; i < chunks_n; i++ ) {
+		const char *data = chunks[i].data;
+		collect->refs_n += data >= collect->input && data < collect->input + collect->input_n;
+		memcpy( collect->out + collect->out_n, data, chunks[i].len );
+		collect->out_n += chunks[i].len;
+	}
+	return 0;
+}
+
+static void test_ben_encode_sink( void **state ) {
+	( void ) state;
+	// lots of small modified dicts, each with a long unmodified list and a long string
+	size_t buffer_n = 0;
+	char *buffer = malloc( 1 << 22 );
+	assert_non_null( buffer );
+	char blob[1000];
+	memset( blob, 'b', sizeof( blob ) );
+	buffer[buffer_n++] = 'l';
+	for ( int i = 0; i < 500; i++ ) {
+		buffer_n += sprintf( buffer + buffer_n, "d1:ai%de1:bl", i );
+		for ( int j = 0; j < 200; j++ ) {
+			buffer_n += sprintf( buffer + buffer_n, "i%de", j );
+		}
+		buffer_n += sprintf( buffer + buffer_n, "e1:c1000:" );
+		memcpy( buffer + buffer_n, blob, sizeof( blob ) );
+		buffer_n += sizeof( blob );
+		buffer[buffer_n++] = 'e';
+	}
+	buffer[buffer_n++] = 'e';
+
+	size_t off = 0;
+	int ben_err;
+	struct bencode *ben = ben_decode_view( buffer, buffer_n, &off, &ben_err );
+	assert_int_equal( ben_err, BEN_OK );
+	for ( size_t i = 0; i < ben_list_len( ben ); i++ ) {
+		struct bencode *dict = ben_list_get( ben, i );
+		assert_int_equal( ben_dict_set_by_str( dict, "a", ben_int( -( long long )i ) ), 0 );
+	}
+	ben_mark_modified( ben );
+
+	size_t expected_n;
+	char *expected = ben_encode( &expected_n, ben );
+	assert_non_null( expected );
+	struct sink_collect collect = {
+		.out = malloc( expected_n ),
+		.input = buffer,
+		.input_n = buffer_n,
+	};
+	assert_non_null( collect.out );
+	struct ben_sink sink = {
+		.write = sink_collect_write,
+		.opaque = &collect,
+	};
+	size_t len;
+	assert_int_equal( ben_encode_sink( &sink, ben, &len ), 0 );
+	assert_int_equal( len, expected_n );
+	assert_int_equal( collect.out_n, expected_n );
+	assert_memory_equal( collect.out, expected, expected_n );
+	assert_true( collect.writes_n > 1 );
+	assert_int_equal( collect.refs_n, 1000 );
+
+	// a sink that gives up stops the encoding
+	collect.out_n = 0;
+	collect.writes_n = 0;
+	collect.fail_at = 2;
+	assert_int_equal( ben_encode_sink( &sink, ben, &len ), -1 );
+	assert_int_equal( collect.writes_n, 2 );
+
+	free( collect.out );
+	free( expected );
+	ben_free( ben );
+	free( buffer );
+}
+
+// keys of every length take a different path through the hash
+static void test_ben_dict_key( void **state ) {
+	( void ) state;
+	char keys[40][41];
+	struct bencode *dict = ben_dict();
+	assert_non_null( dict );
+
+	for ( int i = 0; i < 40; i++ ) {
+		memset( keys[i], 'a' + i % 26, i );
+		keys[i][i] = '\0';
+		assert_int_equal( ben_dict_set_str_by_str( dict, keys[i], keys[i] ), 0 );
+	}
+	assert_int_equal( ben_dict_set_by_str( dict, "n", ben_int( 5 ) ), 0 );
+
+	for ( int i = 0; i < 40; i++ ) {
+		struct ben_key key;
+		ben_key_init( &key, keys[i] );
+		struct bencode *val = ben_dict_get_by_key( dict, &key );
+		assert_ptr_equal( val, ben_dict_get_by_str( dict, keys[i] ) );
+		assert_int_equal( ben_str_len( val ), i );
+	}
+	struct ben_key key;
+	ben_key_init( &key, "absent" );
+	assert_null( ben_dict_get_by_key( dict, &key ) );
+	assert_null( ben_dict_pop_by_key( dict, &key ) );
+
+	ben_key_init( &key, keys[20] );
+	struct bencode *popped = ben_dict_pop_by_key( dict, &key );
+	assert_non_null( popped );
+	assert_int_equal( ben_str_len( popped ), 20 );
+	ben_free( popped );
+	assert_null( ben_dict_get_by_key( dict, &key ) );
+	assert_int_equal( ben_dict_len( dict ), 40 );
+	ben_free( dict );
+}
+
+static void test_ben_dict_small( void **state ) {
+	( void ) state;
+	struct bencode *dict = ben_dict();
+	assert_non_null( dict );
+	char key[8];
+
+	// out of order, so inserts have to go in the middle
+	for ( int i = BEN_DICT_SMALL_MAX - 1; i >= 0; i-- ) {
+		sprintf( key, "k%02d", i * 7 % BEN_DICT_SMALL_MAX );
+		assert_int_equal( ben_dict_set_by_str( dict, key, ben_int( i ) ), 0 );
+	}
+	assert_null( ( ( struct bencode_dict * ) dict )->buckets );
+	assert_int_equal( ben_dict_set_by_str( dict, "k03", ben_int( 100 ) ), 0 );
+	assert_int_equal( ben_dict_len( dict ), BEN_DICT_SMALL_MAX );
+	assert_int_equal( ben_int_val( ben_dict_get_by_str( dict, "k03" ) ), 100 );
+
+	struct bencode *k, *v;
+	size_t pos;
+	ben_dict_for_each( k, v, pos, dict ) {
+		sprintf( key, "k%02d", ( int )pos );
+		assert_string_equal( ben_str_val( k ), key );
+	}
+	size_t len;
+	char *encoded = ben_encode( &len, dict );
+	assert_non_null( encoded );
+	assert_memory_equal( encoded, "d3:k00i0e3:k01i7e", 17 );
+	free( encoded );
+
+	// one more switches to hashing, which must still encode in order
+	assert_int_equal( ben_dict_set_by_str( dict, "a", ben_int( -1 ) ), 0 );
+	assert_non_null( ( ( struct bencode_dict * ) dict )->buckets );
+	for ( int i = 0; i < BEN_DICT_SMALL_MAX; i++ ) {
+		sprintf( key, "k%02d", i );
+		assert_non_null( ben_dict_get_by_str( dict, key ) );
+	}
+	encoded = ben_encode( &len, dict );
+	assert_non_null( encoded );
+	assert_memory_equal( encoded, "d1:ai-1e3:k00i0e", 16 );
+	free( encoded );
+	ben_free( dict );
+
+	// removing while iterating over a small dict
+	dict = ben_dict();
+	assert_non_null( dict );
+	for ( int i = 0; i < 6; i++ ) {
+		sprintf( key, "k%d", i );
+		assert_int_equal( ben_dict_set_by_str( dict, key, ben_int( i ) ), 0 );
+	}
+	ben_dict_for_each( k, v, pos, dict ) {
+		if ( ben_int_val( v ) % 2 == 0 ) {
+			ben_free( ben_dict_pop_current( dict, &pos ) );
+		}
+	}
+	encoded = ben_encode( &len, dict );
+	assert_non_null( encoded );
+	assert_int_equal( len, strlen( "d2:k1i1e2:k3i3e2:k5i5ee" ) );
+	assert_memory_equal( encoded, "d2:k1i1e2:k3i3e2:k5i5ee", len );
+	free( encoded );
+	struct bencode *missing = ben_str( "k9" );
+	assert_null( ben_dict_pop( dict, missing ) );
+	ben_free( missing );
+	ben_free( dict );
+}
+
+static void test_ben_dict_sorted( void **state ) {
+	( void ) state;
+	char key[8];
+	char expected[512];
+	size_t expected_n = 1;
+	strcpy( expected, "d" );
+	for ( int i = 0; i < 40; i++ ) {
+		expected_n += sprintf( expected + expected_n, "3:k%02di%de", i, i );
+	}
+	expected[expected_n++] = 'e';
+
+	// decoded dicts are in order, so encoding them again needs no sorting
+	size_t off = 0;
+	int ben_err;
+	struct bencode *dict = ben_decode2( expected, expected_n, &off, &ben_err );
+	assert_int_equal( ben_err, BEN_OK );
+	assert_false( ( ( struct bencode_dict * ) dict )->unsorted );
+	assert_int_equal( ben_dict_set_by_str( dict, "k05", ben_int( 5 ) ), 0 );
+	assert_false( ( ( struct bencode_dict * ) dict )->unsorted );
+
+	// taking the last key off keeps the order, anything else doesn't
+	struct bencode *popped = ben_dict_pop_by_str( dict, "k39" );
+	assert_non_null( popped );
+	assert_false( ( ( struct bencode_dict * ) dict )->unsorted );
+	assert_int_equal( ben_dict_set_by_str( dict, "k39", popped ), 0 );
+	assert_false( ( ( struct bencode_dict * ) dict )->unsorted );
+	popped = ben_dict_pop_by_str( dict, "k10" );
+	assert_non_null( popped );
+	assert_true( ( ( struct bencode_dict * ) dict )->unsorted );
+	assert_int_equal( ben_dict_set_by_str( dict, "k10", popped ), 0 );
+
+	size_t len;
+	char *encoded = ben_encode( &len, dict );
+	assert_non_null( encoded );
+	assert_int_equal( len, expected_n );
+	assert_memory_equal( encoded, expected, len );
+	free( encoded );
+	ben_free( dict );
+
+	// building it backwards
+	dict = ben_dict();
+	assert_non_null( dict );
+	for ( int i = 39; i >= 0; i-- ) {
+		sprintf( key, "k%02d", i );
+		assert_int_equal( ben_dict_set_by_str( dict, key, ben_int( i ) ), 0 );
+	}
+	assert_true( ( ( struct bencode_dict * ) dict )->unsorted );
+	encoded = ben_encode( &len, dict );
+	assert_non_null( encoded );
+	assert_int_equal( len, expected_n );
+	assert_memory_equal( encoded, expected, len );
+	free( encoded );
+	ben_free( dict );
+}
+
+static void test_ben_encode_span( void **state ) {
+	( void ) state;
+	int ben_err;
+	size_t off = 0;
+
+	const char buffer[] = "d8:announce3:old4:infod6:lengthi3e4:name3:fooee";
+	struct bencode *dict = ben_decode_view( buffer, strlen( buffer ), &off, &ben_err );
+	assert_int_equal( ben_err, BEN_OK );
+	struct bencode_dict *info = ( struct bencode_dict * ) ben_dict_get_by_str( dict, "info" );
+	assert_non_null( info );
+	assert_ptr_equal( info->span, buffer + 22 );
+	assert_int_equal( info->span_len, strlen( buffer ) - 23 );
+
+	// changing a string in place doesn't tell the dict it's in
+	assert_int_equal( ben_str_set( ben_dict_get_by_str( dict, "announce" ), "new", 3 ), 0 );
+	ben_mark_modified( dict );
+	assert_null( ( ( struct bencode_dict * ) dict )->span );
+	assert_non_null( info->span );
+
+	size_t encoded_n;
+	char *encoded = ben_encode( &encoded_n, dict );
+	assert_non_null( encoded );
+	const char expected[] = "d8:announce3:new4:infod6:lengthi3e4:name3:fooee";
+	assert_int_equal( encoded_n, strlen( expected ) );
+	assert_memory_equal( encoded, expected, encoded_n );
+	free( encoded );
+
+	// modifying a dict through the API forgets its span by itself
+	assert_int_equal( ben_dict_set_str_by_str( ( struct bencode * ) info, "name", "bar" ), 0 );
+	assert_null( info->span );
+	ben_free( dict );
+}
+
+static void test_ben_tokenizer( void **state ) {
+	( void ) state;
+
+	const char buffer[] = "d8:announce3:foo4:listli12ei-3elee1:xb1e";
+	const int types[] = {
+		BEN_TOKEN_DICT, BEN_TOKEN_KEY, BEN_TOKEN_STR, BEN_TOKEN_KEY, BEN_TOKEN_LIST, BEN_TOKEN_INT,
+		BEN_TOKEN_INT, BEN_TOKEN_LIST, BEN_TOKEN_END, BEN_TOKEN_END, BEN_TOKEN_KEY, BEN_TOKEN_BOOL, BEN_TOKEN_END,
+	};
+	const int types_n = sizeof( types ) / sizeof( types[0] );
+	struct ben_tokenizer t;
+	struct ben_token token;
+
+	ben_tokenizer_init( &t, buffer, strlen( buffer ) );
+	for ( int i = 0; i < types_n; i++ ) {
+		assert_int_equal( ben_next_token( &t, &token ), 1 );
+		assert_int_equal( token.type, types[i] );
+		if ( i == 2 ) {
+			assert_int_equal( token.off, 11 );
+			assert_int_equal( token.len, 5 );
+			assert_ptr_equal( token.s, buffer + 13 );
+			assert_int_equal( token.s_len, 3 );
+		}
+		if ( i == 6 ) {
+			assert_int_equal( token.ll, -3 );
+		}
+	}
+	assert_int_equal( ben_next_token( &t, &token ), 0 );
+	assert_int_equal( t.pos, strlen( buffer ) );
+
+	// split in two at every possible place, feeding back whatever wasn't used
+	for ( size_t split = 0; split <= strlen( buffer ); split++ ) {
+		char chunk[64];
+		ben_tokenizer_init( &t, buffer, split );
+		int got_n = 0, res;
+		bool fed = false;
+		while ( ( res = ben_next_token( &t, &token ) ) != 0 ) {
+			if ( res == -1 ) {
+				assert_int_equal( t.error, BEN_INSUFFICIENT );
+				assert_false( fed );
+				size_t left_n = t.len - t.pos;
+				memcpy( chunk, t.data + t.pos, left_n );
+				memcpy( chunk + left_n, buffer + split, strlen( buffer ) - split );
+				ben_tokenizer_feed( &t, chunk, left_n + strlen( buffer ) - split );
+				fed = true;
+				continue;
+			}
+			assert_int_equal( token.type, types[got_n] );
+			assert_int_equal( token.off + token.len <= strlen( buffer ), true );
+			got_n++;
+		}
+		assert_int_equal( got_n, types_n );
+	}
+
+	// only strings can be keys, and every dict or list has to end
+	ben_tokenizer_init( &t, "di1e1:ae", 8 );
+	assert_int_equal( ben_next_token( &t, &token ), 1 );
+	assert_int_equal( ben_next_token( &t, &token ), -1 );
+	assert_int_equal( t.error, BEN_INVALID );
+	ben_tokenizer_init( &t, "d1:ae", 5 );
+	while ( ben_next_token( &t, &token ) == 1 );
+	assert_int_equal( t.error, BEN_INVALID );
+	ben_tokenizer_init( &t, "l", 1 );
+	while ( ben_next_token( &t, &token ) == 1 );
+	assert_int_equal( t.error, BEN_INSUFFICIENT );
+}
+
+static void test_ben_tape( void **state ) {
+	( void ) state;
+
+	const char buffer[] = "d8:announce3:foo4:infod6:lengthi5ee4:listli12ei-3elee1:xb1eTRAILING";
+	struct ben_tape tape;
+	size_t off;
+
+	assert_int_equal( ben_tape_build( &tape, buffer, strlen( buffer ), &off ), BEN_OK );
+	assert_int_equal( off, strlen( buffer ) - strlen( "TRAILING" ) );
+	assert_int_equal( ben_tape_next( &tape, 0 ), tape.n );
+
+	size_t announce = ben_tape_dict_get_by_str( &tape, 0, "announce" );
+	assert_int_equal( tape.entries[announce].token.type, BEN_TOKEN_STR );
+	assert_memory_equal( tape.entries[announce].token.s, "foo", 3 );
+
+	// keys of nested dicts are skipped over, not matched
+	assert_int_equal( ben_tape_dict_get_by_str( &tape, 0, "length" ), ( size_t ) -1 );
+	size_t info = ben_tape_dict_get_by_str( &tape, 0, "info" );
+	size_t length = ben_tape_dict_get_by_str( &tape, info, "length" );
+	assert_int_equal( tape.entries[length].token.ll, 5 );
+
+	size_t list = ben_tape_dict_get_by_str( &tape, 0, "list" );
+	assert_int_equal( tape.entries[ben_tape_list_get( &tape, list, 1 )].token.ll, -3 );
+	assert_int_equal( tape.entries[ben_tape_list_get( &tape, list, 2 )].token.type, BEN_TOKEN_LIST );
+	assert_int_equal( ben_tape_list_get( &tape, list, 3 ), ( size_t ) -1 );
+	assert_int_equal( ben_tape_list_get( &tape, info, 0 ), ( size_t ) -1 );
+
+	size_t span_n;
+	const char *span = ben_tape_span( &tape, list, &span_n );
+	assert_int_equal( span_n, strlen( "li12ei-3elee" ) );
+	assert_memory_equal( span, "li12ei-3elee", span_n );
+
+	int err;
+	struct bencode *decoded = ben_tape_decode( &tape, info, &err );
+	assert_non_null( decoded );
+	assert_int_equal( ben_int_val( ben_dict_get_by_str( decoded, "length" ) ), 5 );
+	ben_free( decoded );
+	ben_tape_free( &tape );
+
+	assert_int_equal( ben_tape_build( &tape, "d1:ai1e", 7, NULL ), BEN_INSUFFICIENT );
+	assert_null( tape.entries );
+}
+
+static void test_arena( void **state ) {
+	( void ) state;
+	int in_err;
+	struct grn_arena arena = { 0 };
+
+	char *first = grn_arena_alloc( &arena, 3, &in_err );
+	ASSERT_OK();
+	char *second = grn_arena_alloc( &arena, 8, &in_err );
+	ASSERT_OK();
+	assert_true( second >= first + 3 );
+	assert_int_equal( ( size_t )second % sizeof( void * ), 0 );
+
+	// the last allocation grows in place, anything else gets copied
+	memcpy( second, "abcdefgh", 8 );
+	assert_ptr_equal( grn_arena_realloc( &arena, second, 8, 100, &in_err ), second );
+	ASSERT_OK();
+	memcpy( first, "xyz", 3 );
+	char *first_moved = grn_arena_realloc( &arena, first, 3, 10, &in_err );
+	ASSERT_OK();
+	assert_true( first_moved != first );
+	assert_memory_equal( first_moved, "xyz", 3 );
+
+	// too big for a chunk
+	char *big = grn_arena_alloc( &arena, 1 << 20, &in_err );
+	ASSERT_OK();
+	memset( big, 'b', 1 << 20 );
+
+	// memory is reused after a reset
+	grn_arena_reset( &arena );
+	assert_ptr_equal( grn_arena_alloc( &arena, 3, &in_err ), first );
+	ASSERT_OK();
+	grn_arena_free( &arena );
+	assert_null( arena.chunks );
+}
+
 static void test_is_string_passphrase( void **state ) {
 	( void ) state;
 	assert_int_equal( is_string_passphrase( "hello" ), 0 );
@@ -320,6 +2041,32 @@ static void test_regsubst_all( void **state ) {
 	free( weird_pirates );
 
 	regfree( &yarr );
+
+	// only the real start of the string is the beginning of a line
+	regex_t start_y;
+	regcomp( &start_y, "^y", 0 );
+	char *first_only = regsubst( "yyy", &start_y, "b", true, &in_err );
+	ASSERT_OK();
+	assert_string_equal( first_only, "byy" );
+	free( first_only );
+	regfree( &start_y );
+
+	// empty matches shouldn't loop forever
+	regex_t maybe_x;
+	regcomp( &maybe_x, "x*", 0 );
+	char *everywhere = regsubst( "axb", &maybe_x, "-", true, &in_err );
+	ASSERT_OK();
+	assert_string_equal( everywhere, "-a-b-" );
+	free( everywhere );
+	everywhere = regsubst( "xxaxbx", &maybe_x, "-", true, &in_err );
+	ASSERT_OK();
+	assert_string_equal( everywhere, "-a-b-" );
+	free( everywhere );
+	everywhere = regsubst( "ab", &maybe_x, "-", true, &in_err );
+	ASSERT_OK();
+	assert_string_equal( everywhere, "-a-b-" );
+	free( everywhere );
+	regfree( &maybe_x );
 }
 
 int main( void ) {
@@ -328,10 +2075,35 @@ int main( void ) {
 		cmocka_unit_test( test_vector ),
 		cmocka_unit_test( test_strsubst ),
 		cmocka_unit_test( test_transform_buffer ),
+		cmocka_unit_test( test_transform_split ),
+		cmocka_unit_test( test_fread_ctx ),
+		cmocka_unit_test( test_ben_decode_view ),
+		cmocka_unit_test( test_ben_encode_span ),
+		cmocka_unit_test( test_ben_decode_int ),
+		cmocka_unit_test( test_ben_encode_int ),
+		cmocka_unit_test( test_ben_deep ),
+		cmocka_unit_test( test_ben_encode_sink ),
+		cmocka_unit_test( test_ben_dict_key ),
+		cmocka_unit_test( test_ben_dict_small ),
+		cmocka_unit_test( test_ben_dict_sorted ),
+		cmocka_unit_test( test_ben_tokenizer ),
+		cmocka_unit_test( test_ben_tape ),
+		cmocka_unit_test( test_arena ),
+		cmocka_unit_test( test_run_parallel ),
+		cmocka_unit_test( test_feed ),
+		cmocka_unit_test( test_write_mapped ),
+		cmocka_unit_test( test_mapped_truncated ),
+		cmocka_unit_test( test_walk ),
+		cmocka_unit_test( test_walk_seen ),
+		cmocka_unit_test( test_walk_alias ),
+		cmocka_unit_test( test_index ),
+		cmocka_unit_test( test_run_indexed ),
+		cmocka_unit_test( test_watch ),
 		cmocka_unit_test( test_is_string_passphrase ),
 		cmocka_unit_test( test_normalize_orpheus_announce ),
 		cmocka_unit_test( test_cat_orpheus_transforms ),
 		cmocka_unit_test( test_regsubst_all ),
+		cmocka_unit_test( test_regex_literals ),
 	};
 
 	return cmocka_run_group_tests( tests, NULL, NULL );